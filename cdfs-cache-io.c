@@ -0,0 +1,715 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef CDFS_IO_URING
+#include <liburing.h>
+#endif
+
+#define LOGGING
+
+#include "logging.h"
+#include "cdfs-cache-io.h"
+#include "cdfs-slab.h"
+#include "fuse-loop-epoll-mt.h"
+
+
+//
+// the writes of the cache manager to the cache files
+//
+// the cache manager merges adjacent read results of a track in one cache write (a pwritev of the
+// buffers of the sector slots), and submits it here:
+// - with io_uring (configure --with-liburing) the write is queued to the kernel, and the cache manager
+//   goes on with the next results while it's done; it takes the finished writes with reap_cache_write
+//   an fdatasync when asked for is linked to the write (IOSQE_IO_LINK), so it's in the same submit
+// - else, or when the ring cannot be created, the pwritev (and fdatasync) is done at once, and the
+//   write is finished at the next reap_cache_write
+//
+// only the cache manager submits and reaps, so there is no locking here, the counters are read by
+// others (xattr) and are atomic
+//
+// a cache file opened with O_DIRECT (-o cachedirect=1) is not in the page cache, so the audio is not
+// cached twice in ram (in the page cache of the fuse file and of the cache file); the reads and writes
+// of it have to be aligned, they go through pooled aligned buffers:
+// - a write starts and ends in the middle of a page (a sector is 2352 bytes): the pages at the edges are
+//   read first (read-modify-write), so these writes are done at once and never in flight together
+// - a read is done of the aligned range around it
+//
+
+#ifdef CDFS_IO_URING
+
+static struct io_uring cache_io_ring;
+
+// the fdatasync linked to a write completes with the same write, marked in the lowest bit
+
+#define CACHE_WRITE_SYNC_MARK		1UL
+
+#endif
+
+static unsigned char cache_io_uring=0;
+
+static struct cache_write_struct *finished_first=NULL;
+static struct cache_write_struct *finished_last=NULL;
+
+static unsigned int cache_writes_inflight=0;
+
+struct cache_io_stats_struct {
+    unsigned long writes;
+    unsigned long results;
+    unsigned long bytes;
+    unsigned long syncs;
+    unsigned long errors;
+    unsigned int inflightpeak;
+    unsigned long lastwrites;
+    unsigned long writespersec;
+    unsigned long directreads;
+    unsigned long rmwpages;
+};
+
+static struct cache_io_stats_struct cache_io_stats={0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static void init_direct_buffer(void *object)
+{
+    struct cache_direct_buffer_struct *direct_buffer=(struct cache_direct_buffer_struct *) object;
+
+    if ( posix_memalign((void **) &direct_buffer->buffer, CDFS_CACHE_PAGE_SIZE, CDFS_DIRECT_BUFFER_SIZE)!=0 ) direct_buffer->buffer=NULL;
+
+}
+
+static void free_direct_buffer(void *object)
+{
+    struct cache_direct_buffer_struct *direct_buffer=(struct cache_direct_buffer_struct *) object;
+
+    if ( direct_buffer->buffer ) free(direct_buffer->buffer);
+
+}
+
+static struct cdfs_slab_struct direct_buffers_slab=CDFS_SLAB_INIT("direct_buffer", struct cache_direct_buffer_struct, CDFS_DIRECT_BUFFERS_HIGHWATER, init_direct_buffer, free_direct_buffer);
+
+
+//
+// a timer in the mainloop: the writes per second
+//
+
+static void sample_cache_io_stats(int fd, void *data)
+{
+    unsigned long writes=__atomic_load_n(&cache_io_stats.writes, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&cache_io_stats.writespersec, ( writes - cache_io_stats.lastwrites ) * 1000 / CDFS_CACHE_IO_STATS_INTERVAL, __ATOMIC_RELAXED);
+    cache_io_stats.lastwrites=writes;
+
+}
+
+int init_cache_io()
+{
+    int nreturn=0;
+
+    register_cdfs_slab(&direct_buffers_slab);
+
+#ifdef CDFS_IO_URING
+
+    // every write may come with a linked fdatasync
+
+    nreturn=io_uring_queue_init(2 * CDFS_WRITES_INFLIGHT_MAX, &cache_io_ring, 0);
+
+    if ( nreturn==0 ) {
+
+	cache_io_uring=1;
+
+    } else {
+
+	logoutput("init_cache_io: io_uring not available (error %i), writing with pwritev", -nreturn);
+	nreturn=0;
+
+    }
+
+#endif
+
+    logoutput("init_cache_io: writes to the cache with %s", (cache_io_uring==1) ? "io_uring" : "pwritev");
+
+    add_fuse_loop_timer(CDFS_CACHE_IO_STATS_INTERVAL, sample_cache_io_stats, NULL);
+
+    return nreturn;
+
+}
+
+static void count_cache_write(struct cache_write_struct *cache_write)
+{
+
+    if ( cache_write->res<0 ) {
+
+	__atomic_add_fetch(&cache_io_stats.errors, 1, __ATOMIC_RELAXED);
+
+    } else {
+
+	__atomic_add_fetch(&cache_io_stats.writes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cache_io_stats.results, cache_write->nrresults, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cache_io_stats.bytes, cache_write->size, __ATOMIC_RELAXED);
+
+	if ( cache_write->sync==1 ) __atomic_add_fetch(&cache_io_stats.syncs, 1, __ATOMIC_RELAXED);
+
+    }
+
+}
+
+static void add_finished_cache_write(struct cache_write_struct *cache_write)
+{
+
+    cache_write->next=NULL;
+
+    if ( finished_last ) {
+
+	finished_last->next=cache_write;
+
+    } else {
+
+	finished_first=cache_write;
+
+    }
+
+    finished_last=cache_write;
+
+}
+
+//
+// write at once, the fallback
+//
+
+static void write_cache_write(struct cache_write_struct *cache_write)
+{
+    ssize_t written;
+
+    written=pwritev(cache_write->fd, cache_write->iov, cache_write->nrresults, cache_write->offset);
+
+    if ( written<0 ) {
+
+	cache_write->res=-errno;
+
+    } else if ( (size_t) written < cache_write->size ) {
+
+	// short write: the disk is full
+
+	cache_write->res=-EIO;
+
+    } else {
+
+	cache_write->res=0;
+
+	if ( cache_write->sync==1 && fdatasync(cache_write->fd)==-1 ) cache_write->res=-errno;
+
+    }
+
+    add_finished_cache_write(cache_write);
+
+}
+
+//
+// an aligned buffer for O_DIRECT, NULL when there is no memory
+//
+
+struct cache_direct_buffer_struct *get_cache_direct_buffer()
+{
+    struct cache_direct_buffer_struct *direct_buffer;
+
+    direct_buffer=(struct cache_direct_buffer_struct *) get_slab_object(&direct_buffers_slab);
+
+    if ( direct_buffer && ! direct_buffer->buffer ) {
+
+	put_slab_object(&direct_buffers_slab, (void *) direct_buffer);
+	direct_buffer=NULL;
+
+    }
+
+    return direct_buffer;
+
+}
+
+void put_cache_direct_buffer(struct cache_direct_buffer_struct *direct_buffer)
+{
+
+    put_slab_object(&direct_buffers_slab, (void *) direct_buffer);
+
+}
+
+//
+// read size bytes at pos from a file opened with O_DIRECT
+// returns the bytes read (less at the end of the file) or -errno
+//
+
+ssize_t read_cache_direct(int fd, char *buffer, size_t size, off_t pos)
+{
+    struct cache_direct_buffer_struct *direct_buffer;
+    size_t done=0, skip, len, bytes;
+    off_t start;
+    ssize_t res;
+
+    direct_buffer=get_cache_direct_buffer();
+    if ( ! direct_buffer ) return -ENOMEM;
+
+    while ( done<size ) {
+
+	start=( pos + done ) & ~((off_t) CDFS_CACHE_PAGE_SIZE - 1);
+	skip=pos + done - start;
+
+	len=( skip + size - done + CDFS_CACHE_PAGE_SIZE - 1 ) & ~((size_t) CDFS_CACHE_PAGE_SIZE - 1);
+	if ( len > CDFS_DIRECT_BUFFER_SIZE ) len=CDFS_DIRECT_BUFFER_SIZE;
+
+	res=pread(fd, direct_buffer->buffer, len, start);
+
+	if ( res<0 ) {
+
+	    if ( done==0 ) done=-errno;
+	    break;
+
+	}
+
+	// the end of the file
+
+	if ( (size_t) res <= skip ) break;
+
+	bytes=res - skip;
+	if ( bytes > size - done ) bytes=size - done;
+
+	memcpy(buffer + done, direct_buffer->buffer + skip, bytes);
+	done+=bytes;
+
+	if ( (size_t) res < len ) break;
+
+    }
+
+    put_cache_direct_buffer(direct_buffer);
+
+    __atomic_add_fetch(&cache_io_stats.directreads, 1, __ATOMIC_RELAXED);
+
+    return (ssize_t) done;
+
+}
+
+//
+// read a page at the edge of a direct write, what's not in the file yet is zero
+//
+
+static int read_edge_page(int fd, char *page, off_t start)
+{
+    ssize_t res;
+
+    res=pread(fd, page, CDFS_CACHE_PAGE_SIZE, start);
+
+    if ( res<0 ) return -errno;
+    if ( res < CDFS_CACHE_PAGE_SIZE ) memset(page + res, 0, CDFS_CACHE_PAGE_SIZE - res);
+
+    __atomic_add_fetch(&cache_io_stats.rmwpages, 1, __ATOMIC_RELAXED);
+
+    return 0;
+
+}
+
+//
+// write at once to a file opened with O_DIRECT: the buffers of the write are copied in aligned
+// chunks, with the pages at the edges read first
+// the file may grow to the end of the last page, the size of the track is known anyway
+//
+
+static void write_cache_write_direct(struct cache_write_struct *cache_write)
+{
+    struct cache_direct_buffer_struct *direct_buffer;
+    size_t done=0, skip, len, bytes, iovoff=0, copy;
+    unsigned int iovindex=0;
+    off_t pos, start;
+    ssize_t written;
+    int res=0;
+
+    direct_buffer=get_cache_direct_buffer();
+
+    if ( ! direct_buffer ) {
+
+	res=-ENOMEM;
+	goto out;
+
+    }
+
+    while ( done < cache_write->size ) {
+
+	pos=cache_write->offset + done;
+	start=pos & ~((off_t) CDFS_CACHE_PAGE_SIZE - 1);
+	skip=pos - start;
+
+	bytes=cache_write->size - done;
+	if ( skip + bytes > CDFS_DIRECT_BUFFER_SIZE ) bytes=CDFS_DIRECT_BUFFER_SIZE - skip;
+
+	len=( skip + bytes + CDFS_CACHE_PAGE_SIZE - 1 ) & ~((size_t) CDFS_CACHE_PAGE_SIZE - 1);
+
+	// the first and the last page are partly of other sectors
+
+	if ( skip>0 ) {
+
+	    res=read_edge_page(cache_write->fd, direct_buffer->buffer, start);
+	    if ( res<0 ) goto out;
+
+	}
+
+	if ( skip + bytes < len && ( skip==0 || len > CDFS_CACHE_PAGE_SIZE ) ) {
+
+	    res=read_edge_page(cache_write->fd, direct_buffer->buffer + len - CDFS_CACHE_PAGE_SIZE, start + len - CDFS_CACHE_PAGE_SIZE);
+	    if ( res<0 ) goto out;
+
+	}
+
+	// copy from the buffers of the read results
+
+	copy=0;
+
+	while ( copy < bytes ) {
+	    size_t n=cache_write->iov[iovindex].iov_len - iovoff;
+
+	    if ( n > bytes - copy ) n=bytes - copy;
+
+	    memcpy(direct_buffer->buffer + skip + copy, (char *) cache_write->iov[iovindex].iov_base + iovoff, n);
+
+	    copy+=n;
+	    iovoff+=n;
+
+	    if ( iovoff==cache_write->iov[iovindex].iov_len ) {
+
+		iovindex++;
+		iovoff=0;
+
+	    }
+
+	}
+
+	written=pwrite(cache_write->fd, direct_buffer->buffer, len, start);
+
+	if ( written<0 ) {
+
+	    res=-errno;
+	    goto out;
+
+	} else if ( (size_t) written < len ) {
+
+	    res=-EIO;
+	    goto out;
+
+	}
+
+	done+=bytes;
+
+    }
+
+    if ( cache_write->sync==1 && fdatasync(cache_write->fd)==-1 ) res=-errno;
+
+    out:
+
+    if ( direct_buffer ) put_cache_direct_buffer(direct_buffer);
+
+    cache_write->res=res;
+
+    add_finished_cache_write(cache_write);
+
+}
+
+#ifdef CDFS_IO_URING
+
+//
+// a completion of the ring: returns the write when it's finished (the sync linked to it included)
+//
+
+static struct cache_write_struct *complete_cache_cqe(struct io_uring_cqe *cqe)
+{
+    struct cache_write_struct *cache_write;
+    unsigned long data;
+    int res;
+
+    data=(unsigned long) io_uring_cqe_get_data(cqe);
+    res=cqe->res;
+
+    io_uring_cqe_seen(&cache_io_ring, cqe);
+
+    cache_write=(struct cache_write_struct *) ( data & ~CACHE_WRITE_SYNC_MARK );
+
+    if ( res<0 ) {
+
+	// a sync after a failed write is canceled: keep the error of the write
+
+	if ( cache_write->res==0 ) cache_write->res=res;
+
+    } else if ( ! ( data & CACHE_WRITE_SYNC_MARK ) && (size_t) res < cache_write->size ) {
+
+	cache_write->res=-EIO;
+
+    }
+
+    cache_write->nrpending--;
+
+    if ( cache_write->nrpending==0 ) {
+
+	cache_writes_inflight--;
+	return cache_write;
+
+    }
+
+    return NULL;
+
+}
+
+//
+// submit the sqe's in the ring
+// the kernel is busy (EAGAIN) or the completion queue is full (EBUSY): take the completions
+// there are (the writes finished go in the finished list) and try again
+//
+
+static int submit_cache_ring()
+{
+    struct cache_write_struct *cache_write;
+    struct io_uring_cqe *cqe;
+    unsigned int tries=0;
+    int nreturn=0;
+
+    while (1) {
+
+	nreturn=io_uring_submit(&cache_io_ring);
+
+	if ( nreturn>=0 ) break;
+	if ( nreturn!=-EAGAIN && nreturn!=-EBUSY && nreturn!=-EINTR ) break;
+	if ( tries>=CDFS_CACHE_IO_SUBMIT_TRIES ) break;
+
+	tries++;
+
+	while ( io_uring_peek_cqe(&cache_io_ring, &cqe)==0 ) {
+
+	    cache_write=complete_cache_cqe(cqe);
+	    if ( cache_write ) add_finished_cache_write(cache_write);
+
+	}
+
+	sched_yield();
+
+    }
+
+    return nreturn;
+
+}
+
+#endif
+
+//
+// start a write, finished later (reap_cache_write)
+// the buffers in iov are not touched till then
+//
+
+int submit_cache_write(struct cache_write_struct *cache_write)
+{
+    int nreturn=0;
+
+    cache_write->res=0;
+    cache_write->nrpending=0;
+
+    if ( cache_write->direct==1 ) {
+
+	write_cache_write_direct(cache_write);
+	return nreturn;
+
+    }
+
+#ifdef CDFS_IO_URING
+
+    // the write and the sync linked to it are queued together or not at all, so check the room first
+    // no room in the ring (it's sized to the writes in flight, so this is not expected): write at once
+
+    unsigned int nrsqes=( cache_write->sync==1 ) ? 2 : 1;
+
+    if ( cache_io_uring==1 && io_uring_sq_space_left(&cache_io_ring) >= nrsqes ) {
+	struct io_uring_sqe *sqe, *sqesync=NULL;
+
+	sqe=io_uring_get_sqe(&cache_io_ring);
+	if ( cache_write->sync==1 ) sqesync=io_uring_get_sqe(&cache_io_ring);
+
+	io_uring_prep_writev(sqe, cache_write->fd, cache_write->iov, cache_write->nrresults, cache_write->offset);
+	io_uring_sqe_set_data(sqe, (void *) cache_write);
+
+	cache_write->nrpending=1;
+
+	if ( sqesync ) {
+
+	    sqe->flags |= IOSQE_IO_LINK;
+
+	    io_uring_prep_fsync(sqesync, cache_write->fd, IORING_FSYNC_DATASYNC);
+	    io_uring_sqe_set_data(sqesync, (void *) ((unsigned long) cache_write | CACHE_WRITE_SYNC_MARK));
+
+	    cache_write->nrpending=2;
+
+	}
+
+	// in flight before submitting: the completions taken while trying again may be of it
+
+	cache_writes_inflight++;
+
+	nreturn=submit_cache_ring();
+
+	if ( nreturn<0 ) {
+
+	    logoutput("submit_cache_write: error %i submitting, writing with pwritev", -nreturn);
+
+	    // a hard error, or still busy after trying again: the sqe's are still in the ring,
+	    // never submit them again
+
+	    cache_writes_inflight--;
+	    cache_write->nrpending=0;
+
+	    cache_io_uring=0;
+	    nreturn=0;
+
+	} else {
+
+	    nreturn=0;
+
+	    if ( cache_writes_inflight > cache_io_stats.inflightpeak ) cache_io_stats.inflightpeak=cache_writes_inflight;
+
+	    return nreturn;
+
+	}
+
+    }
+
+#endif
+
+    write_cache_write(cache_write);
+
+    return nreturn;
+
+}
+
+//
+// take a finished write, when wait is set wait for one when writes are in flight
+// returns NULL when there is none
+//
+
+struct cache_write_struct *reap_cache_write(unsigned char wait)
+{
+    struct cache_write_struct *cache_write=NULL;
+
+    if ( finished_first ) {
+
+	cache_write=finished_first;
+
+	finished_first=cache_write->next;
+	if ( ! finished_first ) finished_last=NULL;
+
+	cache_write->next=NULL;
+
+	goto out;
+
+    }
+
+#ifdef CDFS_IO_URING
+
+    while ( cache_writes_inflight>0 ) {
+	struct io_uring_cqe *cqe;
+	int res;
+
+	if ( wait==1 ) {
+
+	    res=io_uring_wait_cqe(&cache_io_ring, &cqe);
+
+	} else {
+
+	    res=io_uring_peek_cqe(&cache_io_ring, &cqe);
+
+	}
+
+	if ( res==-EINTR ) continue;
+	if ( res<0 ) break;
+
+	cache_write=complete_cache_cqe(cqe);
+	if ( cache_write ) goto out;
+
+    }
+
+#endif
+
+    out:
+
+    if ( cache_write ) count_cache_write(cache_write);
+
+    return cache_write;
+
+}
+
+unsigned int get_cache_writes_inflight()
+{
+
+    return cache_writes_inflight;
+
+}
+
+//
+// make a cache file durable outside the writes (sync policy track)
+//
+
+int sync_cache_file(int fd)
+{
+
+    if ( fdatasync(fd)==-1 ) return -errno;
+
+    __atomic_add_fetch(&cache_io_stats.syncs, 1, __ATOMIC_RELAXED);
+
+    return 0;
+
+}
+
+//
+// statistics in a string like:
+// engine=io_uring writes=120 writespersec=14 results=1440 bytesperwrite=211680 syncs=0 errors=0 inflightpeak=3 directreads=0 rmwpages=0
+// results is the number of read results written, more per write when they're merged
+// rmwpages the pages read back at the edges of the writes with O_DIRECT
+//
+
+int get_cache_io_stats(char *buffer, size_t size)
+{
+    unsigned long writes=__atomic_load_n(&cache_io_stats.writes, __ATOMIC_RELAXED);
+    unsigned long bytes=__atomic_load_n(&cache_io_stats.bytes, __ATOMIC_RELAXED);
+
+    return snprintf(buffer, size, "engine=%s writes=%lu writespersec=%lu results=%lu bytesperwrite=%lu syncs=%lu errors=%lu inflightpeak=%u directreads=%lu rmwpages=%lu",
+			(cache_io_uring==1) ? "io_uring" : "pwritev",
+			writes,
+			__atomic_load_n(&cache_io_stats.writespersec, __ATOMIC_RELAXED),
+			__atomic_load_n(&cache_io_stats.results, __ATOMIC_RELAXED),
+			( writes>0 ) ? bytes / writes : 0,
+			__atomic_load_n(&cache_io_stats.syncs, __ATOMIC_RELAXED),
+			__atomic_load_n(&cache_io_stats.errors, __ATOMIC_RELAXED),
+			cache_io_stats.inflightpeak,
+			__atomic_load_n(&cache_io_stats.directreads, __ATOMIC_RELAXED),
+			__atomic_load_n(&cache_io_stats.rmwpages, __ATOMIC_RELAXED));
+
+}
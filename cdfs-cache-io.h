@@ -0,0 +1,69 @@
+/*
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+#ifndef FUSE_CDFS_CACHE_IO_H
+#define FUSE_CDFS_CACHE_IO_H
+
+#include <sys/uio.h>
+
+/* when to make the data written to a cache file durable */
+
+#define CDFS_CACHE_SYNC_NONE			0
+#define CDFS_CACHE_SYNC_BATCH			1
+#define CDFS_CACHE_SYNC_TRACK			2
+
+/* one write to a cache file: adjacent read results of a track in one pwritev */
+
+struct cache_write_struct {
+    struct caching_data_struct *caching_data;
+    int fd;
+    off_t offset;
+    size_t size;
+    unsigned int nrresults;
+    struct read_result_struct *results[CDFS_WRITE_BATCH_MAX];
+    struct iovec iov[CDFS_WRITE_BATCH_MAX];
+    unsigned char sync;
+    unsigned char direct;
+    unsigned char nrpending;
+    int res;
+    struct cache_write_struct *next;
+};
+
+/* an aligned buffer for O_DIRECT, pooled in a slab */
+
+struct cache_direct_buffer_struct {
+    char *buffer;
+};
+
+
+// Prototypes
+
+int init_cache_io();
+
+int submit_cache_write(struct cache_write_struct *cache_write);
+struct cache_write_struct *reap_cache_write(unsigned char wait);
+unsigned int get_cache_writes_inflight();
+
+struct cache_direct_buffer_struct *get_cache_direct_buffer();
+void put_cache_direct_buffer(struct cache_direct_buffer_struct *direct_buffer);
+ssize_t read_cache_direct(int fd, char *buffer, size_t size, off_t pos);
+
+int sync_cache_file(int fd);
+int get_cache_io_stats(char *buffer, size_t size);
+
+#endif
@@ -31,20 +31,30 @@
 
 #include <inttypes.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <setjmp.h>
 #include <sqlite3.h>
 
 #ifndef ENOATTR
 #define ENOATTR ENODATA        /* No such attribute */
 #endif
 
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
+#endif
 
 #include "logging.h"
 #include "cdfs.h"
@@ -52,20 +62,82 @@
 #include "entry-management.h"
 #include "cdfs-cache.h"
 #include "cdfs-cdromutils.h"
+#include "cdfs-queue.h"
+#include "cdfs-slab.h"
+#include "fuse-loop-epoll-mt.h"
+#include "cdfs-cache-io.h"
+#include "cdfs-ramcache.h"
 
 extern struct cdfs_options_struct cdfs_options;
 extern struct cdfs_device_struct cdfs_device;
+#ifdef CDFS_FUSE3
+extern struct fuse_session *cdfs_session;
+#else
+extern struct fuse_chan *cdfs_chan;
+#endif
+
+// read results go from the cdromreader to the cache manager through a lock free queue
+
+struct cdfs_mpsc_queue_struct read_results_queue;
 
-struct read_result_struct *head_queue_read_results=NULL;
-struct read_result_struct *tail_queue_read_results=NULL;
-struct read_result_struct *unused_read_results=NULL;
+// created by the cdromreader, released by the cache manager
+
+struct cdfs_slab_struct read_results_slab=CDFS_SLAB_INIT("read_result", struct read_result_struct, CDFS_SLAB_HIGHWATER, NULL, NULL);
+struct cdfs_slab_struct cache_writes_slab=CDFS_SLAB_INIT("cache_write", struct cache_write_struct, CDFS_WRITES_INFLIGHT_MAX, NULL, NULL);
 
-struct cached_block_struct *unused_cached_blocks=NULL;
 struct caching_data_struct *list_caching_data=NULL;
+pthread_mutex_t list_caching_data_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+// time from the first read after a seek till it's reply, in microseconds
+
+unsigned long seek_count=0;
+unsigned long seek_latency_total=0;
+unsigned long seek_latency_max=0;
+pthread_mutex_t seek_stats_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+// latency of the reads which had to wait for the cd, in microseconds, replied from the buffer
+// of the read result or from the cache file
+
+struct latency_histogram_struct {
+    const char *name;
+    unsigned long count;
+    unsigned long total;
+    unsigned long buckets[CDFS_LATENCY_BUCKETS];
+};
+
+struct latency_histogram_struct miss_latency_buffer={"buffer", 0, 0, {0}};
+struct latency_histogram_struct miss_latency_cache={"cache", 0, 0, {0}};
+
+// readahead pushed in the page cache of the kernel, only by the cache manager
+
+unsigned long notify_store_calls=0;
+unsigned long notify_store_bytes=0;
+unsigned long notify_store_errors=0;
+unsigned long notify_store_dropped=0;
+
+// the readahead to push in the page cache, copied from the read result by the cache manager
+// and stored by a thread of it's own (see notify_store_thread)
+
+struct notify_store_struct {
+    struct caching_data_struct *caching_data;
+    fuse_ino_t ino;
+    off_t off;
+    size_t size;
+    char buffer[];
+};
+
+struct cdfs_mpsc_queue_struct notify_store_queue;
+unsigned char notify_store_started=0;
 
-unsigned char results_lock=0;
-pthread_mutex_t results_lockmutex;
-pthread_cond_t  results_lockcond;
+// bytes read from the cd and not yet written to the cache (in the read results on their way)
+
+unsigned long bytes_in_flight=0;
+unsigned long bytes_in_flight_peak=0;
+
+// bytes of readahead commands queued and not read from the cd yet, they count for the budget
+// when new readahead is sent (see charge_read_command)
+
+unsigned long bytes_queued=0;
 
 
 
@@ -73,35 +145,21 @@ pthread_cond_t  results_lockcond;
 // create a new read_result
 //
 // if there is an unused one, take that one
-// otherwise create one
-//
+// otherwise create one (see cdfs-slab.c)
 //
 
 static struct read_result_struct *get_read_result()
 {
     struct read_result_struct *read_result;
 
-    if ( ! unused_read_results ) {
-
-	// no unused ones... : create a new one
-
-	read_result=malloc(sizeof(struct read_result_struct));
-
-    } else {
-
-	// take from list
-
-	read_result=unused_read_results;
-	unused_read_results=read_result->next;
-	if (unused_read_results) unused_read_results->prev=NULL;
-
-    }
+    read_result=(struct read_result_struct *) get_slab_object(&read_results_slab);
 
     if ( read_result ) {
 
 	read_result->startsector=0;
 	read_result->endsector=0;
 	read_result->read_call=NULL;
+	read_result->sector_slot=NULL;
 	read_result->next=NULL;
 	read_result->prev=NULL;
 
@@ -113,30 +171,107 @@ static struct read_result_struct *get_read_result()
 
 static void move_read_result_to_unused_list(struct read_result_struct *read_result)
 {
-    // remove first from the active list
 
-    if ( read_result->next ) read_result->next->prev=read_result->prev;
-    if ( read_result->prev ) read_result->prev->next=read_result->next;
+    put_slab_object(&read_results_slab, (void *) read_result);
+
+}
+
+//
+// is the memory budget used up: the next batch read would not fit in it anymore
+//
+
+int memory_budget_exhausted()
+{
 
+    return ( __atomic_load_n(&bytes_in_flight, __ATOMIC_SEQ_CST) + CDFS_SECTOR_SLOT_SECTORS * CDIO_CD_FRAMESIZE_RAW > cdfs_options.memorybudget ) ? 1 : 0;
 
-    // insert in unused list at beginning
+}
 
-    if ( unused_read_results ) {
+static void add_bytes_in_flight(unsigned long bytes)
+{
+    unsigned long inflight, peak;
 
-	read_result->next=unused_read_results;
+    inflight=__atomic_add_fetch(&bytes_in_flight, bytes, __ATOMIC_SEQ_CST);
+    peak=__atomic_load_n(&bytes_in_flight_peak, __ATOMIC_RELAXED);
 
-	if ( read_result->next ) read_result->next->prev=read_result;
+    while ( inflight > peak ) {
 
-	read_result->prev=NULL;
+	if ( __atomic_compare_exchange_n(&bytes_in_flight_peak, &peak, inflight, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
 
     }
 
-    unused_read_results=read_result;
+}
+
+static void release_bytes_in_flight(unsigned long bytes)
+{
+
+    __atomic_sub_fetch(&bytes_in_flight, bytes, __ATOMIC_SEQ_CST);
+
+    if ( memory_budget_exhausted()==0 ) resume_readahead();
+
+}
+
+void charge_bytes_queued(unsigned long bytes)
+{
+
+    __atomic_add_fetch(&bytes_queued, bytes, __ATOMIC_SEQ_CST);
+
+}
+
+void release_bytes_queued(unsigned long bytes)
+{
+
+    __atomic_sub_fetch(&bytes_queued, bytes, __ATOMIC_SEQ_CST);
+
+}
+
+//
+// what is left of the memory budget for new readahead: the bytes in flight and the readahead
+// queued already are charged
+//
+
+unsigned long get_memory_budget_room()
+{
+    unsigned long charged=__atomic_load_n(&bytes_in_flight, __ATOMIC_SEQ_CST) + __atomic_load_n(&bytes_queued, __ATOMIC_SEQ_CST);
+
+    return ( charged < cdfs_options.memorybudget ) ? cdfs_options.memorybudget - charged : 0;
+
+}
+
+//
+// the bytes in flight in a string like:
+// current=153664 peak=1054560 queued=376320 budget=1048576
+//
+
+int get_memory_budget_stats(char *buffer, size_t size)
+{
+
+    return snprintf(buffer, size, "current=%lu peak=%lu queued=%lu budget=%lu", __atomic_load_n(&bytes_in_flight, __ATOMIC_RELAXED),
+				__atomic_load_n(&bytes_in_flight_peak, __ATOMIC_RELAXED), __atomic_load_n(&bytes_queued, __ATOMIC_RELAXED), cdfs_options.memorybudget);
+
+}
+
+//
+// a read result is done with: the sector slot goes back to the cdromreader, and it's bytes out of the budget
+//
+
+static void finish_read_result(struct read_result_struct *read_result)
+{
+
+    release_bytes_in_flight((read_result->endsector - read_result->startsector + 1) * CDIO_CD_FRAMESIZE_RAW);
+
+    if ( read_result->sector_slot ) put_sector_slot(read_result->sector_slot);
+    move_read_result_to_unused_list(read_result);
 
 }
 
 
-struct caching_data_struct *create_caching_data()
+//
+// create the caching data of a track: the tracknr is set before it's linked in the list,
+// so a walker of the list never sees it without
+//
+
+struct caching_data_struct *create_caching_data(unsigned char tracknr)
 {
     struct caching_data_struct *caching_data;
     int nreturn=0;
@@ -150,27 +285,55 @@ struct caching_data_struct *create_caching_data()
         caching_data->endsector=0;
         caching_data->sectorsread=0;
 
-        caching_data->tracknr=0;
+        caching_data->tracknr=tracknr;
 
         caching_data->size=0;
 
-	pthread_mutex_init(&(caching_data->cachelockmutex), NULL);
-	pthread_cond_init(&(caching_data->cachelockcond), NULL);
+        caching_data->ready=0;
+
+        caching_data->layout=CDFS_CACHE_LAYOUT_V1;
+        caching_data->direct=0;
+        caching_data->sizeheader=SIZE_RIFFHEADER;
+        caching_data->dataoffset=SIZE_RIFFHEADER;
+        memset(caching_data->header, 0, SIZE_RIFFHEADER);
+
+        caching_data->map=NULL;
+        caching_data->mapsize=0;
+	pthread_rwlock_init(&(caching_data->maplock), NULL);
+        caching_data->mapreads=0;
+        caching_data->mapfaults=0;
+
+        caching_data->bitmap=NULL;
+        caching_data->summary=NULL;
+        caching_data->nrwords=0;
 
-        caching_data->cachelock=0;
-        caching_data->nrreads=0;
-        caching_data->writelock=0;
+	pthread_mutex_init(&(caching_data->waitmutex), NULL);
+        caching_data->waiting_read_calls=NULL;
 
-        caching_data->cached_block=NULL;
+        caching_data->readaheadwindow=0;
+        caching_data->readaheadstream=0;
+        caching_data->readaheadhits=0;
+        caching_data->readaheadmisses=0;
 
+        caching_data->ino=0;
+	pthread_mutex_init(&(caching_data->openmutex), NULL);
+        caching_data->nropen=0;
+        caching_data->backing_id=0;
+        caching_data->readposition=0;
+        caching_data->sectorsprogress=0;
+
+	// insert in list, it's walked by the timers in the mainloop
+
+	pthread_mutex_lock(&list_caching_data_mutex);
 
-	// insert in list
 	caching_data->next=list_caching_data;
 	if ( list_caching_data ) list_caching_data->prev=caching_data;
 	list_caching_data=caching_data;
 
 	caching_data->prev=NULL;
 
+	pthread_mutex_unlock(&list_caching_data_mutex);
+
     }
 
     return caching_data;
@@ -179,12 +342,53 @@ struct caching_data_struct *create_caching_data()
 
 
 //
-// todo: lock the list
+// free caching data which is not set up completely (an error in open): nobody else knows it
+// but the timers walking the list
+//
+
+void free_caching_data(struct caching_data_struct *caching_data)
+{
+
+    pthread_mutex_lock(&list_caching_data_mutex);
+
+    if ( caching_data->prev ) {
+
+	caching_data->prev->next=caching_data->next;
+
+    } else {
+
+	list_caching_data=caching_data->next;
+
+    }
+
+    if ( caching_data->next ) caching_data->next->prev=caching_data->prev;
+
+    pthread_mutex_unlock(&list_caching_data_mutex);
+
+    if ( caching_data->fd>0 ) close(caching_data->fd);
+
+    if ( caching_data->bitmap ) free(caching_data->bitmap);
+    if ( caching_data->summary ) free(caching_data->summary);
+
+    pthread_mutex_destroy(&(caching_data->waitmutex));
+    pthread_mutex_destroy(&(caching_data->openmutex));
+    pthread_rwlock_destroy(&(caching_data->maplock));
+
+    free(caching_data);
+
+}
+
+//
+// find the caching data of a track, the list is walked with the list mutex held
 //
 
 struct caching_data_struct *find_caching_data_by_tracknr(unsigned char tracknr)
 {
-    struct caching_data_struct *caching_data=list_caching_data;
+    struct caching_data_struct *caching_data;
+
+    pthread_mutex_lock(&list_caching_data_mutex);
+
+    caching_data=list_caching_data;
 
     while ( caching_data ) {
 
@@ -194,10 +398,91 @@ struct caching_data_struct *find_caching_data_by_tracknr(unsigned char tracknr)
 
     }
 
+    pthread_mutex_unlock(&list_caching_data_mutex);
+
     return caching_data;
 
 }
 
+//
+// the layout of the cache file of a track (see cdfs-cache.h)
+// with layout 2 the audio starts at the second page, and the file can be opened with O_DIRECT
+//
+
+static void set_cache_file_layout(struct caching_data_struct *caching_data, unsigned char layout, off_t dataoffset)
+{
+
+    caching_data->layout=layout;
+
+    if ( layout==CDFS_CACHE_LAYOUT_V2 ) {
+
+	caching_data->sizeheader=0;
+	caching_data->dataoffset=dataoffset;
+	caching_data->direct=cdfs_options.cachedirect;
+
+    } else {
+
+	caching_data->sizeheader=SIZE_RIFFHEADER;
+	caching_data->dataoffset=SIZE_RIFFHEADER;
+	caching_data->direct=0;
+
+    }
+
+}
+
+//
+// the layout of an existing cache file from the start of it:
+// "RIFF" is layout 1, a line like "fuse-cdfs cache layout=2 dataoffset=4096" layout 2
+// returns -EINVAL when it's none of these (like a file of layout 2 of which the first page is never written)
+//
+
+static int read_cache_file_layout(struct caching_data_struct *caching_data)
+{
+    char buffer[64];
+    unsigned int layout=0, dataoffset=0;
+    ssize_t res;
+    int fd, nreturn=0;
+
+    fd=open(caching_data->path, O_RDONLY | O_CLOEXEC);
+
+    if ( fd==-1 ) {
+
+	nreturn=-errno;
+	goto out;
+
+    }
+
+    memset(buffer, '\0', sizeof(buffer));
+
+    res=pread(fd, buffer, sizeof(buffer) - 1, 0);
+
+    close(fd);
+
+    if ( res<0 ) {
+
+	nreturn=-errno;
+
+    } else if ( res>=4 && strncmp(buffer, "RIFF", 4)==0 ) {
+
+	set_cache_file_layout(caching_data, CDFS_CACHE_LAYOUT_V1, SIZE_RIFFHEADER);
+
+    } else if ( sscanf(buffer, CDFS_CACHE_LAYOUT_MAGIC " layout=%u dataoffset=%u", &layout, &dataoffset)==2 &&
+		layout==CDFS_CACHE_LAYOUT_V2 && dataoffset>0 && dataoffset % CDFS_CACHE_PAGE_SIZE==0 ) {
+
+	set_cache_file_layout(caching_data, CDFS_CACHE_LAYOUT_V2, dataoffset);
+
+    } else {
+
+	nreturn=-EINVAL;
+
+    }
+
+    out:
+
+    return nreturn;
+
+}
+
 //
 //
 // create a file in the cache
@@ -207,8 +492,9 @@ struct caching_data_struct *find_caching_data_by_tracknr(unsigned char tracknr)
 //
 // additionally create list of "already decoded blocks"
 //
+// an existing file keeps it's layout, a new file gets the layout of the option cachelayout
+// (an unknown file is created again)
 //
-// possibly start with a decoded "head" of 4096 (or any other default size) bytes standard
 // return:
 // <0 : error
 // =0 : file does exist already
@@ -255,10 +541,44 @@ int create_cache_file(struct caching_data_struct *caching_data, const char *name
 
     res=stat(caching_data->path, &st);
 
+    if ( res==0 ) {
+
+	nreturn=read_cache_file_layout(caching_data);
+
+	if ( nreturn==0 ) {
+
+	    logoutput2("create_cache_file: %s found, layout %i", caching_data->path, caching_data->layout);
+	    goto out;
+
+	} else if ( nreturn!=-EINVAL ) {
+
+	    // not readable (permissions, io error): do not throw away what is cached
+
+	    logoutput("create_cache_file: error %i reading the layout of %s", -nreturn, caching_data->path);
+	    goto out;
+
+	}
+
+	logoutput("create_cache_file: %s has no known layout, creating it again", caching_data->path);
+
+	nreturn=0;
+
+	if ( unlink(caching_data->path)==-1 ) {
+
+	    nreturn=-errno;
+	    goto out;
+
+	}
+
+	res=-1;
+
+    }
 
     if ( res==-1 ) {
 
-	// does exists already
+	// does not exist (anymore)
+
+	set_cache_file_layout(caching_data, cdfs_options.cachelayout, CDFS_CACHE_PAGE_SIZE);
 
         res=mknod(caching_data->path, S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH, 0);
 
@@ -271,7 +591,7 @@ int create_cache_file(struct caching_data_struct *caching_data, const char *name
 
         logoutput2("set size to %zi", caching_data->size);
 
-        res=truncate(caching_data->path, caching_data->size);
+        res=truncate(caching_data->path, caching_data->dataoffset + caching_data->size - SIZE_RIFFHEADER);
 
         if (res<0 ) {
 
@@ -290,6 +610,37 @@ int create_cache_file(struct caching_data_struct *caching_data, const char *name
 
 }
 
+//
+// the fd to write to the cache file, opened the first time and kept as long as fuse-cdfs runs
+// (the cache manager and an open writing the header may be first at the same time: one fd is kept)
+//
+
+int get_cache_write_fd(struct caching_data_struct *caching_data)
+{
+    int fd=__atomic_load_n(&caching_data->fd, __ATOMIC_ACQUIRE);
+    int expected=0;
+
+    if ( fd>0 ) return fd;
+
+    logoutput2("get_cache_write_fd: opening %s", caching_data->path);
+
+    // read and write: the pages at the edges of a write with O_DIRECT are read first
+
+    fd=open(caching_data->path, O_RDWR | O_CLOEXEC | ( ( caching_data->direct==1 ) ? O_DIRECT : 0 ));
+
+    if ( fd==-1 ) return -errno;
+
+    if ( ! __atomic_compare_exchange_n(&caching_data->fd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+
+	close(fd);
+	fd=expected;
+
+    }
+
+    return fd;
+
+}
+
 //
 // copy nbytes from buffer to offset on cached file
 //
@@ -300,23 +651,15 @@ int write_to_cached_file(struct caching_data_struct *caching_data, char *buffer,
 {
     int nreturn=0;
     int fd=0;
-    unsigned char openhere=0;
-
-    if ( ! buffer || size<=0 ) {
-
-	return 0;
-
-    } else if ( caching_data->fd==0 ) {
 
-	logoutput2("write_to_cached file: fd is zero");
-	fd=open(caching_data->path, O_WRONLY);
+    if ( ! buffer || size<=0 ) return 0;
 
-	if ( fd<=0 ) goto out;
-	openhere=1;
+    fd=get_cache_write_fd(caching_data);
 
-    } else {
+    if ( fd<0 ) {
 
-	fd=caching_data->fd;
+	nreturn=fd;
+	goto out;
 
     }
 
@@ -336,873 +679,1972 @@ int write_to_cached_file(struct caching_data_struct *caching_data, char *buffer,
 
     out:
 
-    if (openhere==1) close(fd);
-
     return nreturn;
 
 }
 
-
-
-
-
-//
-// create a new "cached" interval
-//
-// if there is an unused one, take that one
-// otherwise create one
 //
+// write the start of a new cache file: the wav header (layout 1) or the page describing the file (layout 2)
 //
 
-static struct cached_block_struct *get_cached_block()
+int write_cache_file_header(struct caching_data_struct *caching_data)
 {
-    struct cached_block_struct *cached_block;
+    struct cache_direct_buffer_struct *direct_buffer;
+    int nreturn=0;
 
-    if ( ! unused_cached_blocks ) {
+    if ( caching_data->layout==CDFS_CACHE_LAYOUT_V1 ) {
 
-	// no unused ones... : create a new one
+	write_wavheader(caching_data->header, caching_data->size);
 
-	cached_block=malloc(sizeof(struct cached_block_struct));
+	nreturn=write_to_cached_file(caching_data, caching_data->header, 0, SIZE_RIFFHEADER);
 
-    } else {
+	goto out;
 
-	// take from list
+    }
 
-	cached_block=unused_cached_blocks;
-	unused_cached_blocks=cached_block->next;
-	if (cached_block->next) unused_cached_blocks->prev=NULL;
+    // a whole page, from an aligned buffer: the file may be opened with O_DIRECT
 
-    }
+    direct_buffer=get_cache_direct_buffer();
 
-    if ( cached_block ) {
+    if ( ! direct_buffer ) {
 
-	cached_block->startsector=0;
-	cached_block->endsector=0;
-	cached_block->tracknr=0;
-	cached_block->next=NULL;
-	cached_block->prev=NULL;
+	nreturn=-ENOMEM;
+	goto out;
 
     }
 
-    return cached_block;
-
-}
+    memset(direct_buffer->buffer, 0, CDFS_CACHE_PAGE_SIZE);
+    snprintf(direct_buffer->buffer, CDFS_CACHE_PAGE_SIZE, "%s layout=%i dataoffset=%"PRIu64"\n", CDFS_CACHE_LAYOUT_MAGIC, caching_data->layout, (uint64_t) caching_data->dataoffset);
 
-static void move_cached_block_to_unused_list(struct cached_block_struct *cached_block)
-{
-    // remove first from the active list
+    nreturn=write_to_cached_file(caching_data, direct_buffer->buffer, 0, CDFS_CACHE_PAGE_SIZE);
 
-    if ( cached_block->next ) cached_block->next->prev=cached_block->prev;
-    if ( cached_block->prev ) cached_block->prev->next=cached_block->next;
+    put_cache_direct_buffer(direct_buffer);
 
-    // insert in unused list at beginning
+    out:
 
-    if ( unused_cached_blocks ) {
+    return nreturn;
 
-	cached_block->next=unused_cached_blocks;
+}
 
-	if ( cached_block->next ) cached_block->next->prev=cached_block;
+//
+// the position in the cache file of offset off of the track (off is not in the header with layout 2)
+//
 
-	cached_block->prev=NULL;
+off_t get_cache_file_position(struct caching_data_struct *caching_data, off_t off)
+{
 
-    }
+    if ( off < SIZE_RIFFHEADER ) return off;
 
-    unused_cached_blocks=cached_block;
+    return caching_data->dataoffset + off - SIZE_RIFFHEADER;
 
 }
 
-
-
 //
+// the cache file mapped in memory while the track is open (-o cachemmap=1): the cache manager copies
+// the sectors in it, and reads are replied from it, no buffer and no read for every read
 //
-// get a read lock on caching data
+// the blocks of the file are allocated first: a write in a hole of a mapping on a full fs is a SIGBUS
+// and not an error, so without fallocate (or space) the file is not mapped and used as usual
+// the mapping is used with the lock for reading, (un)mapping it takes the lock for writing
 //
-// if the mutex is locked increase the number of reads just like a semaphore
+// the whole file is mapped: on 32 bit a track may not fit in the address space, then it's not mapped
 //
+// an io error, or the file truncated or replaced behind our back, is still a SIGBUS when the mapping
+// is touched: the copy in it is guarded (see write_to_cache_map), after a fault the mapping is not
+// used anymore; the reads from it are copied by the kernel, that gives an error (EFAULT) and no signal
 //
 
-int get_readlock_caching_data(struct caching_data_struct *caching_data)
-{
-    int nreturn=0;
-    int nerror=0;
+static __thread sigjmp_buf *cache_map_jmpbuf=NULL;
+static pthread_once_t cache_map_once=PTHREAD_ONCE_INIT;
 
-    logoutput2("get_readlock_caching_data");
+static void cache_map_sigbus(int signo)
+{
 
-    nreturn=pthread_mutex_lock(&(caching_data->cachelockmutex));
+    if ( cache_map_jmpbuf ) siglongjmp(*cache_map_jmpbuf, 1);
 
-    if ( nreturn!=0 ) {
+    // not in a guarded copy: a real error, as without this handler
 
-        nerror=-abs(nreturn);
-        goto out;
+    signal(signo, SIG_DFL);
+    raise(signo);
 
-    }
+}
 
-    if ( caching_data->writelock>0 ) {
+static void init_cache_map_sigbus()
+{
+    struct sigaction action;
 
-        // wait for the writelock to become zero
-        // no timeout here: just wait (forever?)
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler=cache_map_sigbus;
+    sigemptyset(&action.sa_mask);
 
-        while ( caching_data->writelock>0 ) {
+    if ( sigaction(SIGBUS, &action, NULL)==-1 ) logoutput("map_cache_file: error %i setting the SIGBUS handler", errno);
 
-            nreturn=pthread_cond_wait(&(caching_data->cachelockcond), &(caching_data->cachelockmutex));
+}
 
-            // if a timeout is used: handle ETIMEDOUT here
+//
+// is the mapping there to use (not when a fault occurred in it)
+//
 
-            if ( nreturn!=0 ) {
+static inline char *get_cache_map(struct caching_data_struct *caching_data)
+{
 
-                nerror=-abs(nreturn);
-                goto out;
+    if ( __atomic_load_n(&caching_data->mapfaults, __ATOMIC_RELAXED)>0 ) return NULL;
 
-            }
+    return __atomic_load_n(&caching_data->map, __ATOMIC_ACQUIRE);
 
-        }
+}
 
-    }
+int map_cache_file(struct caching_data_struct *caching_data)
+{
+    size_t mapsize=caching_data->dataoffset + caching_data->size - SIZE_RIFFHEADER;
+    char *map;
+    int fd, nreturn=0;
 
-    // here: got lock
+    pthread_once(&cache_map_once, init_cache_map_sigbus);
 
-    // increase the number of reads
+    pthread_rwlock_wrlock(&(caching_data->maplock));
 
-    caching_data->nrreads++;
-    nreturn=1;
+    if ( caching_data->map || caching_data->mapfaults>0 ) goto unlock;
 
-    nreturn=pthread_mutex_unlock(&(caching_data->cachelockmutex));
+    fd=get_cache_write_fd(caching_data);
 
-    if ( nreturn!=0 ) {
+    if ( fd<0 ) {
 
-        nerror=-abs(nreturn);
-        goto out;
+	nreturn=fd;
+	goto unlock;
 
     }
 
-    out:
+    if ( fallocate(fd, 0, 0, mapsize)==-1 ) {
 
-    logoutput2("get_readlock_caching_data: error: %i return %i", nerror, nreturn);
+	nreturn=-errno;
+	logoutput("map_cache_file: cannot allocate %s (error %i), not mapped", caching_data->path, errno);
+	goto unlock;
 
-    return (nerror!=0 ) ? nerror : 1;
+    }
 
-}
+    map=mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
+    if ( map==MAP_FAILED ) {
 
-//
-// release read lock
-//
-// just like a semaphore decrease the number of reads
-//
+	nreturn=-errno;
+	logoutput("map_cache_file: cannot map %s (error %i)", caching_data->path, errno);
+	goto unlock;
 
-int release_readlock_caching_data(struct caching_data_struct *caching_data)
-{
-    int nreturn=0;
-    int nerror=0;
+    }
 
+    // a stream reads the track from start to end, with readahead the kernel may read ahead the pages too
 
-    logoutput2("release_readlock_caching_data_internal");
+    madvise(map, mapsize, ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_NONE ) ? MADV_RANDOM : MADV_SEQUENTIAL);
 
+    caching_data->mapsize=mapsize;
+    __atomic_store_n(&caching_data->map, map, __ATOMIC_RELEASE);
 
-    nreturn=pthread_mutex_lock(&(caching_data->cachelockmutex));
+    logoutput2("map_cache_file: %s mapped (%zi bytes)", caching_data->path, mapsize);
 
-    if ( nreturn!=0 ) {
+    unlock:
 
-        nerror=-abs(nreturn);
-        goto out;
+    pthread_rwlock_unlock(&(caching_data->maplock));
 
-    }
+    return nreturn;
 
-    // here: got lock
+}
 
-    // decrease the number of reads
+//
+// unmap when the track is not open anymore (the last release)
+//
 
-    caching_data->nrreads--;
+void unmap_cache_file(struct caching_data_struct *caching_data)
+{
 
-    if ( caching_data->writelock>0 ) {
+    pthread_rwlock_wrlock(&(caching_data->maplock));
 
-        if ( caching_data->nrreads==0 ) {
+    if ( caching_data->map && __atomic_load_n(&caching_data->nropen, __ATOMIC_RELAXED)==0 ) {
 
-            // signal waiting threads which want a writelock
-            // do this only when there is one (writelock>0 ) and there are no reads anymore...
-            // (this has been the latest)
+	munmap(caching_data->map, caching_data->mapsize);
 
-            nreturn=pthread_cond_broadcast(&(caching_data->cachelockcond));
+	__atomic_store_n(&caching_data->map, NULL, __ATOMIC_RELEASE);
+	caching_data->mapsize=0;
 
-            if ( nreturn!=0 ) {
+	logoutput2("unmap_cache_file: %s unmapped", caching_data->path);
 
-                nerror=-abs(nreturn);
-                goto out;
+    }
 
-            }
+    pthread_rwlock_unlock(&(caching_data->maplock));
 
-        }
+}
 
-    }
+//
+// the sectors in the readahead window of a read are needed soon: let the kernel read in the pages
+// of the mapping (those in cache) now
+//
 
+void advise_cache_map(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int nrsectors)
+{
+    off_t start, end;
 
-    // unlock
+    if ( nrsectors==0 || startsector > caching_data->endsector ) return;
+    if ( startsector + nrsectors - 1 > caching_data->endsector ) nrsectors=caching_data->endsector - startsector + 1;
 
-    nreturn=pthread_mutex_unlock(&(caching_data->cachelockmutex));
+    pthread_rwlock_rdlock(&(caching_data->maplock));
 
-    if ( nreturn!=0 ) {
+    if ( get_cache_map(caching_data) ) {
 
-        nerror=-abs(nreturn);
-        goto out;
+	start=caching_data->dataoffset + (off_t) ( startsector - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
+	end=start + (off_t) nrsectors * CDIO_CD_FRAMESIZE_RAW;
 
-    }
+	start-=start % CDFS_CACHE_PAGE_SIZE;
 
-    out:
+	madvise(caching_data->map + start, end - start, MADV_WILLNEED);
 
-    logoutput2("release_readlock_caching_data: error: %i return %i", nerror, nreturn);
+    }
 
-    return (nerror!=0 ) ? nerror : nreturn;
+    pthread_rwlock_unlock(&(caching_data->maplock));
 
 }
 
 //
-// get a write lock on caching data
-//
-// TODO: some stepping down from another write lock ?
+// copy the sectors of a read result in the mapping of the cache file
+// returns 0 when copied, -ENODATA when the file is not mapped or the copy faulted (write it as usual then)
 //
 
-int get_writelock_caching_data(struct caching_data_struct *caching_data)
+static int write_to_cache_map(struct caching_data_struct *caching_data, struct read_result_struct *read_result)
 {
-    int nreturn=0;
-    int nerror=0;
-
-    logoutput2("get_writelock_caching_data");
-
-    nreturn=pthread_mutex_lock(&(caching_data->cachelockmutex));
-
-    if ( nreturn!=0 ) {
+    sigjmp_buf jmpbuf;
+    off_t pos, start;
+    size_t size;
+    int nreturn=-ENODATA;
 
-        nerror=-abs(nreturn);
-        goto out;
+    pthread_rwlock_rdlock(&(caching_data->maplock));
 
-    }
+    if ( get_cache_map(caching_data) ) {
 
+	pos=caching_data->dataoffset + (off_t) ( read_result->startsector - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
+	size=(size_t) ( read_result->endsector - read_result->startsector + 1 ) * CDIO_CD_FRAMESIZE_RAW;
 
-    // wait for the writelock to become zero or one
-    // no timeout here: just wait (forever?)
+	if ( sigsetjmp(jmpbuf, 1)!=0 ) {
 
-    if ( caching_data->writelock==2 ) {
+	    cache_map_jmpbuf=NULL;
 
-        while ( caching_data->writelock==2 ) {
+	    logoutput("write_to_cache_map: SIGBUS copying in the mapping of %s, not used anymore", caching_data->path);
 
-            nreturn=pthread_cond_wait(&(caching_data->cachelockcond), &(caching_data->cachelockmutex));
+	    __atomic_add_fetch(&caching_data->mapfaults, 1, __ATOMIC_RELAXED);
+	    goto unlock;
 
-            // if a timeout is used: handle ETIMEDOUT here
+	}
 
-            if ( nreturn!=0 ) {
+	cache_map_jmpbuf=&jmpbuf;
+	memcpy(caching_data->map + pos, read_result->sector_slot->buffer, size);
+	cache_map_jmpbuf=NULL;
 
-                nerror=-abs(nreturn);
-                goto out;
+	// durable when that's the policy, the pages of this write only
 
-            } else if ( caching_data->writelock==1 || caching_data->writelock==0 ) {
+	if ( cdfs_options.cachesync==CDFS_CACHE_SYNC_BATCH ) {
 
-                break;
+	    start=pos - pos % CDFS_CACHE_PAGE_SIZE;
+	    msync(caching_data->map + start, pos + size - start, MS_SYNC);
 
-            }
+	}
 
-        }
+	nreturn=0;
 
     }
 
+    unlock:
 
-    //
-    // here: got the mutex lock
-    //
-
-    if ( caching_data->writelock==1 ) {
-
-        // got it from another write lock which is releasing
+    pthread_rwlock_unlock(&(caching_data->maplock));
 
-        caching_data->writelock=2;
-
-    } else {
+    return nreturn;
 
-        // set it to 1 to prevent new reads
-        caching_data->writelock=1;
+}
 
-        // wait for read locks to be released
+//
+// the buffers for size bytes at off of the track: the header in memory (layout 2) and the cache file
+// returns the number of buffers set, two at most
+//
 
-        if ( caching_data->nrreads>0 ) {
+static unsigned int set_cached_file_bufs(struct caching_data_struct *caching_data, int fd, struct fuse_buf *buf, size_t size, off_t off)
+{
+    unsigned int count=0;
+    size_t headerlen;
 
-            while ( caching_data->nrreads>0 ) {
+    if ( caching_data->sizeheader==0 && off < SIZE_RIFFHEADER && size>0 ) {
 
-                nreturn=pthread_cond_wait(&(caching_data->cachelockcond), &(caching_data->cachelockmutex));
+	headerlen=SIZE_RIFFHEADER - off;
+	if ( headerlen > size ) headerlen=size;
 
-            }
+	buf[count].size=headerlen;
+	buf[count].flags=0;
+	buf[count].mem=caching_data->header + off;
+	buf[count].fd=-1;
+	buf[count].pos=0;
 
-        }
+	count++;
 
-        caching_data->writelock=2;
+	off+=headerlen;
+	size-=headerlen;
 
     }
 
+    if ( size>0 ) {
 
-    nreturn=pthread_mutex_unlock(&(caching_data->cachelockmutex));
-
-    if ( nreturn!=0 ) {
+	buf[count].size=size;
+	buf[count].flags=FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf[count].mem=NULL;
+	buf[count].fd=fd;
+	buf[count].pos=get_cache_file_position(caching_data, off);
 
-        nerror=-abs(nreturn);
-        goto out;
+	count++;
 
     }
 
-    out:
-
-    logoutput2("get_writelock_caching_data: error: %i return %i", nerror, nreturn);
-
-    return (nerror!=0 ) ? nerror : 1;
+    return count;
 
 }
 
-
 //
-// release write lock
+// read size bytes at off of the track in buffer: the header from memory (layout 2), the rest from the
+// cache file, aligned when it's opened with O_DIRECT
+// returns the bytes read or -errno
 //
 
-int release_writelock_caching_data(struct caching_data_struct *caching_data)
+static ssize_t read_cached_file(struct caching_data_struct *caching_data, int fd, char *buffer, size_t size, off_t off)
 {
-    int nreturn=0;
-    int nerror=0;
+    size_t headerlen=0;
+    ssize_t res=0;
 
-    logoutput2("release_writelock_caching_data");
+    // no cache file
 
-    nreturn=pthread_mutex_lock(&(caching_data->cachelockmutex));
+    if ( cdfs_options.diskless==1 ) return read_from_ram_cache(caching_data, buffer, size, off);
 
-    if ( nreturn!=0 ) {
+    if ( caching_data->sizeheader==0 && off < SIZE_RIFFHEADER ) {
 
-        nerror=-abs(nreturn);
-        goto out;
+	headerlen=SIZE_RIFFHEADER - off;
+	if ( headerlen > size ) headerlen=size;
 
-    }
+	memcpy(buffer, caching_data->header + off, headerlen);
 
-    // here: got mutex lock
-    // two steps: first get down to 1 to enable other waiting threads for a write lock
-    // to get this lock
+    }
 
-    //
-    // first step down to 1
-    //
+    if ( size > headerlen ) {
 
-    caching_data->writelock=1;
+	if ( caching_data->direct==1 ) {
 
-    nreturn=pthread_cond_broadcast(&(caching_data->cachelockcond));
+	    res=read_cache_direct(fd, buffer + headerlen, size - headerlen, get_cache_file_position(caching_data, off + headerlen));
 
-    if ( nreturn!=0 ) {
+	} else {
+	    ssize_t bytes;
 
-        nerror=-abs(nreturn);
-        goto out;
+	    // a short read is not the end of the file: read till size bytes, or the end
 
-    }
+	    while ( (size_t) res < size - headerlen ) {
 
-    // unlock
+		bytes=pread(fd, buffer + headerlen + res, size - headerlen - (size_t) res, get_cache_file_position(caching_data, off + headerlen + res));
 
-    nreturn=pthread_mutex_unlock(&(caching_data->cachelockmutex));
+		if ( bytes<0 ) {
 
-    if ( nreturn!=0 ) {
+		    if ( errno==EINTR ) continue;
 
-        nerror=-abs(nreturn);
-        goto out;
+		    if ( res==0 ) res=-errno;
+		    break;
 
-    }
+		} else if ( bytes==0 ) {
 
+		    break;
 
-    //
-    // second step down to 0
-    //
+		}
 
+		res+=bytes;
 
-    nreturn=pthread_mutex_lock(&(caching_data->cachelockmutex));
+	    }
 
-    if ( nreturn!=0 ) {
+	}
 
-        nerror=-abs(nreturn);
-        goto out;
+	if ( res<0 ) return res;
 
     }
 
-    if ( caching_data->writelock ) {
+    return (ssize_t) headerlen + res;
 
-        caching_data->writelock=0;
-
-        nreturn=pthread_cond_broadcast(&(caching_data->cachelockcond));
+}
 
-        if ( nreturn!=0 ) {
+//
+// the size of a read of size bytes at off, not beyond the end of the file
+//
 
-            nerror=-abs(nreturn);
-            goto out;
+static size_t get_size_in_file(struct caching_data_struct *caching_data, size_t size, off_t off)
+{
 
-        }
+    if ( off >= caching_data->size ) return 0;
+    if ( off + size > caching_data->size ) return caching_data->size - off;
 
-    }
+    return size;
 
-    // unlock
+}
 
-    nreturn=pthread_mutex_unlock(&(caching_data->cachelockmutex));
+//
+// the whole sectors of a read from the cache file in ram
+//
 
-    if ( nreturn!=0 ) {
+static void insert_read_in_ram_cache(struct caching_data_struct *caching_data, char *buffer, size_t size, off_t off)
+{
+    off_t dataoff, dataend;
+    unsigned int first, last;
 
-        nerror=-abs(nreturn);
-        goto out;
+    if ( off + size <= SIZE_RIFFHEADER ) return;
 
-    }
+    dataoff=( off < SIZE_RIFFHEADER ) ? 0 : off - SIZE_RIFFHEADER;
+    dataend=off + size - SIZE_RIFFHEADER;
 
-    out:
+    first=( dataoff + CDIO_CD_FRAMESIZE_RAW - 1 ) / CDIO_CD_FRAMESIZE_RAW;
+    last=dataend / CDIO_CD_FRAMESIZE_RAW;
 
-    logoutput2("release_writelock_caching_data: error: %i return %i", nerror, nreturn);
+    if ( last <= first ) return;
 
-    return (nerror!=0 ) ? nerror : nreturn;
+    insert_sectors_in_ram_cache(caching_data, caching_data->startsector + first, buffer + ( SIZE_RIFFHEADER + (off_t) first * CDIO_CD_FRAMESIZE_RAW - off ), last - first);
 
 }
 
-
 //
-//
-// insert a cached interval/block in the list of existing cached blocks
-//
-// merging with existing intervals is possible
-//
-// called from the special cache thread, that takes care of the setting of locks
+// reply to a read with size bytes at off from the sectors in ram
+// returns 0 when replied, -ENODATA when not all are there (and not replied)
 //
 
-int insert_cached_block_internal(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+static int reply_from_ram_cache(fuse_req_t req, struct caching_data_struct *caching_data, size_t size, off_t off)
 {
-    struct cached_block_struct *cached_block=NULL;
-    struct cached_block_struct *cached_block_found=NULL;
-    struct cached_block_struct *next_cached_block=NULL;
-    struct cached_block_struct *before_cached_block=NULL;
-    struct cached_block_struct *after_cached_block=NULL;
-    unsigned int nrsectors = endsector - startsector + 1;
-    unsigned int tmpsectors=0;
-    int nwritelock;
+    char *buffer;
+    ssize_t res;
 
+    buffer=malloc(( size>0 ) ? size : 1);
+    if ( ! buffer ) return -ENOMEM;
 
-    logoutput2("insert block internal: new block 2 insert from %i to %i", startsector, endsector);
+    res=read_from_ram_cache(caching_data, buffer, size, off);
 
-    nwritelock=get_writelock_caching_data(caching_data);
+    if ( res>=0 ) {
 
-    if ( nwritelock<0 ) {
+	logoutput2("reply_from_ram_cache: %zi bytes from %"PRIu64, res, off);
 
-        // for now ignore the error and just insert without a lock
+	fuse_reply_buf(req, buffer, res);
+	res=0;
 
-        logoutput2("insert block internal: unable to get a write lock....continue anyway without a lock");
+    }
 
-        nwritelock=0;
-        goto out;
+    free(buffer);
 
-    }
+    return (int) res;
 
+}
 
-    cached_block=caching_data->cached_block;
+//
+// reply to a read with size bytes at off from the mapping of the cache file, the header in memory (layout 2)
+// returns -ENODATA when the file is not mapped (and not replied)
+//
+// the mapping is only touched by the kernel copying the reply: a fault there is an error of the reply
+// (the kernel fails the read with EIO), not a SIGBUS; so what's read is not put in the ram cache from
+// here, the pages are in the page cache already
+//
 
-    while ( cached_block ) {
+static int reply_from_cache_map(fuse_req_t req, struct caching_data_struct *caching_data, size_t size, off_t off)
+{
+    struct iovec iov[2];
+    size_t headerlen=0;
+    int count=0, nreturn=-ENODATA;
 
-	next_cached_block=cached_block->next; /* keep it cause cached_block might get lost */
+    pthread_rwlock_rdlock(&(caching_data->maplock));
 
-	// check the cached block is really before
+    if ( ! get_cache_map(caching_data) ) goto unlock;
 
-	if ( startsector > cached_block->endsector + 1 ) {
+    if ( caching_data->sizeheader==0 && off < SIZE_RIFFHEADER && size>0 ) {
 
-	    logoutput2("insert block internal: before cached block found (%i - %i)", cached_block->startsector, cached_block->endsector);
+	headerlen=SIZE_RIFFHEADER - off;
+	if ( headerlen > size ) headerlen=size;
 
-	    before_cached_block=cached_block;
-	    cached_block=next_cached_block;
-	    continue;
+	iov[count].iov_base=caching_data->header + off;
+	iov[count].iov_len=headerlen;
 
-	}
+	count++;
 
-	// check the cached block is really after
+    }
 
-	if ( cached_block->startsector > endsector + 1 ) {
+    if ( size > headerlen ) {
 
-	    logoutput2("insert block internal: after cached block found (%i - %i)", cached_block->startsector, cached_block->endsector);
+	iov[count].iov_base=caching_data->map + get_cache_file_position(caching_data, off + headerlen);
+	iov[count].iov_len=size - headerlen;
 
-	    after_cached_block=cached_block;
-	    break;
+	count++;
 
-	}
+    }
 
-	// everything else is to merge, is as simple as that
+    logoutput2("reply_from_cache_map: %zi bytes from %"PRIu64, size, off);
 
-	logoutput2("insert block internal: merging with block from %i to %i", cached_block->startsector, cached_block->endsector);
+    __atomic_add_fetch(&caching_data->mapreads, 1, __ATOMIC_RELAXED);
 
-        // merge
+    // the reply is written before the lock is given up: the mapping stays while it's copied
 
-        if ( ! cached_block_found ) {
+    nreturn=( count>0 ) ? fuse_reply_iov(req, iov, count) : fuse_reply_buf(req, NULL, 0);
 
-            // adjust cached_block
+    if ( nreturn==-EFAULT ) {
 
-            tmpsectors=cached_block->endsector - cached_block->startsector + 1;
+	logoutput("reply_from_cache_map: fault reading the mapping of %s, not used anymore", caching_data->path);
+	__atomic_add_fetch(&caching_data->mapfaults, 1, __ATOMIC_RELAXED);
 
-	    if ( cached_block->startsector > startsector ) {
+    }
 
-                cached_block->startsector=startsector;
+    unlock:
 
-            } else {
+    pthread_rwlock_unlock(&(caching_data->maplock));
 
-                startsector=cached_block->startsector;
+    return nreturn;
 
-            }
+}
 
-	    if ( cached_block->endsector < endsector ) {
+//
+// reply to a read request with size bytes at off from the cached file
+//
+// the sectors in ram are looked at first (when there is a ram cache), diskless they are the only ones
+// then the mapping of the cache file when it's mapped (see map_cache_file)
+//
+// when splicing is negotiated with the kernel (see cdfs_init) the reply is a buffer backed by the fd
+// of the cached file, so the pages go from the cache file into /dev/fuse without a copy in userspace
+// otherwise, with O_DIRECT, and with a ram cache (what's read goes in ram), fall back to a buffer and a read
+//
+// the request may be (partly) beyond the end of the file, so correct the size first
+//
 
-                cached_block->endsector=endsector;
+int reply_from_cached_file(fuse_req_t req, struct caching_data_struct *caching_data, int fd, size_t size, off_t off)
+{
+    int nreturn=0;
 
-            } else {
+    size=get_size_in_file(caching_data, size, off);
 
-                endsector=cached_block->endsector;
+    if ( ram_cache_enabled()==1 ) {
 
-            }
+	nreturn=reply_from_ram_cache(req, caching_data, size, off);
+	if ( nreturn==0 ) goto out;
 
-            cached_block_found=cached_block;
+	if ( cdfs_options.diskless==1 ) {
 
-            // the actual sectors added are the difference
+	    nreturn=fuse_reply_err(req, ( nreturn==-ENODATA ) ? EIO : -nreturn);
+	    goto out;
 
-            nrsectors=cached_block->endsector - cached_block->startsector + 1 - tmpsectors;
+	}
 
-        } else {
+	nreturn=0;
 
-            // merge two existing blocks together
-            // adjust cached_block_found and
-            // move cached_block to unused list
-            // is this ok???
+    }
 
-            tmpsectors=endsector - startsector + 1;
+    if ( get_cache_map(caching_data) ) {
 
-            if ( cached_block->endsector>endsector ) {
+	nreturn=reply_from_cache_map(req, caching_data, size, off);
+	if ( nreturn!=-ENODATA ) goto out;
 
-                cached_block_found->endsector=cached_block->endsector;
-                endsector=cached_block_found->endsector;
+	nreturn=0;
 
-            }
+    }
 
-            if ( cached_block->startsector<startsector ) {
+    if ( cdfs_options.splicereads==1 && caching_data->direct==0 && ram_cache_enabled()==0 && size>0 ) {
+	struct cached_file_bufvec_struct {
+	    struct fuse_bufvec bufv;
+	    struct fuse_buf buf;
+	} cached_bufv;
 
-                cached_block_found->startsector=cached_block->startsector;
-                startsector=cached_block_found->startsector;
+	memset(&cached_bufv, 0, sizeof(cached_bufv));
 
-            }
+	cached_bufv.bufv.count=set_cached_file_bufs(caching_data, fd, cached_bufv.bufv.buf, size, off);
 
-	    if ( cached_block->prev ) cached_block->prev->next=cached_block->next;
-	    if ( cached_block->next ) cached_block->next->prev=cached_block->prev;
+	logoutput2("reply_from_cached_file: splice %zi bytes from %"PRIu64, size, off);
 
-	    move_cached_block_to_unused_list(cached_block);
+	// fuse_reply_data takes care of errors reading the fd itself
 
-            nrsectors=cached_block_found->endsector - cached_block_found->startsector + 1 - tmpsectors;
+	nreturn=fuse_reply_data(req, &cached_bufv.bufv, FUSE_BUF_SPLICE_MOVE);
 
-        }
+    } else {
 
-	cached_block=next_cached_block;
+	char *buffer=NULL;
+	ssize_t res=0;
 
-    }
+	if ( size>0 ) {
 
+	    buffer=malloc(size);
 
-    //
-    // no block found to merge with
-    //
+	    if ( ! buffer ) {
 
-    if ( ! cached_block_found ) {
+		nreturn=fuse_reply_err(req, ENOMEM);
+		goto out;
 
-        cached_block_found=get_cached_block();
+	    }
 
-        cached_block_found->startsector=startsector;
-        cached_block_found->endsector=endsector;
-        cached_block_found->tracknr=caching_data->tracknr;
+	    res=read_cached_file(caching_data, fd, buffer, size, off);
 
-    }
+	    if ( res<0 ) {
 
+		nreturn=fuse_reply_err(req, -res);
+		free(buffer);
+		goto out;
 
-    if ( before_cached_block ) {
+	    }
 
-	cached_block_found->prev=before_cached_block;
-	before_cached_block->next=cached_block_found;
+	    if ( ram_cache_enabled()==1 ) insert_read_in_ram_cache(caching_data, buffer, res, off);
 
-    } else {
+	}
 
-	caching_data->cached_block=cached_block_found;
-	cached_block_found->prev=NULL;
+	logoutput2("reply_from_cached_file: %zi bytes read", res);
 
-    }
+	nreturn=fuse_reply_buf(req, buffer, res);
 
-    if ( after_cached_block ) {
+	if ( buffer ) free(buffer);
 
-	cached_block_found->next=after_cached_block;
-	after_cached_block->prev=cached_block_found;
+    }
 
-    } else {
+    out:
 
-	cached_block_found->next=NULL;
+    return nreturn;
+
+}
 
-    }
 
-    //
-    // update the number of sectors read
-    //
 
-    caching_data->sectorsread+=nrsectors;
-    cached_block=caching_data->cached_block;
 
-    if ( cached_block ) {
 
-        // check everything is read
+//
+// residency bitmap of a track
+//
+// one bit per sector, relative to the first sector of the track, set when the sector is in the cache file
+// next to that a summary with one bit per word of the bitmap, set when that word is full, to skip
+// large cached parts fast when looking for the next missing sector
+//
+// only the cache manager sets bits (after the data is written to the cache file), and bits are
+// never cleared while the fs is mounted (but diskless, when the ram cache evicts sectors), so readers
+// just load the words atomically without a lock
+//
 
-        if ( ! cached_block->next && 
-        cached_block->startsector==caching_data->startsector && 
-        cached_block->endsector==caching_data->endsector ) {
+int create_cache_bitmap(struct caching_data_struct *caching_data)
+{
+    unsigned int nrsectors=caching_data->endsector - caching_data->startsector + 1;
 
-            caching_data->ready=1;
+    caching_data->nrwords=( nrsectors + CDFS_BITS_PER_WORD - 1 ) / CDFS_BITS_PER_WORD;
 
-        }
+    caching_data->bitmap=calloc(caching_data->nrwords, sizeof(unsigned long));
+    caching_data->summary=calloc(( caching_data->nrwords + CDFS_BITS_PER_WORD - 1 ) / CDFS_BITS_PER_WORD, sizeof(unsigned long));
 
-    }
+    if ( ! caching_data->bitmap || ! caching_data->summary ) {
 
-    //
-    // release the lock
-    //
+	if ( caching_data->bitmap ) free(caching_data->bitmap);
+	if ( caching_data->summary ) free(caching_data->summary);
 
-    if ( nwritelock>0 ) {
+	caching_data->bitmap=NULL;
+	caching_data->summary=NULL;
+	caching_data->nrwords=0;
 
-        nwritelock=release_writelock_caching_data(caching_data);
+	return -ENOMEM;
 
     }
 
-    out:
-
-    logoutput2("insert block internal: %i sectors added", nrsectors);
+    logoutput2("create cache bitmap: %i words for %i sectors", caching_data->nrwords, nrsectors);
 
-    return nrsectors;
+    return 0;
 
 }
 
+//
+// mask of the bits lo to hi (including) in a word
+//
+
+static inline unsigned long get_mask_bits(unsigned int lo, unsigned int hi)
+{
+    unsigned long mask=( hi==CDFS_BITS_PER_WORD - 1 ) ? ~0UL : ( 1UL << ( hi + 1 )) - 1;
 
+    return mask & ~(( 1UL << lo ) - 1);
+
+}
+
+//
+// correct an interval to the sectors of the track
+// returns false when nothing is left
+//
 
-struct cached_block_struct *get_first_cached_block_internal(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+static inline bool clip_to_track(struct caching_data_struct *caching_data, unsigned int *startsector, unsigned int *endsector)
 {
-    struct cached_block_struct *cached_block=NULL;
 
+    if ( *startsector < caching_data->startsector ) *startsector=caching_data->startsector;
+    if ( *endsector > caching_data->endsector ) *endsector=caching_data->endsector;
 
-    if ( caching_data->cached_block ) {
+    return ( *startsector <= *endsector );
 
-        // there are blocks: look for the first block where
-        // the endsector is past the first sector we're looking for
+}
 
-        cached_block=caching_data->cached_block;
+//
+// mark the sectors (startsector, endsector) as present in the cache
+// called by the cache manager, after the sectors are written to the cache file
+//
+// returns the number of sectors which were not in cache before
+//
 
-        while (cached_block) {
+int insert_sectors_in_cache(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+{
+    unsigned int bit, lastbit, word, lo, hi;
+    unsigned long mask, old;
+    int nrsectors=0;
 
-            if ( cached_block->endsector >= startsector ) break;
-            cached_block=cached_block->next;
+    logoutput2("insert sectors in cache: %i to %i", startsector, endsector);
 
-        }
+    if ( ! caching_data->bitmap || ! clip_to_track(caching_data, &startsector, &endsector) ) return 0;
 
-    }
+    bit=startsector - caching_data->startsector;
+    lastbit=endsector - caching_data->startsector;
 
+    while ( bit<=lastbit ) {
 
-    return cached_block;
-}
+	word=bit / CDFS_BITS_PER_WORD;
+	lo=bit % CDFS_BITS_PER_WORD;
+	hi=( lastbit / CDFS_BITS_PER_WORD > word ) ? CDFS_BITS_PER_WORD - 1 : lastbit % CDFS_BITS_PER_WORD;
 
+	mask=get_mask_bits(lo, hi);
 
+	// release: the data in the cache file is there before anyone sees the bit
 
-//
-// send a read result from the cdrom reader to the queue of the cache manager
-//
+	old=__atomic_fetch_or(&(caching_data->bitmap[word]), mask, __ATOMIC_RELEASE);
 
-int send_read_result_to_cache(struct read_call_struct *read_call, struct caching_data_struct *caching_data, unsigned int startsector, char *buffer, unsigned int nrsectors)
-{
-    int nreturn=0;
-    struct read_result_struct *read_result;
+	nrsectors+=__builtin_popcountl(mask & ~old);
 
-    logoutput2("send result to cache: new block 2 insert: (%i - %i)", startsector, startsector + nrsectors);
+	if ( ( old | mask )==~0UL ) {
 
-    read_result=get_read_result();
+	    __atomic_fetch_or(&(caching_data->summary[word / CDFS_BITS_PER_WORD]), 1UL << ( word % CDFS_BITS_PER_WORD ), __ATOMIC_RELEASE);
 
-    if ( ! read_result ) {
+	}
 
-        nreturn=-ENOMEM;
-        goto out;
+	bit=( word + 1 ) * CDFS_BITS_PER_WORD;
 
     }
 
-    read_result->startsector=startsector;
-    read_result->endsector=startsector + nrsectors - 1;
-    read_result->read_call=read_call;
-    read_result->buffer=buffer;
-    read_result->read_call=read_call;
-    read_result->caching_data=caching_data;
+    // update the number of sectors read
 
-    // lock the results queue: set lock to 1
+    caching_data->sectorsread+=nrsectors;
 
-    pthread_mutex_lock(&(results_lockmutex));
+    if ( caching_data->sectorsread >= caching_data->endsector - caching_data->startsector + 1 ) {
 
-    while (results_lock==1) {
+	caching_data->ready=1;
 
-        // if already 1, wait for it to become 0
+    }
 
-	pthread_cond_wait(&(results_lockcond), &(results_lockmutex));
+    logoutput2("insert sectors in cache: %i sectors added", nrsectors);
 
-    }
+    return nrsectors;
 
-    results_lock=1;
-    pthread_mutex_unlock(&(results_lockmutex));
+}
 
+//
+// mark the sectors (startsector, endsector) as not present anymore
+// only diskless, when the ram cache evicts them (with it's lock, see cdfs-ramcache.c)
+//
 
-    // simple insert at list
+void remove_sectors_from_cache(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+{
+    unsigned int bit, lastbit, word, lo, hi;
+    unsigned long mask, old;
+    int nrsectors=0;
 
-    if ( tail_queue_read_results ) {
+    if ( ! caching_data->bitmap || ! clip_to_track(caching_data, &startsector, &endsector) ) return;
 
-        tail_queue_read_results->next=read_result;
+    bit=startsector - caching_data->startsector;
+    lastbit=endsector - caching_data->startsector;
 
-    }
+    while ( bit<=lastbit ) {
 
-    read_result->prev=tail_queue_read_results;
-    tail_queue_read_results=read_result;
+	word=bit / CDFS_BITS_PER_WORD;
+	lo=bit % CDFS_BITS_PER_WORD;
+	hi=( lastbit / CDFS_BITS_PER_WORD > word ) ? CDFS_BITS_PER_WORD - 1 : lastbit % CDFS_BITS_PER_WORD;
 
-    if ( ! head_queue_read_results ) head_queue_read_results=read_result;
+	mask=get_mask_bits(lo, hi);
 
-    logoutput2("send result to cache: added to read results queue");
+	// the summary first: a reader skipping a full word never misses a cleared bit
 
+	__atomic_fetch_and(&(caching_data->summary[word / CDFS_BITS_PER_WORD]), ~( 1UL << ( word % CDFS_BITS_PER_WORD ) ), __ATOMIC_RELEASE);
 
-    // unlock the results queue and signal something has changed
+	old=__atomic_fetch_and(&(caching_data->bitmap[word]), ~mask, __ATOMIC_RELEASE);
 
-    pthread_mutex_lock(&(results_lockmutex));
-    results_lock=0;
-    pthread_cond_broadcast(&(results_lockcond));
-    pthread_mutex_unlock(&(results_lockmutex));
+	nrsectors+=__builtin_popcountl(mask & old);
 
+	bit=( word + 1 ) * CDFS_BITS_PER_WORD;
 
-    out:
+    }
 
-    return nreturn;
+    caching_data->sectorsread-=nrsectors;
+    if ( nrsectors>0 ) caching_data->ready=0;
+
+    logoutput2("remove sectors from cache: %i to %i, %i sectors removed", startsector, endsector, nrsectors);
 
 }
 
 //
-// notify waiting clients for data to be present in cache
-//
-// clients are probably only be threads for the read call
-// one such a client has initiated the read command and is waiting for
-// the result to be present in the cache
-// this function is doing a broadcast 
-// any client interested will take the right action, probably checking the data
-// which has become available in the cache is enough for the read request
+// get the first sector in (startsector, endsector) which is not in cache
+// returns endsector+1 when all are in cache
 //
 
-void notify_waiting_clients(struct read_call_struct *read_call, unsigned int startsector, unsigned int endsector)
+unsigned int get_first_missing_sector(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
 {
+    unsigned int bit, lastbit, word;
+    unsigned int first=startsector, last=endsector;
+    unsigned long value;
 
+    // sectors outside the track are never read, so they count as cached
 
-    logoutput2("notify waiting clients: received read result: (%i - %i)", startsector, endsector);
-
-    // increase the bytes read, and broadcast the original read call
+    if ( ! caching_data->bitmap ) return startsector;
+    if ( ! clip_to_track(caching_data, &first, &last) ) return endsector+1;
 
-    pthread_mutex_lock(&(read_call->lockmutex));
+    bit=first - caching_data->startsector;
+    lastbit=last - caching_data->startsector;
 
-    read_call->lock=1; /* close for other actions */
+    while ( bit<=lastbit ) {
 
-    // increase the bytes read
+	word=bit / CDFS_BITS_PER_WORD;
 
-    read_call->nrsectorsread += endsector - startsector + 1;
+	if ( bit % CDFS_BITS_PER_WORD == 0 ) {
 
-    read_call->lock=0; /* open for other actions */
+	    // at the begin of a word: skip full words using the summary
 
-    pthread_cond_broadcast(&(read_call->lockcond));
-    pthread_mutex_unlock(&(read_call->lockmutex));
+	    if ( word % CDFS_BITS_PER_WORD == 0 && __atomic_load_n(&(caching_data->summary[word / CDFS_BITS_PER_WORD]), __ATOMIC_ACQUIRE)==~0UL ) {
 
+		bit+=CDFS_BITS_PER_WORD * CDFS_BITS_PER_WORD;
+		continue;
 
-}
+	    }
 
-//
-// write progress data to a fifo
-// todo make a difference between tracks
-//
+	}
 
-void write_progress_to_fifo(struct caching_data_struct *caching_data)
-{
-    int procentread=0;
-    char string2write[4];
-    int fd=0;
+	value=~__atomic_load_n(&(caching_data->bitmap[word]), __ATOMIC_ACQUIRE) >> ( bit % CDFS_BITS_PER_WORD );
 
-    fd=open(cdfs_options.progressfifo, O_WRONLY);
+	if ( value ) {
 
-    if ( fd>0 ) {
+	    bit+=__builtin_ctzl(value);
 
-	procentread = 100 * caching_data->sectorsread / ( caching_data->endsector - caching_data->startsector + 1 );
+	    if ( bit<=lastbit ) return caching_data->startsector + bit;
 
-	snprintf(string2write, 4, "%i", procentread);
+	    break;
 
-	write(fd, string2write, strlen(string2write));
+	}
 
-	close(fd);
+	bit=( word + 1 ) * CDFS_BITS_PER_WORD;
 
     }
 
-}
+    return endsector+1;
 
+}
 
 //
+// get the first sector in (startsector, endsector) which is in cache
+// returns endsector+1 when none is in cache
 //
-// thread to process the read results from the cdrom
-// a. write the result to the cached file
-// b. update the cache administration
-// c. send a broadcast signal to waiting clients
-// d. send progress information to a fifo
-//
-// TODO: howto terminate?
-//
-//
-
 
-static void *cache_manager_thread()
+unsigned int get_first_cached_sector(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
 {
-    struct read_result_struct *read_result;
-    off_t offset_infile;
-    struct caching_data_struct *caching_data;
-    unsigned int nrsectors=0;
-    int nreturn=0, nerror=0;
+    unsigned int bit, lastbit, word;
+    unsigned int first=startsector, last=endsector;
+    unsigned long value;
 
+    // sectors outside the track are never read, so they count as cached
 
-    pthread_mutex_init(&results_lockmutex, NULL);
-    pthread_cond_init(&results_lockcond, NULL);
+    if ( ! caching_data->bitmap ) return endsector+1;
+    if ( ! clip_to_track(caching_data, &first, &last) ) return endsector+1;
 
+    bit=first - caching_data->startsector;
+    lastbit=last - caching_data->startsector;
 
-    while (1) {
+    while ( bit<=lastbit ) {
 
-	// wait for something on the results queue and free to lock/use
+	word=bit / CDFS_BITS_PER_WORD;
 
-	pthread_mutex_lock(&results_lockmutex);
+	value=__atomic_load_n(&(caching_data->bitmap[word]), __ATOMIC_ACQUIRE) >> ( bit % CDFS_BITS_PER_WORD );
 
-	while ( results_lock==1 || ! head_queue_read_results) {
+	if ( value ) {
 
-	    pthread_cond_wait(&results_lockcond, &results_lockmutex);
+	    bit+=__builtin_ctzl(value);
 
-	}
+	    if ( bit<=lastbit ) return caching_data->startsector + bit;
 
-        results_lock=1;
+	    break;
 
-	// queue is not empty: get the read result
+	}
 
-	read_result=head_queue_read_results;
+	bit=( word + 1 ) * CDFS_BITS_PER_WORD;
 
-	// remove from results queue
+    }
 
-	head_queue_read_results=read_result->next;
-	if ( tail_queue_read_results == read_result ) tail_queue_read_results=head_queue_read_results;
-	if ( head_queue_read_results ) head_queue_read_results->prev=NULL;
+    return endsector+1;
 
-	results_lock=0;
+}
 
-	pthread_cond_broadcast(&(results_lockcond));
-	pthread_mutex_unlock(&(results_lockmutex)); /* release the results queue */
+//
+// test the interval (startsector, endsector) is completly in cache
+//
 
+int sectors_in_cache(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+{
 
-        logoutput2("cache manager: received read result: (%i - %i)", read_result->startsector, read_result->endsector);
+    if ( caching_data->ready==1 ) return 1;
 
+    return ( get_first_missing_sector(caching_data, startsector, endsector) > endsector ) ? 1 : 0;
 
-	// really detach from the queue
-	read_result->next=NULL;
-	read_result->prev=NULL;
+}
 
 
-        // lookup caching_data
+
+//
+// send a read result from the cdrom reader to the queue of the cache manager
+//
+
+int send_read_result_to_cache(struct read_call_struct *read_call, struct caching_data_struct *caching_data, unsigned char readclass, unsigned int startsector, struct sector_slot_struct *sector_slot, unsigned int nrsectors)
+{
+    int nreturn=0;
+    struct read_result_struct *read_result;
+
+    logoutput2("send result to cache: new block 2 insert: (%i - %i)", startsector, startsector + nrsectors);
+
+    read_result=get_read_result();
+
+    if ( ! read_result ) {
+
+        nreturn=-ENOMEM;
+        goto out;
+
+    }
+
+    read_result->startsector=startsector;
+    read_result->endsector=startsector + nrsectors - 1;
+    read_result->read_call=read_call;
+    read_result->sector_slot=sector_slot;
+    read_result->readclass=readclass;
+    read_result->caching_data=caching_data;
+
+    add_bytes_in_flight(nrsectors * CDIO_CD_FRAMESIZE_RAW);
+
+    // push on the queue of the cache manager, when full (the cache manager is behind writing)
+    // wait till there is space again
+
+    push_mpsc_queue_wait(&read_results_queue, (void *) read_result);
+
+    logoutput2("send result to cache: added to read results queue");
+
+
+    out:
+
+    return nreturn;
+
+}
+
+//
+// reply to the fuse request of a read call, and release the read call
+// called when all the sectors are in the cache, or when reading the cd failed
+//
+
+static void add_latency_to_histogram(struct latency_histogram_struct *histogram, unsigned long latency)
+{
+    unsigned int bucket=0;
+
+    while ( bucket < CDFS_LATENCY_BUCKETS - 1 && latency >= ( 64UL << bucket ) ) bucket++;
+
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, latency, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+}
+
+//
+// the latency of a read call from the start of the read till the reply
+//
+
+static void count_read_call_latency(struct read_call_struct *read_call, struct latency_histogram_struct *histogram)
+{
+    struct timespec now;
+    unsigned long latency;
+
+    if ( read_call->seek==0 && read_call->missed==0 ) return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    latency=(now.tv_sec - read_call->started.tv_sec) * 1000000 + (now.tv_nsec - read_call->started.tv_nsec) / 1000;
+
+    if ( read_call->missed==1 ) add_latency_to_histogram(histogram, latency);
+
+    if ( read_call->seek==1 ) {
+
+        pthread_mutex_lock(&seek_stats_mutex);
+
+        seek_count++;
+        seek_latency_total+=latency;
+        if ( latency > seek_latency_max ) seek_latency_max=latency;
+
+        pthread_mutex_unlock(&seek_stats_mutex);
+
+    }
+
+}
+
+//
+// diskless: sectors of a read call found complete were evicted before it's replied (when it's dispatched
+// by a fuse thread, or the sectors in front of a result it's replied from), read them again, till they are there
+// this ends: the cache manager replies the waiters right after inserting the sectors read again,
+// before it evicts anything for the next result
+//
+
+static void retry_read_call(struct read_call_struct *read_call)
+{
+    struct caching_data_struct *caching_data=read_call->caching_data;
+    int res;
+
+    read_call->retries++;
+
+    logoutput2("reply read call: sectors (%i - %i) not in ram anymore, reading again (%u)", read_call->startsector, read_call->endsector, read_call->retries);
+
+    read_call->complete=0;
+    read_call->dispatched=0;
+
+    register_read_call(caching_data, read_call);
+
+    res=send_read_command(read_call, NULL, caching_data, read_call->startsector, read_call->endsector, 0, 0);
+
+    dispatch_read_call(read_call, res);
+
+}
+
+static void reply_read_call(struct read_call_struct *read_call)
+{
+    int res;
+
+    if ( read_call->nerror<0 ) {
+
+	logoutput2("reply read call: error %i", read_call->nerror);
+
+	count_read_call_latency(read_call, &miss_latency_cache);
+
+	fuse_reply_err(read_call->req, -read_call->nerror);
+
+    } else if ( cdfs_options.diskless==1 ) {
+
+	res=reply_from_ram_cache(read_call->req, read_call->caching_data, get_size_in_file(read_call->caching_data, read_call->size, read_call->off), read_call->off);
+
+	if ( res==-ENODATA ) {
+
+	    retry_read_call(read_call);
+	    return;
+
+	}
+
+	count_read_call_latency(read_call, &miss_latency_cache);
+
+	if ( res<0 ) fuse_reply_err(read_call->req, -res);
+
+    } else {
+
+	count_read_call_latency(read_call, &miss_latency_cache);
+
+	logoutput2("reply read call: reading %zi bytes from %"PRIu64, read_call->size, read_call->off);
+
+	reply_from_cached_file(read_call->req, read_call->caching_data, read_call->fd, read_call->size, read_call->off);
+
+    }
+
+    move_read_call_to_unused_list(read_call);
+
+}
+
+//
+// reply to a read call from the buffer of a read result, before it's written to the cache file
+// the bytes in front of the buffer (the header and sectors of earlier results) are in the cache file already
+// (with O_DIRECT these are read in memory first)
+//
+
+static void reply_read_call_from_buffer(struct read_call_struct *read_call, struct read_result_struct *read_result)
+{
+    struct caching_data_struct *caching_data=read_call->caching_data;
+    struct fuse_bufvec *bufv;
+    char *filebuffer=NULL;
+    off_t bufferstart;
+    size_t size=read_call->size, sizefile=0;
+    ssize_t res;
+
+    bufferstart=SIZE_RIFFHEADER + (off_t) ( read_result->startsector - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
+
+    if ( read_call->off + size > caching_data->size ) size=caching_data->size - read_call->off;
+    if ( read_call->off < bufferstart ) sizefile=bufferstart - read_call->off;
+
+    logoutput2("reply read call: %zi bytes from %"PRIu64" from buffer (%zi from cache file)", size, read_call->off, sizefile);
+
+    // room for three buffers: the header (layout 2), the part in the cache file and the part in memory
+
+    bufv=malloc(sizeof(struct fuse_bufvec) + 2 * sizeof(struct fuse_buf));
+
+    if ( ! bufv ) {
+
+	fuse_reply_err(read_call->req, ENOMEM);
+	goto out;
+
+    }
+
+    memset(bufv, 0, sizeof(struct fuse_bufvec) + 2 * sizeof(struct fuse_buf));
+
+    bufv->count=0;
+
+    if ( sizefile>0 && ( caching_data->direct==1 || cdfs_options.diskless==1 ) ) {
+
+	filebuffer=malloc(sizefile);
+
+	if ( ! filebuffer ) {
+
+	    fuse_reply_err(read_call->req, ENOMEM);
+	    goto out;
+
+	}
+
+	res=read_cached_file(caching_data, read_call->fd, filebuffer, sizefile, read_call->off);
+
+	if ( res < (ssize_t) sizefile && cdfs_options.diskless==1 ) {
+
+	    // diskless: sectors of earlier results are evicted from ram, read them again like reply_read_call does
+
+	    free(bufv);
+	    free(filebuffer);
+
+	    retry_read_call(read_call);
+	    return;
+
+	} else if ( res < (ssize_t) sizefile ) {
+
+	    fuse_reply_err(read_call->req, ( res<0 ) ? -res : EIO);
+	    goto out;
+
+	}
+
+	bufv->buf[0].size=sizefile;
+	bufv->buf[0].mem=filebuffer;
+
+	bufv->count++;
+
+    } else if ( sizefile>0 ) {
+
+	bufv->count=set_cached_file_bufs(caching_data, read_call->fd, bufv->buf, sizefile, read_call->off);
+
+    }
+
+    bufv->buf[bufv->count].size=size - sizefile;
+    bufv->buf[bufv->count].mem=read_result->sector_slot->buffer + ( read_call->off + sizefile - bufferstart );
+
+    bufv->count++;
+
+    // the buffer is not moved: the slot is written to the cache file after this, and reused
+
+    fuse_reply_data(read_call->req, bufv, 0);
+
+    out:
+
+    // replied (or failed): a read call read again is counted when it's replied
+
+    count_read_call_latency(read_call, &miss_latency_buffer);
+
+    if ( bufv ) free(bufv);
+    if ( filebuffer ) free(filebuffer);
+
+    move_read_call_to_unused_list(read_call);
+
+}
+
+//
+// latency of the reads after a seek: count, average and max in microseconds
+//
+
+int get_seek_latency_stats(char *buffer, size_t size)
+{
+    int len;
+
+    pthread_mutex_lock(&seek_stats_mutex);
+
+    len=snprintf(buffer, size, "seeks=%lu avg=%lu max=%lu", seek_count, ( seek_count>0 ) ? seek_latency_total / seek_count : 0, seek_latency_max);
+
+    pthread_mutex_unlock(&seek_stats_mutex);
+
+    return len;
+
+}
+
+//
+// histograms of the latency of the reads which waited for the cd, in a string like:
+// buffer:count=40,avg=2310,hist=0,0,0,1,... cache:count=12,avg=3120,hist=...
+// bucket i counts the latencies below 64 << i microseconds, the last one all above
+//
+
+int get_miss_latency_stats(char *buffer, size_t size)
+{
+    struct latency_histogram_struct *histograms[2]={&miss_latency_buffer, &miss_latency_cache};
+    unsigned long count;
+    unsigned int i, bucket;
+    int len=0;
+
+    for (i=0; i<2 && len < size; i++) {
+
+	count=__atomic_load_n(&histograms[i]->count, __ATOMIC_RELAXED);
+
+	len+=snprintf(buffer+len, size-len, "%s%s:count=%lu,avg=%lu,hist=", (i>0) ? " " : "", histograms[i]->name, count,
+			( count>0 ) ? __atomic_load_n(&histograms[i]->total, __ATOMIC_RELAXED) / count : 0);
+
+	for (bucket=0; bucket<CDFS_LATENCY_BUCKETS && len < size; bucket++) {
+
+	    len+=snprintf(buffer+len, size-len, "%s%lu", (bucket>0) ? "," : "", __atomic_load_n(&histograms[i]->buckets[bucket], __ATOMIC_RELAXED));
+
+	}
+
+    }
+
+    return len;
+
+}
+
+//
+// remove a read call from the waiters of a track
+// caller holds the waitmutex
+//
+
+static void remove_waiting_read_call(struct caching_data_struct *caching_data, struct read_call_struct *read_call)
+{
+
+    if ( read_call->next ) read_call->next->prev=read_call->prev;
+
+    if ( read_call->prev ) {
+
+	read_call->prev->next=read_call->next;
+
+    } else if ( caching_data->waiting_read_calls==read_call ) {
+
+	caching_data->waiting_read_calls=read_call->next;
+
+    }
+
+    read_call->next=NULL;
+    read_call->prev=NULL;
+
+}
+
+//
+// register a read call as waiter for the sectors (read_call->startsector, read_call->endsector) of a track
+//
+// the waiters are kept sorted by startsector, so a read result only has to look at the waiters
+// left of it's endsector
+// register before looking in the cache and sending read commands, then no result or
+// error can get lost
+//
+
+void register_read_call(struct caching_data_struct *caching_data, struct read_call_struct *read_call)
+{
+    struct read_call_struct *read_call_tmp, *read_call_prev=NULL;
+
+    pthread_mutex_lock(&(caching_data->waitmutex));
+
+    read_call_tmp=caching_data->waiting_read_calls;
+
+    while (read_call_tmp) {
+
+	if ( read_call_tmp->startsector > read_call->startsector ) break;
+
+	read_call_prev=read_call_tmp;
+	read_call_tmp=read_call_tmp->next;
+
+    }
+
+    read_call->prev=read_call_prev;
+    read_call->next=read_call_tmp;
+
+    if ( read_call_tmp ) read_call_tmp->prev=read_call;
+
+    if ( read_call_prev ) {
+
+	read_call_prev->next=read_call;
+
+    } else {
+
+	caching_data->waiting_read_calls=read_call;
+
+    }
+
+    pthread_mutex_unlock(&(caching_data->waitmutex));
+
+}
+
+//
+// dispatch a read call: the fuse thread has send all read commands, and does not wait for
+// the result, but returns
+// if all the sectors are already there (or an error is reported) reply here, otherwise the read call is
+// replied by notify_waiting_clients when the last sectors come in
+//
+
+void dispatch_read_call(struct read_call_struct *read_call, int nerror)
+{
+    struct caching_data_struct *caching_data=read_call->caching_data;
+    unsigned char complete=0;
+
+    pthread_mutex_lock(&(caching_data->waitmutex));
+
+    if ( nerror<0 && read_call->nerror==0 ) read_call->nerror=nerror;
+
+    read_call->dispatched=1;
+
+    if ( read_call->nerror==0 && read_call->complete==0 ) {
+
+	// a result may have come in before the read call was registered,
+	// or everything was in cache already
+
+	if ( sectors_in_cache(caching_data, read_call->startsector, read_call->endsector)==1 ) read_call->complete=1;
+
+    }
+
+    if ( read_call->nerror<0 || read_call->complete==1 ) {
+
+	remove_waiting_read_call(caching_data, read_call);
+	complete=1;
+
+    }
+
+    pthread_mutex_unlock(&(caching_data->waitmutex));
+
+    logoutput2("dispatch read call: %s", (complete==1) ? "complete" : "waiting for sectors");
+
+    if ( complete==1 ) reply_read_call(read_call);
+
+}
+
+//
+// wake the waiters of a track overlapping the interval (startsector, endsector)
+//
+// with nerror==0 only the waiters which have their whole range in cache are woken, checked against the
+// cached blocks, with nerror<0 every waiter overlapping gets the error
+// waiters not dispatched yet are only marked, dispatch_read_call replies them
+//
+
+static void wake_waiting_read_calls(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, int nerror)
+{
+    struct read_call_struct *read_call, *read_call_next;
+    struct read_call_struct *woken_read_calls=NULL;
+
+    pthread_mutex_lock(&(caching_data->waitmutex));
+
+    read_call=caching_data->waiting_read_calls;
+
+    while (read_call) {
+
+	read_call_next=read_call->next;
+
+	// sorted by startsector: none of the rest overlaps
+
+	if ( read_call->startsector > endsector ) break;
+
+	if ( read_call->endsector < startsector || read_call->complete==1 || read_call->nerror<0 ) {
+
+	    read_call=read_call_next;
+	    continue;
+
+	}
+
+	if ( nerror<0 ) {
+
+	    read_call->nerror=nerror;
+
+	} else if ( sectors_in_cache(caching_data, read_call->startsector, read_call->endsector)==1 ) {
+
+	    read_call->complete=1;
+
+	} else {
+
+	    read_call=read_call_next;
+	    continue;
+
+	}
+
+	if ( read_call->dispatched==1 ) {
+
+	    remove_waiting_read_call(caching_data, read_call);
+
+	    read_call->next=woken_read_calls;
+	    woken_read_calls=read_call;
+
+	}
+
+	read_call=read_call_next;
+
+    }
+
+    pthread_mutex_unlock(&(caching_data->waitmutex));
+
+    // reply outside the lock
+
+    while (woken_read_calls) {
+
+	read_call=woken_read_calls;
+	woken_read_calls=read_call->next;
+	read_call->next=NULL;
+
+	reply_read_call(read_call);
+
+    }
+
+}
+
+//
+// reply the waiters of a track which get their last sectors with this read result from it's buffer,
+// before it's written to the cache file
+//
+// only waiters which are dispatched, with no sectors after the result, and the sectors before it in cache
+// waiters replied here are removed, so notify_waiting_clients does not see them anymore
+//
+
+static void serve_waiting_read_calls(struct caching_data_struct *caching_data, struct read_result_struct *read_result)
+{
+    struct read_call_struct *read_call, *read_call_next;
+    struct read_call_struct *served_read_calls=NULL;
+    off_t bufferend, readend;
+
+    bufferend=SIZE_RIFFHEADER + (off_t) ( read_result->endsector + 1 - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
+
+    pthread_mutex_lock(&(caching_data->waitmutex));
+
+    read_call=caching_data->waiting_read_calls;
+
+    while (read_call) {
+
+	read_call_next=read_call->next;
+
+	// sorted by startsector: none of the rest overlaps
+
+	if ( read_call->startsector > read_result->endsector ) break;
+
+	if ( read_call->endsector < read_result->startsector || read_call->endsector > read_result->endsector || read_call->complete==1 || read_call->nerror<0 || read_call->dispatched==0 ) {
+
+	    read_call=read_call_next;
+	    continue;
+
+	}
+
+	// the last byte of the reply (not beyond the end of the file) has to be in the buffer
+
+	readend=read_call->off + read_call->size;
+	if ( readend > caching_data->size ) readend=caching_data->size;
+
+	if ( readend > bufferend ) {
+
+	    read_call=read_call_next;
+	    continue;
+
+	}
+
+	if ( read_call->startsector < read_result->startsector && sectors_in_cache(caching_data, read_call->startsector, read_result->startsector - 1)==0 ) {
+
+	    read_call=read_call_next;
+	    continue;
+
+	}
+
+	read_call->complete=1;
+
+	remove_waiting_read_call(caching_data, read_call);
+
+	read_call->next=served_read_calls;
+	served_read_calls=read_call;
+
+	read_call=read_call_next;
+
+    }
+
+    pthread_mutex_unlock(&(caching_data->waitmutex));
+
+    // reply outside the lock
+
+    while (served_read_calls) {
+
+	read_call=served_read_calls;
+	served_read_calls=read_call->next;
+	read_call->next=NULL;
+
+	reply_read_call_from_buffer(read_call, read_result);
+
+    }
+
+}
+
+//
+// push the sectors of a readahead result in the page cache of the kernel, when the track is open
+// and not too far ahead of where it's read
+// then the reads of the player do not come here anymore, the kernel has them already
+//
+// the cache manager only copies the sectors and queues them: storing waits for the pages the kernel
+// has locked for a read, and it's the cache manager which replies that read
+// when the queue is full the readahead is not pushed, it's read from the cache as usual
+//
+
+static void notify_store_read_result(struct caching_data_struct *caching_data, struct read_result_struct *read_result)
+{
+    unsigned int startsector=read_result->startsector, endsector=read_result->endsector, readposition;
+    struct read_call_struct *read_call;
+    struct notify_store_struct *notify_store;
+    off_t off;
+    size_t size;
+
+    if ( notify_store_started==0 || __atomic_load_n(&caching_data->nropen, __ATOMIC_RELAXED)==0 || caching_data->ino==0 ) return;
+
+    readposition=__atomic_load_n(&caching_data->readposition, __ATOMIC_RELAXED);
+
+    // only what's between the last read and the cap ahead of it
+
+    if ( startsector < readposition ) startsector=readposition;
+    if ( endsector >= readposition + cdfs_options.notifystoremax ) endsector=readposition + cdfs_options.notifystoremax - 1;
+
+    // the kernel keeps the pages of a read locked till it's replied, and storing waits for the lock:
+    // stop before the first read still waiting for sectors, the cache manager has to reply that one
+
+    pthread_mutex_lock(&(caching_data->waitmutex));
+
+    read_call=caching_data->waiting_read_calls;
+
+    while (read_call) {
+
+	if ( read_call->startsector > endsector ) break;
+
+	if ( read_call->endsector >= startsector ) {
+
+	    if ( read_call->startsector > startsector ) {
+
+		endsector=read_call->startsector - 1;
+
+	    } else {
+
+		// nothing left to store
+
+		startsector=endsector + 1;
+
+	    }
+
+	    break;
+
+	}
+
+	read_call=read_call->next;
+
+    }
+
+    pthread_mutex_unlock(&(caching_data->waitmutex));
+
+    if ( startsector > endsector ) return;
+
+    // the sectors are in the file behind the wav header
+
+    off=SIZE_RIFFHEADER + (off_t) ( startsector - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
+    size=( endsector - startsector + 1 ) * CDIO_CD_FRAMESIZE_RAW;
+
+    if ( off >= caching_data->size ) return;
+    if ( off + size > caching_data->size ) size=caching_data->size - off;
+
+    notify_store=malloc(sizeof(struct notify_store_struct) + size);
+
+    if ( ! notify_store ) {
+
+	__atomic_add_fetch(&notify_store_dropped, 1, __ATOMIC_RELAXED);
+	return;
+
+    }
+
+    notify_store->caching_data=caching_data;
+    notify_store->ino=caching_data->ino;
+    notify_store->off=off;
+    notify_store->size=size;
+
+    memcpy(notify_store->buffer, read_result->sector_slot->buffer + ( startsector - read_result->startsector ) * CDIO_CD_FRAMESIZE_RAW, size);
+
+    if ( push_mpsc_queue(&notify_store_queue, (void *) notify_store)<0 ) {
+
+	__atomic_add_fetch(&notify_store_dropped, 1, __ATOMIC_RELAXED);
+	free(notify_store);
+
+    }
+
+}
+
+//
+// the thread which pushes the queued readahead in the page cache of the kernel
+//
+
+static void *notify_store_thread()
+{
+    struct notify_store_struct *notify_store;
+    struct fuse_bufvec bufv=FUSE_BUFVEC_INIT(0);
+    int nreturn=0;
+
+    while (1) {
+
+	notify_store=(struct notify_store_struct *) pop_mpsc_queue(&notify_store_queue);
+
+	if ( ! notify_store ) {
+
+	    wait_mpsc_queue(&notify_store_queue);
+	    continue;
+
+	}
+
+	// closed in the meantime, or the kernel does not support it: nothing to push
+
+	if ( cdfs_options.notifystore==0 || __atomic_load_n(&notify_store->caching_data->nropen, __ATOMIC_RELAXED)==0 ) {
+
+	    free(notify_store);
+	    continue;
+
+	}
+
+	bufv.buf[0].size=notify_store->size;
+	bufv.buf[0].mem=notify_store->buffer;
+
+#ifdef CDFS_FUSE3
+	nreturn=fuse_lowlevel_notify_store(cdfs_session, notify_store->ino, notify_store->off, &bufv, 0);
+#else
+	nreturn=fuse_lowlevel_notify_store(cdfs_chan, notify_store->ino, notify_store->off, &bufv, 0);
+#endif
+
+	__atomic_add_fetch(&notify_store_calls, 1, __ATOMIC_RELAXED);
+
+	if ( nreturn<0 ) {
+
+	    logoutput2("notify store: error %i storing %zi bytes at %"PRIu64, nreturn, notify_store->size, (uint64_t) notify_store->off);
+
+	    __atomic_add_fetch(&notify_store_errors, 1, __ATOMIC_RELAXED);
+
+	    // the kernel does not support it: stop trying
+
+	    if ( nreturn==-ENOSYS ) cdfs_options.notifystore=0;
+
+	} else {
+
+	    __atomic_add_fetch(&notify_store_bytes, notify_store->size, __ATOMIC_RELAXED);
+
+	}
+
+	free(notify_store);
+
+    }
+
+    return NULL;
+
+}
+
+//
+// the readahead pushed in the page cache of the kernel in a string like:
+// calls=120 bytes=28224000 errors=0 dropped=0
+//
+
+int get_notify_store_stats(char *buffer, size_t size)
+{
+
+    return snprintf(buffer, size, "calls=%lu bytes=%lu errors=%lu dropped=%lu", __atomic_load_n(&notify_store_calls, __ATOMIC_RELAXED),
+			__atomic_load_n(&notify_store_bytes, __ATOMIC_RELAXED), __atomic_load_n(&notify_store_errors, __ATOMIC_RELAXED),
+			__atomic_load_n(&notify_store_dropped, __ATOMIC_RELAXED));
+
+}
+
+//
+// notify waiting clients for data to be present in cache
+//
+// clients are the read calls waiting for sectors of this track, whatever read command
+// caused the data to be read
+//
+
+void notify_waiting_clients(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+{
+
+    logoutput2("notify waiting clients: received read result: (%i - %i)", startsector, endsector);
+
+    wake_waiting_read_calls(caching_data, startsector, endsector, 0);
+
+}
+
+//
+// notify waiting clients reading the cd failed for sectors
+//
+// called for every failed read command, also the ones without a read call (readahead): a client
+// may wait for sectors of it as well; when nobody waits there is nothing to do (one registering
+// now finds the sectors missing and sends it's own read command)
+//
+
+void notify_read_error(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, int nerror)
+{
+
+    if ( ! caching_data || __atomic_load_n(&caching_data->waiting_read_calls, __ATOMIC_ACQUIRE)==NULL ) return;
+
+    logoutput2("notify read error: error %i for sectors (%i - %i)", nerror, startsector, endsector);
+
+    wake_waiting_read_calls(caching_data, startsector, endsector, nerror);
+
+}
+
+//
+// write progress data to a fifo
+// todo make a difference between tracks
+//
+// a timer in the mainloop, for every track read from since the last time: the cache manager
+// does not wait for the fifo, and without a reader (open fails with ENXIO) nothing is written
+//
+
+static void write_progress_to_fifo(int timerfd, void *data)
+{
+    struct caching_data_struct *caching_data;
+    unsigned int sectorsread;
+    int procentread=0;
+    char string2write[4];
+    int fd=-1;
+
+    pthread_mutex_lock(&list_caching_data_mutex);
+
+    caching_data=list_caching_data;
+
+    while (caching_data) {
+
+	sectorsread=__atomic_load_n(&caching_data->sectorsread, __ATOMIC_RELAXED);
+
+	if ( sectorsread != caching_data->sectorsprogress ) {
+
+	    if ( fd==-1 ) {
+
+		fd=open(cdfs_options.progressfifo, O_WRONLY | O_NONBLOCK);
+		if ( fd==-1 ) break;
+
+	    }
+
+	    procentread = 100 * sectorsread / ( caching_data->endsector - caching_data->startsector + 1 );
+
+	    snprintf(string2write, 4, "%i", procentread);
+
+	    if ( write(fd, string2write, strlen(string2write)) > 0 ) caching_data->sectorsprogress=sectorsread;
+
+	}
+
+	caching_data=caching_data->next;
+
+    }
+
+    pthread_mutex_unlock(&list_caching_data_mutex);
+
+    if ( fd>=0 ) close(fd);
+
+}
+
+//
+// the read result is written (or not, nerror): make the sectors available
+//
+
+static void complete_read_result(struct caching_data_struct *caching_data, struct read_result_struct *read_result, int nerror)
+{
+    unsigned int nrsectors=0;
+
+    if ( nerror<0 ) {
+
+        // not in the cache file: do not add it to the cache administration
+        // and let the waiting client know it's not going to be there
+
+        notify_read_error(caching_data, read_result->startsector, read_result->endsector, -EIO);
+
+        finish_read_result(read_result);
+
+        return;
+
+    }
+
+
+    //
+    // update the cache administration
+    // the actual number of sectors added to the cache is kept
+    // this maybe different from the nr sectors of the read result
+    // when some sectors were already read by another command
+    //
+    // the sectors go in ram too when there is a ram cache, diskless only there (which marks them)
+    //
+
+    if ( cdfs_options.diskless==1 ) {
+
+        nrsectors=insert_sectors_in_ram_cache(caching_data, read_result->startsector, read_result->sector_slot->buffer, read_result->endsector - read_result->startsector + 1);
+
+    } else {
+
+        if ( ram_cache_enabled()==1 ) insert_sectors_in_ram_cache(caching_data, read_result->startsector, read_result->sector_slot->buffer, read_result->endsector - read_result->startsector + 1);
+
+        nrsectors=insert_sectors_in_cache(caching_data, read_result->startsector, read_result->endsector);
+
+        // in the sqlite db with the next batch
+
+        if ( nrsectors>0 && cdfs_options.cachebackend==CDFS_CACHE_ADMIN_BACKEND_SQLITE ) append_interval_sqlite(caching_data, read_result->startsector, read_result->endsector);
+
+    }
+
+    logoutput1("cache manager: number of sectors inserted: %i", nrsectors);
+
+    // the sqlite db is committed in batches (see commit_intervals_sqlite), the progress fifo by a timer in the mainloop
+
+    //
+    // notify waiting clients
+    // every waiter on this track with all it's sectors now in cache, also when
+    // the result is from a read ahead or a read command of another client
+
+    notify_waiting_clients(caching_data, read_result->startsector, read_result->endsector);
+
+    //
+    // readahead: push it in the page cache of the kernel, a copy of the buffer still here
+    //
+
+    if ( cdfs_options.notifystore==1 && read_result->readclass!=CDFS_READ_CLASS_DEMAND ) notify_store_read_result(caching_data, read_result);
+
+
+    //
+    // data written to file... so it's safe to give back the sector slot and free the read_result
+    //
+    // a big TODO: what to do here when the original read_call is "orphaned/lost/not there"
+    //
+
+    finish_read_result(read_result);
+
+}
+
+//
+// a write to the cache file is finished
+//
+
+static void complete_cache_write(struct cache_write_struct *cache_write)
+{
+    struct caching_data_struct *caching_data=cache_write->caching_data;
+    unsigned char ready=caching_data->ready;
+    unsigned int i;
+
+    if ( cache_write->res<0 ) logoutput("cache manager: error %i writing %zi bytes to %s", -cache_write->res, cache_write->size, caching_data->path);
+
+    for (i=0; i<cache_write->nrresults; i++) complete_read_result(caching_data, cache_write->results[i], cache_write->res);
+
+    // the track is complete: make it durable when that's the policy
+
+    if ( cdfs_options.cachesync==CDFS_CACHE_SYNC_TRACK && ready==0 && caching_data->ready==1 ) sync_cache_file(cache_write->fd);
+
+    put_slab_object(&cache_writes_slab, (void *) cache_write);
+
+}
+
+
+//
+//
+// thread to process the read results from the cdrom
+// a. write the result to the cached file
+// b. update the cache administration
+// c. send a broadcast signal to waiting clients
+// d. send progress information to a fifo
+//
+// adjacent read results of a track are merged in one write (see cdfs-cache-io.c), and with io_uring
+// the writes are done while the next results are processed; b. and c. are done when the write is finished
+//
+// TODO: howto terminate?
+//
+//
+
+
+static void *cache_manager_thread()
+{
+    struct read_result_struct *read_result;
+    struct caching_data_struct *caching_data;
+    struct cache_write_struct *cache_write;
+    unsigned int nrsectors=0;
+    int nreturn=0, fd;
+    struct read_result_struct *pending_first[CDFS_READ_CLASSES], *pending_last[CDFS_READ_CLASSES];
+    unsigned char readclass;
+
+    for (readclass=0; readclass<CDFS_READ_CLASSES; readclass++) {
+
+	pending_first[readclass]=NULL;
+	pending_last[readclass]=NULL;
+
+    }
+
+
+    while (1) {
+
+	// take everything from the results queue, in lists per class, so what clients
+	// wait for is written first, and readahead after that
+
+	while ( ( read_result=(struct read_result_struct *) pop_mpsc_queue(&read_results_queue) ) ) {
+
+	    readclass=( read_result->readclass < CDFS_READ_CLASSES ) ? read_result->readclass : CDFS_READ_CLASS_BACKGROUND;
+
+	    read_result->next=NULL;
+	    read_result->prev=pending_last[readclass];
+
+	    if ( pending_last[readclass] ) {
+
+		pending_last[readclass]->next=read_result;
+
+	    } else {
+
+		pending_first[readclass]=read_result;
+
+	    }
+
+	    pending_last[readclass]=read_result;
+
+	}
+
+	// the finished writes first: clients wait for them
+
+	while ( ( cache_write=reap_cache_write(0) ) ) complete_cache_write(cache_write);
+
+	// the intervals of the finished writes in the sqlite db, in batches
+
+	if ( cdfs_options.cachebackend==CDFS_CACHE_ADMIN_BACKEND_SQLITE ) commit_intervals_sqlite(0);
+
+	for (readclass=0; readclass<CDFS_READ_CLASSES; readclass++) {
+
+	    if ( pending_first[readclass] ) break;
+
+	}
+
+	if ( readclass==CDFS_READ_CLASSES || get_cache_writes_inflight() >= CDFS_WRITES_INFLIGHT_MAX ) {
+
+	    if ( get_cache_writes_inflight() > 0 ) {
+
+		// wait for a write to finish
+
+		cache_write=reap_cache_write(1);
+		if ( cache_write ) complete_cache_write(cache_write);
+
+	    } else {
+
+		// nothing to do: wait for something on the results queue
+		// with intervals not in the sqlite db yet, not longer than the commit interval, they are
+		// committed then (at the top), not at once: that's an fdatasync after nearly every result
+
+		if ( cdfs_options.cachebackend==CDFS_CACHE_ADMIN_BACKEND_SQLITE && get_pending_intervals_sqlite()>0 ) {
+
+		    wait_mpsc_queue_timeout(&read_results_queue, CDFS_SQLITE_COMMIT_INTERVAL);
+
+		} else {
+
+		    wait_mpsc_queue(&read_results_queue);
+
+		}
+
+	    }
+
+	    continue;
+
+	}
+
+	read_result=pending_first[readclass];
+
+	pending_first[readclass]=read_result->next;
+	if ( ! pending_first[readclass] ) pending_last[readclass]=NULL;
+
+	read_result->next=NULL;
+	read_result->prev=NULL;
+
+        logoutput2("cache manager: received read result: (%i - %i)", read_result->startsector, read_result->endsector);
+
+
+        // lookup caching_data
 
         caching_data=read_result->caching_data;
 
@@ -1210,95 +2652,199 @@ static void *cache_manager_thread()
 
 	    logoutput("cache manager: error!! caching_data not found!! serious io error");
 
-	    //
-	    // move the read_result to unused list
-	    //
+	    //
+	    // give back the sector slot and move the read_result to unused list
+	    //
+
+            finish_read_result(read_result);
+
+            continue;
+
+        }
+
+        if ( cdfs_options.diskless==1 ) {
+
+            // no cache file: the sectors go in ram at once
+
+            if ( cdfs_options.servefrombuffer==1 ) serve_waiting_read_calls(caching_data, read_result);
+
+            complete_read_result(caching_data, read_result, 0);
+
+            continue;
+
+        }
+
+        if ( get_cache_map(caching_data) ) {
+            unsigned char ready=caching_data->ready;
+
+            // the track is open and the cache file mapped: copy it in, no write
+
+            if ( write_to_cache_map(caching_data, read_result)==0 ) {
+
+                complete_read_result(caching_data, read_result, 0);
+
+                if ( cdfs_options.cachesync==CDFS_CACHE_SYNC_TRACK && ready==0 && caching_data->ready==1 ) sync_cache_file(get_cache_write_fd(caching_data));
+
+                continue;
+
+            }
+
+        }
+
+        fd=get_cache_write_fd(caching_data);
+        cache_write=(struct cache_write_struct *) get_slab_object(&cache_writes_slab);
+
+        if ( fd<0 || ! cache_write ) {
+
+            if ( cache_write ) put_slab_object(&cache_writes_slab, (void *) cache_write);
+
+            complete_read_result(caching_data, read_result, ( fd<0 ) ? fd : -ENOMEM);
+
+            continue;
+
+        }
+
+        //
+        // write to cached file
+        // todo : differ per cache backend
+        //
+
+        cache_write->caching_data=caching_data;
+        cache_write->fd=fd;
+        cache_write->offset=caching_data->dataoffset + (off_t) ( read_result->startsector - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
+        cache_write->size=0;
+        cache_write->nrresults=0;
+        cache_write->sync=( cdfs_options.cachesync==CDFS_CACHE_SYNC_BATCH ) ? 1 : 0;
+        cache_write->direct=caching_data->direct;
+        cache_write->next=NULL;
+
+        while (1) {
+
+            nrsectors=read_result->endsector - read_result->startsector + 1;
+            logoutput1("cache manager: number of sectors from read result: %i", nrsectors);
+
+            //
+            // first reply the clients waiting for just these sectors from the buffer, then they
+            // do not wait for the write to the cache file
+            //
+
+            if ( cdfs_options.servefrombuffer==1 ) serve_waiting_read_calls(caching_data, read_result);
+
+            cache_write->results[cache_write->nrresults]=read_result;
+            cache_write->iov[cache_write->nrresults].iov_base=read_result->sector_slot->buffer;
+            cache_write->iov[cache_write->nrresults].iov_len=nrsectors * CDIO_CD_FRAMESIZE_RAW;
+
+            cache_write->nrresults++;
+            cache_write->size+=nrsectors * CDIO_CD_FRAMESIZE_RAW;
+
+            // the next of the same class follows this one on the track: in the same write
+
+            read_result=pending_first[readclass];
+
+            if ( ! read_result || cache_write->nrresults>=CDFS_WRITE_BATCH_MAX ) break;
+            if ( read_result->caching_data!=caching_data ) break;
+            if ( read_result->startsector!=cache_write->results[cache_write->nrresults-1]->endsector + 1 ) break;
+
+            pending_first[readclass]=read_result->next;
+            if ( ! pending_first[readclass] ) pending_last[readclass]=NULL;
+
+            read_result->next=NULL;
+            read_result->prev=NULL;
+
+        }
+
+        nreturn=submit_cache_write(cache_write);
+
+        if ( nreturn<0 ) {
+
+            cache_write->res=nreturn;
+            complete_cache_write(cache_write);
+
+        }
+
+    }
+
+    free_mpsc_queue(&read_results_queue);
+
+}
 
-            move_read_result_to_unused_list(read_result);
 
-            continue;
+int start_cache_manager_thread(pthread_t *pthreadid)
+{
+    int nreturn=0;
+    pthread_t pthreadid_notify_store;
 
-        }
+    register_cdfs_slab(&read_results_slab);
+    register_cdfs_slab(&cache_writes_slab);
 
+    // the writes to the cache files, with io_uring when there
 
-        //
-        // write to cached file
-        //
+    init_cache_io();
 
-        nrsectors=read_result->endsector - read_result->startsector + 1;
-        logoutput1("cache manager: number of sectors from read result: %i", nrsectors);
+    // the sectors recently read in ram, diskless the only place they are
 
+    init_ram_cache(cdfs_options.ramcache);
 
-        //
-        // todo : differ per cache backend
-        //
+    // the queue the cdromreader sends read results through, ready before it can send
 
-        offset_infile=SIZE_RIFFHEADER + ( read_result->startsector - caching_data->startsector ) * CDIO_CD_FRAMESIZE_RAW;
-        write_to_cached_file(caching_data, read_result->buffer, offset_infile, nrsectors * CDIO_CD_FRAMESIZE_RAW);
+    nreturn=init_mpsc_queue(&read_results_queue, CDFS_READ_RESULTS_QUEUE_SIZE);
 
+    if ( nreturn<0 ) {
 
-        //
-        // update the cache administration
-        // the actual number of sectors added to the cache is kept
-        // this maybe different from the nr sectors of the read result
-        // if if if the read result is merged with an earlier result
-        // and there is some overlap
-        // but that's probably not the case
-        //
+	logoutput("Error creating the queue of read results (error: %i).", abs(nreturn));
+	goto out;
 
-        nrsectors=insert_cached_block_internal(caching_data, read_result->startsector, read_result->endsector);
+    }
 
-        logoutput1("cache manager: number of sectors inserted: %i", nrsectors);
+    //
+    // create a thread to manage the cache
+    //
 
-        // here also: update the sqlite db.....
+    // the periodic work, in the mainloop
 
+    if ( cdfs_options.progressfifo ) {
 
-        // write progress to fifo
+	nreturn=add_fuse_loop_timer(CDFS_PROGRESS_INTERVAL, write_progress_to_fifo, NULL);
+	if ( nreturn<0 ) logoutput("Error adding the progress timer (error: %i).", abs(nreturn));
 
-        if ( cdfs_options.progressfifo ) {
+    }
 
-            write_progress_to_fifo(caching_data);
+    if ( cdfs_options.cachebackend==CDFS_CACHE_ADMIN_BACKEND_SQLITE ) {
 
-        }
+	nreturn=add_fuse_loop_timer(CDFS_SQLITE_CHECKPOINT_INTERVAL, checkpoint_sqlitedb, NULL);
+	if ( nreturn<0 ) logoutput("Error adding the sqlite checkpoint timer (error: %i).", abs(nreturn));
 
-        //
-        // notify waiting clients
-        // only if there is one
-        // in case of read ahead (which is not started by any client but by the fs automatic)
-        // there are none
+    }
 
-        if ( read_result->read_call ) {
+    // the readahead pushed in the page cache, by a thread of it's own, also when the option
+    // is off: it can be switched on with the xattr
+    // without the thread, it's not pushed
 
-            notify_waiting_clients(read_result->read_call, read_result->startsector, read_result->endsector);
+    nreturn=init_mpsc_queue(&notify_store_queue, CDFS_NOTIFY_STORE_QUEUE_SIZE);
 
-        }
+    if ( nreturn==0 ) {
 
+	nreturn=pthread_create(&pthreadid_notify_store, NULL, notify_store_thread, NULL);
 
-        //
-        // data written to file... so it's safe to free the buffer and read_result
-        //
-        // a big TODO: what to do here when the original read_call is "orphaned/lost/not there"
-        //
+	if ( nreturn==0 ) {
 
-        if ( read_result->buffer ) free(read_result->buffer);
-        move_read_result_to_unused_list(read_result);
+	    pthread_detach(pthreadid_notify_store);
+	    notify_store_started=1;
 
+	} else {
 
-    }
+	    free_mpsc_queue(&notify_store_queue);
 
-    pthread_mutex_destroy(&results_lockmutex);
-    pthread_cond_destroy(&results_lockcond);
+	}
 
-}
+    }
 
+    if ( nreturn!=0 ) {
 
-int start_cache_manager_thread(pthread_t *pthreadid)
-{
-    int nreturn=0;
+	logoutput("Error starting the notify store thread (error: %i), readahead not pushed in the page cache.", abs(nreturn));
+	nreturn=0;
 
-    //
-    // create a thread to manage the cache
-    //
+    }
 
     nreturn=pthread_create(pthreadid, NULL, cache_manager_thread, NULL);
 
@@ -1313,6 +2859,8 @@ int start_cache_manager_thread(pthread_t *pthreadid)
 
     }
 
+    out:
+
     return nreturn;
 
 }
@@ -1322,20 +2870,56 @@ int start_cache_manager_thread(pthread_t *pthreadid)
 // sqlite functions
 //
 //
+// the db is in WAL mode: the intervals written by the cache manager are appended in a transaction
+// per batch, with prepared statements, and the WAL is checkpointed by a timer in the mainloop, not
+// by a commit (of the cache manager)
+//
+// an interval is only committed after the cache file it's in is synced: after a crash everything
+// the db says is in a cache file is really there (the last batch may be lost, it's read again)
+//
+// the connection is used by the cache manager, the mainloop and the fuse threads (open): one at a time
+//
+
+static pthread_mutex_t sqlite_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+// the insert statements, per track (a table per track)
+
+static sqlite3_stmt *interval_stmts[UCHAR_MAX + 1];
+
+// the intervals not committed yet, only used by the cache manager
+
+struct pending_interval_struct {
+    struct caching_data_struct *caching_data;
+    unsigned int startsector;
+    unsigned int endsector;
+};
+
+static struct pending_interval_struct pending_intervals[CDFS_SQLITE_BATCH_MAX];
+static unsigned int nrpendingintervals=0;
+static struct timespec lastcommit={0, 0};
+
+struct sqlite_stats_struct {
+    unsigned long commits;
+    unsigned long intervals;
+    unsigned long errors;
+    unsigned long checkpoints;
+};
+
+static struct sqlite_stats_struct sqlite_stats={0, 0, 0, 0};
 
 //
 // create the table for a specific track
 // every track has it's own table
 //
 
-static int create_table_track(unsigned char tracknr)
+static int create_table_track(sqlite3 *dbhandle, unsigned char tracknr)
 {
     int nreturn=0;
     char sql_string[SQL_STRING_MAX_SIZE];
 
     snprintf(sql_string, SQL_STRING_MAX_SIZE, "CREATE TABLE IF NOT EXISTS tracknr_%i (startsector INTEGER PRIMARY KEY, endsector INTEGER)", tracknr);
 
-    nreturn=sqlite3_exec(cdfs_options.dbhandle, sql_string, 0, 0, 0);
+    nreturn=sqlite3_exec(dbhandle, sql_string, 0, 0, 0);
 
     return nreturn;
 
@@ -1343,12 +2927,13 @@ static int create_table_track(unsigned char tracknr)
 
 //
 // open (and eventually create) the sqlite db
+// the handle is set when the tables are there, the cache manager may look at it before that
 //
 
 int create_sqlite_db(unsigned char nrtracks)
 {
+    sqlite3 *dbhandle=NULL;
     int nreturn=0, i;
-    char sql_string[SQL_STRING_MAX_SIZE];
 
     // todo: add the hash to the path
 
@@ -1362,101 +2947,391 @@ int create_sqlite_db(unsigned char nrtracks)
 
     }
 
-    nreturn=sqlite3_open(cdfs_options.dbpath, &(cdfs_options.dbhandle));
+    nreturn=sqlite3_open(cdfs_options.dbpath, &dbhandle);
 
-    if ( nreturn==0 ) {
+    if ( nreturn!=SQLITE_OK ) {
 
-        for (i=1; i<=nrtracks;i++) {
+        if ( dbhandle ) sqlite3_close(dbhandle);
+        goto out;
 
-            nreturn=create_table_track(i);
+    }
 
-        }
+    // WAL: a commit is an append, and consistent after a crash also with synchronous NORMAL
+    // no checkpoint at commit: the timer does that
+
+    sqlite3_exec(dbhandle, "PRAGMA journal_mode=WAL", 0, 0, 0);
+    sqlite3_exec(dbhandle, "PRAGMA synchronous=NORMAL", 0, 0, 0);
+    sqlite3_exec(dbhandle, "PRAGMA wal_autocheckpoint=0", 0, 0, 0);
+
+    for (i=1; i<=nrtracks;i++) {
+
+        nreturn=create_table_track(dbhandle, i);
+
+        if ( nreturn!=SQLITE_OK ) logoutput("create_sqlite_db: error %i creating the table of track %i", nreturn, i);
 
     }
 
+    pthread_mutex_lock(&sqlite_mutex);
+    cdfs_options.dbhandle=dbhandle;
+    pthread_mutex_unlock(&sqlite_mutex);
+
+    out:
+
     return nreturn;
 
 }
 
+//
+// the prepared statement to insert an interval of a track (with the lock)
+//
+
+static sqlite3_stmt *get_interval_stmt(unsigned char tracknr)
+{
+    char sql_string[SQL_STRING_MAX_SIZE];
+
+    if ( ! interval_stmts[tracknr] ) {
+
+        // an interval with the same start as one in the db: the longest is kept
+
+        snprintf(sql_string, SQL_STRING_MAX_SIZE, "INSERT INTO tracknr_%i (startsector, endsector) VALUES (?, ?) ON CONFLICT(startsector) DO UPDATE SET endsector=MAX(endsector, excluded.endsector)", tracknr);
+
+        if ( sqlite3_prepare_v2(cdfs_options.dbhandle, sql_string, -1, &interval_stmts[tracknr], NULL)!=SQLITE_OK ) interval_stmts[tracknr]=NULL;
+
+    }
+
+    return interval_stmts[tracknr];
+
+}
+
+//
+// close the db, the WAL is checkpointed and removed by sqlite
+//
+
+void close_sqlite_db()
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&sqlite_mutex);
+
+    if ( cdfs_options.dbhandle ) {
+
+        for (i=0; i<=UCHAR_MAX; i++) {
+
+            if ( interval_stmts[i] ) sqlite3_finalize(interval_stmts[i]);
+            interval_stmts[i]=NULL;
+
+        }
+
+        sqlite3_close(cdfs_options.dbhandle);
+        cdfs_options.dbhandle=NULL;
+
+    }
+
+    pthread_mutex_unlock(&sqlite_mutex);
+
+}
 
 //
-// create a specific interval into the specific track table
-// typically used at shutdown when writing all information to the sqlite db
+// create a specific interval into the specific track table (with the lock, in a transaction)
+// returns the number of sectors or -EIO
 //
 
 static int create_interval_sqlite(unsigned char tracknr, unsigned int startsector, unsigned int endsector)
 {
-    char sql_string[SQL_STRING_MAX_SIZE];
-    int nreturn;
+    sqlite3_stmt *stmt=get_interval_stmt(tracknr);
+    int nreturn=0;
 
-    logoutput2("add a new interval (%i, %i)\n", startsector, endsector);
+    logoutput2("add a new interval (%i, %i)", startsector, endsector);
 
-    snprintf(sql_string, SQL_STRING_MAX_SIZE, "INSERT OR IGNORE INTO tracknr_%i (startsector, endsector) VALUES (%i, %i)", tracknr, startsector, endsector);
+    if ( ! stmt ) return -EIO;
 
-    sqlite3_exec(cdfs_options.dbhandle, sql_string, 0, 0, 0);
+    sqlite3_bind_int(stmt, 1, (int) startsector);
+    sqlite3_bind_int(stmt, 2, (int) endsector);
 
-    if ( nreturn==0 ) nreturn=endsector - startsector + 1;
+    nreturn=( sqlite3_step(stmt)==SQLITE_DONE ) ? (int) ( endsector - startsector + 1 ) : -EIO;
+
+    sqlite3_reset(stmt);
 
     return nreturn;
 
 }
 
+//
+// remove all intervals from a specific track table (with the lock)
+//
+
+static int delete_intervals_sqlite(unsigned char tracknr)
+{
+    char sql_string[SQL_STRING_MAX_SIZE];
+
+    snprintf(sql_string, SQL_STRING_MAX_SIZE, "DELETE FROM tracknr_%i", tracknr);
+
+    return ( sqlite3_exec(cdfs_options.dbhandle, sql_string, 0, 0, 0)==SQLITE_OK ) ? 0 : -EIO;
+
+}
 
 //
 // remove all intervals from a specific track table
-// typically used at shutdown to remove all (old) information in the db before
-// writing new information to it.
+// used when the cache file is created again: nothing of the old one is there
 //
 
-
 int remove_all_intervals_sqlite(unsigned char tracknr)
 {
-    char sql_string[SQL_STRING_MAX_SIZE];
-    int nreturn;
+    int nreturn=0;
 
-    logoutput2("removing all intervals for tracknr %i\n", tracknr);
+    logoutput2("removing all intervals for tracknr %i", tracknr);
 
-    snprintf(sql_string, SQL_STRING_MAX_SIZE, "DELETE FROM tracknr_%i", tracknr);
+    pthread_mutex_lock(&sqlite_mutex);
+
+    if ( cdfs_options.dbhandle ) nreturn=delete_intervals_sqlite(tracknr);
+
+    pthread_mutex_unlock(&sqlite_mutex);
+
+    return nreturn;
+
+}
+
+//
+// the cache manager: sectors startsector - endsector are in the cache file (written, maybe not synced)
+// adjacent to the last one of the track it's one interval
+//
+
+void append_interval_sqlite(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector)
+{
+    struct pending_interval_struct *pending;
+
+    if ( nrpendingintervals>0 ) {
+
+        pending=&pending_intervals[nrpendingintervals-1];
 
-    sqlite3_exec(cdfs_options.dbhandle, sql_string, 0, 0, 0);
+        if ( pending->caching_data==caching_data && pending->endsector + 1==startsector ) {
+
+            pending->endsector=endsector;
+            return;
+
+        }
+
+    }
+
+    // full: commit now (not possible when the db is not there yet, then the intervals of the batch
+    // are dropped, the db is written completely at shutdown)
+
+    if ( nrpendingintervals==CDFS_SQLITE_BATCH_MAX && commit_intervals_sqlite(1)<0 ) nrpendingintervals=0;
+
+    pending=&pending_intervals[nrpendingintervals];
+
+    pending->caching_data=caching_data;
+    pending->startsector=startsector;
+    pending->endsector=endsector;
+
+    nrpendingintervals++;
+
+}
+
+unsigned int get_pending_intervals_sqlite()
+{
+    return nrpendingintervals;
+}
+
+//
+// the cache manager: commit the intervals appended, when force, the batch is full, or the last commit
+// is CDFS_SQLITE_COMMIT_INTERVAL ago
+// the cache files of them are synced first
+//
+
+int commit_intervals_sqlite(unsigned char force)
+{
+    struct timespec now;
+    unsigned int i, j;
+    int nreturn=0, fd;
+
+    if ( nrpendingintervals==0 ) goto out;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ( force==0 && nrpendingintervals < CDFS_SQLITE_BATCH_MAX && ( now.tv_sec - lastcommit.tv_sec ) * 1000 + ( now.tv_nsec - lastcommit.tv_nsec ) / 1000000 < CDFS_SQLITE_COMMIT_INTERVAL ) goto out;
+
+    if ( __atomic_load_n(&cdfs_options.dbhandle, __ATOMIC_ACQUIRE)==NULL ) {
+
+        nreturn=-EAGAIN;
+        goto out;
+
+    }
+
+    // the data first: every cache file once
+
+    for (i=0; i<nrpendingintervals; i++) {
+
+        for (j=0; j<i; j++) {
+
+            if ( pending_intervals[j].caching_data==pending_intervals[i].caching_data ) break;
+
+        }
+
+        if ( j<i ) continue;
+
+        fd=get_cache_write_fd(pending_intervals[i].caching_data);
+        if ( fd>0 ) sync_cache_file(fd);
+
+    }
+
+    pthread_mutex_lock(&sqlite_mutex);
+
+    if ( ! cdfs_options.dbhandle ) {
+
+        nreturn=-EAGAIN;
+        goto unlock;
+
+    }
+
+    sqlite3_exec(cdfs_options.dbhandle, "BEGIN", 0, 0, 0);
+
+    for (i=0; i<nrpendingintervals; i++) {
+
+        nreturn=create_interval_sqlite(pending_intervals[i].caching_data->tracknr, pending_intervals[i].startsector, pending_intervals[i].endsector);
+        if ( nreturn<0 ) break;
+
+    }
+
+    if ( nreturn<0 || sqlite3_exec(cdfs_options.dbhandle, "COMMIT", 0, 0, 0)!=SQLITE_OK ) {
+
+        sqlite3_exec(cdfs_options.dbhandle, "ROLLBACK", 0, 0, 0);
+
+        sqlite_stats.errors++;
+        nreturn=-EIO;
+
+        logoutput("commit intervals: error, %i intervals not in the db", nrpendingintervals);
+
+    } else {
+
+        logoutput2("commit intervals: %i intervals", nrpendingintervals);
+
+        sqlite_stats.commits++;
+        sqlite_stats.intervals+=nrpendingintervals;
+        nreturn=0;
+
+    }
+
+    // on error these are not tried again: the db is written completely at shutdown
+
+    nrpendingintervals=0;
+    lastcommit=now;
+
+    unlock:
+
+    pthread_mutex_unlock(&sqlite_mutex);
+
+    out:
 
     return nreturn;
 
 }
 
+//
+// a timer in the mainloop: the WAL in the db, so it does not grow while reading the cd
+//
+
+void checkpoint_sqlitedb(int timerfd, void *data)
+{
+    int nlog=0, ncheckpointed=0;
+
+    pthread_mutex_lock(&sqlite_mutex);
+
+    if ( cdfs_options.dbhandle && sqlite3_wal_checkpoint_v2(cdfs_options.dbhandle, NULL, SQLITE_CHECKPOINT_PASSIVE, &nlog, &ncheckpointed)==SQLITE_OK ) {
+
+        if ( ncheckpointed>0 ) {
+
+            logoutput2("checkpoint sqlite db: %i of %i frames", ncheckpointed, nlog);
+            sqlite_stats.checkpoints++;
+
+        }
+
+    }
+
+    pthread_mutex_unlock(&sqlite_mutex);
+
+}
+
+int get_sqlite_stats(char *buffer, size_t size)
+{
+    int len;
+
+    pthread_mutex_lock(&sqlite_mutex);
+
+    len=snprintf(buffer, size, "commits=%lu intervals=%lu errors=%lu checkpoints=%lu", sqlite_stats.commits, sqlite_stats.intervals, sqlite_stats.errors, sqlite_stats.checkpoints);
+
+    pthread_mutex_unlock(&sqlite_mutex);
 
+    return len;
+
+}
 
 //
-// write every cached block per track to the sqlite db
+// write every cached block per track to the sqlite db, in one transaction with the old ones removed
+// the cache file is synced first
 // typically called when fs shuts down
 //
 
 int write_intervals_to_sqlitedb(struct caching_data_struct *caching_data)
 {
-    struct cached_block_struct *cached_block=NULL;
-    int nreturn=0;
+    unsigned int startsector, endsector;
+    int nreturn=0, fd;
 
-    // first clean everything, a little bit rude, but it works
+    if ( ! caching_data->bitmap ) return 0;
 
-    nreturn=remove_all_intervals_sqlite(caching_data->tracknr);
+    fd=__atomic_load_n(&caching_data->fd, __ATOMIC_ACQUIRE);
+    if ( fd>0 ) sync_cache_file(fd);
 
-    cached_block=caching_data->cached_block;
+    pthread_mutex_lock(&sqlite_mutex);
 
-    while (cached_block) {
+    if ( ! cdfs_options.dbhandle ) goto unlock;
 
-        nreturn=create_interval_sqlite(caching_data->tracknr, cached_block->startsector, cached_block->endsector);
+    sqlite3_exec(cdfs_options.dbhandle, "BEGIN", 0, 0, 0);
+
+    nreturn=delete_intervals_sqlite(caching_data->tracknr);
+
+    if ( nreturn<0 ) goto rollback;
+
+    // every run of cached sectors in the bitmap is an interval
+
+    startsector=get_first_cached_sector(caching_data, caching_data->startsector, caching_data->endsector);
+
+    while ( startsector<=caching_data->endsector ) {
+
+        endsector=get_first_missing_sector(caching_data, startsector, caching_data->endsector) - 1;
+
+        nreturn=create_interval_sqlite(caching_data->tracknr, startsector, endsector);
 
         if ( nreturn<0 ) {
 
-            logoutput2("adding a new interval in sqlite failed: %i\n", nreturn);
-            break;
+            logoutput2("adding a new interval in sqlite failed: %i", nreturn);
+            goto rollback;
 
         }
 
-        cached_block=cached_block->next;
+        if ( endsector>=caching_data->endsector ) break;
+
+        startsector=get_first_cached_sector(caching_data, endsector+1, caching_data->endsector);
+
+    }
+
+    if ( sqlite3_exec(cdfs_options.dbhandle, "COMMIT", 0, 0, 0)==SQLITE_OK ) {
+
+        nreturn=0;
+        goto unlock;
 
     }
 
+    nreturn=-EIO;
+
+    rollback:
+
+    sqlite3_exec(cdfs_options.dbhandle, "ROLLBACK", 0, 0, 0);
+
+    unlock:
+
+    pthread_mutex_unlock(&sqlite_mutex);
+
     return nreturn;
 
 }
@@ -1468,9 +3343,13 @@ int write_intervals_to_sqlitedb(struct caching_data_struct *caching_data)
 
 int write_all_intervals_to_sqlitedb()
 {
-    struct caching_data_struct *caching_data=list_caching_data;
+    struct caching_data_struct *caching_data;
     int nreturn=0;
 
+    pthread_mutex_lock(&list_caching_data_mutex);
+
+    caching_data=list_caching_data;
+
     while (caching_data) {
 
         nreturn=write_intervals_to_sqlitedb(caching_data);
@@ -1479,6 +3358,8 @@ int write_all_intervals_to_sqlitedb()
 
     }
 
+    pthread_mutex_unlock(&list_caching_data_mutex);
+
     return nreturn;
 
 }
@@ -1487,6 +3368,7 @@ int write_all_intervals_to_sqlitedb()
 // read the sectors from the sqlite db
 //
 // typically used at open call when opening the cache for the first time
+// (what was committed before a crash is in it too, sqlite reads the WAL)
 //
 
 
@@ -1495,9 +3377,6 @@ int get_intervals_from_sqlite(struct caching_data_struct *caching_data)
     char sql_string[SQL_STRING_MAX_SIZE];
     sqlite3_stmt *stmt;
     unsigned int startsector, endsector;
-    struct cached_block_struct *cached_block_first=NULL;
-    struct cached_block_struct *cached_block_last=NULL;
-    struct cached_block_struct *cached_block_new=NULL;
     int nreturn=0;
     int count=0;
 
@@ -1506,8 +3385,13 @@ int get_intervals_from_sqlite(struct caching_data_struct *caching_data)
 
     snprintf(sql_string, SQL_STRING_MAX_SIZE, "SELECT startsector,endsector FROM tracknr_%i ORDER BY startsector", caching_data->tracknr);
 
+    pthread_mutex_lock(&sqlite_mutex);
+
+    if ( ! cdfs_options.dbhandle ) goto unlock;
+
+    nreturn=sqlite3_prepare_v2(cdfs_options.dbhandle, sql_string, -1, &stmt, NULL);
 
-    nreturn=sqlite3_prepare(cdfs_options.dbhandle, sql_string, -1, &stmt, NULL);
+    if ( nreturn!=SQLITE_OK ) goto unlock;
 
     while (1) {
 
@@ -1523,22 +3407,11 @@ int get_intervals_from_sqlite(struct caching_data_struct *caching_data)
             startsector=(unsigned int) sqlite3_column_int(stmt,0);
             endsector=(unsigned int) sqlite3_column_int(stmt,1);
 
-
-            cached_block_new=get_cached_block();
-
             count++;
 
-            cached_block_new->startsector=startsector;
-            cached_block_new->endsector=endsector;
-            cached_block_new->tracknr=caching_data->tracknr;
-
-
-            cached_block_new->prev=cached_block_last;
-            if ( cached_block_last ) cached_block_last->next=cached_block_new;
-            cached_block_new->next=NULL;
+            // set the bits, this also sets the cache ready when all the sectors are there
 
-            if ( ! cached_block_first ) cached_block_first=cached_block_new; /* first cached block */
-            cached_block_last=cached_block_new; /* last cached block */
+            insert_sectors_in_cache(caching_data, startsector, endsector);
 
 
         } else {
@@ -1553,30 +3426,12 @@ int get_intervals_from_sqlite(struct caching_data_struct *caching_data)
 
     nreturn=sqlite3_finalize(stmt);
 
+    unlock:
 
-    caching_data->cached_block=cached_block_first;
-
-    if ( count==1 ) {
-
-        if ( cached_block_first->startsector==caching_data->startsector && 
-             cached_block_first->endsector==caching_data->endsector ) {
-
-                //
-                // when there is one interval and it's the whole interval
-                // then the cache is complete/ready
-                //
-
-                caching_data->ready=1;
-
-
-        }
-
-    }
+    pthread_mutex_unlock(&sqlite_mutex);
 
+    logoutput2("get intervals from sqlite: %i intervals, %i sectors in cache", count, caching_data->sectorsread);
 
     return nreturn;
 
 }
-
-
-
@@ -28,16 +28,16 @@
 
 #define CDFS_SQLITE_BLOB_SIZE   CDIO_CD_FRAMESIZE_RAW;
 
+#define CDFS_BITS_PER_WORD      ( 8 * sizeof(unsigned long) )
 
-/* struct to decribe the interval of data which is cached */
+/* layout of a cache file: */
+/* 1: the wav file as it is, the header in front of the audio */
+/* 2: the first page describes the file, the audio starts at the second, the header is made in memory */
 
-struct cached_block_struct {
-    unsigned char tracknr;
-    unsigned int startsector;
-    unsigned int endsector;
-    struct cached_block_struct *next;
-    struct cached_block_struct *prev;
-};
+#define CDFS_CACHE_LAYOUT_V1    1
+#define CDFS_CACHE_LAYOUT_V2    2
+
+#define CDFS_CACHE_LAYOUT_MAGIC "fuse-cdfs cache"
 
 
 /* struct to describe a file to be cached */
@@ -50,57 +50,95 @@ struct caching_data_struct {
     unsigned int endsector;
     unsigned int sectorsread;
     unsigned char ready;
+    unsigned char layout;
+    unsigned char direct;
     int sizeheader;
+    off_t dataoffset;
+    char header[SIZE_RIFFHEADER];
     size_t size;
+    char *map;
+    size_t mapsize;
+    pthread_rwlock_t maplock;
+    unsigned long mapreads;
+    unsigned long mapfaults;
     struct caching_data_struct *next;
     struct caching_data_struct *prev;
-    pthread_mutex_t cachelockmutex;
-    pthread_cond_t  cachelockcond;
-    unsigned char cachelock;
-    unsigned char nrreads;
-    unsigned char writelock;
-    struct cached_block_struct *cached_block;
+    unsigned long *bitmap;
+    unsigned long *summary;
+    unsigned int nrwords;
+    pthread_mutex_t waitmutex;
+    struct read_call_struct *waiting_read_calls;
+    unsigned int readaheadwindow;
+    unsigned long readaheadstream;
+    unsigned long readaheadhits;
+    unsigned long readaheadmisses;
+    fuse_ino_t ino;
+    pthread_mutex_t openmutex;
+    unsigned int nropen;
+    int backing_id;
+    unsigned int readposition;
+    unsigned int sectorsprogress;
 };
 
 
 // Prototypes
 
-//
-//
-// locking cache functions
-// only used when using linked lists in C/internal
-//
-//
-
-int get_readlock_caching_data(struct caching_data_struct *caching_data);
-int release_readlock_caching_data(struct caching_data_struct *caching_data);
-
-int get_writelock_caching_data(struct caching_data_struct *caching_data);
-int release_writelock_caching_data(struct caching_data_struct *caching_data);
-
+struct sector_slot_struct;
 
 // general cache functions
 
-struct caching_data_struct *create_caching_data();
+struct caching_data_struct *create_caching_data(unsigned char tracknr);
+void free_caching_data(struct caching_data_struct *caching_data);
 struct caching_data_struct *find_caching_data_by_tracknr(unsigned char tracknr);
 
 int create_cache_file(struct caching_data_struct *caching_data, const char *name);
+int get_cache_write_fd(struct caching_data_struct *caching_data);
 int write_to_cached_file(struct caching_data_struct *caching_data, char *buffer, off_t offset, size_t size);
-
-int send_read_result_to_cache(struct read_call_struct *read_call, struct caching_data_struct *caching_data, unsigned int startsector, char *buffer, unsigned int nrsectors);
-void notify_waiting_clients(struct read_call_struct *read_call, unsigned int startsector, unsigned int endsector);
+int write_cache_file_header(struct caching_data_struct *caching_data);
+off_t get_cache_file_position(struct caching_data_struct *caching_data, off_t off);
+int map_cache_file(struct caching_data_struct *caching_data);
+void unmap_cache_file(struct caching_data_struct *caching_data);
+void advise_cache_map(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int nrsectors);
+int reply_from_cached_file(fuse_req_t req, struct caching_data_struct *caching_data, int fd, size_t size, off_t off);
+
+int send_read_result_to_cache(struct read_call_struct *read_call, struct caching_data_struct *caching_data, unsigned char readclass, unsigned int startsector, struct sector_slot_struct *sector_slot, unsigned int nrsectors);
+int memory_budget_exhausted();
+void charge_bytes_queued(unsigned long bytes);
+void release_bytes_queued(unsigned long bytes);
+unsigned long get_memory_budget_room();
+int get_memory_budget_stats(char *buffer, size_t size);
+void register_read_call(struct caching_data_struct *caching_data, struct read_call_struct *read_call);
+void dispatch_read_call(struct read_call_struct *read_call, int nerror);
+void notify_waiting_clients(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+void notify_read_error(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, int nerror);
+int get_seek_latency_stats(char *buffer, size_t size);
+int get_miss_latency_stats(char *buffer, size_t size);
+int get_notify_store_stats(char *buffer, size_t size);
 
 int start_cache_manager_thread(pthread_t *pthreadid);
 
-struct cached_block_struct *get_first_cached_block_internal(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
-int insert_cached_block_internal(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+// residency bitmap
+
+int create_cache_bitmap(struct caching_data_struct *caching_data);
+int insert_sectors_in_cache(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+void remove_sectors_from_cache(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+unsigned int get_first_missing_sector(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+unsigned int get_first_cached_sector(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+int sectors_in_cache(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
 
 
 // sqlite functions
 
 int create_sqlite_db(unsigned char nrtracks);
+void close_sqlite_db();
 int remove_all_intervals_sqlite(unsigned char tracknr);
 
+void append_interval_sqlite(struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector);
+int commit_intervals_sqlite(unsigned char force);
+unsigned int get_pending_intervals_sqlite();
+void checkpoint_sqlitedb(int timerfd, void *data);
+int get_sqlite_stats(char *buffer, size_t size);
+
 int write_intervals_to_sqlitedb(struct caching_data_struct *caching_data);
 int write_all_intervals_to_sqlitedb();
 
@@ -35,8 +35,13 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <pthread.h>
+#include <time.h>
 
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
+#endif
 
 #include <sqlite3.h>
 
@@ -46,23 +51,63 @@
 #include "entry-management.h"
 #include "cdfs-cache.h"
 #include "cdfs-cdromutils.h"
+#include "cdfs-queue.h"
+#include "cdfs-slab.h"
 
 extern struct cdfs_options_struct cdfs_options;
 extern struct cdfs_device_struct cdfs_device;
 
-struct read_command_struct *head_queue_read_commands=NULL;
-struct read_command_struct *tail_queue_read_commands=NULL;
+// a queue per class, sorted by startsector
 
-struct read_command_struct *unused_read_commands=NULL;
-struct read_call_struct *unused_read_calls=NULL;
+struct read_command_struct *queue_read_commands[CDFS_READ_CLASSES]={NULL, NULL, NULL};
+struct read_class_stats_struct read_class_stats[CDFS_READ_CLASSES];
 
-unsigned char queue_lock=0;
+// read calls are released by the thread replying, which is not always the fuse thread,
+// read commands are created by fuse threads and released by the cdromreader
 
-pthread_mutex_t queue_lockmutex;
-pthread_cond_t  queue_lockcond;
+struct cdfs_slab_struct read_calls_slab=CDFS_SLAB_INIT("read_call", struct read_call_struct, CDFS_SLAB_HIGHWATER, NULL, NULL);
+struct cdfs_slab_struct read_commands_slab=CDFS_SLAB_INIT("read_command", struct read_command_struct, CDFS_SLAB_HIGHWATER, NULL, NULL);
 
+// new read commands go from the fuse threads to the cdromreader through a lock free queue,
+// the cdromreader sorts them in the queues per class (queue_read_commands), only it uses those
+
+struct cdfs_mpsc_queue_struct read_commands_queue;
+
+// the command the cdromreader is reading from the cd
+
+struct caching_data_struct *inflight_caching_data=NULL;
+unsigned int inflight_startsector=0;
+unsigned int inflight_endsector=0;
+
+unsigned long sectors_coalesced=0;
+
+// the stream of the command being read, and if it's to be stopped (readahead of a stream which seeked away)
+
+unsigned long inflight_streamid=0;
+unsigned char inflight_demanded=0;
+unsigned char inflight_cancel=0;
+
+unsigned long sectors_cancelled=0;
+
+// the ring of sector buffers, the free slots go back to the cdromreader through a queue
+
+char *sector_ring=NULL;
+struct sector_slot_struct sector_slots[CDFS_SECTOR_RING_SLOTS];
+struct cdfs_mpsc_queue_struct free_sector_slots;
+
+unsigned long sector_slot_waits=0;
+
+// readahead waits till the cache manager has written enough to get below the memory budget
+// set by the cdromreader when it's going to sleep for it, cleared by the cache manager (resume_readahead)
+
+unsigned char readahead_paused=0;
+unsigned long readahead_pauses=0;
+
+// where the cd head is, and the track of the last command, to choose the next command
+
+unsigned int head_sector=0;
+struct caching_data_struct *last_caching_data=NULL;
 
-// lock vars to lock the the queue
 
 
 
@@ -688,26 +733,8 @@ int get_sector_from_position(int tracknr, off_t pos)
 struct read_call_struct *get_read_call()
 {
     struct read_call_struct *read_call;
-    unsigned char created=0;
-
-    if ( ! unused_read_calls ) {
-
-	// no unused ones... : create a new one
 
-	read_call=malloc(sizeof(struct read_call_struct));
-	created=1;
-
-
-    } else {
-
-	// take from list
-
-	read_call=unused_read_calls;
-
-	unused_read_calls=read_call->next;
-	if (unused_read_calls) unused_read_calls->prev=NULL;
-
-    }
+    read_call=(struct read_call_struct *) get_slab_object(&read_calls_slab);
 
     if ( read_call ) {
 
@@ -717,24 +744,21 @@ struct read_call_struct *get_read_call()
 	read_call->startsector=0;
 	read_call->endsector=0;
 
-	read_call->nrsectorsread=0;
-	read_call->nrsectorstoread=0;
-
 	read_call->complete=0;
+	read_call->dispatched=0;
+	read_call->nerror=0;
+	read_call->seek=0;
+	read_call->missed=0;
 
-	read_call->next=NULL;
-	read_call->prev=NULL;
-
-        if ( created>0 ) {
+	read_call->req=NULL;
+	read_call->fd=0;
+	read_call->size=0;
+	read_call->off=0;
 
-            // only once
+	read_call->caching_data=NULL;
 
-            pthread_mutex_init(&read_call->lockmutex, NULL);
-            pthread_cond_init(&read_call->lockcond, NULL);
-
-        }
-
-	read_call->lock=0;
+	read_call->next=NULL;
+	read_call->prev=NULL;
 
     }
 
@@ -743,7 +767,7 @@ struct read_call_struct *get_read_call()
 }
 
 
-// move a read_command to the unused list...
+// move a read_call to the unused list...
 
 void move_read_call_to_unused_list(struct read_call_struct *read_call)
 {
@@ -753,19 +777,7 @@ void move_read_call_to_unused_list(struct read_call_struct *read_call)
     if ( read_call->next ) read_call->next->prev=read_call->prev;
     if ( read_call->prev ) read_call->prev->next=read_call->next;
 
-    // insert in unused list at beginning
-
-    if ( unused_read_calls ) {
-
-	read_call->next=unused_read_calls;
-
-	if ( read_call->next ) read_call->next->prev=read_call;
-
-	read_call->prev=NULL;
-
-    }
-
-    unused_read_calls=read_call;
+    put_slab_object(&read_calls_slab, (void *) read_call);
 
 }
 
@@ -777,28 +789,17 @@ struct read_command_struct *get_read_command()
 {
     struct read_command_struct *read_command;
 
-    if ( ! unused_read_commands ) {
-
-	// no unused ones... : create a new one
-
-	read_command=malloc(sizeof(struct read_command_struct));
-
-    } else {
-
-	// take from list
-
-	read_command=unused_read_commands;
-
-	unused_read_commands=read_command->next;
-	if (unused_read_commands) unused_read_commands->prev=NULL;
-
-    }
+    read_command=(struct read_command_struct *) get_slab_object(&read_commands_slab);
 
     if ( read_command ) {
 
 	read_command->startsector=0;
 	read_command->endsector=0;
 	read_command->read_call=NULL;
+	read_command->streamid=0;
+	read_command->charged=0;
+	read_command->cancel=0;
+	read_command->readclass=CDFS_READ_CLASS_DEMAND;
 	read_command->next=NULL;
 	read_command->prev=NULL;
 
@@ -809,474 +810,1359 @@ struct read_command_struct *get_read_command()
 }
 
 
-// move a read_command to the unused list...
+//
+// readahead commands are charged to the memory budget from when they are sent till they are read
+// (then the bytes are in flight, see send_read_result_to_cache) or dropped
+// demand commands are not: a client waits for them, they are read anyway
+//
 
-void move_read_command_to_unused_list(struct read_command_struct *read_command)
+static void charge_read_command(struct read_command_struct *read_command)
 {
 
-    // remove first from the active list
+    if ( read_command->read_call ) return;
 
-    if ( read_command->next ) read_command->next->prev=read_command->prev;
-    if ( read_command->prev ) read_command->prev->next=read_command->next;
+    read_command->charged=(unsigned long) (read_command->endsector - read_command->startsector + 1) * CDIO_CD_FRAMESIZE_RAW;
+    charge_bytes_queued(read_command->charged);
 
-    // insert in unused list at beginning
+}
 
-    if ( unused_read_commands ) {
+static void uncharge_read_command(struct read_command_struct *read_command, unsigned long bytes)
+{
 
-	read_command->next=unused_read_commands;
+    if ( bytes > read_command->charged ) bytes=read_command->charged;
 
-	if ( read_command->next ) read_command->next->prev=read_command;
+    if ( bytes>0 ) {
 
-	read_command->prev=NULL;
+	read_command->charged-=bytes;
+	release_bytes_queued(bytes);
 
     }
 
-    unused_read_commands=read_command;
-
 }
 
+// move a read_command to the unused list...
+
+void move_read_command_to_unused_list(struct read_command_struct *read_command)
+{
 
+    // what is still charged of it is not read anymore
 
-//
-// add a read command to the queue
-//
-// check the interval is already in the queue: if completly than ignore
-// if partly then merge
-//
-// todo: rewrite to add the sectors, and only create a new read_command when not merged
-// like the result queue
-//
+    uncharge_read_command(read_command, read_command->charged);
 
-void add_read_command_to_queue(struct read_command_struct *read_command)
-{
-    struct read_command_struct *read_command_tmp;
-    struct read_command_struct *read_command_prev;
-    unsigned char merged=0;
+    // remove first from the active list
 
+    if ( read_command->next ) read_command->next->prev=read_command->prev;
+    if ( read_command->prev ) read_command->prev->next=read_command->next;
 
-    logoutput2("add read command to queue: to read %zi to %zi", read_command->startsector, read_command->endsector);
+    put_slab_object(&read_commands_slab, (void *) read_command);
 
-    // lock the queue: set lock to 1
+}
 
-    pthread_mutex_lock(&(queue_lockmutex));
 
-    while (queue_lock==1) {
 
-	pthread_cond_wait(&(queue_lockcond), &(queue_lockmutex));
+//
+// the class of a read command:
+// - demand: a client is waiting for it
+// - near readahead: readahead policy piece, the sectors right after what a client reads
+// - background: readahead policy whole, filling the cache
+//
 
-    }
+static unsigned char get_read_class(struct read_command_struct *read_command)
+{
 
-    queue_lock=1;
-    pthread_mutex_unlock(&(queue_lockmutex));
+    if ( read_command->read_call ) return CDFS_READ_CLASS_DEMAND;
+    if ( read_command->readaheadpolicy==READAHEAD_POLICY_WHOLE ) return CDFS_READ_CLASS_BACKGROUND;
 
+    return CDFS_READ_CLASS_NEAR;
 
-    if ( tail_queue_read_commands ) {
+}
 
+//
+// remove a read command from the queue of it's class
+// only by the cdromreader
+//
 
-        // walk back to head of list, start at tail
+static void unlink_read_command(struct read_command_struct *read_command)
+{
 
+    if ( read_command->next ) read_command->next->prev=read_command->prev;
 
-	read_command_tmp=tail_queue_read_commands;
+    if ( read_command->prev ) {
 
-	while (read_command_tmp) {
+	read_command->prev->next=read_command->next;
 
-            // remember the prev
+    } else if ( queue_read_commands[read_command->readclass]==read_command ) {
 
-	    read_command_prev=read_command_tmp->prev;
+	queue_read_commands[read_command->readclass]=read_command->next;
 
-            //
-	    // look at some overlap
-	    // first look at cases there is no overlap at all
-	    // if those are not the case then there must be some overlap
-	    // excluding first the non overlap cases is far much easier then look at every
-	    // possible overlap
+    }
 
-            if ( read_command->read_call != read_command_tmp->read_call ) {
+    read_command->next=NULL;
+    read_command->prev=NULL;
 
-                // read command is for other track... skip
-		read_command_tmp=read_command_prev;
-		continue;
+    read_class_stats[read_command->readclass].depth--;
 
-	    } else if ( read_command->startsector > read_command_tmp->endsector + 1 ) {
+}
 
-		// no overlap: too left
-		read_command_tmp=read_command_prev;
-		continue;
+//
+// insert a read command in the queue of it's class, sorted by startsector (LBA)
+// only by the cdromreader
+//
 
-	    } else if ( read_command->endsector < read_command_tmp->startsector - 1 ) {
+static void insert_read_command(struct read_command_struct *read_command)
+{
+    struct read_command_struct *read_command_tmp, *read_command_prev=NULL;
 
-		// no overlap: too right
-		read_command_tmp=read_command_prev;
-		continue;
+    read_command_tmp=queue_read_commands[read_command->readclass];
 
-	    } else {
+    while (read_command_tmp) {
 
-		// some overlap: merge
-		// add the request to the already existing readcommand
+	if ( read_command_tmp->startsector > read_command->startsector ) break;
 
-		logoutput2("add to queue: merging with block from %i to %i", read_command_tmp->startsector, read_command_tmp->endsector);
+	read_command_prev=read_command_tmp;
+	read_command_tmp=read_command_tmp->next;
 
-		if ( read_command->startsector < read_command_tmp->startsector ) read_command_tmp->startsector=read_command->startsector;
-		if ( read_command->endsector > read_command_tmp->endsector ) read_command_tmp->endsector=read_command->endsector;
+    }
 
-		move_read_command_to_unused_list(read_command);
-		read_command=read_command_tmp;
+    read_command->prev=read_command_prev;
+    read_command->next=read_command_tmp;
 
-		merged=1;
+    if ( read_command_tmp ) read_command_tmp->prev=read_command;
 
-	    }
+    if ( read_command_prev ) {
 
-	    read_command_tmp=read_command_prev;
+	read_command_prev->next=read_command;
 
-	    continue;
+    } else {
 
-	}
+	queue_read_commands[read_command->readclass]=read_command;
 
-	if ( merged==0 ) {
+    }
 
-	    // not merged somewhere..add it to the queue
+    read_class_stats[read_command->readclass].depth++;
 
-	    logoutput2("add to queue: not merging... adding at tail");
+}
 
-	    tail_queue_read_commands->next=read_command;
+//
+// cut the interval (startsector, endsector) from a read command, only when it overlaps at one side
+// returns the number of sectors cut, or -1 when the command is completly in the interval
+//
 
-	    read_command->prev=tail_queue_read_commands;
+static int cut_read_command(struct read_command_struct *read_command, unsigned int startsector, unsigned int endsector)
+{
+    int nrsectors=0;
 
-	    tail_queue_read_commands=read_command;
+    if ( read_command->startsector>=startsector && read_command->endsector<=endsector ) {
 
-	    if ( ! head_queue_read_commands ) head_queue_read_commands=read_command;
+	return -1;
 
-	}
+    } else if ( read_command->startsector>=startsector && read_command->startsector<=endsector ) {
 
-    } else {
+	nrsectors=endsector - read_command->startsector + 1;
+	read_command->startsector=endsector+1;
 
-	// queue was empty
+    } else if ( read_command->endsector>=startsector && read_command->endsector<=endsector ) {
 
-	tail_queue_read_commands=read_command;
-	head_queue_read_commands=read_command;
+	nrsectors=read_command->endsector - startsector + 1;
+	read_command->endsector=startsector-1;
 
     }
 
-    logoutput2("add to queue: ready");
-
-    pthread_mutex_lock(&(queue_lockmutex));
+    // the sectors cut are not read with this command anymore
 
-    queue_lock=0;
+    uncharge_read_command(read_command, (unsigned long) nrsectors * CDIO_CD_FRAMESIZE_RAW);
 
-    pthread_cond_broadcast(&(queue_lockcond));
-    pthread_mutex_unlock(&(queue_lockmutex));
+    return nrsectors;
 
 }
 
-int send_read_command(struct read_call_struct *read_call, struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, unsigned char readaheadpolicy, unsigned char readaheadlevel)
-{
-    int nreturn=0;
-    struct read_command_struct *read_command;
+//
+// split a read command which strictly contains the interval (startsector, endsector): the command
+// keeps the part in front of it, the part after it is returned as a new command, not queued yet
+// returns NULL when it does not contain it strictly, or there is no memory (then nothing is cut)
+//
 
-    read_command=get_read_command();
+static struct read_command_struct *split_read_command(struct read_command_struct *read_command, unsigned int startsector, unsigned int endsector)
+{
+    struct read_command_struct *read_command_tail;
 
-    if ( ! read_command) {
+    if ( read_command->startsector>=startsector || read_command->endsector<=endsector ) return NULL;
 
-        nreturn=-ENOMEM;
-	goto out;
+    read_command_tail=get_read_command();
 
-    }
+    if ( ! read_command_tail ) return NULL;
 
-    read_command->read_call=read_call;
-    read_command->caching_data=caching_data;
-    read_command->startsector=startsector;
-    read_command->endsector=endsector;
-    read_command->readaheadpolicy=readaheadpolicy;
+    read_command_tail->readaheadlevel=read_command->readaheadlevel;
+    read_command_tail->readaheadpolicy=read_command->readaheadpolicy;
+    read_command_tail->readclass=read_command->readclass;
+    read_command_tail->queued=read_command->queued;
+    read_command_tail->read_call=read_command->read_call;
+    read_command_tail->streamid=read_command->streamid;
+    read_command_tail->caching_data=read_command->caching_data;
 
-    if ( readaheadpolicy==READAHEAD_POLICY_PIECE ) read_command->readaheadlevel=readaheadlevel;
+    read_command_tail->startsector=endsector+1;
+    read_command_tail->endsector=read_command->endsector;
 
-    add_read_command_to_queue(read_command);
+    read_command->endsector=startsector-1;
 
-    out:
+    // the charge of the part after it goes with it
 
-    return nreturn;
+    read_command_tail->charged=(unsigned long) (read_command_tail->endsector - read_command_tail->startsector + 1) * CDIO_CD_FRAMESIZE_RAW;
+    if ( read_command_tail->charged > read_command->charged ) read_command_tail->charged=read_command->charged;
+    read_command->charged-=read_command_tail->charged;
 
-}
+    // and the interval cut out is not read with this command anymore
 
-/*
-unsigned char track_is_in_queue(unsigned char tracknr)
-{
-    struct _struct *cached_block=tail_queue_cached_blocks;
-    unsigned char isinqueue=0;
+    uncharge_read_command(read_command, (unsigned long) (endsector - startsector + 1) * CDIO_CD_FRAMESIZE_RAW);
 
-    while ( cached_block ) {
+    return read_command_tail;
 
-	if ( cached_block->tracknr==tracknr ) {
+}
 
-	    isinqueue=1;
-	    break;
+//
+// sort a new read command in the queues
+//
+// a command is keyed by the track (caching_data) and the sector range, not by the read call:
+// the waiting clients are in the list of waiters of the track, and are woken when their sectors
+// are in cache, whatever command has read them
+//
+// there is a queue per class (demand, near readahead and background), every queue sorted by startsector
+// a sector is only in one command:
+// - the part which is read from the cd right now is cut of (split in two when it's in the middle,
+//   the part after it is queued as a command of it's own)
+// - the part already in a command of a higher class is cut of
+// - the part in a command of a lower class is cut from that command (so it's read sooner)
+// a command in the middle of the other is split (the part after it is a command of it's own)
+// - with a command of the same class for the same track it overlaps with or is next to it's merged
+// the sectors which are not read twice are counted in sectors_coalesced
+//
+// only by the cdromreader, the other threads send commands with add_read_command_to_queue
+//
 
-	}
+static void queue_read_command(struct read_command_struct *read_command)
+{
+    struct read_command_struct *read_command_tmp, *read_command_next;
+    struct read_command_struct *read_command_tails=NULL, *read_command_split;
+    unsigned char merged=0, readclass;
+    unsigned int startsector, endsector;
+    int nrsectors;
 
-	cached_block=cached_block->next;
+    logoutput2("queue read command: to read %i to %i class %i", read_command->startsector, read_command->endsector, read_command->readclass);
 
-    }
 
-    return isinqueue;
+    //
+    // the command being read from the cd
+    //
 
-}*/
+    if ( inflight_caching_data && inflight_caching_data==read_command->caching_data ) {
 
+	read_command_tmp=split_read_command(read_command, inflight_startsector, inflight_endsector);
 
-void log_what_is_in_queue()
-{
-    struct read_command_struct *read_command;
+	if ( read_command_tmp ) {
 
-    read_command=head_queue_read_commands;
+	    // the part after the command being read is queued after this one
 
-    if ( read_command ) {
+	    nrsectors=inflight_endsector - inflight_startsector + 1;
 
-	while (read_command) {
+	    read_command_tmp->next=read_command_tails;
+	    read_command_tails=read_command_tmp;
 
-	    logoutput2("found block (%i - %i) in queue", read_command->startsector, read_command->endsector);
+	} else {
 
-	    read_command=read_command->next;
+	    nrsectors=cut_read_command(read_command, inflight_startsector, inflight_endsector);
 
 	}
 
-    } else {
-
-	logoutput2("no blocks in queue");
-
-    }
+	// a client is going to wait for sectors of the command being read: do not cancel that anymore
 
-}
+	if ( nrsectors!=0 && read_command->readclass==CDFS_READ_CLASS_DEMAND ) {
 
+	    inflight_demanded=1;
+	    inflight_cancel=0;
 
-//
-// thread to read from cd , getting requests via queue
-//
-// TODO: howto terminate
+	}
 
+	if ( nrsectors<0 ) {
 
-static void *cdromreader_thread()
-{
-    int nreturn=0, nrsectors, nrstartsector, nrsectorsread, nrtotalsectorsread;
-    struct caching_data_struct *caching_data;
-    struct cached_block_struct *cached_block;
-    struct read_call_struct *read_call;
-    unsigned char tries1, tries2;
-    bool foundincache, cachetested;
-    struct read_command_struct *read_command=NULL;
-    struct read_command_struct *read_command_again=NULL;
-    char *buffread, *buffer;
-    unsigned char cachereadlock;
+	    // completly in the command being read: nothing to do
 
+	    logoutput2("add to queue: already being read (%i - %i)", inflight_startsector, inflight_endsector);
 
+	    sectors_coalesced+=read_command->endsector - read_command->startsector + 1;
 
-    logoutput0("CDROMREADER");
+	    move_read_command_to_unused_list(read_command);
+	    goto unlock;
 
+	}
 
-    pthread_mutex_init(&queue_lockmutex, NULL);
-    pthread_cond_init(&queue_lockcond, NULL);
+	sectors_coalesced+=nrsectors;
 
-    while (1) {
+    }
 
+    //
+    // the commands of other classes
+    //
 
-	// wait for something on the queue and free to lock
+    for (readclass=0; readclass<CDFS_READ_CLASSES; readclass++) {
 
-	pthread_mutex_lock(&queue_lockmutex);
+	if ( readclass==read_command->readclass ) continue;
 
-	while ( queue_lock==1 || ! head_queue_read_commands) {
+	read_command_tmp=queue_read_commands[readclass];
 
-	    pthread_cond_wait(&queue_lockcond, &queue_lockmutex);
+	while (read_command_tmp) {
 
-	}
+	    read_command_next=read_command_tmp->next;
 
-	// set it to locked
+	    if ( read_command_tmp->caching_data != read_command->caching_data || read_command_tmp->startsector > read_command->endsector ) {
 
-	queue_lock=1;
+		read_command_tmp=read_command_next;
+		continue;
 
-	// log_what_is_in_queue();
+	    } else if ( read_command_tmp->endsector < read_command->startsector ) {
 
-	// queue is not empty: process the read command
-	// first get the read request (to read cached_block)
+		read_command_tmp=read_command_next;
+		continue;
 
-	read_command=head_queue_read_commands;
+	    }
 
-	// remove from queue
+	    if ( readclass < read_command->readclass ) {
 
-	head_queue_read_commands=read_command->next;
-	if ( tail_queue_read_commands == read_command ) tail_queue_read_commands=head_queue_read_commands;
-	if ( head_queue_read_commands ) head_queue_read_commands->prev=NULL;
+		// already in a command with a higher priority
+		// when that's in the middle of this one, the part after it is queued on it's own
 
-	queue_lock=0;
+		read_command_split=split_read_command(read_command, read_command_tmp->startsector, read_command_tmp->endsector);
 
-	pthread_cond_broadcast(&(queue_lockcond));
-	pthread_mutex_unlock(&(queue_lockmutex)); /* release the queue */
+		if ( read_command_split ) {
 
-	// really detach from the queue
-	read_command->next=NULL;
-	read_command->prev=NULL;
+		    nrsectors=read_command_tmp->endsector - read_command_tmp->startsector + 1;
 
-	// process the read request
-	// first find out which file to write to
-	// TODO: no read_call when a read ahead
+		    read_command_split->next=read_command_tails;
+		    read_command_tails=read_command_split;
 
-        if ( read_command->readaheadpolicy==READAHEAD_POLICY_NONE ) {
+		} else {
 
-            // not initiated for read ahead purposes
-            // so there must be a read_call
+		    nrsectors=cut_read_command(read_command, read_command_tmp->startsector, read_command_tmp->endsector);
 
-            read_call=read_command->read_call;
+		}
 
-            if ( ! read_call ) {
+		if ( nrsectors<0 ) {
 
-                move_read_command_to_unused_list(read_command);
-                logoutput2("error!! original read call not found....");
-                continue;
+		    sectors_coalesced+=read_command->endsector - read_command->startsector + 1;
 
-            }
+		    move_read_command_to_unused_list(read_command);
+		    goto unlock;
 
-        }
+		}
 
-        //
-        // determine the track
-        //
+	    } else {
 
-	caching_data=read_command->caching_data;
+		// in a command with a lower priority: take it from there
+		// when this one is in the middle of it, the part after it stays in that class as a command of it's own
 
-	if ( ! caching_data ) {
+		read_command_split=split_read_command(read_command_tmp, read_command->startsector, read_command->endsector);
 
-	    logoutput2("error!! caching_data not found!! serious io error");
-	    continue;
+		if ( read_command_split ) {
 
-	}
+		    nrsectors=read_command->endsector - read_command->startsector + 1;
 
+		    insert_read_command(read_command_split);
 
-	logoutput2("cdromreader: check data already available and readehead");
+		} else {
 
+		    nrsectors=cut_read_command(read_command_tmp, read_command->startsector, read_command->endsector);
 
-        foundincache=false;
-        cachetested=false;
-        read_command_again=NULL;
-        cached_block=NULL;
+		}
 
-        //
-        // a read lock on the cache for this file/track
-        //
+		if ( nrsectors<0 ) {
 
-        nreturn=get_readlock_caching_data(caching_data);
+		    nrsectors=read_command_tmp->endsector - read_command_tmp->startsector + 1;
 
-        if ( nreturn<0 ) {
+		    unlink_read_command(read_command_tmp);
+		    move_read_command_to_unused_list(read_command_tmp);
 
-	    logoutput2("error!! not able to get read lock caching_data for track %i!! serious io error", read_call->tracknr);
+		}
 
-            // what to do here??? try again?
+	    }
 
-        } else {
+	    sectors_coalesced+=nrsectors;
 
-            cachereadlock=(unsigned char) nreturn;
+	    read_command_tmp=read_command_next;
 
-        }
+	}
 
-        while ( ! cachetested ) {
+    }
 
+    //
+    // merge with a command of the same class and track it overlaps with or is next to
+    //
 
-            if ( ! cached_block ) {
+    read_command_tmp=queue_read_commands[read_command->readclass];
 
-                // get the first cached block...
+    while (read_command_tmp) {
 
+	if ( read_command->caching_data != read_command_tmp->caching_data ) {
 
-                cached_block=get_first_cached_block_internal(caching_data, read_command->startsector, read_command->endsector);
+	    // read command is for other track... skip
+	    read_command_tmp=read_command_tmp->next;
+	    continue;
 
+	} else if ( read_command->startsector > read_command_tmp->endsector + 1 ) {
 
-            } else {
+	    // no overlap: too left
+	    read_command_tmp=read_command_tmp->next;
+	    continue;
 
-                cached_block=cached_block->next;
+	} else if ( read_command->endsector + 1 < read_command_tmp->startsector ) {
 
-            }
+	    // no overlap: too right, and the queue is sorted
+	    break;
 
+	}
 
-            if ( ! cached_block ) {
+	// some overlap or next to each other: merge
+	// add the request to the already existing readcommand
 
-                // nothing found in cache
-                break;
+	logoutput2("add to queue: merging with block from %i to %i", read_command_tmp->startsector, read_command_tmp->endsector);
 
-            } else if ( cached_block->startsector<=read_command->startsector ) {
+	startsector=( read_command->startsector > read_command_tmp->startsector ) ? read_command->startsector : read_command_tmp->startsector;
+	endsector=( read_command->endsector < read_command_tmp->endsector ) ? read_command->endsector : read_command_tmp->endsector;
 
-                // a cached block found, with startsector left of the desired sector
-                // check the endsector
+	if ( endsector>=startsector ) sectors_coalesced+=endsector - startsector + 1;
 
-                if ( cached_block->endsector >= read_command->endsector ) {
+	// a command shared by streams is not cancelled by one of them
 
-                    // read_command->(startsector,endsector) is in cache
+	if ( read_command_tmp->streamid!=read_command->streamid ) read_command_tmp->streamid=0;
 
-                    foundincache=true;
-                    break;
+	if ( read_command->endsector > read_command_tmp->endsector ) read_command_tmp->endsector=read_command->endsector;
 
-                } else {
+	if ( read_command->startsector < read_command_tmp->startsector ) {
 
-                    //
-                    // check the next interval right of cached_block->endsector
-                    //
-                    // right of cached_block->endsector is not in cache
-                    // correct the read command
+	    // the startsector changes: keep the queue sorted
 
-                    read_command->startsector=cached_block->endsector+1;
-                    continue;
+	    unlink_read_command(read_command_tmp);
+	    read_command_tmp->startsector=read_command->startsector;
+	    insert_read_command(read_command_tmp);
 
-                }
+	}
 
+	read_command_tmp->charged+=read_command->charged;
+	read_command->charged=0;
 
-            } else {
+	move_read_command_to_unused_list(read_command);
 
-                // cached_block->startsector>tmpsector
+	merged=1;
+	break;
 
-                if ( cached_block->startsector>read_command->endsector ) {
+    }
 
-                    // the cached block found doesn't offer anything
-                    // so the interval has to be read
+    if ( merged==0 ) {
 
-	            break;
+	// not merged somewhere..add it to the queue
 
+	logoutput2("add to queue: not merging... adding sorted");
 
-                } else {
+	insert_read_command(read_command);
 
-                    // cached_block->startsector<=read_command->endsector
+    }
 
-                    if ( cached_block->endsector<read_command->endsector ) {
+    unlock:
 
-                        read_command_again=get_read_command();
+    // the parts split of, they do not overlap with what's cut from them anymore
 
-                        if ( read_command_again ) {
+    while ( read_command_tails ) {
 
-                            read_command_again->read_call=read_command->read_call;
-                            read_command_again->caching_data=caching_data;
+	read_command_tmp=read_command_tails;
+	read_command_tails=read_command_tmp->next;
 
-                            read_command_again->startsector=cached_block->endsector+1;
-                            read_command_again->endsector=read_command->endsector;
+	read_command_tmp->next=NULL;
+	queue_read_command(read_command_tmp);
 
-                            read_command_again->readaheadlevel=read_command->readaheadlevel;
-                            read_command_again->readaheadpolicy=read_command->readaheadpolicy;
+    }
 
-                        }
+    logoutput2("add to queue: ready");
 
-                    }
+}
 
-                    read_command->endsector=cached_block->startsector-1;
-                    break;
+//
+// send a read command to the cdromreader
+//
+// the command is only pushed on the queue, the cdromreader merges it with the commands it has
+// when the queue is full (the cdromreader is busy in a long read) wait till there is space again
+//
 
+void add_read_command_to_queue(struct read_command_struct *read_command)
+{
 
-                }
+    read_command->readclass=get_read_class(read_command);
+    clock_gettime(CLOCK_MONOTONIC, &(read_command->queued));
 
-            }
+    logoutput2("add read command to queue: to read %i to %i class %i", read_command->startsector, read_command->endsector, read_command->readclass);
 
-        }
+    // when full (the cdromreader is behind) wait till there is space again
 
+    push_mpsc_queue_wait(&read_commands_queue, (void *) read_command);
 
-        if ( cachereadlock>0 ) {
+}
 
-            // a read lock has been set, release it
+//
+// take the next read command to read from the cd
+//
+// the first class with commands is served, within the class:
+// - in order of LBA, starting from where the cd head is (the end of the last read), and when at the end
+//   of the disc start again at the begin, just like an elevator
+// - but a command for another track than the last one served goes first, so several streams
+//   share the drive
+//
+// only demand commands when demandonly is set (the memory budget is used up)
+//
+// only by the cdromreader
+//
+
+static struct read_command_struct *get_next_read_command(unsigned char demandonly)
+{
+    struct read_command_struct *read_command=NULL;
+    struct read_command_struct *first=NULL, *firstother=NULL, *wrapfirst=NULL, *wrapother=NULL;
+    unsigned char readclass;
+    struct timespec now;
+    unsigned long waittime;
+
+    for (readclass=0; readclass<CDFS_READ_CLASSES; readclass++) {
+
+	if ( queue_read_commands[readclass] ) break;
+
+    }
+
+    if ( readclass==CDFS_READ_CLASSES ) return NULL;
+
+    if ( readclass>CDFS_READ_CLASS_DEMAND && demandonly==1 ) return NULL;
+
+    read_command=queue_read_commands[readclass];
+
+    while (read_command) {
+
+	if ( read_command->startsector >= head_sector ) {
+
+	    if ( ! first ) first=read_command;
+	    if ( ! firstother && read_command->caching_data!=last_caching_data ) firstother=read_command;
+
+	    if ( firstother ) break;
+
+	} else {
+
+	    if ( ! wrapfirst ) wrapfirst=read_command;
+	    if ( ! wrapother && read_command->caching_data!=last_caching_data ) wrapother=read_command;
+
+	}
+
+	read_command=read_command->next;
+
+    }
+
+    if ( firstother ) {
+
+	read_command=firstother;
+
+    } else if ( wrapother ) {
+
+	read_command=wrapother;
+
+    } else if ( first ) {
+
+	read_command=first;
+
+    } else {
+
+	read_command=wrapfirst;
+
+    }
+
+    unlink_read_command(read_command);
+
+    last_caching_data=read_command->caching_data;
+
+    // wait time in the queue (in microseconds)
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    waittime=( now.tv_sec - read_command->queued.tv_sec ) * 1000000 + ( now.tv_nsec - read_command->queued.tv_nsec ) / 1000;
+
+    read_class_stats[readclass].served++;
+    read_class_stats[readclass].waittime+=waittime;
+    if ( waittime > read_class_stats[readclass].maxwaittime ) read_class_stats[readclass].maxwaittime=waittime;
+
+    return read_command;
+
+}
+
+//
+// write the statistics of the queues per class in a string like:
+// demand:depth=0,served=12,avgwait=105,maxwait=2040 near:... background:... cancelled=750
+// the wait times in microseconds
+//
+// the counters are owned by the cdromreader, here they are only read (no lock), so they may
+// be off by one command
+//
+
+int get_read_class_stats(char *buffer, size_t size)
+{
+    const char *classname[CDFS_READ_CLASSES]={"demand", "near", "background"};
+    unsigned char readclass;
+    unsigned long served, waittime;
+    int len=0;
+
+    for (readclass=0; readclass<CDFS_READ_CLASSES && len < size; readclass++) {
+
+	served=__atomic_load_n(&read_class_stats[readclass].served, __ATOMIC_RELAXED);
+	waittime=__atomic_load_n(&read_class_stats[readclass].waittime, __ATOMIC_RELAXED);
+
+	len+=snprintf(buffer+len, size-len, "%s%s:depth=%i,served=%lu,avgwait=%lu,maxwait=%lu", (readclass>0) ? " " : "", classname[readclass],
+			__atomic_load_n(&read_class_stats[readclass].depth, __ATOMIC_RELAXED),
+			served,
+			( served>0 ) ? waittime / served : 0,
+			__atomic_load_n(&read_class_stats[readclass].maxwaittime, __ATOMIC_RELAXED));
+
+    }
+
+    // sectors of readahead not read because the stream seeked away
+
+    if ( len < size ) len+=snprintf(buffer+len, size-len, " cancelled=%lu", __atomic_load_n(&sectors_cancelled, __ATOMIC_RELAXED));
+
+    // times the cdromreader had to wait for the cache manager to give back a sector buffer
+
+    if ( len < size ) len+=snprintf(buffer+len, size-len, " slotwaits=%lu", __atomic_load_n(&sector_slot_waits, __ATOMIC_RELAXED));
+
+    // times readahead had to wait because the memory budget was used up
+
+    if ( len < size ) len+=snprintf(buffer+len, size-len, " readaheadpauses=%lu", __atomic_load_n(&readahead_pauses, __ATOMIC_RELAXED));
+
+    return len;
+
+}
+
+//
+// set the command being read from the cd, NULL when nothing is read
+//
+
+static void set_inflight_read_command(struct read_command_struct *read_command)
+{
+
+    if ( read_command ) {
+
+	inflight_caching_data=read_command->caching_data;
+	inflight_startsector=read_command->startsector;
+	inflight_endsector=read_command->endsector;
+	inflight_streamid=read_command->streamid;
+	inflight_demanded=( read_command->readclass==CDFS_READ_CLASS_DEMAND ) ? 1 : 0;
+
+	head_sector=read_command->endsector+1;
+
+    } else {
+
+	inflight_caching_data=NULL;
+	inflight_streamid=0;
+	inflight_demanded=0;
+
+    }
+
+    inflight_cancel=0;
+
+}
+
+//
+// test the command being read is cancelled, and if so clear it as in flight
+// the commands sent in the meantime are taken from the queue before (see drain_read_commands)
+// so a client which has started waiting for sectors of it keeps it going
+//
+
+static int stop_cancelled_read_command(unsigned int nrsectors)
+{
+    int nreturn=0;
+
+    if ( inflight_cancel==1 && inflight_demanded==0 ) {
+
+	set_inflight_read_command(NULL);
+
+	__atomic_add_fetch(&sectors_cancelled, nrsectors, __ATOMIC_RELAXED);
+
+	nreturn=1;
+
+    }
+
+    return nreturn;
+
+}
+
+//
+// remove the readahead of a stream
+//
+// the queued readahead commands of the stream are removed, and the readahead command which is
+// read right now is stopped after the current batch
+// not when a client is waiting for sectors of that command (see queue_read_command)
+//
+// only by the cdromreader
+//
+
+static void remove_readahead_stream(unsigned long streamid)
+{
+    struct read_command_struct *read_command, *read_command_next;
+    unsigned char readclass;
+    unsigned int nrsectors=0;
+
+    for (readclass=CDFS_READ_CLASS_NEAR; readclass<CDFS_READ_CLASSES; readclass++) {
+
+	read_command=queue_read_commands[readclass];
+
+	while (read_command) {
+
+	    read_command_next=read_command->next;
+
+	    if ( read_command->streamid==streamid ) {
+
+		nrsectors+=read_command->endsector - read_command->startsector + 1;
+
+		unlink_read_command(read_command);
+		move_read_command_to_unused_list(read_command);
+
+	    }
+
+	    read_command=read_command_next;
+
+	}
+
+    }
+
+    if ( inflight_caching_data && inflight_streamid==streamid && inflight_demanded==0 ) {
+
+	inflight_cancel=1;
+
+    }
+
+    __atomic_add_fetch(&sectors_cancelled, nrsectors, __ATOMIC_RELAXED);
+
+    logoutput2("remove readahead stream: %i sectors removed from queue", nrsectors);
+
+}
+
+//
+// cancel the readahead of a stream, called when the stream seeks away, or is closed
+// the cdromreader removes it, it's send as a command with the cancel flag set
+//
+// the commands know the stream by it's id, not the address: the stream may be freed right after,
+// and the address is reused by the next open, which is not cancelled by a late cancel of this one
+//
+
+void cancel_readahead_stream(struct read_stream_struct *stream)
+{
+    struct read_command_struct *read_command;
+
+    read_command=get_read_command();
+
+    if ( ! read_command ) {
+
+	// no harm: the readahead is read for nothing
+
+	logoutput("cancel readahead stream: no memory, readahead not cancelled");
+	return;
+
+    }
+
+    read_command->caching_data=NULL;
+    read_command->streamid=stream->id;
+    read_command->cancel=1;
+    read_command->readaheadpolicy=READAHEAD_POLICY_PIECE;
+
+    add_read_command_to_queue(read_command);
+
+}
+
+//
+// take all the commands send to the cdromreader from the queue, and sort them in the
+// queues per class
+//
+
+static void drain_read_commands()
+{
+    struct read_command_struct *read_command;
+
+    while ( ( read_command=(struct read_command_struct *) pop_mpsc_queue(&read_commands_queue) ) ) {
+
+	if ( read_command->cancel==1 ) {
+
+	    remove_readahead_stream(read_command->streamid);
+	    move_read_command_to_unused_list(read_command);
+
+	} else {
+
+	    queue_read_command(read_command);
+
+	}
+
+    }
+
+}
+
+unsigned long get_sectors_coalesced()
+{
+    return sectors_coalesced;
+}
+
+int send_read_command(struct read_call_struct *read_call, struct read_stream_struct *stream, struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, unsigned char readaheadpolicy, unsigned char readaheadlevel)
+{
+    int nreturn=0;
+    struct read_command_struct *read_command;
+
+    // do not read past last sector for this track: there are no bits for it in the cache
+
+    if ( endsector > caching_data->endsector ) endsector=caching_data->endsector;
+    if ( startsector > endsector ) goto out;
+
+    read_command=get_read_command();
+
+    if ( ! read_command) {
+
+        nreturn=-ENOMEM;
+	goto out;
+
+    }
+
+    read_command->read_call=read_call;
+    read_command->streamid=( stream ) ? stream->id : 0;
+    read_command->caching_data=caching_data;
+    read_command->startsector=startsector;
+    read_command->endsector=endsector;
+    read_command->readaheadpolicy=readaheadpolicy;
+
+    if ( readaheadpolicy==READAHEAD_POLICY_PIECE ) read_command->readaheadlevel=readaheadlevel;
+
+    charge_read_command(read_command);
+
+    add_read_command_to_queue(read_command);
+
+    out:
+
+    return nreturn;
+
+}
+
+//
+// readahead window of a stream
+//
+// like the ondemand readahead of the kernel: after a seek (and at the first read) the window
+// is sized after the read, and every time the stream reaches the window the next one is sent,
+// twice (or four times when still small) as big, till the readaheadmax option
+// the window is never smaller than what the stream consumes in CDFS_READAHEAD_LEAD_MS, so
+// a player has it's data before it's needed, and a thumbnailer reading a few kilobytes
+// does not cause a lot of sectors being read for nothing
+//
+
+static unsigned int get_init_readahead_size(unsigned int nrsectors, unsigned int maxsize)
+{
+    unsigned int size=1;
+
+    while ( size < nrsectors ) size<<=1;
+
+    if ( size <= maxsize/32 ) {
+
+	size*=4;
+
+    } else if ( size <= maxsize/4 ) {
+
+	size*=2;
+
+    } else {
+
+	size=maxsize;
+
+    }
+
+    return size;
+
+}
+
+static unsigned int get_next_readahead_size(unsigned int size, unsigned int maxsize)
+{
+
+    if ( size < maxsize/16 ) {
+
+	size*=4;
+
+    } else {
+
+	size*=2;
+
+    }
+
+    return size;
+
+}
+
+//
+// with the default options the background fill of policy whole fits in the budget next to the biggest window
+//
+
+_Static_assert(CDFS_MEMORY_BUDGET >= ( CDFS_READAHEAD_MAX_SECTORS + READAHEAD_POLICY_WHOLE_SECTORS + CDFS_SECTOR_SLOT_SECTORS ) * CDIO_CD_FRAMESIZE_RAW,
+		"default memory budget too small for the readahead window and the background fill");
+
+//
+// send the readahead for a read (startsector, endsector) of a stream
+// seek is set when the read is not a continuation of the previous one
+//
+// the window is not bigger than what is left of the memory budget (the readahead queued already is
+// charged), and when not even the smallest window fits, the window is not moved: it's tried again
+// at the next read
+// with policy whole the window is capped to the budget minus the background fill, so it can reach
+// it's cap, and the background fill starts from there
+//
+
+int readahead_stream(struct read_stream_struct *stream, struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, unsigned char seek)
+{
+    int nreturn=0;
+    unsigned int maxsize=cdfs_options.readaheadmax, minsize, nrsectors=endsector - startsector + 1;
+    unsigned int rastart=0, rasize=0, bgstart=0;
+    unsigned long elapsed, room, cap;
+    struct timespec now;
+
+    // the cap of the window: what the budget holds, with policy whole minus the background fill
+
+    cap=cdfs_options.memorybudget / CDIO_CD_FRAMESIZE_RAW;
+
+    if ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_WHOLE ) cap=( cap > READAHEAD_POLICY_WHOLE_SECTORS ) ? cap - READAHEAD_POLICY_WHOLE_SECTORS : 0;
+
+    if ( maxsize > cap ) maxsize=cap;
+    if ( maxsize < CDFS_READAHEAD_MIN_SECTORS ) maxsize=CDFS_READAHEAD_MIN_SECTORS;
+
+    room=get_memory_budget_room() / CDIO_CD_FRAMESIZE_RAW;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&(stream->mutex));
+
+    // the rate of consumption, only over sequential reads
+
+    if ( seek==0 && stream->lastread.tv_sec>0 ) {
+
+	elapsed=(now.tv_sec - stream->lastread.tv_sec) * 1000000 + (now.tv_nsec - stream->lastread.tv_nsec) / 1000;
+
+	if ( elapsed>0 ) stream->rate=( 3 * (unsigned long) stream->rate + ( (unsigned long) nrsectors * 1000000 ) / elapsed ) / 4;
+
+    }
+
+    stream->lastread=now;
+
+    minsize=( (unsigned long) stream->rate * CDFS_READAHEAD_LEAD_MS ) / 1000;
+    if ( minsize < CDFS_READAHEAD_MIN_SECTORS ) minsize=CDFS_READAHEAD_MIN_SECTORS;
+
+    if ( seek==1 || stream->rasize==0 ) {
+
+	// first read or after a seek: a new window right after this read
+	// no room in the budget: no window, the next read starts one
+
+	stream->rastart=endsector+1;
+	stream->rasize=get_init_readahead_size(nrsectors, maxsize);
+	stream->background=0;
+
+	if ( stream->rasize < minsize ) stream->rasize=minsize;
+	if ( stream->rasize > maxsize ) stream->rasize=maxsize;
+	if ( stream->rasize > room ) stream->rasize=( room >= CDFS_READAHEAD_MIN_SECTORS ) ? room : 0;
+
+	rastart=stream->rastart;
+	rasize=stream->rasize;
+
+    } else if ( endsector >= stream->rastart && room >= CDFS_READAHEAD_MIN_SECTORS ) {
+
+	// the stream has reached the window: send the next one, bigger
+
+	rastart=stream->rastart + stream->rasize;
+	if ( rastart <= endsector ) rastart=endsector+1;
+
+	rasize=get_next_readahead_size(stream->rasize, maxsize);
+
+	if ( rasize < minsize ) rasize=minsize;
+	if ( rasize > maxsize ) rasize=maxsize;
+	if ( rasize > room ) rasize=room;
+
+	stream->rastart=rastart;
+	stream->rasize=rasize;
+
+    }
+
+    // with policy whole the rest of the track is filled in the background, but only
+    // when the stream has proven to read sequential (the window has stopped growing at it's cap),
+    // and there is room for it next to the window
+
+    if ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_WHOLE && stream->background==0 && stream->rasize>=maxsize && room >= rasize + READAHEAD_POLICY_WHOLE_SECTORS ) {
+
+	bgstart=stream->rastart + stream->rasize;
+	stream->background=1;
+
+    }
+
+    pthread_mutex_unlock(&(stream->mutex));
+
+    if ( rasize>0 ) {
+
+	caching_data->readaheadwindow=rasize;
+
+	logoutput2("readahead stream: window %i - %i", rastart, rastart + rasize - 1);
+
+	nreturn=send_read_command(NULL, stream, caching_data, rastart, rastart + rasize - 1, READAHEAD_POLICY_PIECE, 0);
+	if ( nreturn<0 ) goto out;
+
+    }
+
+    if ( bgstart>0 ) {
+
+	logoutput2("readahead stream: background from %i", bgstart);
+
+	nreturn=send_read_command(NULL, stream, caching_data, bgstart, bgstart + READAHEAD_POLICY_WHOLE_SECTORS, READAHEAD_POLICY_WHOLE, 0);
+
+    }
+
+    out:
+
+    return nreturn;
+
+}
+
+/*
+unsigned char track_is_in_queue(unsigned char tracknr)
+{
+    struct _struct *cached_block=tail_queue_cached_blocks;
+    unsigned char isinqueue=0;
+
+    while ( cached_block ) {
+
+	if ( cached_block->tracknr==tracknr ) {
+
+	    isinqueue=1;
+	    break;
+
+	}
+
+	cached_block=cached_block->next;
+
+    }
+
+    return isinqueue;
+
+}*/
+
+
+void log_what_is_in_queue()
+{
+    struct read_command_struct *read_command;
+    unsigned char readclass;
+
+    for (readclass=0; readclass<CDFS_READ_CLASSES; readclass++) {
+
+	read_command=queue_read_commands[readclass];
+
+	if ( read_command ) {
+
+	    while (read_command) {
+
+		logoutput2("found block (%i - %i) in queue class %i", read_command->startsector, read_command->endsector, readclass);
+
+		read_command=read_command->next;
+
+	    }
+
+	} else {
+
+	    logoutput2("no blocks in queue class %i", readclass);
+
+	}
+
+    }
+
+}
+
+
+//
+// thread to read from cd , getting requests via queue
+//
+// TODO: howto terminate
+
+
+//
+// ring of sector buffers
+//
+// allocated once, every slot holds a batch of CDFS_SECTOR_SLOT_SECTORS sectors
+// the cdromreader reads the cd directly in a slot, the read result owns it till the
+// cache manager has written it to the cache file, then it's put back
+//
+
+static int init_sector_ring()
+{
+    unsigned int i;
+    int nreturn=0;
+
+    sector_ring=malloc(CDFS_SECTOR_RING_SLOTS * CDFS_SECTOR_SLOT_SECTORS * CDIO_CD_FRAMESIZE_RAW);
+
+    if ( ! sector_ring ) {
+
+	nreturn=-ENOMEM;
+	goto out;
+
+    }
+
+    nreturn=init_mpsc_queue(&free_sector_slots, CDFS_SECTOR_RING_SLOTS);
+
+    if ( nreturn<0 ) {
+
+	free(sector_ring);
+	sector_ring=NULL;
+
+	goto out;
+
+    }
+
+    for (i=0; i<CDFS_SECTOR_RING_SLOTS; i++) {
+
+	sector_slots[i].buffer=sector_ring + i * CDFS_SECTOR_SLOT_SECTORS * CDIO_CD_FRAMESIZE_RAW;
+	sector_slots[i].index=i;
+
+	push_mpsc_queue(&free_sector_slots, (void *) &sector_slots[i]);
+
+    }
+
+    out:
+
+    return nreturn;
+
+}
+
+//
+// take a free slot, only by the cdromreader, wait when they're all in use
+//
+
+static struct sector_slot_struct *get_sector_slot()
+{
+    struct sector_slot_struct *sector_slot;
+
+    sector_slot=(struct sector_slot_struct *) pop_mpsc_queue(&free_sector_slots);
+
+    if ( ! sector_slot ) {
+
+	__atomic_add_fetch(&sector_slot_waits, 1, __ATOMIC_RELAXED);
+
+	while ( ! ( sector_slot=(struct sector_slot_struct *) pop_mpsc_queue(&free_sector_slots) ) ) {
+
+	    wait_mpsc_queue(&free_sector_slots);
+
+	}
+
+    }
+
+    return sector_slot;
+
+}
+
+//
+// give a slot back, there are never more slots than fit in the queue
+//
+
+void put_sector_slot(struct sector_slot_struct *sector_slot)
+{
+
+    push_mpsc_queue(&free_sector_slots, (void *) sector_slot);
+
+}
+
+//
+// sleep till there is a new command
+// or, when there is readahead waiting for the memory budget, till the cache manager has written enough
+//
+
+static void wait_for_read_commands()
+{
+
+    if ( ( queue_read_commands[CDFS_READ_CLASS_NEAR] || queue_read_commands[CDFS_READ_CLASS_BACKGROUND] ) && memory_budget_exhausted()==1 ) {
+
+	__atomic_store_n(&readahead_paused, 1, __ATOMIC_SEQ_CST);
+
+	// look again: the cache manager may have written before it could see the pause
+
+	if ( memory_budget_exhausted()==0 ) {
+
+	    __atomic_store_n(&readahead_paused, 0, __ATOMIC_SEQ_CST);
+	    return;
+
+	}
+
+	__atomic_add_fetch(&readahead_pauses, 1, __ATOMIC_RELAXED);
+
+    }
+
+    wait_mpsc_queue(&read_commands_queue);
+
+}
+
+//
+// the cache manager has written enough to get below the memory budget again: wake the cdromreader
+// when it sleeps for it
+//
+
+void resume_readahead()
+{
+
+    if ( __atomic_load_n(&readahead_paused, __ATOMIC_SEQ_CST)==1 && __atomic_exchange_n(&readahead_paused, 0, __ATOMIC_SEQ_CST)==1 ) {
+
+	// no command pushed with this wakeup, so also when it's not sleeping yet
+
+	kick_mpsc_queue(&read_commands_queue);
+
+    }
+
+}
+
+static void *cdromreader_thread()
+{
+    int nreturn=0, nrsectors, nrstartsector, nrsectorsread, nrtotalsectorsread, nrsectorsbatch;
+    struct caching_data_struct *caching_data;
+    struct read_call_struct *read_call;
+    unsigned char tries1;
+    bool foundincache, lostsectors;
+    unsigned int loststartsector=0, lostendsector=0;
+    unsigned int missingsector, cachedsector;
+    struct read_command_struct *read_command=NULL;
+    struct read_command_struct *read_command_again=NULL;
+    struct sector_slot_struct *sector_slot;
+
+
+
+    logoutput0("CDROMREADER");
+
+
+    while (1) {
+
+
+	// take the new commands, and sleep when there is nothing to read
+
+	drain_read_commands();
+
+	// demand reads always, readahead only within the memory budget
+
+	read_command=get_next_read_command(memory_budget_exhausted());
+
+	if ( ! read_command ) {
+
+	    wait_for_read_commands();
+	    continue;
+
+	}
+
+	// log_what_is_in_queue();
+
+	// the read command is taken from the queue of the highest class
+	// process the read command
+
+	// process the read request
+	// first find out which file to write to
+	// TODO: no read_call when a read ahead
+
+        if ( read_command->readaheadpolicy==READAHEAD_POLICY_NONE ) {
+
+            // not initiated for read ahead purposes
+            // so there must be a read_call
+
+            read_call=read_command->read_call;
+
+            if ( ! read_call ) {
 
-            nreturn=release_readlock_caching_data(caching_data);
+                move_read_command_to_unused_list(read_command);
+                logoutput2("error!! original read call not found....");
+                continue;
+
+            }
+
+        }
+
+        //
+        // determine the track
+        //
+
+	caching_data=read_command->caching_data;
+
+	if ( ! caching_data ) {
+
+	    logoutput2("error!! caching_data not found!! serious io error");
+	    continue;
+
+	}
+
+
+	logoutput2("cdromreader: check data already available and readehead");
+
+
+        foundincache=false;
+        lostsectors=false;
+        read_command_again=NULL;
+
+        //
+        // look in the residency bitmap which part is still to read
+        // no lock required: only the cache manager sets bits
+        //
+
+        missingsector=get_first_missing_sector(caching_data, read_command->startsector, read_command->endsector);
+
+        if ( missingsector>read_command->endsector ) {
+
+            // read_command->(startsector,endsector) is in cache
+
+            foundincache=true;
+
+        } else {
+
+            // left of the first missing sector is in cache: correct the read command
+
+            read_command->startsector=missingsector;
+
+            cachedsector=get_first_cached_sector(caching_data, missingsector, read_command->endsector);
+
+            if ( cachedsector<=read_command->endsector ) {
+
+                // a cached part in the middle: read only till there, and the part right of it
+                // (if something is missing there) with another command
+
+                missingsector=get_first_missing_sector(caching_data, cachedsector, read_command->endsector);
+
+                if ( missingsector<=read_command->endsector ) {
+
+                    read_command_again=get_read_command();
+
+                    if ( ! read_command_again ) {
+
+                        // the right part is lost
+
+                        lostsectors=true;
+                        loststartsector=missingsector;
+                        lostendsector=read_command->endsector;
+
+                    } else {
+
+                        read_command_again->read_call=read_command->read_call;
+                        read_command_again->streamid=read_command->streamid;
+                        read_command_again->caching_data=caching_data;
+
+                        read_command_again->startsector=missingsector;
+                        read_command_again->endsector=read_command->endsector;
+
+                        read_command_again->readaheadlevel=read_command->readaheadlevel;
+                        read_command_again->readaheadpolicy=read_command->readaheadpolicy;
+
+                    }
+
+                }
+
+                read_command->endsector=cachedsector-1;
+
+            }
 
         }
 
+        if ( lostsectors ) notify_read_error(caching_data, loststartsector, lostendsector, -ENOMEM);
+
         // readahead
         // put more read_commands in the queue
         // if there is read_command_again (created above) use that
@@ -1305,6 +2191,7 @@ static void *cdromreader_thread()
                             if ( read_command_again ) {
 
                                 read_command_again->read_call=NULL;
+                                read_command_again->streamid=read_command->streamid;
                                 read_command_again->caching_data=caching_data;
 
                                 read_command_again->startsector=read_command->endsector+1;
@@ -1325,6 +2212,7 @@ static void *cdromreader_thread()
                         if ( read_command_again ) {
 
                             read_command_again->read_call=NULL;
+                            read_command_again->streamid=read_command->streamid;
                             read_command_again->caching_data=caching_data;
                         
                             read_command_again->startsector=read_command->endsector+1;
@@ -1348,7 +2236,9 @@ static void *cdromreader_thread()
 
                 if ( read_command_again->readaheadpolicy==READAHEAD_POLICY_PIECE ) {
 
-                    if ( read_command_again->startsector + READAHEAD_POLICY_PIECE_SECTORS > read_command_again->endsector ) {
+                    // the window of a stream (level 0) is sized already, do not pad it
+
+                    if ( read_command_again->readaheadlevel>0 && read_command_again->startsector + READAHEAD_POLICY_PIECE_SECTORS > read_command_again->endsector ) {
 
                         read_command_again->endsector = read_command_again->startsector + READAHEAD_POLICY_PIECE_SECTORS;
 
@@ -1381,7 +2271,13 @@ static void *cdromreader_thread()
 
             logoutput2("cdrom reader: sending a read command (%i - %i) again", read_command_again->startsector, read_command_again->endsector);
 
-            add_read_command_to_queue(read_command_again);
+            // sort it directly in the queues: pushing to the queue this thread empties could block
+
+            read_command_again->readclass=get_read_class(read_command_again);
+            clock_gettime(CLOCK_MONOTONIC, &(read_command_again->queued));
+            charge_read_command(read_command_again);
+
+            queue_read_command(read_command_again);
 
         }
 
@@ -1389,17 +2285,10 @@ static void *cdromreader_thread()
         if (foundincache) {
 
             //
-            // signal and loop
+            // nothing to read: the waiting clients have been or will be woken
+            // by the read result which put the sectors in cache
             //
 
-            if ( read_command->read_call ) {
-
-                // notify waiting clients ..... of course only when there is one
-
-                notify_waiting_clients(read_command->read_call, read_command->startsector, read_command->endsector);
-
-            }
-
             move_read_command_to_unused_list(read_command);
 
             continue;
@@ -1416,6 +2305,7 @@ static void *cdromreader_thread()
 	    // invalid 
 
 	    logoutput2("invalid block,nrsectors %i serious io error", nrsectors);
+	    notify_read_error(caching_data, read_command->startsector, read_command->endsector, -EIO);
 	    move_read_command_to_unused_list(read_command);
 	    continue;
 
@@ -1435,6 +2325,7 @@ static void *cdromreader_thread()
                 // errors opening cd 
                 // this will not happen likely since the cdrom has already been opened using cdio
 
+	        notify_read_error(caching_data, read_command->startsector, read_command->endsector, -EIO);
 	        move_read_command_to_unused_list(read_command);
 	        continue;
 
@@ -1457,24 +2348,12 @@ static void *cdromreader_thread()
 
         // the read of the cdrom goes in batches with size probably much smaller than the size requested
         // (batch size 20110920: 25 sectors)
-        // but because it's not know here how much sectors are read in one batch (and how to change that)
-        // we take the "overall" size of the buffer
-        // and copy the sectors read to another buffer with the right size
-
-        size_t size=nrsectors * CDIO_CD_FRAMESIZE_RAW;
-
-        createbuffer:
-
-	buffer=malloc(size);
-
-	if ( ! buffer ) {
-
-	    // maybe retry here in case of errors
+        // every batch is read directly in a slot of the ring of sector buffers, which is handed over
+        // to the cache manager with the read result, and given back when written to the cache
 
-	    logoutput("error!! cannot create buffer to read cdrom.....ioerrors will be result...");
-	    continue;
+        // from now on read commands for the same sectors attach to this one
 
-	}
+        set_inflight_read_command(read_command);
 
 	tries1=0;
 	nrstartsector=read_command->startsector;
@@ -1485,10 +2364,17 @@ static void *cdromreader_thread()
 
 	readfromcd:
 
-        // clear the buffer
+        // wait for a free slot: when the cache manager is behind writing, the reading waits
+
+        sector_slot=get_sector_slot();
+
+        // read per batch of the drive, so a cancelled readahead stops at the next batch
 
-        memset(buffer, '\0', size);
-	nrsectorsread=cdio_cddap_read(cdfs_device.cddevice, buffer, nrstartsector, nrsectors - nrtotalsectorsread);
+        nrsectorsbatch=nrsectors - nrtotalsectorsread;
+        if ( cdfs_device.cddevice->nsectors>0 && nrsectorsbatch > cdfs_device.cddevice->nsectors ) nrsectorsbatch=cdfs_device.cddevice->nsectors;
+        if ( nrsectorsbatch > CDFS_SECTOR_SLOT_SECTORS ) nrsectorsbatch=CDFS_SECTOR_SLOT_SECTORS;
+
+	nrsectorsread=cdio_cddap_read(cdfs_device.cddevice, sector_slot->buffer, nrstartsector, nrsectorsbatch);
 
         if ( nrsectorsread<0 ) {
 
@@ -1496,23 +2382,23 @@ static void *cdromreader_thread()
 
             logoutput2("cdromreader: error %i reading cd", nrsectorsread);
 
+            put_sector_slot(sector_slot);
+
             tries1++;
 
             if ( tries1>4 ) {
 
-                // howto report back to the original caller there is an error
-                //
-                // just for now do nothing to report back
-                //
-                // just leave it for the original caller (a cdfs_read call!) to expire and leave it there
+                // report back to the original caller there is an error for the sectors
+                // not read yet, the read call is replied with an error
                 //
                 // for an incident this is ok, but for serious error, like the cdrom is not readable
                 // anymore the reading should be stopped in an earlier stage than here
                 // 
 
+	        set_inflight_read_command(NULL);
+	        notify_read_error(caching_data, nrstartsector, read_command->endsector, -EIO);
 	        move_read_command_to_unused_list(read_command);
 	        logoutput("error!! serious errors (%i) reading the cd", nrsectorsread);
-	        free(buffer);
 	        continue;
 
             }
@@ -1522,74 +2408,79 @@ static void *cdromreader_thread()
         } else {
 
 
-            // send the bytes to the cache
+            // send the sectors to the cache, the slot goes with it
 
-            if ( nrtotalsectorsread+nrsectorsread > nrsectors ) nrsectorsread=nrsectors-nrtotalsectorsread;
-            tries2=0;
+            if ( nrsectorsread > nrsectorsbatch ) nrsectorsread=nrsectorsbatch;
 
-            //
-            // create the buffer read, it's best to copy this to another buffer cause the writing to the cache
-            // might take longer than the reading of the next buffer, overwriting existing read result
-            // maybe this is nonsense but to be safe
-            //
+            nreturn=send_read_result_to_cache(read_command->read_call, caching_data, ( inflight_demanded==1 ) ? CDFS_READ_CLASS_DEMAND : read_command->readclass, nrstartsector, sector_slot, nrsectorsread);
+
+            if ( nreturn<0 ) {
+
+                set_inflight_read_command(NULL);
+                notify_read_error(caching_data, nrstartsector, read_command->endsector, nreturn);
+                move_read_command_to_unused_list(read_command);
+                logoutput("error!! serious errors creating buffer reading the cd");
+                put_sector_slot(sector_slot);
+
+                continue;
 
-            createbufferread:
+            }
 
-            buffread=malloc(nrsectorsread * CDIO_CD_FRAMESIZE_RAW);
+            // the sectors are in flight now, not queued anymore
 
-            if ( ! buffread ) {
+            uncharge_read_command(read_command, (unsigned long) nrsectorsread * CDIO_CD_FRAMESIZE_RAW);
 
-                tries2++;
+            // update counters
 
-                if ( tries2>4 ) {
+	    nrtotalsectorsread+=nrsectorsread;
+	    nrstartsector+=nrsectorsread;
 
-                    // same as above
-                    // no way yet to report back
-                    //
-                    //
+	    logoutput2("cdromreader: %i sectors read, total so far: %i, %i requested)", nrsectorsread, nrtotalsectorsread, nrsectors);
 
-                    move_read_command_to_unused_list(read_command);
-                    logoutput("error!! serious errors creating buffer reading the cd");
-                    free(buffer);
-                    continue;
+            if ( nrtotalsectorsread>=nrsectors ) {
 
-                }
+                // ready: continue
+                // the slot is given back by the cache manager
+
+                set_inflight_read_command(NULL);
+                move_read_command_to_unused_list(read_command);
 
-                goto createbufferread;
+                continue;
 
             }
 
-            // copy the bytes just read in the cdrom read buffer (size: nrsectors) to the 
-            // result buffer (size: nrsectorsread)
+            // commands send while reading: sectors of this command a client waits for
+            // keep it going, cancel of the stream of it stops it
 
-            memcpy(buffread, buffer, nrsectorsread * CDIO_CD_FRAMESIZE_RAW);
-            nreturn=send_read_result_to_cache(read_command->read_call, caching_data, nrstartsector, buffread, nrsectorsread);
+            drain_read_commands();
 
-            if ( nreturn<0 ) {
+            if ( stop_cancelled_read_command(nrsectors - nrtotalsectorsread)==1 ) {
+
+                // readahead of a stream which seeked away: stop here
+
+                logoutput2("cdromreader: readahead cancelled, %i sectors not read", nrsectors - nrtotalsectorsread);
 
                 move_read_command_to_unused_list(read_command);
-                logoutput("error!! serious errors creating buffer reading the cd");
-                free(buffread);
-                free(buffer);
 
                 continue;
 
             }
 
-            // update counters
+            if ( inflight_demanded==0 && memory_budget_exhausted()==1 ) {
 
-	    nrtotalsectorsread+=nrsectorsread;
-	    nrstartsector+=nrsectorsread;
+                // readahead while the memory budget is used up: the rest waits in the queue
+                // so demand reads go first, it's readahead is queued already, do not chain it again
 
-	    logoutput2("cdromreader: %i sectors read, total so far: %i, %i requested)", nrsectorsread, nrtotalsectorsread, nrsectors);
+                logoutput2("cdromreader: memory budget used up, readahead paused at %i", nrstartsector);
 
-            if ( nrtotalsectorsread>=nrsectors ) {
+                set_inflight_read_command(NULL);
 
-                // ready: continue
-                // note it's not necessary to free the buffread, that's freed when it's written to the cache
+                read_command->startsector=nrstartsector;
+                if ( read_command->readaheadpolicy==READAHEAD_POLICY_PIECE ) read_command->readaheadlevel=0;
 
-                move_read_command_to_unused_list(read_command);
-                free(buffer);
+                insert_read_command(read_command);
+
+                __atomic_add_fetch(&readahead_pauses, 1, __ATOMIC_RELAXED);
 
                 continue;
 
@@ -1601,8 +2492,7 @@ static void *cdromreader_thread()
 
     }
 
-    pthread_mutex_destroy(&queue_lockmutex);
-    pthread_cond_destroy(&queue_lockcond);
+    free_mpsc_queue(&read_commands_queue);
 
 }
 
@@ -1611,6 +2501,29 @@ int start_cdrom_reader_thread(pthread_t *pthreadid)
 {
     int nreturn=0;
 
+    register_cdfs_slab(&read_calls_slab);
+    register_cdfs_slab(&read_commands_slab);
+
+    nreturn=init_sector_ring();
+
+    if ( nreturn<0 ) {
+
+	logoutput("Error creating the ring of sector buffers (error: %i).", abs(nreturn));
+	goto out;
+
+    }
+
+    // the queue the other threads send read commands through, ready before anyone can send
+
+    nreturn=init_mpsc_queue(&read_commands_queue, CDFS_READ_COMMANDS_QUEUE_SIZE);
+
+    if ( nreturn<0 ) {
+
+	logoutput("Error creating the queue of read commands (error: %i).", abs(nreturn));
+	goto out;
+
+    }
+
     //
     // create a thread to read the cd
     //
@@ -1628,6 +2541,8 @@ int start_cdrom_reader_thread(pthread_t *pthreadid)
 
     }
 
+    out:
+
     return nreturn;
 
 }
@@ -28,26 +28,59 @@
 
 
 
+/* classes of read commands, in order of priority */
+
+#define CDFS_READ_CLASS_DEMAND          0
+#define CDFS_READ_CLASS_NEAR            1
+#define CDFS_READ_CLASS_BACKGROUND      2
+
+#define CDFS_READ_CLASSES               3
+
 /* struct for read command */
+/* with cancel set nothing is read, the readahead of stream is cancelled */
 
 struct read_command_struct {
     unsigned char readaheadlevel;
     unsigned char readaheadpolicy;
+    unsigned char readclass;
+    unsigned char cancel;
     unsigned int startsector;
     unsigned int endsector;
+    struct timespec queued;
     struct read_command_struct *next;
     struct read_command_struct *prev;
     struct read_call_struct *read_call;
+    unsigned long streamid;
+    unsigned long charged;
     struct caching_data_struct *caching_data;
 };
 
 
+/* statistics per class of read commands, wait times in microseconds */
+
+struct read_class_stats_struct {
+    int depth;
+    unsigned long served;
+    unsigned long waittime;
+    unsigned long maxwaittime;
+};
+
+
 /* struct for a read result from cdromreader
  to send to the cache manager */
 
-struct read_result_struct {
+/* slot of the ring of sector buffers: the cdromreader reads a batch in it, and hands it */
+/* over to the cache manager with the read result, which gives it back when written */
+
+struct sector_slot_struct {
     char *buffer;
+    unsigned int index;
+};
+
+struct read_result_struct {
+    struct sector_slot_struct *sector_slot;
     unsigned char status;
+    unsigned char readclass;
     unsigned int startsector;
     unsigned int endsector;
     struct read_result_struct *next;
@@ -76,10 +109,17 @@ int get_sector_from_position(int tracknr, off_t pos);
 
 struct read_call_struct *get_read_call();
 void move_read_call_to_unused_list(struct read_call_struct *read_call);
+unsigned long get_sectors_coalesced();
+int get_read_class_stats(char *buffer, size_t size);
 
 // cd rom read utilities
 
-int send_read_command(struct read_call_struct *read_call, struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, unsigned char readaheadpolicy, unsigned char readaheadlevel);
+int send_read_command(struct read_call_struct *read_call, struct read_stream_struct *stream, struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, unsigned char readaheadpolicy, unsigned char readaheadlevel);
+void cancel_readahead_stream(struct read_stream_struct *stream);
+int readahead_stream(struct read_stream_struct *stream, struct caching_data_struct *caching_data, unsigned int startsector, unsigned int endsector, unsigned char seek);
 int start_cdrom_reader_thread(pthread_t *pthreadid);
 
+void put_sector_slot(struct sector_slot_struct *sector_slot);
+void resume_readahead();
+
 #endif
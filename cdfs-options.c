@@ -35,7 +35,11 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
+#endif
 
 #include "cdfs-options.h"
 
@@ -49,6 +53,13 @@ static void usage(const char *progname, FILE *f)
 	        "             --readaheadpolicy=none/piece/whole\n",
 	        "             --hashprogram=[prog]\n",
 	        "             --discid=FILE\n",
+	        "             --notifystore=0/1\n",
+	        "             --iouring=0/1\n",
+	        "             --minworkers=NR --maxworkers=NR\n",
+	        "             --cachesync=none/batch/track\n",
+	        "             --cachelayout=1/2 --cachedirect=0/1\n",
+	        "             --ramcache=MB --diskless=0/1 --cachemmap=0/1\n",
+	        "             --memorybudget=KB\n",
 		progname);
 }
 
@@ -78,21 +89,43 @@ int cdfs_options_output_proc(void *data, const char *arg, int key, struct fuse_a
 		"    -o readaheadpolicy=none/piece/whole        policy for readahead\n"
 		"    -o hashprogram=md5sum/sha1sum/..           program to compute hash, default md5sum\n"
 		"    -o discid                                  path write the discid to, default cache-directory\n"
+		"    -o notifystore=0/1                         push readahead in the page cache of the kernel, default 0\n"
+		"    -o iouring=0/1                             requests over io_uring (libfuse3 3.18, linux 6.14), default 0\n"
+		"    -o minworkers=NR                           workers always running, default 10 (libfuse2)\n"
+		"    -o maxworkers=NR                           workers at most when requests wait, default 32 (libfuse2)\n"
+		"    -o cachesync=none/batch/track              fdatasync the cache files never, every write or per complete track, default none\n"
+		"    -o cachelayout=1/2                         new cache files as wav file (1) or with page aligned audio (2), default 1\n"
+		"    -o cachedirect=0/1                         cache files with O_DIRECT, not in the page cache (implies cachelayout=2), default 0\n"
+		"    -o ramcache=MB                             keep sectors recently read in ram, default 0 (diskless 32)\n"
+		"    -o diskless=0/1                            no cache files, sectors in ram only (also without cache-directory), default 0\n"
+		"    -o cachemmap=0/1                           map the cache file of an open track, reads are replied from it (not with cachedirect), default 0\n"
+		"                                               (the whole track: on 32 bit it may not fit in the address space, then it's not mapped)\n"
+		"    -o memorybudget=KB                         read from the cd and not yet in the cache, queued readahead included, default 3072\n"
 		"\n"
 		"FUSE options:\n");
 		fflush(stdout);
 		dup2(1, 2);
+#ifdef CDFS_FUSE3
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+#else
 		fuse_opt_add_arg(outargs, "--help");
 		fuse_mount(NULL, outargs);
 		fuse_lowlevel_new(outargs, NULL, 0, NULL);
+#endif
 		exit(0);
 	case KEY_VERSION:
 		printf("xmpfs version %s\n", PACKAGE_VERSION);
 		fflush(stdout);
 		dup2(1, 2);
+#ifdef CDFS_FUSE3
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+#else
 		fuse_opt_add_arg(outargs, "--version");
 		fuse_parse_cmdline(outargs, NULL, NULL, NULL);
 		fuse_lowlevel_new(outargs, NULL, 0, NULL);
+#endif
 		exit(0);
 	}
 	return 1;
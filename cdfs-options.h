@@ -35,6 +35,17 @@ struct cdfs_commandline_options_struct {
      char *cachebackend;
      char *readaheadpolicy;
      char *hashprogram;
+     int notifystore;
+     int iouring;
+     int minworkers;
+     int maxworkers;
+     char *cachesync;
+     int cachelayout;
+     int cachedirect;
+     int ramcache;
+     int diskless;
+     int cachemmap;
+     int memorybudget;
 };
 
 // Prototypes
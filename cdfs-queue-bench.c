@@ -0,0 +1,314 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+//
+// microbenchmark of the queues between the threads of fuse-cdfs:
+// the enqueue latency with many producers and one consumer of
+// - the lock flag in a mutex with a condition variable, as the queues used before
+// - the lock free queue of cdfs-queue.c with the eventfd wakeup
+//
+// build with "make cdfs-queue-bench", run as: cdfs-queue-bench [nrproducers] [nritems per producer]
+//
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "cdfs-queue.h"
+
+#define BENCH_DEFAULT_PRODUCERS		16
+#define BENCH_DEFAULT_ITEMS		100000
+
+struct bench_item_struct {
+    struct bench_item_struct *next;
+};
+
+struct bench_result_struct {
+    unsigned int index;
+    unsigned long total;
+    unsigned long max;
+};
+
+// the lock flag queue
+
+struct bench_item_struct *head_lockqueue=NULL;
+struct bench_item_struct *tail_lockqueue=NULL;
+
+unsigned char lockqueue_lock=0;
+pthread_mutex_t lockqueue_lockmutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lockqueue_lockcond=PTHREAD_COND_INITIALIZER;
+
+// the lock free queue
+
+struct cdfs_mpsc_queue_struct mpscqueue;
+
+unsigned int nrproducers=BENCH_DEFAULT_PRODUCERS;
+unsigned int nritems=BENCH_DEFAULT_ITEMS;
+
+struct bench_item_struct *items=NULL;
+
+
+static unsigned long get_nanoseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+
+}
+
+static void push_lockqueue(struct bench_item_struct *item)
+{
+
+    pthread_mutex_lock(&lockqueue_lockmutex);
+
+    while (lockqueue_lock==1) {
+
+	pthread_cond_wait(&lockqueue_lockcond, &lockqueue_lockmutex);
+
+    }
+
+    lockqueue_lock=1;
+    pthread_mutex_unlock(&lockqueue_lockmutex);
+
+    item->next=NULL;
+
+    if ( tail_lockqueue ) tail_lockqueue->next=item;
+    tail_lockqueue=item;
+    if ( ! head_lockqueue ) head_lockqueue=item;
+
+    pthread_mutex_lock(&lockqueue_lockmutex);
+    lockqueue_lock=0;
+    pthread_cond_broadcast(&lockqueue_lockcond);
+    pthread_mutex_unlock(&lockqueue_lockmutex);
+
+}
+
+static void *lockqueue_consumer(void *arg)
+{
+    unsigned long nrleft=(unsigned long) nrproducers * nritems;
+
+    while (nrleft>0) {
+
+	pthread_mutex_lock(&lockqueue_lockmutex);
+
+	while ( lockqueue_lock==1 || ! head_lockqueue ) {
+
+	    pthread_cond_wait(&lockqueue_lockcond, &lockqueue_lockmutex);
+
+	}
+
+	lockqueue_lock=1;
+
+	head_lockqueue=head_lockqueue->next;
+	if ( ! head_lockqueue ) tail_lockqueue=NULL;
+
+	lockqueue_lock=0;
+
+	pthread_cond_broadcast(&lockqueue_lockcond);
+	pthread_mutex_unlock(&lockqueue_lockmutex);
+
+	nrleft--;
+
+    }
+
+    return NULL;
+
+}
+
+static void *mpscqueue_consumer(void *arg)
+{
+    unsigned long nrleft=(unsigned long) nrproducers * nritems;
+
+    while (nrleft>0) {
+
+	if ( pop_mpsc_queue(&mpscqueue) ) {
+
+	    nrleft--;
+
+	} else {
+
+	    wait_mpsc_queue(&mpscqueue);
+
+	}
+
+    }
+
+    return NULL;
+
+}
+
+static void *lockqueue_producer(void *arg)
+{
+    struct bench_result_struct *result=(struct bench_result_struct *) arg;
+    struct bench_item_struct *item=&items[(unsigned long) result->index * nritems];
+    unsigned long start, latency;
+    unsigned int i;
+
+    for (i=0; i<nritems; i++) {
+
+	start=get_nanoseconds();
+
+	push_lockqueue(item + i);
+
+	latency=get_nanoseconds() - start;
+
+	result->total+=latency;
+	if ( latency > result->max ) result->max=latency;
+
+    }
+
+    return NULL;
+
+}
+
+static void *mpscqueue_producer(void *arg)
+{
+    struct bench_result_struct *result=(struct bench_result_struct *) arg;
+    struct bench_item_struct *item=&items[(unsigned long) result->index * nritems];
+    unsigned long start, latency;
+    unsigned int i;
+
+    for (i=0; i<nritems; i++) {
+
+	start=get_nanoseconds();
+
+	push_mpsc_queue_wait(&mpscqueue, (void *) (item + i));
+
+	latency=get_nanoseconds() - start;
+
+	result->total+=latency;
+	if ( latency > result->max ) result->max=latency;
+
+    }
+
+    return NULL;
+
+}
+
+static int run_bench(const char *name, void *(*producer) (void *), void *(*consumer) (void *))
+{
+    pthread_t *producers, consumerid;
+    struct bench_result_struct *results;
+    unsigned long start, elapsed, total=0, max=0;
+    unsigned int i;
+    int nreturn=0;
+
+    producers=calloc(nrproducers, sizeof(pthread_t));
+    results=calloc(nrproducers, sizeof(struct bench_result_struct));
+
+    if ( ! producers || ! results ) {
+
+	nreturn=-ENOMEM;
+	goto out;
+
+    }
+
+    start=get_nanoseconds();
+
+    pthread_create(&consumerid, NULL, consumer, NULL);
+
+    for (i=0; i<nrproducers; i++) {
+
+	results[i].index=i;
+	pthread_create(&producers[i], NULL, producer, (void *) &results[i]);
+
+    }
+
+    for (i=0; i<nrproducers; i++) pthread_join(producers[i], NULL);
+
+    pthread_join(consumerid, NULL);
+
+    elapsed=get_nanoseconds() - start;
+
+    for (i=0; i<nrproducers; i++) {
+
+	total+=results[i].total;
+	if ( results[i].max > max ) max=results[i].max;
+
+    }
+
+    printf("%-12s producers=%u items=%lu enqueue avg=%luns max=%luns throughput=%lu items/s\n", name, nrproducers,
+		(unsigned long) nrproducers * nritems,
+		total / ( (unsigned long) nrproducers * nritems ),
+		max,
+		( elapsed>0 ) ? (unsigned long) ( (double) nrproducers * nritems * 1000000000.0 / elapsed ) : 0);
+
+    out:
+
+    if ( producers ) free(producers);
+    if ( results ) free(results);
+
+    return nreturn;
+
+}
+
+int main(int argc, char *argv[])
+{
+    int nreturn=0;
+
+    if ( argc>1 ) nrproducers=atoi(argv[1]);
+    if ( argc>2 ) nritems=atoi(argv[2]);
+
+    if ( nrproducers==0 || nritems==0 ) {
+
+	fprintf(stderr, "usage: %s [nrproducers] [nritems per producer]\n", argv[0]);
+	return 1;
+
+    }
+
+    // every producer has it's own items, the lock flag queue links them
+
+    items=calloc((unsigned long) nritems * nrproducers, sizeof(struct bench_item_struct));
+
+    if ( ! items ) {
+
+	fprintf(stderr, "cannot allocate %u items\n", nritems * nrproducers);
+	return 1;
+
+    }
+
+    nreturn=init_mpsc_queue(&mpscqueue, CDFS_READ_COMMANDS_QUEUE_SIZE);
+
+    if ( nreturn<0 ) {
+
+	fprintf(stderr, "cannot create lock free queue (error %i)\n", nreturn);
+	return 1;
+
+    }
+
+    run_bench("lockflag", lockqueue_producer, lockqueue_consumer);
+    run_bench("mpsc", mpscqueue_producer, mpscqueue_consumer);
+
+    free_mpsc_queue(&mpscqueue);
+    free(items);
+
+    return 0;
+
+}
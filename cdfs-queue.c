@@ -0,0 +1,603 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "cdfs-queue.h"
+
+
+//
+// bounded lock free queue with many producers and one consumer
+//
+// a ring of slots, size a power of two, every slot with a sequence number:
+// - a producer claims position pos by moving the tail from pos to pos+1 (compare and swap), which
+//   only succeeds when the slot is free for that position (sequence==pos), then fills the slot
+//   and sets the sequence to pos+1
+// - the consumer takes the slot at head when it's filled (sequence==head+1), and frees it for
+//   the next round by setting the sequence to head+size
+//
+// the consumer is woken with an eventfd, written only when the consumer is sleeping
+// a producer waiting for space (push_mpsc_queue_wait) is woken with a condition, signalled only
+// when a producer is waiting
+// this module does no logging, so it can be used outside fuse-cdfs (see cdfs-queue-bench.c)
+//
+
+int init_mpsc_queue(struct cdfs_mpsc_queue_struct *queue, unsigned int size)
+{
+    unsigned long nrslots=1, i;
+    int nreturn=0;
+
+    while ( nrslots < size ) nrslots<<=1;
+
+    queue->slots=malloc(nrslots * sizeof(struct cdfs_mpsc_slot_struct));
+
+    if ( ! queue->slots ) {
+
+	nreturn=-ENOMEM;
+	goto out;
+
+    }
+
+    for (i=0; i<nrslots; i++) {
+
+	queue->slots[i].sequence=i;
+	queue->slots[i].data=NULL;
+
+    }
+
+    queue->mask=nrslots-1;
+    queue->tail=0;
+    queue->head=0;
+    queue->sleeping=0;
+    queue->waitingspace=0;
+
+    pthread_mutex_init(&(queue->spacemutex), NULL);
+    pthread_cond_init(&(queue->spacecond), NULL);
+
+    queue->eventfd=eventfd(0, EFD_CLOEXEC);
+
+    if ( queue->eventfd==-1 ) {
+
+	nreturn=-errno;
+
+	free(queue->slots);
+	queue->slots=NULL;
+
+    }
+
+    out:
+
+    return nreturn;
+
+}
+
+void free_mpsc_queue(struct cdfs_mpsc_queue_struct *queue)
+{
+
+    if ( queue->slots ) {
+
+	free(queue->slots);
+	queue->slots=NULL;
+
+    }
+
+    if ( queue->eventfd>=0 ) {
+
+	close(queue->eventfd);
+	queue->eventfd=-1;
+
+    }
+
+    pthread_mutex_destroy(&(queue->spacemutex));
+    pthread_cond_destroy(&(queue->spacecond));
+
+}
+
+//
+// wake the consumer, only when it's sleeping or about to
+//
+
+void wake_mpsc_queue(struct cdfs_mpsc_queue_struct *queue)
+{
+    uint64_t value=1;
+
+    // pairs with the fence in wait_mpsc_queue: either the consumer sees the data pushed,
+    // or this sees the consumer sleeping
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if ( __atomic_load_n(&queue->sleeping, __ATOMIC_RELAXED)==1 ) {
+
+	if ( __atomic_exchange_n(&queue->sleeping, 0, __ATOMIC_SEQ_CST)==1 ) {
+
+	    if ( write(queue->eventfd, &value, sizeof(uint64_t)) < 0 ) {
+
+		// the counter is at it's max: the consumer is woken anyway
+
+		return;
+
+	    }
+
+	}
+
+    }
+
+}
+
+//
+// wake the consumer also when it's not sleeping (yet): the next wait returns at once
+// for a wakeup which does not come with data pushed
+//
+
+void kick_mpsc_queue(struct cdfs_mpsc_queue_struct *queue)
+{
+    uint64_t value=1;
+
+    if ( write(queue->eventfd, &value, sizeof(uint64_t)) < 0 ) {
+
+	// the counter is at it's max: the consumer is woken anyway
+
+	return;
+
+    }
+
+}
+
+//
+// add data to the queue
+// returns 0, or -EAGAIN when the queue is full
+//
+
+int push_mpsc_queue(struct cdfs_mpsc_queue_struct *queue, void *data)
+{
+    struct cdfs_mpsc_slot_struct *slot;
+    unsigned long pos, sequence;
+    long dif;
+
+    pos=__atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+
+	slot=&queue->slots[pos & queue->mask];
+	sequence=__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+	dif=(long) sequence - (long) pos;
+
+	if ( dif==0 ) {
+
+	    // slot is free for this position: claim it
+
+	    if ( __atomic_compare_exchange_n(&queue->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
+
+	    // another producer was first: pos is updated with the actual tail
+
+	} else if ( dif<0 ) {
+
+	    // the consumer has not taken the slot of the previous round yet: full
+
+	    return -EAGAIN;
+
+	} else {
+
+	    pos=__atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+	}
+
+    }
+
+    slot->data=data;
+    __atomic_store_n(&slot->sequence, pos+1, __ATOMIC_RELEASE);
+
+    wake_mpsc_queue(queue);
+
+    return 0;
+
+}
+
+//
+// is the slot at the tail not taken by the consumer yet
+//
+
+static int mpsc_queue_full(struct cdfs_mpsc_queue_struct *queue)
+{
+    unsigned long pos=__atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    struct cdfs_mpsc_slot_struct *slot=&queue->slots[pos & queue->mask];
+
+    return ( (long) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (long) pos < 0 ) ? 1 : 0;
+
+}
+
+//
+// add data to the queue, when it's full sleep till the consumer has taken something
+//
+
+void push_mpsc_queue_wait(struct cdfs_mpsc_queue_struct *queue, void *data)
+{
+
+    while ( push_mpsc_queue(queue, data)==-EAGAIN ) {
+
+	// the consumer has to be awake to make space
+
+	wake_mpsc_queue(queue);
+
+	pthread_mutex_lock(&(queue->spacemutex));
+
+	__atomic_add_fetch(&queue->waitingspace, 1, __ATOMIC_SEQ_CST);
+
+	// pairs with the fence in pop_mpsc_queue: either the consumer sees this waiting,
+	// or this sees the slot it took
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while ( mpsc_queue_full(queue)==1 ) pthread_cond_wait(&(queue->spacecond), &(queue->spacemutex));
+
+	__atomic_sub_fetch(&queue->waitingspace, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&(queue->spacemutex));
+
+    }
+
+}
+
+//
+// take data from the queue, only by the consumer
+// returns NULL when empty (or the producer of the first slot is not ready filling it)
+//
+
+void *pop_mpsc_queue(struct cdfs_mpsc_queue_struct *queue)
+{
+    struct cdfs_mpsc_slot_struct *slot;
+    unsigned long pos=queue->head;
+    void *data;
+
+    slot=&queue->slots[pos & queue->mask];
+
+    if ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos+1 ) return NULL;
+
+    data=slot->data;
+
+    __atomic_store_n(&slot->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    queue->head=pos+1;
+
+    // a producer found the queue full: there is space now
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if ( __atomic_load_n(&queue->waitingspace, __ATOMIC_RELAXED)>0 ) {
+
+	pthread_mutex_lock(&(queue->spacemutex));
+	pthread_cond_broadcast(&(queue->spacecond));
+	pthread_mutex_unlock(&(queue->spacemutex));
+
+    }
+
+    return data;
+
+}
+
+//
+// let the consumer sleep till something is pushed, it may return without anything in the queue
+//
+
+void wait_mpsc_queue(struct cdfs_mpsc_queue_struct *queue)
+{
+    struct cdfs_mpsc_slot_struct *slot;
+    uint64_t value;
+
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // look again: a producer may have pushed before it could see the consumer sleeping
+
+    slot=&queue->slots[queue->head & queue->mask];
+
+    if ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == queue->head+1 ) {
+
+	__atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+	return;
+
+    }
+
+    if ( read(queue->eventfd, &value, sizeof(uint64_t)) < 0 ) {
+
+	// interrupted: the caller looks in the queue and waits again
+
+	__atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+
+    }
+
+}
+
+//
+// like wait_mpsc_queue, at most timeout milliseconds
+// returns 1 when woken (or there is something already), 0 when timed out
+// a wakeup of a producer which came just after the timeout is taken by the next wait
+//
+
+int wait_mpsc_queue_timeout(struct cdfs_mpsc_queue_struct *queue, int timeout)
+{
+    struct cdfs_mpsc_slot_struct *slot;
+    struct pollfd pfd;
+    uint64_t value;
+    int res;
+
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // look again: a producer may have pushed before it could see the consumer sleeping
+
+    slot=&queue->slots[queue->head & queue->mask];
+
+    if ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == queue->head+1 ) {
+
+	__atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+	return 1;
+
+    }
+
+    pfd.fd=queue->eventfd;
+    pfd.events=POLLIN;
+
+    res=poll(&pfd, 1, timeout);
+
+    if ( res>0 && read(queue->eventfd, &value, sizeof(uint64_t))==sizeof(uint64_t) ) return 1;
+
+    // timed out or interrupted: the caller looks in the queue
+
+    __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+
+    return ( res==0 ) ? 0 : 1;
+
+}
+
+//
+// bounded lock free queue with many producers and many consumers
+//
+// the same ring of slots, only the consumers also claim their position, by moving the head from
+// pos to pos+1 (compare and swap) when the slot is filled for that position (sequence==pos+1)
+//
+// every push adds one to the eventfd, which is a semaphore: a consumer waits till it can take one
+// off, and then there is data for it in the queue, so consumers do not spin on an empty queue
+//
+
+int init_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, unsigned int size)
+{
+    unsigned long nrslots=1, i;
+    int nreturn=0;
+
+    while ( nrslots < size ) nrslots<<=1;
+
+    queue->slots=malloc(nrslots * sizeof(struct cdfs_mpsc_slot_struct));
+
+    if ( ! queue->slots ) {
+
+	nreturn=-ENOMEM;
+	goto out;
+
+    }
+
+    for (i=0; i<nrslots; i++) {
+
+	queue->slots[i].sequence=i;
+	queue->slots[i].data=NULL;
+
+    }
+
+    queue->mask=nrslots-1;
+    queue->tail=0;
+    queue->head=0;
+
+    queue->eventfd=eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+
+    if ( queue->eventfd==-1 ) {
+
+	nreturn=-errno;
+
+	free(queue->slots);
+	queue->slots=NULL;
+
+    }
+
+    out:
+
+    return nreturn;
+
+}
+
+void free_mpmc_queue(struct cdfs_mpmc_queue_struct *queue)
+{
+
+    if ( queue->slots ) {
+
+	free(queue->slots);
+	queue->slots=NULL;
+
+    }
+
+    if ( queue->eventfd>=0 ) {
+
+	close(queue->eventfd);
+	queue->eventfd=-1;
+
+    }
+
+}
+
+//
+// add data to the queue
+// returns 0, or -EAGAIN when the queue is full
+//
+
+int push_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, void *data)
+{
+    struct cdfs_mpsc_slot_struct *slot;
+    unsigned long pos, sequence;
+    long dif;
+
+    pos=__atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    while (1) {
+
+	slot=&queue->slots[pos & queue->mask];
+	sequence=__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+	dif=(long) sequence - (long) pos;
+
+	if ( dif==0 ) {
+
+	    if ( __atomic_compare_exchange_n(&queue->tail, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
+
+	} else if ( dif<0 ) {
+
+	    return -EAGAIN;
+
+	} else {
+
+	    pos=__atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+	}
+
+    }
+
+    slot->data=data;
+    __atomic_store_n(&slot->sequence, pos+1, __ATOMIC_RELEASE);
+
+    wake_mpmc_queue(queue, 1);
+
+    return 0;
+
+}
+
+//
+// take data from the queue
+// returns NULL when empty (or the producer of the first slot is not ready filling it)
+//
+
+void *pop_mpmc_queue(struct cdfs_mpmc_queue_struct *queue)
+{
+    struct cdfs_mpsc_slot_struct *slot;
+    unsigned long pos, sequence;
+    void *data;
+    long dif;
+
+    pos=__atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    while (1) {
+
+	slot=&queue->slots[pos & queue->mask];
+	sequence=__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+	dif=(long) sequence - (long) (pos+1);
+
+	if ( dif==0 ) {
+
+	    // filled for this position: claim it
+
+	    if ( __atomic_compare_exchange_n(&queue->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
+
+	} else if ( dif<0 ) {
+
+	    return NULL;
+
+	} else {
+
+	    pos=__atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+	}
+
+    }
+
+    data=slot->data;
+
+    __atomic_store_n(&slot->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+    return data;
+
+}
+
+//
+// wait at most timeout milliseconds (-1 is forever) for data pushed
+// returns 1 when a count is taken off (the caller pops), 0 on timeout, or -errno
+//
+
+int wait_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, int timeout)
+{
+    struct pollfd pfd;
+    uint64_t value;
+    int res;
+
+    pfd.fd=queue->eventfd;
+    pfd.events=POLLIN;
+
+    while (1) {
+
+	if ( read(queue->eventfd, &value, sizeof(uint64_t))==sizeof(uint64_t) ) return 1;
+
+	if ( errno!=EAGAIN ) return -errno;
+
+	// zero: another consumer was first, or nothing pushed
+
+	res=poll(&pfd, 1, timeout);
+
+	if ( res==0 ) return 0;
+	if ( res<0 && errno!=EINTR ) return -errno;
+
+    }
+
+}
+
+//
+// add count to the semaphore without data, to wake consumers (for example to let them exit)
+//
+
+void wake_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, unsigned int count)
+{
+    uint64_t value=count;
+
+    if ( write(queue->eventfd, &value, sizeof(uint64_t)) < 0 ) {
+
+	// the counter is at it's max: the consumers are woken anyway
+
+	return;
+
+    }
+
+}
+
+unsigned long get_mpmc_queue_depth(struct cdfs_mpmc_queue_struct *queue)
+{
+    unsigned long tail=__atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    unsigned long head=__atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    return ( tail > head ) ? tail - head : 0;
+
+}
@@ -0,0 +1,86 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+#ifndef CDFS_QUEUE_H
+#define CDFS_QUEUE_H
+
+/* a slot of the ring: the sequence tells if the slot is free for the producer */
+/* at position pos (sequence==pos) or filled for the consumer (sequence==pos+1) */
+
+struct cdfs_mpsc_slot_struct {
+    unsigned long sequence;
+    void *data;
+};
+
+/* bounded queue, many threads push, one thread pops */
+/* the consumer sleeps on the eventfd when the queue is empty, producers only */
+/* write to it when the consumer said it's going to sleep */
+/* a producer finding the queue full sleeps on the condition, the consumer only */
+/* signals it when a producer said it's waiting for space */
+
+struct cdfs_mpsc_queue_struct {
+    struct cdfs_mpsc_slot_struct *slots;
+    unsigned long mask;
+    unsigned long tail __attribute__ ((aligned (64)));
+    unsigned long head __attribute__ ((aligned (64)));
+    unsigned char sleeping __attribute__ ((aligned (64)));
+    int eventfd;
+    unsigned int waitingspace __attribute__ ((aligned (64)));
+    pthread_mutex_t spacemutex;
+    pthread_cond_t spacecond;
+};
+
+/* bounded queue, many threads push and many threads pop */
+/* the eventfd is a semaphore (EFD_SEMAPHORE) counting the data pushed: a consumer */
+/* takes one count, and then there is data in the queue for it */
+
+struct cdfs_mpmc_queue_struct {
+    struct cdfs_mpsc_slot_struct *slots;
+    unsigned long mask;
+    unsigned long tail __attribute__ ((aligned (64)));
+    unsigned long head __attribute__ ((aligned (64)));
+    int eventfd;
+};
+
+
+// Prototypes
+
+int init_mpsc_queue(struct cdfs_mpsc_queue_struct *queue, unsigned int size);
+void free_mpsc_queue(struct cdfs_mpsc_queue_struct *queue);
+
+int push_mpsc_queue(struct cdfs_mpsc_queue_struct *queue, void *data);
+void push_mpsc_queue_wait(struct cdfs_mpsc_queue_struct *queue, void *data);
+void *pop_mpsc_queue(struct cdfs_mpsc_queue_struct *queue);
+
+void wait_mpsc_queue(struct cdfs_mpsc_queue_struct *queue);
+int wait_mpsc_queue_timeout(struct cdfs_mpsc_queue_struct *queue, int timeout);
+void wake_mpsc_queue(struct cdfs_mpsc_queue_struct *queue);
+void kick_mpsc_queue(struct cdfs_mpsc_queue_struct *queue);
+
+int init_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, unsigned int size);
+void free_mpmc_queue(struct cdfs_mpmc_queue_struct *queue);
+
+int push_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, void *data);
+void *pop_mpmc_queue(struct cdfs_mpmc_queue_struct *queue);
+
+int wait_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, int timeout);
+void wake_mpmc_queue(struct cdfs_mpmc_queue_struct *queue, unsigned int count);
+unsigned long get_mpmc_queue_depth(struct cdfs_mpmc_queue_struct *queue);
+
+#endif
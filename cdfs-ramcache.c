@@ -0,0 +1,659 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
+#include <fuse/fuse_lowlevel.h>
+#endif
+
+#define LOGGING
+
+#include "logging.h"
+#include "cdfs.h"
+#include "cdfs-cache.h"
+#include "cdfs-ramcache.h"
+#include "cdfs-slab.h"
+#include "fuse-loop-epoll-mt.h"
+
+extern struct cdfs_options_struct cdfs_options;
+
+
+//
+// the sectors recently read in ram, in front of the cache files, or instead of them (diskless)
+//
+// the sectors are kept in chunks of CDFS_RAMCACHE_CHUNK_SECTORS of a track, at most budget bytes
+// of them, evicted 2Q like:
+// - a new chunk goes in the in queue (a fifo), and is evicted from it when that has more than
+//   CDFS_RAMCACHE_IN_PERCENT of the budget, it's key stays in the ghost queue for a while
+// - a chunk inserted again while it's a ghost (read again not long after it was evicted) goes in
+//   the main queue (lru), a hit there moves it to the front
+// a hit in the in queue does nothing: a stream reads a chunk in a few reads and never again, and a
+// thumbnailer reading the start of every track only once, so these do not flush the main queue
+//
+// the chunks are filled by the cache manager with the sectors read from the cd, and by the reads
+// from the cache files; the budget is lowered when the kernel reports memory pressure (psi), and
+// grows back slowly after that
+//
+// diskless: the residency bitmap of a track is of the sectors in ram, the bits are set and cleared
+// here, with the lock held; chunks are only evicted by the cache manager then (when inserting), so a
+// waiter it finds complete is still complete when it replies it, one found complete by a fuse thread
+// may be evicted before that and is read again (see reply_read_call)
+//
+
+static struct ram_cache_chunk_struct *ram_cache_hash[CDFS_RAMCACHE_HASHSIZE];
+
+static struct ram_cache_chunk_struct *queue_first[CDFS_RAMCACHE_QUEUES];
+static struct ram_cache_chunk_struct *queue_last[CDFS_RAMCACHE_QUEUES];
+static unsigned int queue_count[CDFS_RAMCACHE_QUEUES];
+
+static pthread_mutex_t ram_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long ram_cache_budget=0;
+static unsigned long ram_cache_limit=0;
+
+struct ram_cache_stats_struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long ghosthits;
+    unsigned long evictions;
+    unsigned long pressure;
+};
+
+static struct ram_cache_stats_struct ram_cache_stats={0, 0, 0, 0, 0};
+
+static struct cdfs_slab_struct ram_chunks_slab=CDFS_SLAB_INIT("ram_chunk", struct ram_cache_chunk_struct, CDFS_SLAB_HIGHWATER, NULL, NULL);
+
+
+static inline unsigned int get_chunk_hash(struct caching_data_struct *caching_data, unsigned int index)
+{
+
+    return ( (unsigned int) ( (uintptr_t) caching_data >> 4 ) ^ ( index * 2654435761U ) ) % CDFS_RAMCACHE_HASHSIZE;
+
+}
+
+static inline unsigned long get_ram_cache_bytes()
+{
+
+    return (unsigned long) ( queue_count[CDFS_RAMCACHE_QUEUE_IN] + queue_count[CDFS_RAMCACHE_QUEUE_MAIN] ) * CDFS_RAMCACHE_CHUNK_SIZE;
+
+}
+
+static inline unsigned int get_sectors_mask(unsigned int first, unsigned int nrsectors)
+{
+
+    return ( nrsectors>=32 ) ? ~0U : ( ( 1U << nrsectors ) - 1 ) << first;
+
+}
+
+static struct ram_cache_chunk_struct *lookup_chunk(struct caching_data_struct *caching_data, unsigned int index)
+{
+    struct ram_cache_chunk_struct *chunk=ram_cache_hash[get_chunk_hash(caching_data, index)];
+
+    while (chunk) {
+
+	if ( chunk->caching_data==caching_data && chunk->index==index ) break;
+
+	chunk=chunk->hashnext;
+
+    }
+
+    return chunk;
+
+}
+
+static void remove_chunk_from_hash(struct ram_cache_chunk_struct *chunk)
+{
+    struct ram_cache_chunk_struct **link=&ram_cache_hash[get_chunk_hash(chunk->caching_data, chunk->index)];
+
+    while (*link) {
+
+	if ( *link==chunk ) {
+
+	    *link=chunk->hashnext;
+	    break;
+
+	}
+
+	link=&(*link)->hashnext;
+
+    }
+
+    chunk->hashnext=NULL;
+
+}
+
+static void remove_chunk_from_queue(struct ram_cache_chunk_struct *chunk)
+{
+
+    if ( chunk->prev ) {
+
+	chunk->prev->next=chunk->next;
+
+    } else {
+
+	queue_first[chunk->queue]=chunk->next;
+
+    }
+
+    if ( chunk->next ) {
+
+	chunk->next->prev=chunk->prev;
+
+    } else {
+
+	queue_last[chunk->queue]=chunk->prev;
+
+    }
+
+    chunk->next=NULL;
+    chunk->prev=NULL;
+
+    queue_count[chunk->queue]--;
+
+}
+
+static void add_chunk_to_queue(struct ram_cache_chunk_struct *chunk, unsigned char queue)
+{
+
+    chunk->queue=queue;
+    chunk->prev=NULL;
+    chunk->next=queue_first[queue];
+
+    if ( queue_first[queue] ) {
+
+	queue_first[queue]->prev=chunk;
+
+    } else {
+
+	queue_last[queue]=chunk;
+
+    }
+
+    queue_first[queue]=chunk;
+
+    queue_count[queue]++;
+
+}
+
+//
+// the data of a chunk goes, diskless the sectors are not in cache anymore
+//
+
+static void drop_chunk_data(struct ram_cache_chunk_struct *chunk)
+{
+    struct caching_data_struct *caching_data=chunk->caching_data;
+    unsigned int bit=0, first;
+
+    if ( cdfs_options.diskless==1 ) {
+
+	while ( bit<CDFS_RAMCACHE_CHUNK_SECTORS ) {
+
+	    if ( ! ( chunk->valid & ( 1U << bit ) ) ) {
+
+		bit++;
+		continue;
+
+	    }
+
+	    first=bit;
+	    while ( bit<CDFS_RAMCACHE_CHUNK_SECTORS && ( chunk->valid & ( 1U << bit ) ) ) bit++;
+
+	    remove_sectors_from_cache(caching_data, caching_data->startsector + chunk->index * CDFS_RAMCACHE_CHUNK_SECTORS + first,
+					caching_data->startsector + chunk->index * CDFS_RAMCACHE_CHUNK_SECTORS + bit - 1);
+
+	}
+
+    }
+
+    if ( chunk->buffer ) free(chunk->buffer);
+
+    chunk->buffer=NULL;
+    chunk->valid=0;
+
+}
+
+static void free_chunk(struct ram_cache_chunk_struct *chunk)
+{
+
+    remove_chunk_from_hash(chunk);
+    put_slab_object(&ram_chunks_slab, (void *) chunk);
+
+}
+
+//
+// evict one chunk, returns 0 when there is nothing to evict
+//
+
+static int evict_chunk()
+{
+    struct ram_cache_chunk_struct *chunk;
+    unsigned int maxghosts=ram_cache_budget / CDFS_RAMCACHE_CHUNK_SIZE / 2;
+
+    if ( queue_last[CDFS_RAMCACHE_QUEUE_IN] && ( (unsigned long) queue_count[CDFS_RAMCACHE_QUEUE_IN] * CDFS_RAMCACHE_CHUNK_SIZE > ram_cache_limit / 100 * CDFS_RAMCACHE_IN_PERCENT || ! queue_last[CDFS_RAMCACHE_QUEUE_MAIN] ) ) {
+
+	// from the in queue: remember it as ghost
+
+	chunk=queue_last[CDFS_RAMCACHE_QUEUE_IN];
+
+	remove_chunk_from_queue(chunk);
+	drop_chunk_data(chunk);
+	add_chunk_to_queue(chunk, CDFS_RAMCACHE_QUEUE_GHOST);
+
+	while ( queue_count[CDFS_RAMCACHE_QUEUE_GHOST] > maxghosts ) {
+
+	    chunk=queue_last[CDFS_RAMCACHE_QUEUE_GHOST];
+
+	    remove_chunk_from_queue(chunk);
+	    free_chunk(chunk);
+
+	}
+
+    } else if ( queue_last[CDFS_RAMCACHE_QUEUE_MAIN] ) {
+
+	chunk=queue_last[CDFS_RAMCACHE_QUEUE_MAIN];
+
+	remove_chunk_from_queue(chunk);
+	drop_chunk_data(chunk);
+	free_chunk(chunk);
+
+    } else {
+
+	return 0;
+
+    }
+
+    ram_cache_stats.evictions++;
+
+    return 1;
+
+}
+
+static void evict_to_limit(unsigned long bytes)
+{
+
+    while ( get_ram_cache_bytes() + bytes > ram_cache_limit ) {
+
+	if ( evict_chunk()==0 ) break;
+
+    }
+
+}
+
+//
+// memory pressure (psi): the limit goes to half of what's in ram, evicted at once but diskless,
+// then the cache manager evicts when it inserts (see above)
+//
+
+static void process_memory_pressure(int fd, void *data)
+{
+    unsigned long limit;
+
+    pthread_mutex_lock(&ram_cache_mutex);
+
+    limit=get_ram_cache_bytes() / 2;
+    if ( limit < CDFS_RAMCACHE_MIN ) limit=CDFS_RAMCACHE_MIN;
+
+    if ( limit < ram_cache_limit ) ram_cache_limit=limit;
+
+    if ( cdfs_options.diskless==0 ) evict_to_limit(0);
+
+    ram_cache_stats.pressure++;
+
+    pthread_mutex_unlock(&ram_cache_mutex);
+
+    logoutput1("ram cache: memory pressure, limit %lu", limit);
+
+}
+
+//
+// a timer in the mainloop: after pressure the limit grows back to the budget
+//
+
+static void grow_ram_cache(int fd, void *data)
+{
+
+    pthread_mutex_lock(&ram_cache_mutex);
+
+    if ( ram_cache_limit < ram_cache_budget ) {
+
+	ram_cache_limit+=ram_cache_budget / 8;
+	if ( ram_cache_limit > ram_cache_budget ) ram_cache_limit=ram_cache_budget;
+
+    }
+
+    pthread_mutex_unlock(&ram_cache_mutex);
+
+}
+
+//
+// a trigger on the memory pressure of the system: some task stalled CDFS_RAMCACHE_PSI_STALL
+// microseconds in CDFS_RAMCACHE_PSI_WINDOW, notified with POLLPRI
+//
+
+static int start_memory_pressure()
+{
+    char trigger[64];
+    int fd, nreturn=0;
+
+    fd=open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if ( fd==-1 ) {
+
+	nreturn=-errno;
+	goto out;
+
+    }
+
+    snprintf(trigger, sizeof(trigger), "some %i %i", CDFS_RAMCACHE_PSI_STALL, CDFS_RAMCACHE_PSI_WINDOW);
+
+    if ( write(fd, trigger, strlen(trigger) + 1) < 0 ) {
+
+	nreturn=-errno;
+	close(fd);
+	goto out;
+
+    }
+
+    nreturn=add_fuse_loop_pressure(fd, process_memory_pressure, NULL);
+
+    if ( nreturn<0 ) {
+
+	close(fd);
+	goto out;
+
+    }
+
+    nreturn=add_fuse_loop_timer(CDFS_RAMCACHE_GROW_INTERVAL, grow_ram_cache, NULL);
+
+    out:
+
+    return nreturn;
+
+}
+
+//
+// budget in bytes, 0 is no ram cache
+//
+
+int init_ram_cache(unsigned long budget)
+{
+    int nreturn=0;
+
+    if ( budget==0 ) goto out;
+
+    if ( budget < CDFS_RAMCACHE_MIN ) budget=CDFS_RAMCACHE_MIN;
+
+    ram_cache_budget=budget;
+    ram_cache_limit=budget;
+
+    register_cdfs_slab(&ram_chunks_slab);
+
+    logoutput("init_ram_cache: %lu bytes of sectors in ram%s", budget, (cdfs_options.diskless==1) ? ", diskless" : "");
+
+    nreturn=start_memory_pressure();
+
+    if ( nreturn<0 ) {
+
+	logoutput("init_ram_cache: no memory pressure notifications (error %i)", -nreturn);
+	nreturn=0;
+
+    }
+
+    out:
+
+    return nreturn;
+
+}
+
+unsigned char ram_cache_enabled()
+{
+
+    return ( ram_cache_budget>0 ) ? 1 : 0;
+
+}
+
+//
+// copy nrsectors from buffer, starting with startsector, in ram
+// returns the number of sectors which were not in cache before (diskless: not in the bitmap)
+//
+
+int insert_sectors_in_ram_cache(struct caching_data_struct *caching_data, unsigned int startsector, char *buffer, unsigned int nrsectors)
+{
+    struct ram_cache_chunk_struct *chunk;
+    unsigned int sector=startsector, endsector=startsector + nrsectors - 1;
+    unsigned int index, first, count, mask;
+    int nrnew=0;
+
+    if ( ram_cache_budget==0 || nrsectors==0 ) return 0;
+
+    if ( endsector > caching_data->endsector ) endsector=caching_data->endsector;
+
+    pthread_mutex_lock(&ram_cache_mutex);
+
+    while ( sector<=endsector ) {
+
+	index=( sector - caching_data->startsector ) / CDFS_RAMCACHE_CHUNK_SECTORS;
+	first=( sector - caching_data->startsector ) % CDFS_RAMCACHE_CHUNK_SECTORS;
+
+	count=CDFS_RAMCACHE_CHUNK_SECTORS - first;
+	if ( count > endsector - sector + 1 ) count=endsector - sector + 1;
+
+	chunk=lookup_chunk(caching_data, index);
+
+	if ( ! chunk || chunk->queue==CDFS_RAMCACHE_QUEUE_GHOST ) {
+	    unsigned char queue=CDFS_RAMCACHE_QUEUE_IN;
+
+	    if ( chunk ) {
+
+		// read again not long after it was evicted
+
+		remove_chunk_from_queue(chunk);
+		queue=CDFS_RAMCACHE_QUEUE_MAIN;
+
+		ram_cache_stats.ghosthits++;
+
+	    } else {
+
+		chunk=(struct ram_cache_chunk_struct *) get_slab_object(&ram_chunks_slab);
+		if ( ! chunk ) break;
+
+		chunk->caching_data=caching_data;
+		chunk->index=index;
+		chunk->valid=0;
+		chunk->buffer=NULL;
+		chunk->next=NULL;
+		chunk->prev=NULL;
+
+		chunk->hashnext=ram_cache_hash[get_chunk_hash(caching_data, index)];
+		ram_cache_hash[get_chunk_hash(caching_data, index)]=chunk;
+
+	    }
+
+	    evict_to_limit(CDFS_RAMCACHE_CHUNK_SIZE);
+
+	    chunk->buffer=malloc(CDFS_RAMCACHE_CHUNK_SIZE);
+
+	    if ( ! chunk->buffer ) {
+
+		free_chunk(chunk);
+		break;
+
+	    }
+
+	    add_chunk_to_queue(chunk, queue);
+
+	}
+
+	memcpy(chunk->buffer + first * CDIO_CD_FRAMESIZE_RAW, buffer, count * CDIO_CD_FRAMESIZE_RAW);
+
+	mask=get_sectors_mask(first, count);
+
+	if ( cdfs_options.diskless==1 ) {
+
+	    // after the copy: the data is there before anyone sees the bit
+
+	    nrnew+=insert_sectors_in_cache(caching_data, sector, sector + count - 1);
+
+	} else {
+
+	    nrnew+=__builtin_popcount(mask & ~chunk->valid);
+
+	}
+
+	chunk->valid|=mask;
+
+	buffer+=count * CDIO_CD_FRAMESIZE_RAW;
+	sector+=count;
+
+    }
+
+    pthread_mutex_unlock(&ram_cache_mutex);
+
+    return nrnew;
+
+}
+
+//
+// read size bytes at off of a track from ram (the header is made in memory)
+// returns size when all is there, -ENODATA when not
+//
+
+ssize_t read_from_ram_cache(struct caching_data_struct *caching_data, char *buffer, size_t size, off_t off)
+{
+    struct ram_cache_chunk_struct *chunk;
+    size_t headerlen=0, datasize, bytes;
+    off_t dataoff, chunkstart;
+    unsigned int index, lastindex, first, last, mask;
+    unsigned char pass;
+
+    if ( ram_cache_budget==0 ) return -ENODATA;
+    if ( size==0 ) return 0;
+
+    if ( off < SIZE_RIFFHEADER ) {
+
+	headerlen=SIZE_RIFFHEADER - off;
+	if ( headerlen > size ) headerlen=size;
+
+	memcpy(buffer, caching_data->header + off, headerlen);
+
+	if ( headerlen==size ) return size;
+
+    }
+
+    dataoff=off + headerlen - SIZE_RIFFHEADER;
+    datasize=size - headerlen;
+
+    index=( dataoff / CDIO_CD_FRAMESIZE_RAW ) / CDFS_RAMCACHE_CHUNK_SECTORS;
+    lastindex=( ( dataoff + datasize - 1 ) / CDIO_CD_FRAMESIZE_RAW ) / CDFS_RAMCACHE_CHUNK_SECTORS;
+
+    pthread_mutex_lock(&ram_cache_mutex);
+
+    // first look all is there, then copy
+
+    for (pass=0; pass<2; pass++) {
+	unsigned int i;
+
+	for (i=index; i<=lastindex; i++) {
+
+	    chunk=lookup_chunk(caching_data, i);
+	    chunkstart=(off_t) i * CDFS_RAMCACHE_CHUNK_SIZE;
+
+	    first=( dataoff > chunkstart ) ? ( dataoff - chunkstart ) / CDIO_CD_FRAMESIZE_RAW : 0;
+	    last=( dataoff + datasize < chunkstart + CDFS_RAMCACHE_CHUNK_SIZE ) ? ( dataoff + datasize - 1 - chunkstart ) / CDIO_CD_FRAMESIZE_RAW : CDFS_RAMCACHE_CHUNK_SECTORS - 1;
+
+	    if ( pass==0 ) {
+
+		mask=get_sectors_mask(first, last - first + 1);
+
+		if ( ! chunk || ! chunk->buffer || ( chunk->valid & mask )!=mask ) {
+
+		    ram_cache_stats.misses++;
+		    pthread_mutex_unlock(&ram_cache_mutex);
+
+		    return -ENODATA;
+
+		}
+
+		continue;
+
+	    }
+
+	    first=( dataoff > chunkstart ) ? dataoff - chunkstart : 0;
+	    bytes=( dataoff + datasize < chunkstart + CDFS_RAMCACHE_CHUNK_SIZE ) ? dataoff + datasize - chunkstart - first : CDFS_RAMCACHE_CHUNK_SIZE - first;
+
+	    memcpy(buffer + headerlen + ( chunkstart + first - dataoff ), chunk->buffer + first, bytes);
+
+	    if ( chunk->queue==CDFS_RAMCACHE_QUEUE_MAIN && queue_first[CDFS_RAMCACHE_QUEUE_MAIN]!=chunk ) {
+
+		remove_chunk_from_queue(chunk);
+		add_chunk_to_queue(chunk, CDFS_RAMCACHE_QUEUE_MAIN);
+
+	    }
+
+	}
+
+    }
+
+    ram_cache_stats.hits++;
+
+    pthread_mutex_unlock(&ram_cache_mutex);
+
+    return size;
+
+}
+
+//
+// statistics in a string like:
+// budget=33554432 limit=33554432 bytes=4515840 in=48 main=12 ghosts=20 hits=1024 misses=96 ghosthits=12 evictions=40 pressure=0
+//
+
+int get_ram_cache_stats(char *buffer, size_t size)
+{
+    int nreturn;
+
+    pthread_mutex_lock(&ram_cache_mutex);
+
+    nreturn=snprintf(buffer, size, "budget=%lu limit=%lu bytes=%lu in=%u main=%u ghosts=%u hits=%lu misses=%lu ghosthits=%lu evictions=%lu pressure=%lu",
+			ram_cache_budget, ram_cache_limit, get_ram_cache_bytes(),
+			queue_count[CDFS_RAMCACHE_QUEUE_IN], queue_count[CDFS_RAMCACHE_QUEUE_MAIN], queue_count[CDFS_RAMCACHE_QUEUE_GHOST],
+			ram_cache_stats.hits, ram_cache_stats.misses, ram_cache_stats.ghosthits, ram_cache_stats.evictions, ram_cache_stats.pressure);
+
+    pthread_mutex_unlock(&ram_cache_mutex);
+
+    return nreturn;
+
+}
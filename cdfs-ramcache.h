@@ -0,0 +1,55 @@
+/*
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+#ifndef FUSE_CDFS_RAMCACHE_H
+#define FUSE_CDFS_RAMCACHE_H
+
+/* the queues of the 2Q ram cache: new chunks (fifo), chunks used again (lru), and the ghosts */
+/* of the chunks recently evicted from the first (only the key, no data) */
+
+#define CDFS_RAMCACHE_QUEUE_IN			0
+#define CDFS_RAMCACHE_QUEUE_MAIN		1
+#define CDFS_RAMCACHE_QUEUE_GHOST		2
+
+#define CDFS_RAMCACHE_QUEUES			3
+
+/* a chunk of sectors of a track in ram, valid has a bit for every sector in it */
+
+struct ram_cache_chunk_struct {
+    struct caching_data_struct *caching_data;
+    unsigned int index;
+    unsigned int valid;
+    unsigned char queue;
+    char *buffer;
+    struct ram_cache_chunk_struct *hashnext;
+    struct ram_cache_chunk_struct *next;
+    struct ram_cache_chunk_struct *prev;
+};
+
+
+// Prototypes
+
+int init_ram_cache(unsigned long budget);
+unsigned char ram_cache_enabled();
+
+int insert_sectors_in_ram_cache(struct caching_data_struct *caching_data, unsigned int startsector, char *buffer, unsigned int nrsectors);
+ssize_t read_from_ram_cache(struct caching_data_struct *caching_data, char *buffer, size_t size, off_t off);
+
+int get_ram_cache_stats(char *buffer, size_t size);
+
+#endif
@@ -0,0 +1,385 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "cdfs-slab.h"
+
+
+//
+// slab allocator for the objects passed between the threads (read calls, read commands, ...)
+//
+// every object has a small header in front of it, which links it in a list of free objects, so
+// the object itself (with it's initialized mutexes) is not touched while free
+//
+// a thread first uses it's own cache (no lock), only when that's empty or full a batch of objects
+// is moved from or to the depot of the slab (under the mutex of the slab)
+// when a thread exits it's cache goes back to the depot
+//
+
+struct cdfs_slab_header_struct {
+    struct cdfs_slab_header_struct *next;
+    void *align;
+};
+
+struct cdfs_slab_cache_struct {
+    struct cdfs_slab_struct *slab;
+    struct cdfs_slab_header_struct *objects;
+    unsigned int nrobjects;
+};
+
+static __thread struct cdfs_slab_cache_struct slab_caches[CDFS_SLAB_MAX_TYPES];
+
+static pthread_key_t slab_caches_key;
+static pthread_once_t slab_caches_once=PTHREAD_ONCE_INIT;
+
+// list of slabs, for the statistics
+
+static struct cdfs_slab_struct *list_slabs=NULL;
+static pthread_mutex_t list_slabs_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+
+#define SLAB_HEADER(object) ((struct cdfs_slab_header_struct *) (object) - 1)
+#define SLAB_OBJECT(header) ((void *) ((struct cdfs_slab_header_struct *) (header) + 1))
+
+
+void register_cdfs_slab(struct cdfs_slab_struct *slab)
+{
+
+    pthread_mutex_lock(&list_slabs_mutex);
+
+    slab->next=list_slabs;
+    list_slabs=slab;
+
+    pthread_mutex_unlock(&list_slabs_mutex);
+
+}
+
+//
+// return objects to the OS, with the destructor
+//
+
+static void release_slab_objects(struct cdfs_slab_struct *slab, struct cdfs_slab_header_struct *header)
+{
+    struct cdfs_slab_header_struct *next;
+
+    while (header) {
+
+	next=header->next;
+
+	if ( slab->destructor ) slab->destructor(SLAB_OBJECT(header));
+	free(header);
+
+	__atomic_add_fetch(&slab->released, 1, __ATOMIC_RELAXED);
+
+	header=next;
+
+    }
+
+}
+
+//
+// move objects of a thread cache to the depot, leaving keep objects in the cache
+// what is above the highwater of the depot is returned to the OS
+//
+
+static void flush_slab_cache(struct cdfs_slab_cache_struct *slab_cache, unsigned int keep)
+{
+    struct cdfs_slab_struct *slab=slab_cache->slab;
+    struct cdfs_slab_header_struct *header, *release=NULL;
+
+    pthread_mutex_lock(&slab->mutex);
+
+    while ( slab_cache->nrobjects > keep ) {
+
+	header=slab_cache->objects;
+	slab_cache->objects=header->next;
+	slab_cache->nrobjects--;
+
+	if ( slab->nrdepot < slab->highwater ) {
+
+	    header->next=(struct cdfs_slab_header_struct *) slab->depot;
+	    slab->depot=(void *) header;
+	    slab->nrdepot++;
+
+	} else {
+
+	    header->next=release;
+	    release=header;
+
+	}
+
+    }
+
+    pthread_mutex_unlock(&slab->mutex);
+
+    release_slab_objects(slab, release);
+
+}
+
+//
+// the thread exits: all it's cached objects go to the depots
+//
+
+static void flush_slab_caches(void *data)
+{
+    struct cdfs_slab_cache_struct *slab_caches_thread=(struct cdfs_slab_cache_struct *) data;
+    unsigned int i;
+
+    for (i=0; i<CDFS_SLAB_MAX_TYPES; i++) {
+
+	if ( slab_caches_thread[i].slab && slab_caches_thread[i].nrobjects>0 ) flush_slab_cache(&slab_caches_thread[i], 0);
+
+    }
+
+}
+
+static void create_slab_caches_key()
+{
+
+    pthread_key_create(&slab_caches_key, flush_slab_caches);
+
+}
+
+//
+// the cache of this thread for a slab, NULL when all the entries are in use (then the depot is used)
+//
+
+static struct cdfs_slab_cache_struct *get_slab_cache(struct cdfs_slab_struct *slab)
+{
+    unsigned int i;
+
+    for (i=0; i<CDFS_SLAB_MAX_TYPES; i++) {
+
+	if ( slab_caches[i].slab==slab ) return &slab_caches[i];
+
+	if ( ! slab_caches[i].slab ) {
+
+	    // first time this thread uses this slab: make sure the cache is flushed when the thread exits
+
+	    pthread_once(&slab_caches_once, create_slab_caches_key);
+
+	    if ( ! pthread_getspecific(slab_caches_key) ) pthread_setspecific(slab_caches_key, (void *) slab_caches);
+
+	    slab_caches[i].slab=slab;
+	    slab_caches[i].objects=NULL;
+	    slab_caches[i].nrobjects=0;
+
+	    return &slab_caches[i];
+
+	}
+
+    }
+
+    return NULL;
+
+}
+
+static void count_slab_object_inuse(struct cdfs_slab_struct *slab)
+{
+    unsigned long inuse, peak;
+
+    inuse=__atomic_add_fetch(&slab->inuse, 1, __ATOMIC_RELAXED);
+    peak=__atomic_load_n(&slab->peak, __ATOMIC_RELAXED);
+
+    while ( inuse > peak ) {
+
+	if ( __atomic_compare_exchange_n(&slab->peak, &peak, inuse, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) break;
+
+    }
+
+}
+
+//
+// get an object, from the cache of this thread, the depot, or else create a new one
+//
+
+void *get_slab_object(struct cdfs_slab_struct *slab)
+{
+    struct cdfs_slab_cache_struct *slab_cache=get_slab_cache(slab);
+    struct cdfs_slab_header_struct *header=NULL;
+
+    if ( slab_cache && slab_cache->nrobjects==0 ) {
+
+	// refill the cache with a batch from the depot
+
+	pthread_mutex_lock(&slab->mutex);
+
+	while ( slab->depot && slab_cache->nrobjects < CDFS_SLAB_CACHE_SIZE / 2 ) {
+
+	    header=(struct cdfs_slab_header_struct *) slab->depot;
+	    slab->depot=(void *) header->next;
+	    slab->nrdepot--;
+
+	    header->next=slab_cache->objects;
+	    slab_cache->objects=header;
+	    slab_cache->nrobjects++;
+
+	}
+
+	pthread_mutex_unlock(&slab->mutex);
+
+    }
+
+    if ( slab_cache && slab_cache->nrobjects>0 ) {
+
+	header=slab_cache->objects;
+	slab_cache->objects=header->next;
+	slab_cache->nrobjects--;
+
+    } else if ( ! slab_cache ) {
+
+	pthread_mutex_lock(&slab->mutex);
+
+	header=(struct cdfs_slab_header_struct *) slab->depot;
+
+	if ( header ) {
+
+	    slab->depot=(void *) header->next;
+	    slab->nrdepot--;
+
+	}
+
+	pthread_mutex_unlock(&slab->mutex);
+
+    } else {
+
+	header=NULL;
+
+    }
+
+    if ( ! header ) {
+
+	// nothing free: create a new one
+
+	header=malloc(sizeof(struct cdfs_slab_header_struct) + slab->size);
+	if ( ! header ) return NULL;
+
+	if ( slab->constructor ) slab->constructor(SLAB_OBJECT(header));
+
+	__atomic_add_fetch(&slab->created, 1, __ATOMIC_RELAXED);
+
+    }
+
+    header->next=NULL;
+
+    count_slab_object_inuse(slab);
+
+    return SLAB_OBJECT(header);
+
+}
+
+//
+// put an object back, it may be got again by any thread
+//
+
+void put_slab_object(struct cdfs_slab_struct *slab, void *object)
+{
+    struct cdfs_slab_cache_struct *slab_cache=get_slab_cache(slab);
+    struct cdfs_slab_header_struct *header=SLAB_HEADER(object);
+
+    __atomic_sub_fetch(&slab->inuse, 1, __ATOMIC_RELAXED);
+
+    if ( slab_cache ) {
+
+	header->next=slab_cache->objects;
+	slab_cache->objects=header;
+	slab_cache->nrobjects++;
+
+	// full: half of it to the depot
+
+	if ( slab_cache->nrobjects >= CDFS_SLAB_CACHE_SIZE ) flush_slab_cache(slab_cache, CDFS_SLAB_CACHE_SIZE / 2);
+
+    } else {
+
+	pthread_mutex_lock(&slab->mutex);
+
+	if ( slab->nrdepot < slab->highwater ) {
+
+	    header->next=(struct cdfs_slab_header_struct *) slab->depot;
+	    slab->depot=(void *) header;
+	    slab->nrdepot++;
+
+	    header=NULL;
+
+	}
+
+	pthread_mutex_unlock(&slab->mutex);
+
+	if ( header ) {
+
+	    header->next=NULL;
+	    release_slab_objects(slab, header);
+
+	}
+
+    }
+
+}
+
+//
+// statistics of all slabs in a string like:
+// read_call:inuse=2,peak=40,depot=16,cached=8,created=56,released=0 read_command:...
+// cached is what's in the caches of the threads
+//
+
+int get_slab_stats(char *buffer, size_t size)
+{
+    struct cdfs_slab_struct *slab;
+    unsigned long inuse, created, released, nrdepot, cached;
+    int len=0;
+
+    pthread_mutex_lock(&list_slabs_mutex);
+
+    slab=list_slabs;
+
+    while ( slab && len < size ) {
+
+	pthread_mutex_lock(&slab->mutex);
+	nrdepot=slab->nrdepot;
+	pthread_mutex_unlock(&slab->mutex);
+
+	inuse=__atomic_load_n(&slab->inuse, __ATOMIC_RELAXED);
+	created=__atomic_load_n(&slab->created, __ATOMIC_RELAXED);
+	released=__atomic_load_n(&slab->released, __ATOMIC_RELAXED);
+
+	cached=( created - released > inuse + nrdepot ) ? created - released - inuse - nrdepot : 0;
+
+	len+=snprintf(buffer+len, size-len, "%s%s:inuse=%lu,peak=%lu,depot=%lu,cached=%lu,created=%lu,released=%lu", ( slab==list_slabs ) ? "" : " ", slab->name,
+			inuse, __atomic_load_n(&slab->peak, __ATOMIC_RELAXED), nrdepot, cached, created, released);
+
+	slab=slab->next;
+
+    }
+
+    pthread_mutex_unlock(&list_slabs_mutex);
+
+    return len;
+
+}
@@ -0,0 +1,57 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+#ifndef CDFS_SLAB_H
+#define CDFS_SLAB_H
+
+/* a slab for objects of one type */
+/* free objects are kept in a cache per thread, and when that's full in the depot of the slab */
+/* when the depot has more than highwater objects the rest is returned to the OS */
+/* constructor is called once when an object is created, destructor when it's returned to the OS */
+/* so the mutexes and conds in it are initialized once, not every time the object is used */
+
+struct cdfs_slab_struct {
+    const char *name;
+    size_t size;
+    unsigned int highwater;
+    void (*constructor) (void *object);
+    void (*destructor) (void *object);
+    pthread_mutex_t mutex;
+    void *depot;
+    unsigned int nrdepot;
+    unsigned long inuse;
+    unsigned long peak;
+    unsigned long created;
+    unsigned long released;
+    struct cdfs_slab_struct *next;
+};
+
+#define CDFS_SLAB_INIT(NAME, TYPE, HIGHWATER, CONSTRUCTOR, DESTRUCTOR) { NAME, sizeof(TYPE), HIGHWATER, CONSTRUCTOR, DESTRUCTOR, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, NULL }
+
+
+// Prototypes
+
+void register_cdfs_slab(struct cdfs_slab_struct *slab);
+
+void *get_slab_object(struct cdfs_slab_struct *slab);
+void put_slab_object(struct cdfs_slab_struct *slab, void *object);
+
+int get_slab_stats(char *buffer, size_t size);
+
+#endif
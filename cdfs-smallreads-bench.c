@@ -0,0 +1,321 @@
+/*
+
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+//
+// benchmark of the request path of a mounted fuse-cdfs with many small requests:
+// every op is a getattr (statx forced to the filesystem) and a read of 4 Kb (O_DIRECT, so it's not
+// served by the page cache) at a random offset of a track
+//
+// next to the latency per op it shows what the daemon did for it: the cpu time and the context
+// switches of all it's threads per op
+// there is no count of syscalls: syscr+syscw of /proc/PID/io are only the read and write calls, and
+// the requests over io_uring make none, the cpu time includes the io_uring workers (tasks of the daemon)
+// run it against a mount with and a mount without -o iouring=1 to compare the transports
+//
+// use a track which is not completely cached, complete tracks are read by the kernel itself (passthrough)
+//
+// build with "make cdfs-smallreads-bench", run as: cdfs-smallreads-bench FILE [nrthreads] [nrops per thread] [pid of fuse-cdfs]
+// without pid it's read from $TMPDIR/fuse-cdfs.pid
+//
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_THREADS		4
+#define BENCH_DEFAULT_OPS		10000
+#define BENCH_READSIZE			4096
+
+struct bench_result_struct {
+    unsigned int index;
+    unsigned long total;
+    unsigned long max;
+    unsigned long errors;
+};
+
+struct bench_daemon_counters_struct {
+    unsigned long cputime;
+    unsigned long ctxswitches;
+};
+
+const char *path=NULL;
+off_t filesize=0;
+
+unsigned int nrthreads=BENCH_DEFAULT_THREADS;
+unsigned int nrops=BENCH_DEFAULT_OPS;
+
+
+static unsigned long get_nanoseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+
+}
+
+static pid_t read_daemon_pid()
+{
+    char pidpath[256], buf[20];
+    char *tmpchar=getenv("TMPDIR");
+    FILE *fp;
+    pid_t pid=0;
+
+    if ( ! tmpchar ) return 0;
+
+    snprintf(pidpath, sizeof(pidpath), "%s/fuse-cdfs.pid", tmpchar);
+
+    fp=fopen(pidpath, "r");
+
+    if ( fp ) {
+
+	if ( fgets(buf, sizeof(buf), fp) ) pid=atoi(buf);
+	fclose(fp);
+
+    }
+
+    return pid;
+
+}
+
+//
+// the counters of the daemon: the cpu time (nanoseconds, first field of schedstat) and the context
+// switches (in status) are per task, so these are added for every task
+// a task which ended in between is not counted
+//
+
+static int read_daemon_counters(pid_t pid, struct bench_daemon_counters_struct *counters)
+{
+    char procpath[512], line[256];
+    unsigned long value;
+    struct dirent *de;
+    DIR *dp;
+    FILE *fp;
+
+    counters->cputime=0;
+    counters->ctxswitches=0;
+
+    snprintf(procpath, sizeof(procpath), "/proc/%i/task", (int) pid);
+
+    dp=opendir(procpath);
+    if ( ! dp ) return -errno;
+
+    while ( (de=readdir(dp)) ) {
+
+	if ( de->d_name[0]=='.' ) continue;
+
+	snprintf(procpath, sizeof(procpath), "/proc/%i/task/%s/schedstat", (int) pid, de->d_name);
+
+	fp=fopen(procpath, "r");
+
+	if ( fp ) {
+
+	    if ( fscanf(fp, "%lu", &value)==1 ) counters->cputime+=value;
+	    fclose(fp);
+
+	}
+
+	snprintf(procpath, sizeof(procpath), "/proc/%i/task/%s/status", (int) pid, de->d_name);
+
+	fp=fopen(procpath, "r");
+	if ( ! fp ) continue;
+
+	while ( fgets(line, sizeof(line), fp) ) {
+
+	    if ( sscanf(line, "voluntary_ctxt_switches: %lu", &value)==1 || sscanf(line, "nonvoluntary_ctxt_switches: %lu", &value)==1 ) counters->ctxswitches+=value;
+
+	}
+
+	fclose(fp);
+
+    }
+
+    closedir(dp);
+
+    return 0;
+
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_result_struct *result=(struct bench_result_struct *) arg;
+    unsigned int seed=result->index + 1;
+    unsigned long start, latency;
+    unsigned long nrblocks=filesize / BENCH_READSIZE;
+    struct statx stx;
+    void *buffer=NULL;
+    unsigned int i;
+    off_t offset;
+    int fd;
+
+    if ( posix_memalign(&buffer, BENCH_READSIZE, BENCH_READSIZE)!=0 ) {
+
+	result->errors=nrops;
+	return NULL;
+
+    }
+
+    fd=open(path, O_RDONLY | O_DIRECT);
+
+    if ( fd==-1 ) {
+
+	result->errors=nrops;
+	goto out;
+
+    }
+
+    for (i=0; i<nrops; i++) {
+
+	offset=(off_t) ( rand_r(&seed) % nrblocks ) * BENCH_READSIZE;
+
+	start=get_nanoseconds();
+
+	// force the getattr to go to the filesystem, the attributes are cached for attr_timeout
+
+	if ( statx(AT_FDCWD, path, AT_STATX_FORCE_SYNC, STATX_BASIC_STATS, &stx)==-1 ) result->errors++;
+	if ( pread(fd, buffer, BENCH_READSIZE, offset) < 0 ) result->errors++;
+
+	latency=get_nanoseconds() - start;
+
+	result->total+=latency;
+	if ( latency > result->max ) result->max=latency;
+
+    }
+
+    close(fd);
+
+    out:
+
+    free(buffer);
+
+    return NULL;
+
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_daemon_counters_struct before, after;
+    struct bench_result_struct *results=NULL;
+    pthread_t *threads=NULL;
+    unsigned long start, elapsed, total=0, max=0, errors=0, nrtotal;
+    unsigned int i;
+    struct stat st;
+    pid_t pid=0;
+    int res;
+
+    if ( argc>1 ) path=argv[1];
+    if ( argc>2 ) nrthreads=atoi(argv[2]);
+    if ( argc>3 ) nrops=atoi(argv[3]);
+    if ( argc>4 ) pid=atoi(argv[4]);
+
+    if ( ! path || nrthreads==0 || nrops==0 ) {
+
+	fprintf(stderr, "usage: %s FILE [nrthreads] [nrops per thread] [pid of fuse-cdfs]\n", argv[0]);
+	return 1;
+
+    }
+
+    if ( stat(path, &st)==-1 || st.st_size < BENCH_READSIZE ) {
+
+	fprintf(stderr, "cannot use %s (too small or error %i)\n", path, errno);
+	return 1;
+
+    }
+
+    filesize=st.st_size;
+
+    if ( pid==0 ) pid=read_daemon_pid();
+
+    if ( pid==0 ) {
+
+	fprintf(stderr, "no pid of fuse-cdfs: give it as argument or set TMPDIR\n");
+	return 1;
+
+    }
+
+    threads=calloc(nrthreads, sizeof(pthread_t));
+    results=calloc(nrthreads, sizeof(struct bench_result_struct));
+
+    if ( ! threads || ! results ) {
+
+	fprintf(stderr, "cannot allocate %u threads\n", nrthreads);
+	return 1;
+
+    }
+
+    res=read_daemon_counters(pid, &before);
+
+    if ( res<0 ) {
+
+	fprintf(stderr, "cannot read the counters of pid %i (error %i)\n", (int) pid, -res);
+	return 1;
+
+    }
+
+    start=get_nanoseconds();
+
+    for (i=0; i<nrthreads; i++) {
+
+	results[i].index=i;
+	pthread_create(&threads[i], NULL, bench_thread, (void *) &results[i]);
+
+    }
+
+    for (i=0; i<nrthreads; i++) pthread_join(threads[i], NULL);
+
+    elapsed=get_nanoseconds() - start;
+
+    read_daemon_counters(pid, &after);
+
+    for (i=0; i<nrthreads; i++) {
+
+	total+=results[i].total;
+	errors+=results[i].errors;
+	if ( results[i].max > max ) max=results[i].max;
+
+    }
+
+    nrtotal=(unsigned long) nrthreads * nrops;
+
+    printf("threads=%u ops=%lu (getattr + %i bytes read) errors=%lu\n", nrthreads, nrtotal, BENCH_READSIZE, errors);
+    printf("latency avg=%luns max=%luns throughput=%lu ops/s\n", total / nrtotal, max,
+		( elapsed>0 ) ? (unsigned long) ( (double) nrtotal * 1000000000.0 / elapsed ) : 0);
+    printf("daemon cputime/op=%luns ctxswitches/op=%.2f\n",
+		( after.cputime > before.cputime ) ? ( after.cputime - before.cputime ) / nrtotal : 0,
+		(double) ( after.ctxswitches - before.ctxswitches ) / nrtotal);
+
+    free(threads);
+    free(results);
+
+    return 0;
+
+}
@@ -41,13 +41,23 @@
 
 #include <sqlite3.h>
 
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
+#endif
 
 #include "logging.h"
 #include "cdfs.h"
 
 #include "entry-management.h"
 #include "cdfs-xattr.h"
+#include "cdfs-cdromutils.h"
+#include "cdfs-cache.h"
+#include "cdfs-slab.h"
+#include "fuse-loop-epoll-mt.h"
+#include "cdfs-cache-io.h"
+#include "cdfs-ramcache.h"
 
 
 extern struct cdfs_options_struct cdfs_options;
@@ -126,6 +136,120 @@ int setxattr4workspace(struct cdfs_entry_struct *entry, const char *name, const
 
 	    }
 
+	} else if ( strcmp(name, "cancelreadahead")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    if ( nvalue==0 || nvalue==1 ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.cancelreadahead=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
+	} else if ( strcmp(name, "readaheadmax")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    if ( nvalue>=CDFS_READAHEAD_MIN_SECTORS ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.readaheadmax=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
+	} else if ( strcmp(name, "memorybudget")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    // at least one batch of the cdromreader
+
+	    if ( nvalue>=CDFS_SECTOR_SLOT_SECTORS * CDIO_CD_FRAMESIZE_RAW ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.memorybudget=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
+	} else if ( strcmp(name, "servefrombuffer")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    if ( nvalue==0 || nvalue==1 ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.servefrombuffer=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
+	} else if ( strcmp(name, "notifystore")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    if ( nvalue==0 || nvalue==1 ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.notifystore=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
+	} else if ( strcmp(name, "notifystoremax")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    if ( nvalue>0 ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.notifystoremax=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
+	} else if ( strcmp(name, "cachesync")==0 ) {
+
+	    nvalue=atoi(value);
+
+	    if ( nvalue>=CDFS_CACHE_SYNC_NONE && nvalue<=CDFS_CACHE_SYNC_TRACK ) {
+
+		logoutput1("setxattr: value found %i", nvalue);
+                nreturn=0;
+		cdfs_options.cachesync=nvalue;
+
+	    } else {
+
+		nreturn=-EINVAL;
+
+	    }
+
 	}
 
     }
@@ -257,8 +381,206 @@ void getxattr4workspace(struct cdfs_entry_struct *entry, const char *name, struc
 
 	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.readaheadpolicy);
 
+	} else if ( strcmp(name, "sectors_coalesced")==0 ) {
+	    char statsstring[32];
+
+            logoutput2("getxattr4workspace, found: sectors_coalesced");
+
+	    xattr_workspace->nerror=0;
+
+	    snprintf(statsstring, sizeof(statsstring), "%lu", get_sectors_coalesced());
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "readqueues")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: readqueues");
+
+	    xattr_workspace->nerror=0;
+
+	    get_read_class_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "cancelreadahead")==0 ) {
+
+            logoutput2("getxattr4workspace, found: cancelreadahead");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.cancelreadahead);
+
+	} else if ( strcmp(name, "seeklatency")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: seeklatency");
+
+	    xattr_workspace->nerror=0;
+
+	    get_seek_latency_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "readaheadmax")==0 ) {
+
+            logoutput2("getxattr4workspace, found: readaheadmax");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.readaheadmax);
+
+	} else if ( strcmp(name, "slabs")==0 ) {
+	    char statsstring[512];
+
+            logoutput2("getxattr4workspace, found: slabs");
+
+	    xattr_workspace->nerror=0;
+
+	    get_slab_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "memorybudget")==0 ) {
+
+            logoutput2("getxattr4workspace, found: memorybudget");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.memorybudget);
+
+	} else if ( strcmp(name, "bytesinflight")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: bytesinflight");
+
+	    xattr_workspace->nerror=0;
+
+	    get_memory_budget_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "servefrombuffer")==0 ) {
+
+            logoutput2("getxattr4workspace, found: servefrombuffer");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.servefrombuffer);
+
+	} else if ( strcmp(name, "misslatency")==0 ) {
+	    char statsstring[512];
+
+            logoutput2("getxattr4workspace, found: misslatency");
+
+	    xattr_workspace->nerror=0;
+
+	    get_miss_latency_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "notifystore")==0 ) {
+
+            logoutput2("getxattr4workspace, found: notifystore");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.notifystore);
+
+	} else if ( strcmp(name, "notifystoremax")==0 ) {
+
+            logoutput2("getxattr4workspace, found: notifystoremax");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.notifystoremax);
+
+	} else if ( strcmp(name, "notifystored")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: notifystored");
+
+	    xattr_workspace->nerror=0;
+
+	    get_notify_store_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "workers")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: workers");
+
+	    xattr_workspace->nerror=0;
+
+	    get_fuse_loop_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "cachesync")==0 ) {
+
+            logoutput2("getxattr4workspace, found: cachesync");
+
+	    xattr_workspace->nerror=0;
+
+	    fill_in_simpleinteger(xattr_workspace, (int) cdfs_options.cachesync);
+
+	} else if ( strcmp(name, "cachewrites")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: cachewrites");
+
+	    xattr_workspace->nerror=0;
+
+	    get_cache_io_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "ramcache")==0 ) {
+	    char statsstring[512];
+
+            logoutput2("getxattr4workspace, found: ramcache");
+
+	    xattr_workspace->nerror=0;
+
+	    get_ram_cache_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "sqlite")==0 ) {
+	    char statsstring[256];
+
+            logoutput2("getxattr4workspace, found: sqlite");
+
+	    xattr_workspace->nerror=0;
+
+	    get_sqlite_stats(statsstring, sizeof(statsstring));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
 	} 
 
+    } else if ( entry->data ) {
+	struct caching_data_struct *caching_data=(struct caching_data_struct *) entry->data;
+
+	// the readahead state of the open file (stream) which read the track last:
+	// it's window and the hit ratio of it's reads
+
+	if ( strcmp(name, "readahead")==0 ) {
+	    char statsstring[256];
+	    unsigned long stream=__atomic_load_n(&caching_data->readaheadstream, __ATOMIC_RELAXED);
+	    unsigned long hits=__atomic_load_n(&caching_data->readaheadhits, __ATOMIC_RELAXED);
+	    unsigned long misses=__atomic_load_n(&caching_data->readaheadmisses, __ATOMIC_RELAXED);
+
+            logoutput2("getxattr4workspace, found: readahead");
+
+	    xattr_workspace->nerror=0;
+
+	    snprintf(statsstring, sizeof(statsstring), "stream=%lu window=%u hits=%lu misses=%lu hitratio=%lu%%", stream, caching_data->readaheadwindow, hits, misses, ( hits + misses > 0 ) ? ( 100 * hits ) / ( hits + misses ) : 0);
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	} else if ( strcmp(name, "cachelayout")==0 ) {
+	    char statsstring[128];
+
+            logoutput2("getxattr4workspace, found: cachelayout");
+
+	    xattr_workspace->nerror=0;
+
+	    snprintf(statsstring, sizeof(statsstring), "layout=%i dataoffset=%"PRIu64" direct=%i mapped=%i mapreads=%lu mapfaults=%lu", caching_data->layout, (uint64_t) caching_data->dataoffset, caching_data->direct,
+			( __atomic_load_n(&caching_data->map, __ATOMIC_RELAXED) ) ? 1 : 0, caching_data->mapreads, __atomic_load_n(&caching_data->mapfaults, __ATOMIC_RELAXED));
+	    fill_in_simplestring(xattr_workspace, statsstring);
+
+	}
+
     }
 
 
@@ -391,6 +713,166 @@ int listxattr4workspace(struct cdfs_entry_struct *entry, char *list, size_t size
 	nlenlist=add_xattr_to_list(xattr_workspace, list);
 	if ( size > 0 && nlenlist > size ) goto out;
 
+	// sectors not read twice from the cd because read commands are coalesced
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_sectors_coalesced", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// depth and wait times of the queues of read commands per class
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_readqueues", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// cancel readahead of a stream when it seeks away
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_cancelreadahead", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// latency of the first read after a seek
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_seeklatency", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// max of the readahead window of a stream
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_readaheadmax", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// objects in use and free per slab
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_slabs", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// budget of bytes read from the cd and not yet in the cache
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_memorybudget", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// bytes read from the cd and not yet in the cache, now and at most
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_bytesinflight", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// reply waiting reads from the sectors read before they are in the cache file
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_servefrombuffer", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// histograms of the latency of cache misses, replied from buffer and from the cache file
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_misslatency", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// push readahead of open tracks in the page cache of the kernel, and how far ahead
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_notifystore", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_notifystoremax", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// what is pushed in the page cache
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_notifystored", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// the pool of workers processing the fuse requests and it's queue
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_workers", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// when the cache files are made durable (0 never, 1 every write, 2 when a track is complete)
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_cachesync", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// the writes to the cache files: how many, per second, and bytes per write
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_cachewrites", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// the sectors in ram: size, limit (lowered under memory pressure), hits and evictions
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_ramcache", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// the intervals committed to the sqlite db: commits, intervals, errors and checkpoints
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_sqlite", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+    } else if ( entry->data ) {
+
+	// readahead window and hit ratio of the track
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_readahead", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
+	// the layout of the cache file of the track, O_DIRECT or not, and mapped or not
+
+	memset(xattr_workspace->name, '\0', LINE_MAXLEN);
+	snprintf(xattr_workspace->name, LINE_MAXLEN, "system.%s_cachelayout", XATTR_SYSTEM_NAME);
+
+	nlenlist=add_xattr_to_list(xattr_workspace, list);
+	if ( size > 0 && nlenlist > size ) goto out;
+
     }
 
     memset(xattr_workspace->name, '\0', LINE_MAXLEN);
@@ -69,6 +69,8 @@
 #include "cdfs-xattr.h"
 #include "cdfs-cache.h"
 #include "cdfs-cdromutils.h"
+#include "cdfs-slab.h"
+#include "cdfs-cache-io.h"
 
 
 
@@ -92,6 +94,28 @@ struct fuse_opt cdfs_help_options[] = {
      CDFS_OPT("discid=%s",		        discid, 0),
      CDFS_OPT("--readaheadpolicy=%s",		readaheadpolicy, 0),
      CDFS_OPT("readaheadpolicy=%s",		readaheadpolicy, 0),
+     CDFS_OPT("--notifystore=%i",		notifystore, 0),
+     CDFS_OPT("notifystore=%i",			notifystore, 0),
+     CDFS_OPT("--iouring=%i",			iouring, 0),
+     CDFS_OPT("iouring=%i",			iouring, 0),
+     CDFS_OPT("--minworkers=%i",		minworkers, 0),
+     CDFS_OPT("minworkers=%i",			minworkers, 0),
+     CDFS_OPT("--maxworkers=%i",		maxworkers, 0),
+     CDFS_OPT("maxworkers=%i",			maxworkers, 0),
+     CDFS_OPT("--cachesync=%s",			cachesync, 0),
+     CDFS_OPT("cachesync=%s",			cachesync, 0),
+     CDFS_OPT("--cachelayout=%i",		cachelayout, 0),
+     CDFS_OPT("cachelayout=%i",			cachelayout, 0),
+     CDFS_OPT("--cachedirect=%i",		cachedirect, 0),
+     CDFS_OPT("cachedirect=%i",			cachedirect, 0),
+     CDFS_OPT("--ramcache=%i",			ramcache, 0),
+     CDFS_OPT("ramcache=%i",			ramcache, 0),
+     CDFS_OPT("--diskless=%i",			diskless, 0),
+     CDFS_OPT("diskless=%i",			diskless, 0),
+     CDFS_OPT("--cachemmap=%i",			cachemmap, 0),
+     CDFS_OPT("cachemmap=%i",			cachemmap, 0),
+     CDFS_OPT("--memorybudget=%i",		memorybudget, 0),
+     CDFS_OPT("memorybudget=%i",		memorybudget, 0),
      FUSE_OPT_KEY("-V",            		KEY_VERSION),
      FUSE_OPT_KEY("--version",      		KEY_VERSION),
      FUSE_OPT_KEY("-h",             		KEY_HELP),
@@ -101,7 +125,10 @@ struct fuse_opt cdfs_help_options[] = {
 
 struct cdfs_device_struct cdfs_device;
 
-static struct fuse_chan *cdfs_chan;
+#ifndef CDFS_FUSE3
+struct fuse_chan *cdfs_chan;
+#endif
+struct fuse_session *cdfs_session;
 struct cdfs_entry_struct *root_entry;
 
 unsigned long long inoctr = FUSE_ROOT_ID;
@@ -215,7 +242,11 @@ static void cdfs_lookup(fuse_req_t req, fuse_ino_t parentino, const char *name)
 }
 
 
+#ifdef CDFS_FUSE3
+static void cdfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+#else
 static void cdfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+#endif
 {
     struct cdfs_inode_struct *inode;
 
@@ -403,6 +434,41 @@ static inline struct cdfs_generic_dirp_struct *get_dirp(struct fuse_file_info *f
     return (struct cdfs_generic_dirp_struct *) (uintptr_t) fi->fh;
 }
 
+static inline struct cdfs_generic_fh_struct *get_generic_fh(struct fuse_file_info *fi)
+{
+    return (struct cdfs_generic_fh_struct *) (uintptr_t) fi->fh;
+}
+
+//
+// the streams of open files, from a slab: the mutex is initialized once
+//
+
+static void construct_read_stream(void *object)
+{
+    struct read_stream_struct *stream=(struct read_stream_struct *) object;
+
+    pthread_mutex_init(&(stream->mutex), NULL);
+
+}
+
+static void destruct_read_stream(void *object)
+{
+    struct read_stream_struct *stream=(struct read_stream_struct *) object;
+
+    pthread_mutex_destroy(&(stream->mutex));
+
+}
+
+// the id of the streams, the readahead commands are tagged with it
+
+static unsigned long read_stream_ids=0;
+
+// serializes the first opens of the tracks: only one creates the caching data of a track
+
+static pthread_mutex_t create_caching_data_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+struct cdfs_slab_struct read_streams_slab=CDFS_SLAB_INIT("read_stream", struct read_stream_struct, CDFS_SLAB_HIGHWATER, construct_read_stream, destruct_read_stream);
+
 static void free_dirp(struct cdfs_generic_dirp_struct *dirp)
 {
 
@@ -744,6 +810,8 @@ static void cdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
     int tracknr;
     struct caching_data_struct *caching_data=NULL;
     struct track_info_struct *track_info;
+    struct cdfs_generic_fh_struct *generic_fh=NULL;
+    struct read_stream_struct *stream=NULL;
 
     logoutput0("OPEN");
 
@@ -796,18 +864,32 @@ static void cdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
     // check and/or create the file in the cache
     // get an fd of this file
     // write the header to this file
-    // and create a initial cached_block for this
+    // and create the residency bitmap for this
 
-    caching_data = ( struct caching_data_struct *) entry->data;
+    caching_data = ( struct caching_data_struct *) __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE);
 
     if ( ! caching_data ) {
 
 	// not found: probably the first time here
+	// another open of the same track can be here at the same time: the one holding the mutex creates it,
+	// the other one finds it when it gets the mutex
+
+	pthread_mutex_lock(&create_caching_data_mutex);
+
+	caching_data = ( struct caching_data_struct *) entry->data;
 
-	caching_data=create_caching_data();
+	if ( caching_data ) {
+
+	    pthread_mutex_unlock(&create_caching_data_mutex);
+	    goto openfile;
+
+	}
+
+	caching_data=create_caching_data(tracknr);
 
 	if ( ! caching_data ) {
 
+	    pthread_mutex_unlock(&create_caching_data_mutex);
 	    nreturn=-ENOMEM;
 	    goto out;
 
@@ -817,9 +899,8 @@ static void cdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 
 	snprintf(caching_data->path, PATH_MAX, "%s/%s", cdfs_options.cache_directory, entry->name);
 
-	entry->data=(void *) caching_data;
-
-        caching_data->tracknr=tracknr;
+	// the entry gets it when it's set up completely, on error it's freed:
+	// the next open tries again
 
         track_info = (struct track_info_struct *) (cdfs_device.track_info + ( tracknr - 1 ) * sizeof(struct track_info_struct));
 
@@ -828,6 +909,31 @@ static void cdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	caching_data->startsector=track_info->firstsector_lsn;
 	caching_data->endsector=track_info->lastsector;
 
+	// the wav header in memory, for the reads not from a file with it
+
+	write_wavheader(caching_data->header, caching_data->size);
+
+        nreturn=create_cache_bitmap(caching_data);
+
+        if ( nreturn<0 ) {
+
+	    free_caching_data(caching_data);
+	    pthread_mutex_unlock(&create_caching_data_mutex);
+	    goto out;
+
+	}
+
+	if ( cdfs_options.diskless==1 ) {
+
+	    // no cache file: the sectors are in ram only
+
+	    caching_data->sizeheader=0;
+	    caching_data->fd=-1;
+
+	    goto publish;
+
+	}
+
 
         nreturn=create_cache_file(caching_data, entry->name);
 
@@ -835,6 +941,8 @@ static void cdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 
             /* possible error creating file in cache */
 
+	    free_caching_data(caching_data);
+	    pthread_mutex_unlock(&create_caching_data_mutex);
             goto out;
 
         } else if ( nreturn==0 ) {
@@ -852,46 +960,134 @@ static void cdfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 
             //
             // file created, did not exist... 
-	    // the first block should be the header
+	    // the first block should be the header (layout 1) or the page describing the file (layout 2)
 	    //
 
-	    char *header=malloc(SIZE_RIFFHEADER);
+	    res=write_cache_file_header(caching_data);
 
-	    if ( header ) {
+	    if ( res<0 ) {
 
-	        write_wavheader(header, caching_data->size);
+		nreturn=res;
+		free_caching_data(caching_data);
+		pthread_mutex_unlock(&create_caching_data_mutex);
+		goto out;
 
-	        res=write_to_cached_file(caching_data, header, 0, SIZE_RIFFHEADER);
+	    }
 
-	        if ( res<0 ) {
+            res=remove_all_intervals_sqlite(tracknr);
 
-		    nreturn=res;
-		    goto out;
+        }
 
-	        }
+	publish:
 
-            }
+	// set up completely: the entry gets it
 
-            res=remove_all_intervals_sqlite(tracknr);
+	__atomic_store_n(&entry->data, (void *) caching_data, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&create_caching_data_mutex);
 
-        }
+    }
+
+    openfile:
+
+    if ( cdfs_options.diskless==1 ) {
+
+	fd=-1;
+
+    } else {
+
+	fd=open(caching_data->path, O_RDONLY | ( ( caching_data->direct==1 ) ? O_DIRECT : 0 ));
+
+	if ( fd==-1 ) {
+
+	    nreturn=-errno;
+	    goto out;
+
+	}
 
     }
 
-    fd=open(caching_data->path, O_RDONLY);
+    // the file handle keeps the fd of the cached file and the stream of reads
+
+    generic_fh=malloc(sizeof(struct cdfs_generic_fh_struct));
+    stream=(struct read_stream_struct *) get_slab_object(&read_streams_slab);
 
-    if ( fd==-1 ) {
+    if ( ! generic_fh || ! stream ) {
 
-	nreturn=-errno;
+	if ( generic_fh ) free(generic_fh);
+	if ( stream ) put_slab_object(&read_streams_slab, (void *) stream);
+
+	if ( fd>=0 ) close(fd);
+
+	nreturn=-ENOMEM;
 	goto out;
 
     }
 
-
-    fi->fh=fd;
+    stream->id=__atomic_add_fetch(&read_stream_ids, 1, __ATOMIC_RELAXED);
+    stream->nextsector=0;
+    stream->started=0;
+    stream->rastart=0;
+    stream->rasize=0;
+    stream->background=0;
+    stream->rate=0;
+    stream->lastread.tv_sec=0;
+    stream->lastread.tv_nsec=0;
+    stream->hits=0;
+    stream->misses=0;
+
+    generic_fh->entry=entry;
+    generic_fh->fd=fd;
+    generic_fh->data=(void *) stream;
+
+    fi->fh=(uint64_t) (uintptr_t) generic_fh;
     fi->keep_cache=1;
     fi->nonseekable=0;
 
+    pthread_mutex_lock(&(caching_data->openmutex));
+
+#ifdef FUSE_CAP_PASSTHROUGH
+
+    // a complete track: the kernel reads the cached file itself (passthrough), the reads do not come here anymore
+    // when the kernel refuses (no CAP_SYS_ADMIN, the cache on a stacked fs) the reads come here as usual
+    // only with layout 1: the kernel reads at the same offsets as in the file of the track
+    //
+    // the kernel does not allow passthrough and cached opens of an inode at the same time (EIO), and
+    // all passthrough opens have to use the same backing file: the first open decides, the opens after it
+    // follow, till the last one is released (a track completed while open is passthrough after that)
+
+    if ( caching_data->nropen==0 && cdfs_options.passthrough==1 && fd>=0 && caching_data->ready==1 && caching_data->layout==CDFS_CACHE_LAYOUT_V1 ) {
+
+	res=fuse_passthrough_open(req, fd);
+
+	if ( res>0 ) {
+
+	    caching_data->backing_id=res;
+
+	    logoutput2("open: passthrough to cached file (backing id %i)", res);
+
+	} else {
+
+	    logoutput2("open: passthrough not possible (error %i)", res);
+
+	}
+
+    }
+
+    if ( caching_data->backing_id>0 ) fi->backing_id=caching_data->backing_id;
+
+#endif
+
+    // the track is open: the cache manager may push readahead of it in the page cache of the kernel
+
+    caching_data->ino=entry->inode->ino;
+    __atomic_add_fetch(&caching_data->nropen, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&(caching_data->openmutex));
+
+    // the first open maps the cache file, the reads are replied from the mapping
+
+    if ( cdfs_options.cachemmap==1 ) map_cache_file(caching_data);
+
     out:
 
     if (nreturn < 0) {
@@ -915,14 +1111,14 @@ static void cdfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
     struct cdfs_entry_struct *entry=NULL;
     struct cdfs_inode_struct *inode=NULL;
     struct caching_data_struct *caching_data=NULL;
-    struct cached_block_struct *cached_block=NULL;
     off_t off_exheader;
     size_t headerlen=0, size_exheader;
-    int startsector, endsector, tmpsector;
-    char *buffer=NULL;
-    unsigned char buffalloc=0, cachereadlock=0;
-    bool notfound;
+    unsigned int startsector, endsector, tmpsector, missingsector, cachedsector;
+    int senderror=0, nrsectorstoread=0;
     struct read_call_struct *read_call=NULL;
+    struct cdfs_generic_fh_struct *generic_fh=get_generic_fh(fi);
+    struct read_stream_struct *stream=NULL;
+    unsigned char discontiguous=0;
 
     if ( size>0 ) {
 
@@ -954,60 +1150,37 @@ static void cdfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 
     caching_data = ( struct caching_data_struct *) entry->data;
 
-    if ( ! caching_data ) {
+    if ( ! caching_data || ! generic_fh ) {
 
 	nreturn=-EIO;
 	goto out;
 
     }
 
-    buffer=malloc(size);
-
-    if ( ! buffer ) {
-
-	nreturn=-ENOMEM;
-	goto out;
-
-    }
-
-    buffalloc=1;
+    stream=(struct read_stream_struct *) generic_fh->data;
 
+    //
+    // the data is read from the cached file when replying (see below)
+    //
 
     if ( off + size < SIZE_RIFFHEADER ) {
 
 	// bytes requested totally from header
 	// this header is already present in the cache file
 
-	res=pread(fi->fh, buffer, size, off);
-
-	if ( res<0 ) {
-
-	    nreturn=-errno;
-
-	} else {
-
-	    nreturn=res;
-
-	}
-
+	logoutput2("read: only header requested");
 
-    } else if ( caching_data->ready==1 ) {
+    } else if ( caching_data->ready==1 && cdfs_options.diskless==0 ) {
 
         // every available in cache: there is no need to investigate and possibly
         // wait for sectors to become available ( and also not to read ahead)
+        // not diskless: the ram cache evicts sectors
 
-	res=pread(fi->fh, buffer, size, off);
+	logoutput2("read: everything in cache");
 
-	if ( res<0 ) {
-
-	    nreturn=-errno;
-
-	} else {
-
-	    nreturn=res;
-
-	}
+	// the pages ahead in the mapping: what the window of the last readahead was
 
+	if ( cdfs_options.cachemmap==1 && off >= SIZE_RIFFHEADER ) advise_cache_map(caching_data, get_sector_from_position(caching_data->tracknr, off + size - SIZE_RIFFHEADER), caching_data->readaheadwindow);
 
     } else {
 
@@ -1033,16 +1206,18 @@ static void cdfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 	// find out the start and end sector of the requested read 
 
 	startsector=get_sector_from_position(caching_data->tracknr, off_exheader);
-	endsector=get_sector_from_position(caching_data->tracknr, off_exheader + size_exheader);
+	endsector=get_sector_from_position(caching_data->tracknr, off_exheader + size_exheader - 1);
+
+        // a read past the last sector of the track is satisfied by the cache file
+        // as far as it goes, never try to read beyond the track
+
+        if ( endsector > caching_data->endsector ) endsector=caching_data->endsector;
 
         // look the sectors are in the cache
         // and what read_commands to send to the cdrom reader
 
 	logoutput2("read: looking for block from %i to %i", startsector, endsector);
 
-        notfound=true;
-        tmpsector=startsector;
-
         read_call=get_read_call();
 
         if ( ! read_call ) {
@@ -1056,330 +1231,223 @@ static void cdfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
         read_call->tracknr=caching_data->tracknr;
         read_call->startsector=startsector;
         read_call->endsector=endsector;
-        read_call->nrsectorstoread=0;
-        read_call->nrsectorsread=0;
         read_call->complete=0;
+        read_call->dispatched=0;
+        read_call->retries=0;
+        read_call->nerror=0;
 
-        read_call->nrsectorstoread=0;
+        // everything required to reply later, from another thread
 
-        pthread_mutex_init(&read_call->lockmutex, NULL);
-        pthread_cond_init(&read_call->lockcond, NULL);
+        read_call->req=req;
+        read_call->fd=generic_fh->fd;
+        read_call->size=size;
+        read_call->off=off;
+        read_call->caching_data=caching_data;
 
-        read_call->lock=0;
-        cached_block=NULL;
+        clock_gettime(CLOCK_MONOTONIC, &read_call->started);
 
-        //
-        // get a read lock on the cache blocks
-        //
+        // register as waiter for the sectors before looking in the cache:
+        // every result which comes in from now on is checked against this read call
 
-        nreturn=get_readlock_caching_data(caching_data);
-
-        if ( nreturn<0 ) {
-
-	    logoutput2("error!! not able to get read lock caching_data for track %i!! serious io error", read_call->tracknr);
-
-            // what to do here??? try again?
-
-        } else {
-
-            cachereadlock=(unsigned char) nreturn;
-
-        }
+        register_read_call(caching_data, read_call);
 
         //
-        // look in the cache if any of the required bytes is already there
+        // follow the stream of this handle: a read far from where the previous one ended
+        // is a seek, and the readahead queued for the old position is of no use anymore
         //
 
-        while (notfound) {
-
-
-            if ( cached_block) {
-
-                cached_block=cached_block->next;
-
-            } else {
-
-                // get the first cached block...
+        pthread_mutex_lock(&(stream->mutex));
 
-                cached_block=get_first_cached_block_internal(caching_data, startsector, endsector);
+        if ( stream->started==1 ) {
 
+            if ( startsector + CDFS_STREAM_SEEK_SECTORS < stream->nextsector || startsector > stream->nextsector + CDFS_STREAM_SEEK_SECTORS ) discontiguous=1;
 
-            }
-
-            //
-            // there are three cases: 
-            // a. no cached block found, send the reader request (tmpsector, endsector) to cdromreader
-            // b. there is a cached block found, it's startsector <= tmpsector
-            // c. there is a cached block found, it's startsector > tmpsector
-            //
-            // in case a ready and leave
-            //
-            //
-
-	    if ( ! cached_block ) {
-
-	        // no data found: send a command to the cdromreader 
-
-                read_call->nrsectorstoread += endsector - tmpsector + 1;
-
-                nreturn=send_read_command(read_call, caching_data, tmpsector, endsector, 0, 0);
-                if ( nreturn<0 ) goto out;
+        }
 
-                break;
+        if ( stream->started==0 || discontiguous==1 ) {
 
-            } else if ( cached_block->startsector<=tmpsector ) {
+            read_call->seek=1;
 
-                // a cached block found, with startsector left of the desired sector
-                // check the endsector
+        }
 
-                if ( cached_block->endsector >= endsector ) {
+        if ( discontiguous==1 ) {
 
-                    // (tmpsector,endsector) is in cache
+            logoutput2("read: seek from sector %i to %i", stream->nextsector, startsector);
 
-                    break;
+            if ( cdfs_options.cancelreadahead==1 ) cancel_readahead_stream(stream);
 
-                } else {
+            stream->nextsector=endsector+1;
 
-                    // check the next interval right of cached_block->endsector
+        } else if ( endsector+1 > stream->nextsector ) {
 
-                    tmpsector=cached_block->endsector+1;
-                    continue;
+            stream->nextsector=endsector+1;
 
-                }
+        }
 
-            } else {
+        stream->started=1;
 
-                // cached_block->startsector>tmpsector
+        pthread_mutex_unlock(&(stream->mutex));
 
-                if ( cached_block->startsector>endsector ) {
+        //
+        // look in the cache which sectors are missing, and send a read command for every run of them
+        // no lock required: the residency bitmap is read atomically
+        //
 
-                    // the cached block found doesn't offer anything
-                    // so the interval has to be read
+        tmpsector=startsector;
 
-                    read_call->nrsectorstoread += endsector - tmpsector + 1;
+        while ( tmpsector<=endsector ) {
 
-                    nreturn=send_read_command(read_call, caching_data, tmpsector, endsector, 0, 0);
-                    if ( nreturn<0 ) goto out;
+            missingsector=get_first_missing_sector(caching_data, tmpsector, endsector);
 
-	            break;
+            if ( missingsector>endsector ) break;
 
-                } else {
+            // the missing sectors run till the next sector in cache
 
-                    // cached_block->startsector<=endsector
+            cachedsector=get_first_cached_sector(caching_data, missingsector, endsector);
 
-                    // cached block does offer something, but left of still uncached
-                    // a read command is still required
+            res=send_read_command(read_call, stream, caching_data, missingsector, cachedsector-1, 0, 0);
 
-                    read_call->nrsectorstoread += cached_block->startsector - tmpsector;
+            if ( res<0 ) {
 
-                    nreturn=send_read_command(read_call, caching_data, tmpsector, cached_block->startsector-1, 0, 0);
-                    if ( nreturn<0 ) goto out;
+                senderror=res;
+                break;
 
-                    if ( cached_block->endsector<endsector ) {
+            }
 
-                        // right of cached block is still uncached
+            nrsectorstoread += cachedsector - missingsector;
 
-                        tmpsector=cached_block->endsector+1;
-                        continue;
+            tmpsector=cachedsector;
 
-                    }
+        }
 
-                    break;
 
-                }
+        // hit ratio: the sectors of this read which were in cache already (the readahead was in time)
+        // counted per stream (per open), and the counters of the stream which read last are
+        // published on the track, like the window, for the readahead xattr
 
-            }
+        pthread_mutex_lock(&(stream->mutex));
 
-        }
+        stream->hits+=endsector - startsector + 1 - nrsectorstoread;
+        stream->misses+=nrsectorstoread;
 
+        __atomic_store_n(&caching_data->readaheadstream, stream->id, __ATOMIC_RELAXED);
+        __atomic_store_n(&caching_data->readaheadhits, stream->hits, __ATOMIC_RELAXED);
+        __atomic_store_n(&caching_data->readaheadmisses, stream->misses, __ATOMIC_RELAXED);
 
-        if ( cachereadlock>0 ) {
+        pthread_mutex_unlock(&(stream->mutex));
 
-            // a read lock has been set, release it
+        // a miss: the latency till the reply goes in the histograms (see reply_read_call)
 
-            nreturn=release_readlock_caching_data(caching_data);
+        if ( nrsectorstoread>0 ) read_call->missed=1;
 
-        }
+        // where the track is read, readahead is pushed in the page cache only a bit ahead of it
 
+        __atomic_store_n(&caching_data->readposition, endsector+1, __ATOMIC_RELAXED);
 
         // read ahead
         //
-        // send a read command
-        // do this only when the cache is not complete and
-        // the readahead policy is set 
+        // the window is kept per stream, and adapts to how the stream reads (see readahead_stream)
+        // do this only when the cache is not complete and the readahead policy is set
         //
 
-        if ( caching_data->ready==0 ) {
-
-            if ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_PIECE || cdfs_options.readaheadpolicy==READAHEAD_POLICY_WHOLE ) {
-
-                logoutput2("read: readahead");
+        if ( caching_data->ready==0 && senderror==0 && cdfs_options.readaheadpolicy!=READAHEAD_POLICY_NONE ) {
 
-                if ( endsector<caching_data->endsector ) {
+            logoutput2("read: readahead");
 
-                    // create only when there is some space left over
-                    // to readahead
+            res=readahead_stream(stream, caching_data, startsector, endsector, read_call->seek);
 
-                    if ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_PIECE ) {
-
-                        nreturn=send_read_command(NULL, caching_data, endsector+1, endsector+READAHEAD_POLICY_PIECE_SECTORS, READAHEAD_POLICY_PIECE, 2);
-
-                    } else if ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_WHOLE ) {
-
-                        // do here something to fallback to readahead piece when reading the begin sectors
-                        // make the begin (250) configurable
-
-                        if ( endsector - caching_data->startsector > CDFS_TRACK_BEGIN_SIZE ) {
-
-                            nreturn=send_read_command(NULL, caching_data, endsector+1, endsector+READAHEAD_POLICY_WHOLE_SECTORS, READAHEAD_POLICY_WHOLE, 0);
-
-                        } else {
-
-                            // when in the begin of a track fall back to policy "piece"
-                            // this is because lots of graphical environment read the first X bytes
-                            // to get information, and thus it's not required
-                            // to read the whole file
-
-                            nreturn=send_read_command(NULL, caching_data, endsector+1, endsector+READAHEAD_POLICY_PIECE_SECTORS, READAHEAD_POLICY_PIECE, 2);
-
-                        }
-
-                    }
+        }
 
-                }
+        // the sectors of the window in cache already: let the kernel read them in the mapping
 
-            }
-
-        }
+        if ( cdfs_options.cachemmap==1 ) advise_cache_map(caching_data, endsector+1, caching_data->readaheadwindow);
 
 
         //
-        // when there are commands send to the cdromreader wait for these to be read
+        // do not wait for the read commands send to the cdromreader here:
+        // hand the read call over, the thread which finds the whole range in cache replies
+        // (the cache manager, or the cdromreader on error, or dispatch when it's there already)
+        // and this worker is free again
         //
 
 
-        if ( read_call->nrsectorstoread>0 ) {
-
-
-            // here totally different: wait for an event on read_call->lockcond
-            // and then compare nrsectorstoread with nrsectorsread
-
-
-            logoutput2("read: read commands send, waiting for %i sectors to be read", read_call->nrsectorstoread);
-
-
-            if ( read_call->nrsectorsread < read_call->nrsectorstoread ) {
-
-                // the read commands send are not completed yet
-
-                struct timespec expiretime;
-
-                // no error checking here....
-
-                res=clock_gettime(CLOCK_REALTIME, &expiretime);
-
-                expiretime.tv_sec+=15; /* todo: make this global configurable var */
-
-                res=pthread_mutex_lock(&(read_call->lockmutex));
+        logoutput2("read: %i sectors to read, reply deferred till all are in cache", nrsectorstoread);
 
-                res=0;
+        dispatch_read_call(read_call, senderror);
 
+        return;
 
-                while ( read_call->nrsectorsread < read_call->nrsectorstoread ) {
 
-                    logoutput2("read: inside wait loop for %i sectors, already done %i, expire: %li", read_call->nrsectorstoread, read_call->nrsectorsread, expiretime.tv_sec);
-
-                    res=pthread_cond_timedwait(&(read_call->lockcond), &(read_call->lockmutex), &expiretime);
+    }
 
-                    if ( res!=0 ) {
+    out:
 
-                        nreturn=-abs(res);
-                        break;
+    if ( nreturn<0 ) {
 
-                    }
+	logoutput2("read, error %i", nreturn);
 
-                    logoutput2("read: caught signal already read: %i (total: %i )", read_call->nrsectorsread, read_call->nrsectorstoread);
+	fuse_reply_err(req, -nreturn);
 
-                }
+    } else {
 
+	logoutput2("read, reading %zi bytes from %"PRIu64, size, off);
 
-                res=pthread_mutex_unlock(&(read_call->lockmutex));
+	reply_from_cached_file(req, caching_data, generic_fh->fd, size, off);
 
-                // check errors
+    }
 
-                if ( nreturn!=0 ) {
+}
 
-                    if ( nreturn==-ETIMEDOUT ) {
 
-                        logoutput2("read call: waiting for read results to finish timed out");
 
-                    } else {
+static void cdfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int nreturn=0;
+    struct cdfs_generic_fh_struct *generic_fh=get_generic_fh(fi);
 
-                        logoutput2("read call: waiting for read results to finish unknown error %i", nreturn);
+    logoutput0("RELEASE");
 
-                    }
+    if ( generic_fh ) {
 
+	// nobody is going to read the readahead of this stream anymore
 
-                    // handle error here???
+	cancel_readahead_stream((struct read_stream_struct *) generic_fh->data);
 
+	if ( generic_fh->entry && generic_fh->entry->data ) {
+	    struct caching_data_struct *caching_data=(struct caching_data_struct *) generic_fh->entry->data;
 
-                    goto out;
+	    pthread_mutex_lock(&(caching_data->openmutex));
 
-                }
+	    if ( __atomic_sub_fetch(&caching_data->nropen, 1, __ATOMIC_RELAXED)==0 ) {
 
-            }
+#ifdef FUSE_CAP_PASSTHROUGH
 
-        }
+		// the last open of a passthrough track: the next open decides again
 
+		if ( caching_data->backing_id>0 ) {
 
-	logoutput2("reading %zi bytes from %"PRIu64, size, off);
+		    fuse_passthrough_close(req, caching_data->backing_id);
+		    caching_data->backing_id=0;
 
-	res=pread(fi->fh, buffer, size, off);
+		}
 
-	if ( res<0 ) {
+#endif
 
-	    nreturn=-errno;
+		if ( cdfs_options.cachemmap==1 ) unmap_cache_file(caching_data);
 
-	} else {
+	    }
 
-	    nreturn=res;
+	    pthread_mutex_unlock(&(caching_data->openmutex));
 
 	}
 
-    }
-
-    out:
-
-    if ( nreturn<0 ) {
-
-	logoutput2("read, error %i", nreturn);
-
-	fuse_reply_err(req, -nreturn);
-
-    } else {
-
-	logoutput2("read, %i bytes read", nreturn);
+	if ( generic_fh->fd>=0 ) close(generic_fh->fd);
 
-	fuse_reply_buf(req, buffer, nreturn);
+	put_slab_object(&read_streams_slab, generic_fh->data);
+	free(generic_fh);
 
     }
 
-    if ( buffalloc==1 ) free(buffer);
-
-    if ( read_call ) move_read_call_to_unused_list(read_call);
-
-}
-
-
-
-static void cdfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
-{
-    int nreturn=0;
-
-    logoutput0("RELEASE");
-
-    close(fi->fh);
-
     fi->fh=0;
 
     out:
@@ -1864,6 +1932,62 @@ static void cdfs_init (void *userdata, struct fuse_conn_info *conn)
 
     create_pid_file();
 
+    // reply to reads by splicing from the cached file when the kernel supports it
+    // otherwise cdfs_read falls back to a buffer
+
+    cdfs_options.splicereads=0;
+
+    if ( conn->capable & FUSE_CAP_SPLICE_WRITE ) {
+
+	conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if ( conn->capable & FUSE_CAP_SPLICE_MOVE ) conn->want |= FUSE_CAP_SPLICE_MOVE;
+
+	cdfs_options.splicereads=1;
+
+    }
+
+    logoutput("init: splicing reads %s", (cdfs_options.splicereads==1) ? "enabled" : "not available");
+
+    // the kernel reads complete tracks from the cached file itself (linux 6.9 and libfuse 3.16)
+
+    cdfs_options.passthrough=0;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+
+    if ( conn->capable & FUSE_CAP_PASSTHROUGH ) {
+
+	conn->want |= FUSE_CAP_PASSTHROUGH;
+
+	cdfs_options.passthrough=1;
+
+    }
+
+#endif
+
+    logoutput("init: passthrough %s", (cdfs_options.passthrough==1) ? "enabled" : "not available");
+
+#ifdef CDFS_FUSE3
+
+    // large reads: the kernel sends up to max_read (mount option) per request, libfuse3 asks for
+    // max_pages to fit it's buffer (1 Mb)
+    // the readahead of the kernel can only be made smaller here: keep what the kernel offers, it's
+    // raised with read_ahead_kb of the bdi of the mount
+
+    logoutput("init: max_read %u max_readahead %u", conn->max_read, conn->max_readahead);
+
+#ifdef FUSE_CAP_OVER_IO_URING
+
+    // the requests come over io_uring queues (one per cpu) when the kernel has it (linux 6.14 and
+    // the module parameter enable_uring of fuse), else libfuse reads them from the fuse fds
+
+    if ( cdfs_options.iouring==1 && ! (conn->capable & FUSE_CAP_OVER_IO_URING) ) cdfs_options.iouring=0;
+
+#endif
+
+    logoutput("init: io_uring transport %s", (cdfs_options.iouring==1) ? "enabled" : "not used");
+
+#endif
+
 }
 
 
@@ -1895,17 +2019,126 @@ static struct fuse_lowlevel_ops cdfs_oper = {
 };
 
 
+//
+// go in the background, start the helper threads and run the fuse session till it ends
+//
+
+static int run_cdfs_session(int foreground)
+{
+    pthread_t pthreadid_cdrom_reader;
+    pthread_t pthreadid_cache_manager;
+    pthread_t pthreadid_create_hash;
+    int res;
+
+    res = fuse_daemonize(foreground);
+
+    if (res==0) {
+
+        //
+        // start different helper threads
+        //
+
+        if ( cdfs_options.caching==1 && cdfs_options.diskless==0 ) {
+
+            logoutput("Starting create cache hash thread...");
+
+            res=start_do_init_in_background_thread(&pthreadid_create_hash);
+
+            if ( res != 0 ) {
+
+                logoutput("Error creating cache hash: %i.", res);
+
+            }
+
+        }
+
+        register_cdfs_slab(&read_streams_slab);
+
+        logoutput("Starting cdrom reader thread...");
+
+        res=start_cdrom_reader_thread(&pthreadid_cdrom_reader);
+
+        logoutput("Starting cache manager thread...");
+
+        res=start_cache_manager_thread(&pthreadid_cache_manager);
+
+
+        //
+        // begin fuse
+        //
+
+        logoutput("Session created, starting fuse_session_loop_epoll_mt.");
+
+        set_fuse_loop_workers(( cdfs_commandline_options.minworkers>0 ) ? cdfs_commandline_options.minworkers : 0,
+				( cdfs_commandline_options.maxworkers>0 ) ? cdfs_commandline_options.maxworkers : 0);
+
+        res=fuse_session_loop_epoll_mt(cdfs_session, loglevel);
+
+        pthread_cancel(pthreadid_cdrom_reader);
+        pthread_cancel(pthreadid_cache_manager);
+
+    }
+
+    return res;
+
+}
+
+#ifdef CDFS_FUSE3
+
+//
+// a session with the requests over io_uring (libfuse 3.18, session option io_uring)
+// a libfuse which does not know the option fails to create the session: then the caller creates
+// one without it, and the requests are read from the (cloned) fuse fds as before
+//
+
+static struct fuse_session *new_cdfs_session_iouring(struct fuse_args *args)
+{
+    struct fuse_args iouring_args = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_session *se=NULL;
+    int i;
+
+    for (i=0; i<args->argc; i++) {
+
+	if ( fuse_opt_add_arg(&iouring_args, args->argv[i])==-1 ) goto out;
+
+    }
+
+    if ( fuse_opt_add_arg(&iouring_args, "-oio_uring")==-1 ) goto out;
+
+    se=fuse_session_new(&iouring_args, &cdfs_oper, sizeof(cdfs_oper), NULL);
+
+    if ( se ) {
+
+	cdfs_options.iouring=1;
+
+    } else {
+
+	logoutput("io_uring transport not supported by libfuse, using the fuse fds");
+
+    }
+
+    out:
+
+    fuse_opt_free_args(&iouring_args);
+
+    return se;
+
+}
+
+#endif
+
 int main(int argc, char *argv[])
 {
     struct fuse_args cdfs_args = FUSE_ARGS_INIT(argc, argv);
-    struct fuse_session *cdfs_session;
+#ifdef CDFS_FUSE3
+    struct fuse_cmdline_opts cdfs_cmdline_opts;
+#else
     char *cdfs_mountpoint;
     int foreground=0;
+#endif
+    char mountoptions[256];
     int res;
     struct stat st;
-    pthread_t pthreadid_cdrom_reader;
-    pthread_t pthreadid_cache_manager;
-    pthread_t pthreadid_create_hash;
 
     umask(0);
 
@@ -1922,6 +2155,17 @@ int main(int argc, char *argv[])
     cdfs_commandline_options.hashprogram=NULL;
     cdfs_commandline_options.discid=NULL;
     cdfs_commandline_options.device=NULL;
+    cdfs_commandline_options.notifystore=0;
+    cdfs_commandline_options.iouring=0;
+    cdfs_commandline_options.minworkers=0;
+    cdfs_commandline_options.maxworkers=0;
+    cdfs_commandline_options.cachesync=NULL;
+    cdfs_commandline_options.cachelayout=0;
+    cdfs_commandline_options.cachedirect=0;
+    cdfs_commandline_options.ramcache=-1;
+    cdfs_commandline_options.diskless=0;
+    cdfs_commandline_options.cachemmap=0;
+    cdfs_commandline_options.memorybudget=0;
 
 
     // set defaults
@@ -1933,6 +2177,9 @@ int main(int argc, char *argv[])
     cdfs_options.discid=NULL;
     cdfs_options.caching=1;
     cdfs_options.device=NULL;
+    cdfs_options.diskless=0;
+    cdfs_options.ramcache=0;
+    cdfs_options.cachemmap=0;
 
     // read commandline options
 
@@ -1945,7 +2192,19 @@ int main(int argc, char *argv[])
 
     }
 
-    res = fuse_opt_insert_arg(&cdfs_args, 1, "-oallow_other,ro,default_permissions,nonempty,big_writes,nodev,nosuid");
+#ifdef CDFS_FUSE3
+
+    // libfuse3 knows no nonempty and big_writes anymore (it's the default), and reads up to max_read
+
+    snprintf(mountoptions, sizeof(mountoptions), "-oallow_other,ro,default_permissions,nodev,nosuid,max_read=%i", CDFS_FUSE_MAX_READ);
+
+#else
+
+    snprintf(mountoptions, sizeof(mountoptions), "-oallow_other,ro,default_permissions,nonempty,big_writes,nodev,nosuid");
+
+#endif
+
+    res = fuse_opt_insert_arg(&cdfs_args, 1, mountoptions);
 
 
     // get the device
@@ -1999,10 +2258,12 @@ int main(int argc, char *argv[])
         }
 
 
-        if ( ! cdfs_options.cache_directory ) {
+        if ( ! cdfs_options.cache_directory || cdfs_commandline_options.diskless==1 ) {
 
-            fprintf(stdout, "Cache directory not set. Cannot continue.\n");
-            exit(1);
+            // no cache files: the sectors read are kept in ram only
+
+            fprintf(stdout, "%s, sectors read are kept in ram only (diskless).\n", ( cdfs_options.cache_directory ) ? "Diskless" : "Cache directory not set");
+            cdfs_options.diskless=1;
 
         }
 
@@ -2096,6 +2357,60 @@ int main(int argc, char *argv[])
 
     }
 
+    // when the cache files are made durable, default never: what's lost is read again
+
+    cdfs_options.cachesync=CDFS_CACHE_SYNC_NONE;
+
+    if ( cdfs_commandline_options.cachesync ) {
+
+        if ( strcmp(cdfs_commandline_options.cachesync, "none")==0 ) {
+
+            cdfs_options.cachesync=CDFS_CACHE_SYNC_NONE;
+
+        } else if ( strcmp(cdfs_commandline_options.cachesync, "batch")==0 ) {
+
+            cdfs_options.cachesync=CDFS_CACHE_SYNC_BATCH;
+
+        } else if ( strcmp(cdfs_commandline_options.cachesync, "track")==0 ) {
+
+            cdfs_options.cachesync=CDFS_CACHE_SYNC_TRACK;
+
+        }
+
+    }
+
+    // the layout of new cache files, and opening them with O_DIRECT (only with layout 2, the audio is page aligned)
+    // existing cache files keep their layout
+
+    cdfs_options.cachelayout=( cdfs_commandline_options.cachelayout==CDFS_CACHE_LAYOUT_V2 ) ? CDFS_CACHE_LAYOUT_V2 : CDFS_CACHE_LAYOUT_V1;
+    cdfs_options.cachedirect=( cdfs_commandline_options.cachedirect==1 ) ? 1 : 0;
+
+    if ( cdfs_options.cachedirect==1 ) cdfs_options.cachelayout=CDFS_CACHE_LAYOUT_V2;
+
+    // the sectors recently read in ram (in MB): none by default with cache files, diskless always some
+    // diskless there is nothing to administer in sqlite
+
+    if ( cdfs_commandline_options.ramcache>0 ) {
+
+	cdfs_options.ramcache=(unsigned long) cdfs_commandline_options.ramcache * 1024 * 1024;
+
+    } else if ( cdfs_options.diskless==1 ) {
+
+	cdfs_options.ramcache=CDFS_RAMCACHE_DISKLESS;
+
+    }
+
+    if ( cdfs_options.diskless==1 ) {
+
+	if ( cdfs_options.ramcache < CDFS_RAMCACHE_MIN ) cdfs_options.ramcache=CDFS_RAMCACHE_MIN;
+	cdfs_options.cachebackend=CDFS_CACHE_ADMIN_BACKEND_INTERNAL;
+
+    }
+
+    // the cache files mapped while open: not with O_DIRECT (the page cache is what's mapped), and not without them
+
+    cdfs_options.cachemmap=( cdfs_commandline_options.cachemmap==1 && cdfs_options.cachedirect==0 && cdfs_options.diskless==0 ) ? 1 : 0;
+
     //
     // init the name and inode hashtables
     //
@@ -2154,65 +2469,91 @@ int main(int argc, char *argv[])
     cdfs_device.initready=0;
 
     cdfs_options.secondswaitforread=15; /* a commandline option for this ??*/
+    cdfs_options.splicereads=0; /* set in init when supported */
+    cdfs_options.passthrough=0; /* set in init when supported */
+    cdfs_options.cancelreadahead=1; /* drop the readahead of a stream which seeks away, xattr to compare */
+    cdfs_options.readaheadmax=CDFS_READAHEAD_MAX_SECTORS; /* budget of the readahead window of a stream */
+    cdfs_options.memorybudget=CDFS_MEMORY_BUDGET; /* bytes read and not yet in cache, above it readahead pauses */
+
+    // the memory budget in KB, at least one batch of the cdromreader (like the xattr)
+
+    if ( cdfs_commandline_options.memorybudget>0 ) {
+
+	cdfs_options.memorybudget=(unsigned long) cdfs_commandline_options.memorybudget * 1024;
+	if ( cdfs_options.memorybudget < CDFS_SECTOR_SLOT_SECTORS * CDIO_CD_FRAMESIZE_RAW ) cdfs_options.memorybudget=CDFS_SECTOR_SLOT_SECTORS * CDIO_CD_FRAMESIZE_RAW;
+
+	// with policy whole the background fill has to fit next to the smallest window
+
+	if ( cdfs_options.readaheadpolicy==READAHEAD_POLICY_WHOLE && cdfs_options.memorybudget < ( CDFS_READAHEAD_MIN_SECTORS + READAHEAD_POLICY_WHOLE_SECTORS ) * CDIO_CD_FRAMESIZE_RAW ) {
+
+	    fprintf(stderr, "Memory budget %lu too small for readahead policy whole, the track is not filled in the background.\n", cdfs_options.memorybudget);
+
+	}
+
+    }
+    cdfs_options.servefrombuffer=1; /* reply waiting reads from the sectors read before they are written to the cache */
+    cdfs_options.notifystore=( cdfs_commandline_options.notifystore==1 ) ? 1 : 0; /* push readahead of open tracks in the page cache of the kernel */
+    cdfs_options.notifystoremax=CDFS_NOTIFY_STORE_MAX_SECTORS; /* not further ahead of the last read than this */
+    cdfs_options.iouring=0; /* set when the session is created with the io_uring transport */
 
 
     res = -1;
 
-    if (fuse_parse_cmdline(&cdfs_args, &cdfs_mountpoint, NULL, &foreground) != -1 ) {
+#ifdef CDFS_FUSE3
 
-	if ( (cdfs_chan = fuse_mount(cdfs_mountpoint, &cdfs_args)) != NULL) {
+    if ( fuse_parse_cmdline(&cdfs_args, &cdfs_cmdline_opts)==0 && cdfs_cmdline_opts.mountpoint ) {
 
-	    cdfs_session=fuse_lowlevel_new(&cdfs_args, &cdfs_oper, sizeof(cdfs_oper), NULL);
+	if ( cdfs_commandline_options.iouring==1 ) cdfs_session=new_cdfs_session_iouring(&cdfs_args);
 
-	    if ( cdfs_session != NULL ) {
+	if ( cdfs_options.iouring==0 ) cdfs_session=fuse_session_new(&cdfs_args, &cdfs_oper, sizeof(cdfs_oper), NULL);
 
-		res = fuse_daemonize(foreground);
+	if ( cdfs_session != NULL ) {
 
-		if (res==0) {
+	    if ( fuse_session_mount(cdfs_session, cdfs_cmdline_opts.mountpoint)==0 ) {
 
-                    //
-                    // start different helper threads
-                    //
+		res=run_cdfs_session(cdfs_cmdline_opts.foreground);
 
-                    if ( cdfs_options.caching==1 ) {
+		fuse_session_unmount(cdfs_session);
 
-                        logoutput("Starting create cache hash thread...");
+	    } else {
 
-                        res=start_do_init_in_background_thread(&pthreadid_create_hash);
+		logoutput("Error mounting.\n");
 
-                        if ( res != 0 ) {
+	    }
 
-                            logoutput("Error creating cache hash: %i.", res);
+	    fuse_session_destroy(cdfs_session);
 
-                        }
+	} else {
 
-                    }
+	    logoutput("Error starting a new session.\n");
 
-                    logoutput("Starting cdrom reader thread...");
+	}
 
-		    res=start_cdrom_reader_thread(&pthreadid_cdrom_reader);
+	free(cdfs_cmdline_opts.mountpoint);
 
-                    logoutput("Starting cache manager thread...");
+    } else {
 
-                    res=start_cache_manager_thread(&pthreadid_cache_manager);
+	logoutput("Error parsing options.\n");
+
+    }
 
+#else
 
-                    //
-                    // begin fuse
-                    //
+    if ( cdfs_commandline_options.iouring==1 ) logoutput("io_uring transport only with libfuse3, using the fuse fd");
 
-		    fuse_session_add_chan(cdfs_session, cdfs_chan);
+    if (fuse_parse_cmdline(&cdfs_args, &cdfs_mountpoint, NULL, &foreground) != -1 ) {
+
+	if ( (cdfs_chan = fuse_mount(cdfs_mountpoint, &cdfs_args)) != NULL) {
 
-		    logoutput("Channel created, starting fuse_session_loop_epoll_mt.");
+	    cdfs_session=fuse_lowlevel_new(&cdfs_args, &cdfs_oper, sizeof(cdfs_oper), NULL);
 
-		    res=fuse_session_loop_epoll_mt(cdfs_session, loglevel);
+	    if ( cdfs_session != NULL ) {
 
-		    fuse_session_remove_chan(cdfs_chan);
+		fuse_session_add_chan(cdfs_session, cdfs_chan);
 
-                    pthread_cancel(pthreadid_cdrom_reader);
-                    pthread_cancel(pthreadid_cache_manager);
+		res=run_cdfs_session(foreground);
 
-		}
+		fuse_session_remove_chan(cdfs_chan);
 
 		fuse_session_destroy(cdfs_session);
 
@@ -2236,6 +2577,8 @@ int main(int argc, char *argv[])
 
     }
 
+#endif
+
     if ( cdfs_device.cddevice ) {
 
         cdio_cddap_close_no_free_cdio(cdfs_device.cddevice);
@@ -2248,7 +2591,7 @@ int main(int argc, char *argv[])
 
     if ( cdfs_options.cachebackend==CDFS_CACHE_ADMIN_BACKEND_SQLITE ) {
 
-        // create the sqlite db
+        // all the intervals in one go, what was committed while running is replaced by it
 
         res=write_all_intervals_to_sqlitedb();
 
@@ -2258,6 +2601,8 @@ int main(int argc, char *argv[])
 
         }
 
+        close_sqlite_db();
+
     }
 
     out:
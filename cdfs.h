@@ -18,8 +18,12 @@
 
 */
 
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
 #include <ulockmgr.h>
+#endif
 #include <dirent.h>
 
 #include <cdio/paranoia/paranoia.h>
@@ -60,6 +64,21 @@ struct cdfs_options_struct {
      unsigned char caching;
      unsigned char readaheadpolicy;
      unsigned char secondswaitforread;
+     unsigned char splicereads;
+     unsigned char passthrough;
+     unsigned char cancelreadahead;
+     unsigned int readaheadmax;
+     unsigned long memorybudget;
+     unsigned char servefrombuffer;
+     unsigned char notifystore;
+     unsigned int notifystoremax;
+     unsigned char iouring;
+     unsigned char cachesync;
+     unsigned char cachelayout;
+     unsigned char cachedirect;
+     unsigned long ramcache;
+     unsigned char diskless;
+     unsigned char cachemmap;
      double attr_timeout;
      double entry_timeout;
      double negative_timeout;
@@ -86,19 +105,47 @@ struct cdfs_generic_dirp_struct {
 };
 
 
+/* struct for a stream: the reads on one open file */
+/* readahead commands are tagged with it's id, to cancel them when the stream seeks away */
+/* (a new id every open: the address of a stream is reused) */
+/* the readahead window (rastart, rasize) grows while the stream reads sequential */
+/* rate is the consumption in sectors per second, averaged */
+
+struct read_stream_struct {
+    pthread_mutex_t mutex;
+    unsigned long id;
+    unsigned int nextsector;
+    unsigned char started;
+    unsigned int rastart;
+    unsigned int rasize;
+    unsigned char background;
+    unsigned int rate;
+    struct timespec lastread;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+
 /* struct for a base for every read command */
+/* the fuse request is kept here, and replied when all the sectors are read */
+/* while waiting it's in the list of waiters of the track, sorted by startsector */
 
 struct read_call_struct {
     pthread_t fuse_cdfs_thread_id;
     unsigned char tracknr;
     unsigned int startsector;
     unsigned int endsector;
-    size_t  nrsectorstoread;
-    size_t  nrsectorsread;
     unsigned char complete;
-    pthread_mutex_t lockmutex;
-    pthread_cond_t  lockcond;
-    unsigned char   lock;
+    unsigned char dispatched;
+    int nerror;
+    fuse_req_t req;
+    int fd;
+    size_t size;
+    off_t off;
+    unsigned char seek;
+    unsigned char missed;
+    unsigned int retries;
+    struct timespec started;
     struct read_call_struct *next;
     struct read_call_struct *prev;
     struct caching_data_struct *caching_data;
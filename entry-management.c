@@ -41,7 +41,11 @@
 
 #include <sqlite3.h>
 
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
 #include <fuse/fuse_lowlevel.h>
+#endif
 
 #include "logging.h"
 #include "cdfs.h"
@@ -46,173 +46,330 @@
 #include <sys/signalfd.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <time.h>
 
 #define LOGGING
 
 #include "logging.h"
 #include "fuse-loop-epoll-mt.h"
 
+static struct global_data_struct global_data;
+
+static unsigned int fuse_loop_minworkers=NUM_WORKER_THREADS;
+static unsigned int fuse_loop_maxworkers=MAX_WORKER_THREADS;
+
 
 //
-// a thread in the pool of active threads
-// to process the fuse event
-// the mainloop has noticed there is data available, and read in a buffer
-// but is not processed yet
+// the buffers the requests are received in
+//
+// the mainloop receives a request in the buffer of a fuse event data, hands that over to a worker
+// as it is, and takes another one for the next request: no copy of the request, and no clearing of
+// the buffer (the kernel tells how much is received)
+// the worker puts it back when the request is processed, so there is no malloc per request either
 //
 
-static void *thread_to_process_fuse_event(void *threadarg)
+static struct fuse_event_data_struct *get_fuse_event_data(struct global_data_struct *global_data, size_t buffsize)
 {
-	struct fuse_worker_thread_data_struct *worker_data;
 	struct fuse_event_data_struct *fuse_event_data;
-	bool permanentthread;
-	struct global_data_struct *global_data;
-	unsigned char loglevel;
 
-	logoutput("thread started..");
+	pthread_mutex_lock(&global_data->event_data_mutex);
 
-	worker_data=(struct fuse_worker_thread_data_struct *) threadarg;
+	fuse_event_data=global_data->free_event_data;
 
-	if ( worker_data ) {
+	if ( fuse_event_data ) {
 
-	    permanentthread=false;
-	    loglevel=worker_data->global_data->loglevel;
+	    global_data->free_event_data=fuse_event_data->next;
+	    global_data->nrfree_event_data--;
 
-	    if ( worker_data->typeworker==TYPE_WORKER_PERMANENT ) permanentthread=true;
+	}
 
-	    worker_data->threadid=pthread_self();
+	pthread_mutex_unlock(&global_data->event_data_mutex);
 
-	    if ( permanentthread ) {
+	if ( fuse_event_data && fuse_event_data->buffsize < buffsize ) {
 
-		writelog(loglevel, 1, "perm thread %i: starting for loop..", worker_data->nr);
+	    // too small for this channel
 
-	    } else {
+	    free(fuse_event_data->buff);
+	    free(fuse_event_data);
+	    fuse_event_data=NULL;
 
-		writelog(loglevel, 1, "temp thread started..");
+	}
+
+	if ( ! fuse_event_data ) {
+
+	    fuse_event_data=malloc(sizeof(struct fuse_event_data_struct));
+
+	    if ( ! fuse_event_data ) return NULL;
+
+	    fuse_event_data->buff=malloc(buffsize);
+
+	    if ( ! fuse_event_data->buff ) {
+
+		free(fuse_event_data);
+		return NULL;
 
 	    }
 
-	    while (1) {
+	    fuse_event_data->buffsize=buffsize;
 
-		// if permanent : wait for the condition
-		// this is set by the mainloop to inform this thread there is data ready to process
+	}
 
-		if ( permanentthread ) {
+	fuse_event_data->ch=NULL;
+	fuse_event_data->se=NULL;
+	fuse_event_data->res=0;
+	fuse_event_data->next=NULL;
 
-		    // wait for semaphore to "release"
-		    sem_wait(&(worker_data->busy_sem));
+	return fuse_event_data;
 
-		    writelog(loglevel, 1, "thread %i waking up, setting state to busy", worker_data->nr);
+}
 
-		    worker_data->busy=2;
+static void put_fuse_event_data(struct global_data_struct *global_data, struct fuse_event_data_struct *fuse_event_data)
+{
 
-		}
+	pthread_mutex_lock(&global_data->event_data_mutex);
 
-		fuse_event_data=worker_data->fuse_event_data;
+	if ( global_data->nrfree_event_data < MAX_FREE_EVENT_DATA ) {
 
-		if ( fuse_event_data && fuse_event_data->buff ) {
+	    fuse_event_data->next=global_data->free_event_data;
+	    global_data->free_event_data=fuse_event_data;
+	    global_data->nrfree_event_data++;
 
+	    fuse_event_data=NULL;
 
-		    writelog(loglevel, 1, "data found, start fuse_session_process");
+	}
 
+	pthread_mutex_unlock(&global_data->event_data_mutex);
 
-		    fuse_session_process(fuse_event_data->se, fuse_event_data->buff, fuse_event_data->res, fuse_event_data->ch);
+	if ( fuse_event_data ) {
 
-		    // reset the various data
+	    // more than enough for the workers: back to the OS
 
-		    free(fuse_event_data->buff);
-		    free(fuse_event_data);
-		    worker_data->fuse_event_data=NULL;
+	    free(fuse_event_data->buff);
+	    free(fuse_event_data);
 
-		}
+	}
+
+}
+
+//
+// the pool of workers
+//
+// the mainloop pushes every request on the work queue (a bounded lock free queue with many
+// consumers, see cdfs-queue.c), and the workers take them off
+// there are at least minworkers; when a request is pushed and no worker is idle, another one is
+// started, up to maxworkers; a worker above the minimum which is idle WORKER_IDLE_TIMEOUT ends
+// when the queue is full the mainloop processes the request itself: it does not read new requests
+// meanwhile, so the kernel queues them
+//
+
+static void process_fuse_event(struct fuse_event_data_struct *fuse_event_data)
+{
+
+	fuse_session_process(fuse_event_data->se, fuse_event_data->buff, fuse_event_data->res, fuse_event_data->ch);
+
+	// the buffer goes back for another request
+
+	put_fuse_event_data(&global_data, fuse_event_data);
+
+}
+
+static void end_fuse_worker()
+{
+
+	pthread_mutex_lock(&global_data.workers_mutex);
+
+	global_data.nrworkers--;
+	pthread_cond_broadcast(&global_data.workers_cond);
+
+	pthread_mutex_unlock(&global_data.workers_mutex);
+
+}
+
+static void *thread_fuse_worker(void *threadarg)
+{
+	struct fuse_event_data_struct *fuse_event_data;
+	unsigned char loglevel=global_data.loglevel;
+	unsigned int nrworkers;
+	int res;
+
+	writelog(loglevel, 1, "worker started..");
+
+	while (1) {
+
+	    __atomic_add_fetch(&global_data.nridle, 1, __ATOMIC_SEQ_CST);
 
-		if ( permanentthread ) {
+	    res=wait_mpmc_queue(&global_data.workqueue, WORKER_IDLE_TIMEOUT);
 
-		    writelog(loglevel, 1, "thread %i: set state to not busy", worker_data->nr);
+	    __atomic_sub_fetch(&global_data.nridle, 1, __ATOMIC_SEQ_CST);
 
-		    worker_data->busy=0;
+	    if ( res==1 ) {
 
-		} else {
+		// a count taken off the semaphore: there is a request for this worker
+		// (the producer may not be ready filling the slot)
+		// or, when exiting, the count is of the wakeup: then there may be none
+		// a request taken off is always processed, also when exiting
 
-		    writelog(loglevel, 1, "temp thread ready, exit");
+		while ( ! (fuse_event_data=(struct fuse_event_data_struct *) pop_mpmc_queue(&global_data.workqueue)) ) {
 
-		    break;
+		    if ( __atomic_load_n(&global_data.exiting, __ATOMIC_ACQUIRE)==1 ) break;
+		    sched_yield();
 
 		}
 
+		if ( fuse_event_data ) process_fuse_event(fuse_event_data);
+
 	    }
 
-	    if ( ! permanentthread ) {
+	    if ( __atomic_load_n(&global_data.exiting, __ATOMIC_ACQUIRE)==1 ) break;
+
+	    if ( res==0 ) {
 
-		// freeing the worker data when temp thread
-		// the buff is already freed..
-		// free 
-		// remove itself from list of temp threads
+		// idle: end when above the minimum
 
-		global_data=worker_data->global_data;
+		pthread_mutex_lock(&global_data.workers_mutex);
 
-		if ( worker_data->prev ) worker_data->prev->next=worker_data->next;
-		if ( worker_data->next ) worker_data->next->prev=worker_data->prev;
-		if ( global_data->temp_worker_data==worker_data) global_data->temp_worker_data=worker_data->next;
+		nrworkers=global_data.nrworkers;
 
-		free(worker_data);
+		if ( nrworkers > global_data.minworkers ) {
+
+		    global_data.nrworkers--;
+		    global_data.workersreaped++;
+
+		    pthread_cond_broadcast(&global_data.workers_cond);
+
+		}
+
+		pthread_mutex_unlock(&global_data.workers_mutex);
+
+		if ( nrworkers > global_data.minworkers ) {
+
+		    writelog(loglevel, 1, "worker idle, ending");
+
+		    return NULL;
+
+		}
+
+	    } else if ( res<0 ) {
+
+		writelog(loglevel, 0, "worker: error %i waiting for requests", res);
 
 	    }
 
 	}
 
-	logoutput("thread ending");
+	writelog(loglevel, 1, "worker ending");
 
-	pthread_exit(NULL);
+	end_fuse_worker();
+
+	return NULL;
 
 }
 
-static struct fuse_event_data_struct *create_fuse_event_data(struct fuse_epoll_data_struct *fuse_epoll_data)
+//
+// start another worker, when not at the maximum already
+//
+
+static int start_fuse_worker()
 {
-	struct fuse_event_data_struct *fuse_event_data;
-	unsigned ncount=0;
+	pthread_attr_t attr;
+	pthread_t pthreadid;
+	int res;
 
-	while (ncount<4) {
+	pthread_mutex_lock(&global_data.workers_mutex);
 
-	    fuse_event_data=malloc(sizeof(struct fuse_event_data_struct));
+	if ( global_data.nrworkers >= global_data.maxworkers ) {
+
+	    pthread_mutex_unlock(&global_data.workers_mutex);
+	    return -EAGAIN;
+
+	}
+
+	global_data.nrworkers++;
+	global_data.workersstarted++;
+
+	pthread_mutex_unlock(&global_data.workers_mutex);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-	    if ( fuse_event_data ) break;
+	res=pthread_create(&pthreadid, &attr, thread_fuse_worker, NULL);
 
-	    ncount++;
+	pthread_attr_destroy(&attr);
+
+	if ( res!=0 ) {
+
+	    end_fuse_worker();
+	    return -res;
 
 	}
 
-	if ( fuse_event_data ) {
+	return 0;
 
-	    ncount=0;
-	    fuse_event_data->buffsize=fuse_epoll_data->buffsize;
+}
 
-	    while (ncount<4) {
+//
+// hand the request over to the workers
+//
 
-		fuse_event_data->buff=malloc(fuse_event_data->buffsize);
+static void queue_fuse_event(struct fuse_event_data_struct *fuse_event_data)
+{
+	unsigned long queued;
 
-		if (fuse_event_data->buff) break;
+	if ( push_mpmc_queue(&global_data.workqueue, (void *) fuse_event_data)==0 ) {
 
-		ncount++;
+	    global_data.enqueued++;
 
-	    }
+	    queued=get_mpmc_queue_depth(&global_data.workqueue);
+	    if ( queued > global_data.queuedpeak ) global_data.queuedpeak=queued;
 
-	    if ( ! fuse_event_data->buff ) {
+	    // all busy: one more
 
-		free(fuse_event_data);
-		fuse_event_data=NULL;
+	    if ( __atomic_load_n(&global_data.nridle, __ATOMIC_SEQ_CST)==0 ) start_fuse_worker();
 
-	    } else {
+	} else {
 
-		memcpy(fuse_event_data->buff, fuse_epoll_data->buff, fuse_event_data->buffsize);
-		fuse_event_data->ch=fuse_epoll_data->ch;
-		fuse_event_data->se=fuse_epoll_data->se;
-		fuse_event_data->res=fuse_epoll_data->res;
+	    // queue full
 
-	    }
+	    global_data.processedinline++;
+
+	    process_fuse_event(fuse_event_data);
 
 	}
 
-	return fuse_event_data;
+}
+
+//
+// the size of the pool, before the loop is started
+//
+
+void set_fuse_loop_workers(unsigned int minworkers, unsigned int maxworkers)
+{
+
+	if ( minworkers>0 ) fuse_loop_minworkers=minworkers;
+	if ( maxworkers>0 ) fuse_loop_maxworkers=maxworkers;
+
+	if ( fuse_loop_maxworkers < fuse_loop_minworkers ) fuse_loop_maxworkers=fuse_loop_minworkers;
+
+}
+
+//
+// statistics of the pool in a string like:
+// workers=12 idle=9 min=10 max=32 queued=0 queuedpeak=14 enqueued=5843 inline=0 started=14 reaped=2
+//
+
+int get_fuse_loop_stats(char *buffer, size_t size)
+{
+	unsigned int nrworkers;
+
+	pthread_mutex_lock(&global_data.workers_mutex);
+	nrworkers=global_data.nrworkers;
+	pthread_mutex_unlock(&global_data.workers_mutex);
+
+	return snprintf(buffer, size, "workers=%u idle=%u min=%u max=%u queued=%lu queuedpeak=%lu enqueued=%lu inline=%lu started=%lu reaped=%lu",
+			nrworkers, __atomic_load_n(&global_data.nridle, __ATOMIC_RELAXED), global_data.minworkers, global_data.maxworkers,
+			( global_data.workqueue.slots ) ? get_mpmc_queue_depth(&global_data.workqueue) : 0, global_data.queuedpeak,
+			global_data.enqueued, global_data.processedinline, global_data.workersstarted, global_data.workersreaped);
 
 }
 
@@ -220,7 +377,7 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 {
 	int epoll_fd, signal_fd, fuse_fd;
 	struct epoll_event epoll_events[MAX_EPOLL_NREVENTS];
-	int i, res, nextfreethread=0, ncount;
+	int i, res;
 	struct fuse_chan *ch = NULL;
 	ssize_t readlen;
 	struct signalfd_siginfo fdsi;
@@ -228,19 +385,36 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 	sigset_t fuse_sigset;
 	pid_t cpid;
 	struct fuse_epoll_data_struct *fuse_epoll_data;
-	struct fuse_worker_thread_data_struct fuse_worker_data[NUM_WORKER_THREADS];
-	struct fuse_worker_thread_data_struct *tmp_worker_data;
 	struct fuse_event_data_struct *fuse_event_data;
-	pthread_t pthreadid;
-	bool threadfound=false;
-	struct global_data_struct global_data;
 
 	// init mainloop data
 
+	memset(&global_data, 0, sizeof(struct global_data_struct));
+
 	global_data.epoll_data=NULL;
-	global_data.temp_worker_data=NULL;
+	global_data.free_event_data=NULL;
+	global_data.nrfree_event_data=0;
+	global_data.minworkers=fuse_loop_minworkers;
+	global_data.maxworkers=fuse_loop_maxworkers;
 	global_data.loglevel=loglevel;
 
+	global_data.workqueue.eventfd=-1;
+
+	pthread_mutex_init(&global_data.event_data_mutex, NULL);
+	pthread_mutex_init(&global_data.workers_mutex, NULL);
+	pthread_cond_init(&global_data.workers_cond, NULL);
+
+	res=init_mpmc_queue(&global_data.workqueue, WORK_QUEUE_SIZE);
+
+	if ( res<0 ) {
+
+	    logoutput("mainloop: unable to create work queue, error: %i", res);
+
+	    nreturn=res;
+	    goto out;
+
+	}
+
 	// create an epoll instance
 
 	epoll_fd=epoll_create(MAX_EPOLL_NRFDS);
@@ -266,14 +440,14 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 		fuse_epoll_data->ch=ch;
 		fuse_epoll_data->se=se;
 		fuse_epoll_data->buffsize=fuse_chan_bufsize(fuse_epoll_data->ch);
-		fuse_epoll_data->buff=(char *) malloc(fuse_epoll_data->buffsize);
+		fuse_epoll_data->fuse_event_data=get_fuse_event_data(&global_data, fuse_epoll_data->buffsize);
 
 		// add epoll_data to list (insert at begin)
 
 		fuse_epoll_data->next=global_data.epoll_data;
 		global_data.epoll_data=fuse_epoll_data;
 
-		if ( ! fuse_epoll_data->buff ) {
+		if ( ! fuse_epoll_data->fuse_event_data ) {
 
 		    // here some freeing of data?
 
@@ -375,38 +549,26 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 
 	}
 
-	// init and fire up the different worker threads
-
-	for (i=0; i<NUM_WORKER_THREADS; i++) {
-
-	    res=sem_init(&(fuse_worker_data[i].busy_sem), 0, 0);
-
-	    if ( res!=0 ) {
+	// the timers and the fd's of other threads
 
-		// error
+	res=start_fuse_loop_events(epoll_fd);
 
-		writelog(loglevel, 0, "Error creating a semaphore for thread(nr: %i, error: %i).", i, res);
+	if ( res<0 ) {
 
-		goto out;
-
-	    }
-
-	    fuse_worker_data[i].busy=0;
-	    fuse_worker_data[i].nr=i;
-	    fuse_worker_data[i].typeworker=TYPE_WORKER_PERMANENT;
+	  nreturn=res;
+	  goto out;
 
-	    fuse_worker_data[i].fuse_event_data=NULL;
-	    fuse_worker_data[i].global_data=&global_data;
+	}
 
-	    writelog(loglevel, 1, "creating a new thread: %i.", i);
+	// fire up the minimum of workers
 
-	    res=pthread_create(&pthreadid, NULL, thread_to_process_fuse_event, (void *) &fuse_worker_data[i]);
+	for (i=0; i<global_data.minworkers; i++) {
 
-	    if ( res!=0 ) {
+	    res=start_fuse_worker();
 
-		// error
+	    if ( res<0 ) {
 
-		logoutput("Error creating a new thread (nr: %i, error: %i).", i, res);
+		logoutput("Error creating a new thread (nr: %i, error: %i).", i, -res);
 
 		goto out;
 
@@ -414,6 +576,8 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 
 	}
 
+	writelog(loglevel, 1, "mainloop: %i workers started (max %i)", global_data.minworkers, global_data.maxworkers);
+
 
 	writelog(loglevel, 0, "mainloop: starting epoll wait loop");
 
@@ -450,124 +614,34 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 
 		    if ( fuse_session_exited(se) ) goto out;
 
-		    memset(fuse_epoll_data->buff, 0, fuse_epoll_data->buffsize);
-		    res=fuse_chan_recv(&fuse_epoll_data->ch, fuse_epoll_data->buff, fuse_epoll_data->buffsize);
+		    fuse_event_data=fuse_epoll_data->fuse_event_data;
+
+		    res=fuse_chan_recv(&fuse_epoll_data->ch, fuse_event_data->buff, fuse_event_data->buffsize);
 
 		    if ( res>0 ) {
 
 			fuse_epoll_data->res=res;
 
-			// copy the data to a new event data 
-
-			fuse_event_data=create_fuse_event_data(fuse_epoll_data);
-
-			if ( ! fuse_event_data ) {
-
-			    nreturn=-ENOMEM;
-			    goto out;
-
-			}
-
-			threadfound=false;
-			ncount=0;
-
-			while ( ! threadfound ) {
-
-			    if ( fuse_worker_data[nextfreethread].busy==0 ) {
-
-				fuse_worker_data[nextfreethread].fuse_event_data=fuse_event_data;
-
-				// not busy, activate ("verhogen") the sem
-
-				writelog(loglevel, 0, "mainloop: sem post for thread %i", nextfreethread);
-
-				res=sem_post(&(fuse_worker_data[nextfreethread].busy_sem));
-
-				if ( res==0 ) {
-
-				    threadfound=true;
-
-				} else {
+			fuse_event_data->ch=fuse_epoll_data->ch;
+			fuse_event_data->se=fuse_epoll_data->se;
+			fuse_event_data->res=res;
 
-				    // some error, just try the next worker thread
+			// the request goes to a worker in this buffer, the next is received in another one
 
-				    writelog(loglevel, 0, "mainloop: sem post failed");
+			fuse_epoll_data->fuse_event_data=get_fuse_event_data(&global_data, fuse_epoll_data->buffsize);
 
-				    fuse_worker_data[nextfreethread].fuse_event_data=NULL;
+			if ( ! fuse_epoll_data->fuse_event_data ) {
 
-				}
+			    // keep it, so it's freed with the channel
 
-			    }
-
-			    nextfreethread++;
-			    ncount++;
-
-			    if ( nextfreethread>=NUM_WORKER_THREADS ) {
-
-				nextfreethread=0;
-
-			    }
-
-			    // stop if found or all the threads are tried
-
-			    if ( threadfound || ncount>=NUM_WORKER_THREADS) break;
-
-			}
-
-			if ( ! threadfound) {
-
-			    // no free thread found in the pool
-			    // start a temp thread especially for this purpose
-
-			    writelog(loglevel, 0, "mainloop: no free thread found, starting a temp thread");
-
-			    tmp_worker_data=malloc(sizeof(struct fuse_worker_thread_data_struct));
-
-			    if ( tmp_worker_data ) {
-
-				tmp_worker_data->busy=0;
-				tmp_worker_data->nr=0;
-				tmp_worker_data->typeworker=TYPE_WORKER_TEMPORARY;
-				tmp_worker_data->fuse_event_data=fuse_event_data;
-				tmp_worker_data->global_data=&global_data;
-
-				// insert at beginning
-
-				tmp_worker_data->prev=NULL;
-
-				if ( global_data.temp_worker_data ) {
-
-				    global_data.temp_worker_data->prev=tmp_worker_data;
-				    tmp_worker_data->next=global_data.temp_worker_data;
-
-				} else {
-
-				    tmp_worker_data->next=NULL;
-
-				}
-
-				global_data.temp_worker_data=tmp_worker_data;
-
-				res=pthread_create(&pthreadid, NULL, thread_to_process_fuse_event, (void *) tmp_worker_data);
+			    fuse_epoll_data->fuse_event_data=fuse_event_data;
 
-				if ( res!=0 ) {
-
-				    free(fuse_event_data->buff);
-				    free(fuse_event_data);
-				    free(tmp_worker_data);
-
-				    writelog(loglevel, 0, "mainloop: cannot start temp thread");
-
-				} 
-
-			    } else {
-
-				writelog(loglevel, 0, "mainloop: cannot allocate space for temp thread");
-
-			    }
+			    nreturn=-ENOMEM;
+			    goto out;
 
 			}
 
+			queue_fuse_event(fuse_event_data);
 
 		    } else {
 
@@ -644,6 +718,10 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 
 		    }
 
+		} else if ( fuse_epoll_data->type_fd==TYPE_FD_TIMER || fuse_epoll_data->type_fd==TYPE_FD_EVENT || fuse_epoll_data->type_fd==TYPE_FD_PRESSURE ) {
+
+		    process_fuse_loop_event(fuse_epoll_data);
+
 		}
 
 	    }
@@ -652,13 +730,27 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 
 	out:
 
+	stop_fuse_loop_events();
+
+
+	// let the workers end: they're woken and see the exit, the ones busy with a request finish it first
+	// wait for all of them: they use the session, the buffers and the queue freed below
 
-	// stop any thread here
+	__atomic_store_n(&global_data.exiting, 1, __ATOMIC_RELEASE);
 
-	for (i=0; i<NUM_WORKER_THREADS; i++) {
+	if ( global_data.workqueue.eventfd>=0 ) wake_mpmc_queue(&global_data.workqueue, global_data.maxworkers);
 
-	    pthread_cancel(fuse_worker_data[i].threadid);
-	    sem_destroy(&(fuse_worker_data[i].busy_sem));
+	pthread_mutex_lock(&global_data.workers_mutex);
+
+	while ( global_data.nrworkers>0 ) pthread_cond_wait(&global_data.workers_cond, &global_data.workers_mutex);
+
+	pthread_mutex_unlock(&global_data.workers_mutex);
+
+	// the requests no worker took anymore: not processed, the buffers go back to be freed
+
+	if ( global_data.workqueue.eventfd>=0 ) {
+
+	    while ( ( fuse_event_data=(struct fuse_event_data_struct *) pop_mpmc_queue(&global_data.workqueue) ) ) put_fuse_event_data(&global_data, fuse_event_data);
 
 	}
 
@@ -671,29 +763,38 @@ int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
 
 	    fuse_epoll_data=fuse_epoll_data->next;
 
-	    if (global_data.epoll_data->buff) free(global_data.epoll_data->buff);
+	    if (global_data.epoll_data->fuse_event_data) {
+
+		free(global_data.epoll_data->fuse_event_data->buff);
+		free(global_data.epoll_data->fuse_event_data);
+
+	    }
+
 	    free(global_data.epoll_data);
 
 	    global_data.epoll_data=fuse_epoll_data;
 
 	}
 
-	// what to do with temp threads??
+	// the free receive buffers
 
-	tmp_worker_data=global_data.temp_worker_data;
+	pthread_mutex_lock(&global_data.event_data_mutex);
 
-	while (tmp_worker_data) {
+	while (global_data.free_event_data) {
 
-	    // this is safe?
-	    pthread_cancel(tmp_worker_data->threadid);
+	    fuse_event_data=global_data.free_event_data;
+	    global_data.free_event_data=fuse_event_data->next;
 
-	    tmp_worker_data=tmp_worker_data->next;
-
-	    free(global_data.temp_worker_data);
-	    global_data.temp_worker_data=tmp_worker_data;
+	    free(fuse_event_data->buff);
+	    free(fuse_event_data);
 
 	}
 
+	global_data.nrfree_event_data=0;
+
+	pthread_mutex_unlock(&global_data.event_data_mutex);
+
+	free_mpmc_queue(&global_data.workqueue);
 
 	fuse_session_reset(se);
 
@@ -30,15 +30,26 @@
 #define TYPE_FD_SIGNAL			1
 #define TYPE_FD_FUSE			2
 #define TYPE_FD_TIMER			3
+#define TYPE_FD_EVENT			4
+#define TYPE_FD_PRESSURE		5
 
-// types of threads
-#define TYPE_WORKER_PERMANENT		1
-#define TYPE_WORKER_TEMPORARY		2
-
-// number of threads
+// number of threads: at least NUM_WORKER_THREADS, more are started when requests wait
+// and all are busy, up to MAX_WORKER_THREADS (see set_fuse_loop_workers)
 #ifndef NUM_WORKER_THREADS
 #define NUM_WORKER_THREADS		10
 #endif
+#ifndef MAX_WORKER_THREADS
+#define MAX_WORKER_THREADS		32
+#endif
+
+// a thread above the minimum which is idle this long (milliseconds) ends
+#define WORKER_IDLE_TIMEOUT		10000
+
+// requests waiting for a worker, when full the mainloop processes the request itself
+#define WORK_QUEUE_SIZE			256
+
+// number of free receive buffers kept for reuse
+#define MAX_FREE_EVENT_DATA		NUM_WORKER_THREADS
 
 #include <sys/wait.h>
 #include <sys/epoll.h>
@@ -46,6 +57,8 @@
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "cdfs-queue.h"
+
 // struct to identify the fd when epoll singals activity on that fd
 
 struct fuse_epoll_data_struct {
@@ -54,26 +67,15 @@ struct fuse_epoll_data_struct {
 	struct fuse_chan *ch;
 	struct fuse_session *se;
 	size_t buffsize;
-	char *buff;
+	struct fuse_event_data_struct *fuse_event_data;
 	int res;
+	void (*cb) (int fd, void *data);
+	void *data;
 	struct fuse_epoll_data_struct *next;
 };
 
-// struct for the threads (permanent and temporary)
-
-struct fuse_worker_thread_data_struct {
-	pthread_t threadid;
-	int busy;
-	int nr;
-	int typeworker;
-	sem_t busy_sem;
-	struct fuse_event_data_struct *fuse_event_data;
-	struct fuse_worker_thread_data_struct *next;
-	struct fuse_worker_thread_data_struct *prev;
-	struct global_data_struct *global_data;
-};
-
 // struct to store the fuse event in when receiving data on fuse channel
+// the request is received in it's buffer, and handed over to a worker as it is
 
 struct fuse_event_data_struct {
 	struct fuse_chan *ch;
@@ -81,13 +83,29 @@ struct fuse_event_data_struct {
 	char *buff;
 	size_t buffsize;
 	int res;
+	struct fuse_event_data_struct *next;
 };
 
 // struct with all the global data, used to have a reference to it in threads
 
 struct global_data_struct {
 	struct fuse_epoll_data_struct *epoll_data;
-	struct fuse_worker_thread_data_struct *temp_worker_data;
+	struct fuse_event_data_struct *free_event_data;
+	unsigned int nrfree_event_data;
+	pthread_mutex_t event_data_mutex;
+	struct cdfs_mpmc_queue_struct workqueue;
+	unsigned int minworkers;
+	unsigned int maxworkers;
+	unsigned int nrworkers;
+	unsigned int nridle;
+	unsigned char exiting;
+	pthread_mutex_t workers_mutex;
+	pthread_cond_t workers_cond;
+	unsigned long enqueued;
+	unsigned long processedinline;
+	unsigned long queuedpeak;
+	unsigned long workersstarted;
+	unsigned long workersreaped;
 	unsigned char loglevel;
 };
 
@@ -95,6 +113,17 @@ struct global_data_struct {
 // Prototypes
 
 int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel);
+void set_fuse_loop_workers(unsigned int minworkers, unsigned int maxworkers);
+int get_fuse_loop_stats(char *buffer, size_t size);
+
+// other fd's and timers in the mainloop (fuse-loop-events.c)
+
+int add_fuse_loop_fd(int fd, void (*cb) (int fd, void *data), void *data);
+int add_fuse_loop_timer(unsigned int interval, void (*cb) (int fd, void *data), void *data);
+int add_fuse_loop_pressure(int fd, void (*cb) (int fd, void *data), void *data);
+int start_fuse_loop_events(int epoll_fd);
+void process_fuse_loop_event(struct fuse_epoll_data_struct *fuse_epoll_data);
+void stop_fuse_loop_events();
 
 
 #endif
@@ -0,0 +1,429 @@
+/*
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+  fuse-loop-epoll-mt3.c
+  The mainloop for the fuse filesystem with libfuse3: epoll on a signalfd, and the workers of libfuse
+  every one with it's own clone of the fuse fd.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#define FUSE_USE_VERSION 31
+#define _REENTRANT
+#define _GNU_SOURCE
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#define LOGGING
+
+#include "logging.h"
+#include "fuse-loop-epoll-mt.h"
+
+// the signal to wake the thread of fuse_session_loop_mt when exiting (see exit_fuse_workers)
+#define CDFS_SIGNAL_WAKE_WORKERS	SIGUSR2
+
+
+//
+// with libfuse2 the mainloop reads every request from the one fuse fd and copies it to a worker
+// (see fuse-loop-epoll-mt.c)
+//
+// with libfuse3 the workers of fuse_session_loop_mt read the requests themselves, every worker from
+// it's own clone of the fuse fd (clone_fd), so the requests are spread over the workers by the kernel,
+// in a buffer as big as max_read, and a reply goes back over the fd the request came from
+//
+// when the session is created with the io_uring transport (option iouring), fuse_session_loop_mt
+// sets up a ring per cpu instead: the requests are fetched and the replies committed over the ring,
+// no read(2) and write(2) per request; the kernel or libfuse without it falls back to the fds above
+//
+// the mainloop here only waits with epoll for the signals (signalfd), for the workers to end, and
+// for the timers and fd's of other threads (see fuse-loop-events.c)
+//
+
+struct fuse_workers_data_struct {
+	struct fuse_session *se;
+	int eventfd;
+	int res;
+};
+
+static void *thread_fuse_workers(void *threadarg)
+{
+	struct fuse_workers_data_struct *workers_data=(struct fuse_workers_data_struct *) threadarg;
+	uint64_t value=1;
+
+	logoutput("workers started..");
+
+	// with clone_fd every worker opens /dev/fuse and clones the session fd
+
+	workers_data->res=fuse_session_loop_mt(workers_data->se, 1);
+
+	logoutput("workers ended (%i)", workers_data->res);
+
+	// tell the mainloop, the session ended (exited)
+
+	if ( write(workers_data->eventfd, &value, sizeof(uint64_t)) < 0 ) {
+
+	    logoutput("workers: error %i writing to eventfd", errno);
+
+	}
+
+	return NULL;
+
+}
+
+//
+// end the workers: only the session is exited, it's unmounted once by the caller when the workers
+// are joined (unmounting while they still read from the fd ends up in errors and a second unmount)
+// fuse_session_loop_mt sleeps till a worker ends, and the workers in a read till a request: the
+// thread of fuse_session_loop_mt is woken with a signal with a handler which does nothing, it sees
+// the session exited, and cancels the workers
+//
+
+static void wake_fuse_workers(int signo)
+{
+	(void) signo;
+}
+
+static void exit_fuse_workers(struct fuse_session *se, pthread_t pthreadid)
+{
+
+	fuse_session_exit(se);
+	pthread_kill(pthreadid, CDFS_SIGNAL_WAKE_WORKERS);
+
+}
+
+//
+// the workers are libfuse's: started when all are busy, and ending when more than max_idle_threads
+// (10) are idle, so the pool of fuse-loop-epoll-mt.c and it's size do not apply
+//
+
+void set_fuse_loop_workers(unsigned int minworkers, unsigned int maxworkers)
+{
+
+	if ( minworkers>0 || maxworkers>0 ) logoutput("workers: managed by libfuse, minworkers and maxworkers ignored");
+
+}
+
+int get_fuse_loop_stats(char *buffer, size_t size)
+{
+
+	return snprintf(buffer, size, "workers=libfuse clonefd=1");
+
+}
+
+int fuse_session_loop_epoll_mt(struct fuse_session *se, unsigned char loglevel)
+{
+	struct sigaction wake_action;
+	int epoll_fd=-1, signal_fd=-1;
+	struct epoll_event epoll_events[MAX_EPOLL_NREVENTS];
+	struct epoll_event epoll_instance;
+	int i, res, nreturn=0, nerror;
+	ssize_t readlen;
+	struct signalfd_siginfo fdsi;
+	int signo;
+	sigset_t fuse_sigset;
+	pid_t cpid;
+	struct fuse_epoll_data_struct signal_epoll_data, workers_epoll_data;
+	struct fuse_workers_data_struct workers_data;
+	pthread_t pthreadid;
+	bool workersstarted=false;
+
+	workers_data.se=se;
+	workers_data.res=0;
+	workers_data.eventfd=-1;
+
+	// create an epoll instance
+
+	epoll_fd=epoll_create(MAX_EPOLL_NRFDS);
+
+	if ( epoll_fd==-1 ) {
+
+	    nreturn=-errno;
+	    goto out;
+
+	}
+
+	// set the set of signals for signalfd to listen to
+	// blocked before the workers are started, so they do not get them
+
+	sigemptyset(&fuse_sigset);
+
+	sigaddset(&fuse_sigset, SIGINT);
+	sigaddset(&fuse_sigset, SIGIO);
+	sigaddset(&fuse_sigset, SIGHUP);
+	sigaddset(&fuse_sigset, SIGTERM);
+	sigaddset(&fuse_sigset, SIGPIPE);
+	sigaddset(&fuse_sigset, SIGCHLD);
+	sigaddset(&fuse_sigset, SIGUSR1);
+
+	signal_fd = signalfd(-1, &fuse_sigset, SFD_NONBLOCK);
+
+	if (signal_fd == -1) {
+
+	  nreturn=-errno;
+
+	  logoutput("mainloop: unable to create signalfd, error: %i", nreturn);
+
+	  goto out;
+
+	}
+
+	if (sigprocmask(SIG_BLOCK, &fuse_sigset, NULL) == -1) {
+
+	  logoutput("mainloop: error sigprocmask");
+
+	  goto out;
+
+	}
+
+	writelog(loglevel, 1, "mainloop: adding signalfd %i to epoll", signal_fd);
+
+	memset(&signal_epoll_data, 0, sizeof(struct fuse_epoll_data_struct));
+
+	signal_epoll_data.type_fd=TYPE_FD_SIGNAL;
+	signal_epoll_data.fd=signal_fd;
+
+	epoll_instance.events=EPOLLIN;
+	epoll_instance.data.ptr=(void *) &signal_epoll_data;
+
+	res=epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &epoll_instance);
+
+	if ( res==-1 ) {
+
+	  nreturn=-errno;
+	  goto out;
+
+	}
+
+	// the timers and the fd's of other threads
+
+	res=start_fuse_loop_events(epoll_fd);
+
+	if ( res<0 ) {
+
+	  nreturn=res;
+	  goto out;
+
+	}
+
+	// the workers signal through an eventfd they're ended
+
+	workers_data.eventfd=eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if ( workers_data.eventfd==-1 ) {
+
+	    nreturn=-errno;
+	    goto out;
+
+	}
+
+	memset(&workers_epoll_data, 0, sizeof(struct fuse_epoll_data_struct));
+
+	workers_epoll_data.type_fd=TYPE_FD_FUSE;
+	workers_epoll_data.fd=workers_data.eventfd;
+	workers_epoll_data.se=se;
+
+	epoll_instance.events=EPOLLIN;
+	epoll_instance.data.ptr=(void *) &workers_epoll_data;
+
+	res=epoll_ctl(epoll_fd, EPOLL_CTL_ADD, workers_data.eventfd, &epoll_instance);
+
+	if ( res==-1 ) {
+
+	  nreturn=-errno;
+	  goto out;
+
+	}
+
+	// the signal to wake the workers when exiting, not interrupted reads are not restarted
+
+	memset(&wake_action, 0, sizeof(struct sigaction));
+	wake_action.sa_handler=wake_fuse_workers;
+	sigemptyset(&wake_action.sa_mask);
+
+	if ( sigaction(CDFS_SIGNAL_WAKE_WORKERS, &wake_action, NULL)==-1 ) {
+
+	    nreturn=-errno;
+	    goto out;
+
+	}
+
+	res=pthread_create(&pthreadid, NULL, thread_fuse_workers, (void *) &workers_data);
+
+	if ( res!=0 ) {
+
+	    logoutput("Error creating the fuse workers (error: %i).", res);
+
+	    nreturn=-res;
+	    goto out;
+
+	}
+
+	workersstarted=true;
+
+	writelog(loglevel, 0, "mainloop: starting epoll wait loop");
+
+
+	while (1) {
+
+
+	    int number_of_fds=epoll_wait(epoll_fd, epoll_events, MAX_EPOLL_NREVENTS, -1);
+
+	    if (number_of_fds < 0) {
+
+		if ( errno==EINTR ) continue;
+
+		nreturn=-errno;
+
+		writelog(loglevel, 0, "mainloop: epoll_wait error");
+
+		goto out;
+
+	    }
+
+
+	    for (i=0; i<number_of_fds; i++) {
+
+		struct fuse_epoll_data_struct *fuse_epoll_data=(struct fuse_epoll_data_struct *) epoll_events[i].data.ptr;
+
+		if ( fuse_epoll_data->type_fd==TYPE_FD_FUSE ) {
+
+		    // the workers are ended
+
+		    writelog(loglevel, 0, "mainloop: fuse session ended");
+
+		    nreturn=workers_data.res;
+
+		    goto out;
+
+		} else if ( fuse_epoll_data->type_fd==TYPE_FD_SIGNAL ) {
+
+
+                    //
+		    // some data on signalfd
+		    //
+
+		    writelog(loglevel, 0, "mainloop: in signal loop");
+
+		    readlen=read(signal_fd, &fdsi, sizeof(struct signalfd_siginfo));
+		    nerror=errno;
+
+		    if ( readlen==-1 ) {
+
+			if ( nerror==EAGAIN ) {
+
+                            // blocking error: back to the mainloop
+
+			    continue;
+
+                        }
+
+			writelog(loglevel, 0, "error %i reading from signalfd......", nerror);
+
+		    } else {
+
+			if ( readlen == sizeof(struct signalfd_siginfo)) {
+
+		    	    // check the signal
+
+		    	    signo=fdsi.ssi_signo;
+
+		    	    if ( signo==SIGHUP || signo==SIGINT || signo==SIGTERM ) {
+
+				writelog(loglevel, 0, "mainloop: caught signal %i, exit session", signo);
+
+				// the workers end, and the eventfd tells
+
+				exit_fuse_workers(se, pthreadid);
+
+		    	    } else if ( signo==SIGPIPE ) {
+
+				signo=0;
+
+				writelog(loglevel, 0, "mainloop: caught signal SIGPIPE, ignoring");
+
+	            	    } else if ( signo == SIGCHLD) {
+
+		        	writelog(loglevel, 0, "Got SIGCHLD, from pid: %d", fdsi.ssi_pid);
+
+		        	// look at the pid of the child with waitpid for preventing zombies
+
+		        	cpid=waitpid(fdsi.ssi_pid, NULL, WNOHANG);
+
+	            	    } else if ( signo == SIGIO) {
+
+		        	writelog(loglevel, 0, "Got SIGIO.....");
+
+		    	    } else {
+
+				writelog(loglevel, 0, "got unknown signal %i", signo);
+
+			    }
+
+			}
+
+		    }
+
+		} else if ( fuse_epoll_data->type_fd==TYPE_FD_TIMER || fuse_epoll_data->type_fd==TYPE_FD_EVENT || fuse_epoll_data->type_fd==TYPE_FD_PRESSURE ) {
+
+		    process_fuse_loop_event(fuse_epoll_data);
+
+		}
+
+	    }
+
+	}
+
+	out:
+
+	stop_fuse_loop_events();
+
+	if ( workersstarted ) {
+
+	    // when leaving on an error the workers are still running: end them first
+
+	    if ( ! fuse_session_exited(se) ) exit_fuse_workers(se, pthreadid);
+
+	    pthread_join(pthreadid, NULL);
+
+	}
+
+	if ( workers_data.eventfd>=0 ) close(workers_data.eventfd);
+	if ( signal_fd>=0 ) close(signal_fd);
+	if ( epoll_fd>=0 ) close(epoll_fd);
+
+	fuse_session_reset(se);
+
+	return nreturn < 0 ? -1 : 0;
+}
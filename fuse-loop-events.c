@@ -0,0 +1,261 @@
+/*
+  2010, 2011 Stef Bon <stefbon@gmail.com>
+  fuse-loop-events.c
+  Other fd's in the epoll set of the mainloop: eventfd's of other threads and timers.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#include "global-defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+
+#ifdef CDFS_FUSE3
+#include <fuse3/fuse_lowlevel.h>
+#else
+#include <fuse/fuse_lowlevel.h>
+#endif
+
+#define LOGGING
+
+#include "logging.h"
+#include "fuse-loop-epoll-mt.h"
+
+
+//
+// next to the fuse fd and the signalfd, the mainloop waits on:
+// - an fd of another part of fuse-cdfs (typically an eventfd another thread writes to when it has
+//   something done), the callback reads the fd itself
+// - a timer (timerfd) for periodic work, the expirations are read here before the callback
+// - a psi trigger (like /proc/pressure/memory), which signals with EPOLLPRI, nothing is read
+//
+// the callbacks run in the mainloop: they should be short and not block
+//
+// they can be added before the mainloop is started (then they're added to the epoll set when it
+// starts) and when it's running
+//
+
+static struct fuse_epoll_data_struct *list_loop_events=NULL;
+static pthread_mutex_t loop_events_mutex=PTHREAD_MUTEX_INITIALIZER;
+static int loop_events_epoll_fd=-1;
+
+
+static int add_epoll_loop_event(int epoll_fd, struct fuse_epoll_data_struct *fuse_epoll_data)
+{
+	struct epoll_event epoll_instance;
+
+	epoll_instance.events=( fuse_epoll_data->type_fd==TYPE_FD_PRESSURE ) ? EPOLLPRI : EPOLLIN;
+	epoll_instance.data.ptr=(void *) fuse_epoll_data;
+
+	if ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fuse_epoll_data->fd, &epoll_instance)==-1 ) return -errno;
+
+	return 0;
+
+}
+
+static int add_loop_event(int type_fd, int fd, void (*cb) (int fd, void *data), void *data)
+{
+	struct fuse_epoll_data_struct *fuse_epoll_data;
+	int nreturn=0;
+
+	fuse_epoll_data=malloc(sizeof(struct fuse_epoll_data_struct));
+
+	if ( ! fuse_epoll_data ) {
+
+	    nreturn=-ENOMEM;
+	    goto out;
+
+	}
+
+	memset(fuse_epoll_data, 0, sizeof(struct fuse_epoll_data_struct));
+
+	fuse_epoll_data->type_fd=type_fd;
+	fuse_epoll_data->fd=fd;
+	fuse_epoll_data->cb=cb;
+	fuse_epoll_data->data=data;
+
+	pthread_mutex_lock(&loop_events_mutex);
+
+	if ( loop_events_epoll_fd>=0 ) nreturn=add_epoll_loop_event(loop_events_epoll_fd, fuse_epoll_data);
+
+	if ( nreturn==0 ) {
+
+	    fuse_epoll_data->next=list_loop_events;
+	    list_loop_events=fuse_epoll_data;
+
+	}
+
+	pthread_mutex_unlock(&loop_events_mutex);
+
+	if ( nreturn<0 ) free(fuse_epoll_data);
+
+	out:
+
+	return nreturn;
+
+}
+
+//
+// call cb in the mainloop when fd is readable
+//
+
+int add_fuse_loop_fd(int fd, void (*cb) (int fd, void *data), void *data)
+{
+
+	return add_loop_event(TYPE_FD_EVENT, fd, cb, data);
+
+}
+
+//
+// call cb in the mainloop every interval milliseconds
+//
+
+int add_fuse_loop_timer(unsigned int interval, void (*cb) (int fd, void *data), void *data)
+{
+	struct itimerspec its;
+	int fd, nreturn=0;
+
+	fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if ( fd==-1 ) {
+
+	    nreturn=-errno;
+	    goto out;
+
+	}
+
+	its.it_interval.tv_sec=interval / 1000;
+	its.it_interval.tv_nsec=( interval % 1000 ) * 1000000;
+	its.it_value=its.it_interval;
+
+	if ( timerfd_settime(fd, 0, &its, NULL)==-1 ) {
+
+	    nreturn=-errno;
+	    close(fd);
+	    goto out;
+
+	}
+
+	nreturn=add_loop_event(TYPE_FD_TIMER, fd, cb, data);
+
+	if ( nreturn<0 ) close(fd);
+
+	out:
+
+	return nreturn;
+
+}
+
+//
+// call cb in the mainloop when the psi trigger fd signals pressure
+//
+
+int add_fuse_loop_pressure(int fd, void (*cb) (int fd, void *data), void *data)
+{
+
+	return add_loop_event(TYPE_FD_PRESSURE, fd, cb, data);
+
+}
+
+//
+// the mainloop starts: add what's registered to it's epoll set
+//
+
+int start_fuse_loop_events(int epoll_fd)
+{
+	struct fuse_epoll_data_struct *fuse_epoll_data;
+	int nreturn=0;
+
+	pthread_mutex_lock(&loop_events_mutex);
+
+	fuse_epoll_data=list_loop_events;
+
+	while (fuse_epoll_data) {
+
+	    nreturn=add_epoll_loop_event(epoll_fd, fuse_epoll_data);
+
+	    if ( nreturn<0 ) {
+
+		logoutput("mainloop: unable to add fd %i to epoll, error: %i", fuse_epoll_data->fd, nreturn);
+		break;
+
+	    }
+
+	    fuse_epoll_data=fuse_epoll_data->next;
+
+	}
+
+	if ( nreturn==0 ) loop_events_epoll_fd=epoll_fd;
+
+	pthread_mutex_unlock(&loop_events_mutex);
+
+	return nreturn;
+
+}
+
+void process_fuse_loop_event(struct fuse_epoll_data_struct *fuse_epoll_data)
+{
+	uint64_t expirations;
+
+	if ( fuse_epoll_data->type_fd==TYPE_FD_TIMER ) {
+
+	    // nothing to read: another wakeup for an expiration already read
+
+	    if ( read(fuse_epoll_data->fd, &expirations, sizeof(uint64_t)) != sizeof(uint64_t) ) return;
+
+	}
+
+	if ( fuse_epoll_data->cb ) fuse_epoll_data->cb(fuse_epoll_data->fd, fuse_epoll_data->data);
+
+}
+
+//
+// the mainloop ends: the timers are closed, the other fd's are of the ones who added them
+// (the psi triggers too: the trigger is removed with the fd)
+//
+
+void stop_fuse_loop_events()
+{
+	struct fuse_epoll_data_struct *fuse_epoll_data;
+
+	pthread_mutex_lock(&loop_events_mutex);
+
+	loop_events_epoll_fd=-1;
+
+	while (list_loop_events) {
+
+	    fuse_epoll_data=list_loop_events;
+	    list_loop_events=fuse_epoll_data->next;
+
+	    if ( fuse_epoll_data->type_fd==TYPE_FD_TIMER || fuse_epoll_data->type_fd==TYPE_FD_PRESSURE ) close(fuse_epoll_data->fd);
+
+	    free(fuse_epoll_data);
+
+	}
+
+	pthread_mutex_unlock(&loop_events_mutex);
+
+}
@@ -17,7 +17,13 @@
 
 */
 
+// the fuse api: version 2.6, or 3.1 when built with libfuse3 (configure --with-fuse3)
+
+#ifdef CDFS_FUSE3
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
+#endif
 #define _REENTRANT
 #define _GNU_SOURCE
 #define _XOPEN_SOURCE 500
@@ -74,7 +80,107 @@
 #define READAHEAD_POLICY_PIECE_SECTORS          750
 #define READAHEAD_POLICY_WHOLE_SECTORS          250
 
-#define CDFS_TRACK_BEGIN_SIZE                   250
+// bounds of the readahead window of a stream, the max is the default of the readaheadmax option
+// lead: the window covers at least the sectors the stream consumes in this time
+
+#define CDFS_READAHEAD_MIN_SECTORS              16
+#define CDFS_READAHEAD_MAX_SECTORS              1024
+#define CDFS_READAHEAD_LEAD_MS                  2000
+
+// size of the lock free queues to the cdromreader and to the cache manager
+
+#define CDFS_READ_COMMANDS_QUEUE_SIZE           1024
+#define CDFS_READ_RESULTS_QUEUE_SIZE            256
+
+// slab allocator: number of types, objects in the cache of a thread, and free objects
+// kept per type, the rest is given back to the OS
+
+#define CDFS_SLAB_MAX_TYPES                     8
+#define CDFS_SLAB_CACHE_SIZE                    16
+#define CDFS_SLAB_HIGHWATER                     64
+
+// ring of sector buffers the cd is read in: slots of a batch of sectors
+// this fixes the memory used for reading, 16 slots of 32 sectors is 1.2 Mb
+
+#define CDFS_SECTOR_RING_SLOTS                  16
+#define CDFS_SECTOR_SLOT_SECTORS                32
+
+// default budget of bytes read from the cd and not yet written to the cache, when used up
+// the readahead pauses, demand reads go on
+// it holds the biggest window, the background fill of policy whole next to it and a batch of the cdromreader
+
+#define CDFS_MEMORY_BUDGET                      ( 3 * 1024 * 1024 )
+
+// buckets of the histograms of the latency of cache misses, bucket i counts latencies below
+// 64 << i microseconds, the last one all above
+
+#define CDFS_LATENCY_BUCKETS                    16
+
+// default of how far ahead of the last read of a track readahead is pushed in the page cache of the kernel
+
+#define CDFS_NOTIFY_STORE_MAX_SECTORS           1024
+
+// size of the queue of the readahead to push in the page cache of the kernel, when full
+// the readahead is not pushed (the cache manager does not wait for it)
+
+#define CDFS_NOTIFY_STORE_QUEUE_SIZE            16
+
+// periodic work in the mainloop (milliseconds): the progress to the fifo, and the checkpoint of
+// the WAL of the sqlite db
+
+#define CDFS_PROGRESS_INTERVAL                  1000
+#define CDFS_SQLITE_CHECKPOINT_INTERVAL         30000
+
+// the cached intervals to the sqlite db: committed by the cache manager per batch of at most this
+// many, or when the last commit is this long ago (milliseconds), or when it's idle
+
+#define CDFS_SQLITE_BATCH_MAX                   256
+#define CDFS_SQLITE_COMMIT_INTERVAL             1000
+
+// writes to the cache files: read results merged in one write at most, writes in flight at most
+// (io_uring), and the interval the writes per second are sampled
+
+#define CDFS_WRITE_BATCH_MAX                    CDFS_SECTOR_RING_SLOTS
+#define CDFS_WRITES_INFLIGHT_MAX                4
+
+// times a submit to io_uring is tried again when the kernel is busy (EAGAIN, EBUSY), after that
+// the writes are done with pwritev
+
+#define CDFS_CACHE_IO_SUBMIT_TRIES              8
+#define CDFS_CACHE_IO_STATS_INTERVAL            1000
+
+// cache files with O_DIRECT: the reads and writes are aligned to this (the page size, enough for
+// every logical block size), through pooled buffers of this size, kept at most
+
+#define CDFS_CACHE_PAGE_SIZE                    4096
+#define CDFS_DIRECT_BUFFER_SIZE                 ( 256 * 1024 )
+#define CDFS_DIRECT_BUFFERS_HIGHWATER           4
+
+// the sectors recently read in ram (see cdfs-ramcache.c): in chunks of sectors (at most 32, a bit per
+// sector), the share of the budget for new chunks, the least budget, and the default when diskless
+
+#define CDFS_RAMCACHE_CHUNK_SECTORS             CDFS_SECTOR_SLOT_SECTORS
+#define CDFS_RAMCACHE_CHUNK_SIZE                ( CDFS_RAMCACHE_CHUNK_SECTORS * CDIO_CD_FRAMESIZE_RAW )
+#define CDFS_RAMCACHE_HASHSIZE                  1024
+#define CDFS_RAMCACHE_IN_PERCENT                25
+#define CDFS_RAMCACHE_MIN                       ( 4 * 1024 * 1024 )
+#define CDFS_RAMCACHE_DISKLESS                  ( 32 * 1024 * 1024 )
+
+// memory pressure: notified when tasks stall this long (microseconds) in a window (a multiple of
+// 2 seconds, also without privileges), and every interval (milliseconds) the budget grows back
+
+#define CDFS_RAMCACHE_PSI_STALL                 150000
+#define CDFS_RAMCACHE_PSI_WINDOW                2000000
+#define CDFS_RAMCACHE_GROW_INTERVAL             5000
+
+// size of the reads negotiated with the kernel with libfuse3 (max_read and max_readahead), libfuse2 is
+// limited to 128 Kb
+
+#define CDFS_FUSE_MAX_READ                      ( 1024 * 1024 )
+
+// a read further than this from where the previous read of the stream ended is a seek
+
+#define CDFS_STREAM_SEEK_SECTORS                256
 
 
 #define CDFS_CACHE_ADMIN_BACKEND_INTERNAL                   0